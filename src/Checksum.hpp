@@ -1,10 +1,82 @@
 #pragma once
 
 #include <utility>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <string>
+#include <vector>
+
+// Recording file checksums into demos is in FileSums.cpp
+
+// Streaming CRC32, with the polynomial used by zip and PNG. Uses carry-
+// less multiplies where the CPU supports them, and slicing-by-8
+// otherwise.
+class Crc32 {
+public:
+	void Update(const void *data, size_t size);
+	uint32_t Value() const { return ~this->state; }
+
+	// The implementations behind Update, which take and return the raw
+	// (uninverted) state; exposed so they can be tested against each
+	// other. UpdatePCLMUL must only be used if Cpu::HasPCLMUL().
+	static uint32_t UpdateBytewise(uint32_t state, const uint8_t *data, size_t size);
+	static uint32_t UpdateSlicing8(uint32_t state, const uint8_t *data, size_t size);
+	static uint32_t UpdatePCLMUL(uint32_t state, const uint8_t *data, size_t size);
+	static const char *ImplName();
+
+	// The CRC of A followed by B, given the CRCs of each and B's size
+	static uint32_t Combine(uint32_t crcA, uint32_t crcB, uint64_t sizeB);
+
+private:
+	uint32_t state = 0xFFFFFFFF;
+};
+
+// Keeps the checksum of a demo up to date while it's being recorded. The
+// recorder passes on the engine's writes to the file as they're made, so
+// each byte is hashed once from the engine's own buffer and nothing has
+// to be read back. The engine rewrites the header when it closes the
+// demo, so the header is kept aside and combined with the rest in Finish.
+class DemoChecksumTracker {
+public:
+	static constexpr size_t HEADER_SIZE = 1072;
+
+	// Whether a write should be passed to OnWrite: it's to the demo being
+	// tracked, or it could be the start of a new one
+	bool Wants(void *file, const void *data, size_t size) const;
+	// size bytes written at offset in file
+	void OnWrite(void *file, uint64_t offset, const void *data, size_t size);
+	void OnClose(void *file);
+
+	// Names the demo being written, so that Finish can find it
+	void SetFilename(const std::string &filename);
+
+	// Gives the checksum of a demo which has been closed, and forgets it.
+	// Returns false if it wasn't tracked or some of its writes couldn't be
+	// followed, in which case it needs a full re-hash.
+	bool Finish(const std::string &filename, uint32_t *crcOut);
+
+private:
+	struct Stream {
+		std::string filename;
+		bool failed = false;
+		uint8_t header[HEADER_SIZE];
+		size_t headerSeen = 0;  // Leading bytes of header that have been written
+		uint64_t hashed = 0;    // Bytes after the header
+		Crc32 body;
+	};
+
+	std::atomic<void *> file{nullptr};  // Handle of the demo being written
+	Stream current;
+	std::vector<Stream> closed;  // Waiting for Finish, oldest first
+};
+
+// CRC32 of a whole file
+bool FileChecksum(const char *filename, uint32_t *crcOut);
 
 bool AddDemoChecksum(const char *filename);
-void AddDemoFileChecksums();
+// Appends the checksum trailer for a demo whose CRC is already known
+bool AddDemoChecksum(const char *filename, uint32_t checksum);
 
 enum VerifyResult {
 	VERIFY_BAD_DEMO,
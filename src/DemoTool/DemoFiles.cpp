@@ -0,0 +1,33 @@
+#include "DemoFiles.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+
+std::vector<std::string> DemoTool::CollectDemos(const std::vector<std::string> &args) {
+	std::vector<std::string> demos;
+
+	for (auto &arg : args) {
+		std::error_code ec;
+		if (!std::filesystem::is_directory(arg, ec)) {
+			demos.push_back(arg);
+			continue;
+		}
+
+		std::vector<std::string> found;
+		try {
+			for (auto &ent : std::filesystem::recursive_directory_iterator(arg)) {
+				if (ent.is_regular_file() && ent.path().extension() == ".dem") {
+					found.push_back(ent.path().string());
+				}
+			}
+		} catch (std::filesystem::filesystem_error &e) {
+			fprintf(stderr, "%s: %s\n", arg.c_str(), e.what());
+		}
+
+		std::sort(found.begin(), found.end());
+		demos.insert(demos.end(), found.begin(), found.end());
+	}
+
+	return demos;
+}
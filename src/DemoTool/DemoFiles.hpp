@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace DemoTool {
+	// Expands every folder in args to the demos under it, recursively and
+	// sorted by path; anything else is taken to be a demo as it is
+	std::vector<std::string> CollectDemos(const std::vector<std::string> &args);
+}  // namespace DemoTool
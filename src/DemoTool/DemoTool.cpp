@@ -0,0 +1,401 @@
+// sar-demotool: times, verifies and extracts data from demos without the
+// game, using the same parser and checksum code as SAR itself. Built by
+// `make sar-demotool`; Linux only.
+
+#include "Checksum.hpp"
+#include "DemoFiles.hpp"
+#include "Features/Demo/Demo.hpp"
+#include "Features/Demo/DemoIndex.hpp"
+#include "Features/Demo/DemoParser.hpp"
+#include "Features/Demo/GhostFile.hpp"
+#include "Features/Demo/GhostTrack.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SAR_MSG_INIT_CVAR 0x02
+#define SAR_MSG_TIMESTAMP 0x0B
+#define SAR_MSG_FILE_CHECKSUM 0x0C
+#define SAR_MSG_CHECKSUM 0xFF
+
+struct Options {
+	int threads = 0;
+	bool useIndex = false;
+	std::string gameDir;    // verify: check recorded file checksums against this install
+	std::string outputDir;  // ghost: where to write the tracks
+};
+
+// The output of one job, printed once every job before it has been
+struct JobResult {
+	std::string out;
+	bool ok;
+};
+
+using JobFn = std::function<JobResult(const std::string &path)>;
+
+static void usage() {
+	fputs(
+		"usage: sar-demotool [options] <command> <demo|folder>...\n"
+		"\n"
+		"Folders are searched recursively for demos, and demos are processed\n"
+		"on all cores. Results are always printed in the order given.\n"
+		"\n"
+		"commands:\n"
+		"  time        print the map, client, ticks and time of each demo as CSV\n"
+		"  verify      check the checksum of each demo, printing the results as CSV\n"
+		"  customdata  dump the SAR data recorded in each demo\n"
+		"  ghost       extract the path of the player in each demo to <demo>.csv\n"
+		"  track       bake the run starting at each demo (demo, demo_2, ... as\n"
+		"              for ghost_set_demos) into <demo>.sarghost for ghost_set_track\n"
+		"\n"
+		"options:\n"
+		"  -j <n>      use n threads (default: number of cores)\n"
+		"  --index     use and write .idx files next to demos when timing them\n"
+		"  --game <d>  verify: also check the file checksums recorded in each demo\n"
+		"              against the Portal 2 install in d\n"
+		"  -o <d>      ghost, track: write to d rather than next to each demo\n",
+		stderr);
+}
+
+// Runs fn over every demo on a pool of threads, printing each result to
+// stdout in order as soon as it and everything before it are done
+static bool runJobs(const std::vector<std::string> &demos, int nThreads, JobFn fn) {
+	std::vector<JobResult> results(demos.size());
+	std::vector<bool> done(demos.size(), false);
+	std::atomic<size_t> nextJob{0};
+	std::mutex lock;
+	std::condition_variable cond;
+
+	auto worker = [&]() {
+		size_t idx;
+		while ((idx = nextJob++) < demos.size()) {
+			JobResult res = fn(demos[idx]);
+			std::lock_guard<std::mutex> guard(lock);
+			results[idx] = std::move(res);
+			done[idx] = true;
+			cond.notify_one();
+		}
+	};
+
+	if (nThreads <= 0) nThreads = std::max(1u, std::thread::hardware_concurrency());
+	nThreads = std::min(nThreads, (int)demos.size());
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < nThreads; ++i) {
+		threads.emplace_back(worker);
+	}
+
+	bool allOk = true;
+	for (size_t i = 0; i < demos.size(); ++i) {
+		std::unique_lock<std::mutex> guard(lock);
+		cond.wait(guard, [&]() { return done[i]; });
+		JobResult res = std::move(results[i]);
+		guard.unlock();
+
+		fputs(res.out.c_str(), stdout);
+		allOk &= res.ok;
+	}
+
+	for (auto &t : threads) t.join();
+
+	return allOk;
+}
+
+static std::string csvQuote(const std::string &str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"') out += '"';
+		out += c;
+	}
+	return out + "\"";
+}
+
+static uint32_t readLE32(const uint8_t *data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Commands {{{
+
+static JobResult timeDemo(const Options &opts, const std::string &path) {
+	DemoIndex index;
+	if (!index.Open(path, opts.useIndex)) {
+		return {Utils::ssprintf("%s,,,,\n", csvQuote(path).c_str()), false};
+	}
+
+	Demo demo;
+	DemoParser parser;
+	index.FillDemo(&demo);
+	parser.Adjust(&demo);
+
+	return {Utils::ssprintf("%s,%s,%s,%d,%.3f\n", csvQuote(path).c_str(), csvQuote(demo.mapName).c_str(), csvQuote(demo.clientName).c_str(), demo.playbackTicks, demo.playbackTime), true};
+}
+
+namespace {
+	// Collects the file checksums SAR records at the start of a demo
+	class FileSumVisitor : public DemoVisitor {
+	public:
+		std::vector<std::pair<std::string, uint32_t>> sums;
+
+		bool OnCustomData(int32_t tick, int32_t type, const uint8_t *data, int32_t length) override {
+			if (type != 0 || length < 8 + 6 || data[8] != SAR_MSG_FILE_CHECKSUM) return true;
+
+			const char *path = (const char *)data + 8 + 5;
+			size_t maxLen = length - 8 - 5;
+			size_t len = strnlen(path, maxLen);
+			if (len < maxLen) {
+				this->sums.push_back({std::string(path, len), readLE32(data + 8 + 1)});
+			}
+			return true;
+		}
+	};
+}  // namespace
+
+static JobResult verifyDemo(const Options &opts, const std::string &path) {
+	static const char *names[] = {"bad demo", "none", "invalid", "valid"};
+
+	auto [res, sarSum] = VerifyDemoChecksum(path.c_str());
+	bool ok = res == VERIFY_VALID_CHECKSUM;
+
+	std::string badFiles;
+	if (!opts.gameDir.empty() && res != VERIFY_BAD_DEMO) {
+		Demo demo;
+		DemoParser parser;
+		FileSumVisitor visitor;
+		parser.Parse(path, &demo, &visitor);
+
+		int nBad = 0;
+		for (auto &[file, sum] : visitor.sums) {
+			uint32_t actual = 0;
+			FileChecksum((opts.gameDir + "/" + file).c_str(), &actual);
+			if (actual != sum) ++nBad;
+		}
+
+		badFiles = std::to_string(nBad);
+		ok &= nBad == 0;
+	}
+
+	return {Utils::ssprintf("%s,%s,%08X,%s\n", csvQuote(path).c_str(), names[res], sarSum, badFiles.c_str()), ok};
+}
+
+static std::string describeCustomData(const uint8_t *data, size_t size) {
+	std::string decoded = DemoParser::DecodeCustomData((const char *)data, size);
+	if (!decoded.empty()) return decoded;
+
+	switch (data[0]) {
+	case SAR_MSG_INIT_CVAR:
+	{
+		const char *name = (const char *)data + 1;
+		size_t nameLen = strnlen(name, size - 1);
+		if (nameLen + 2 >= size) break;
+		const char *val = name + nameLen + 1;
+		return std::string(name, nameLen) + " " + std::string(val, strnlen(val, size - nameLen - 2));
+	}
+	case SAR_MSG_TIMESTAMP:
+		if (size < 8) break;
+		return Utils::ssprintf("%04d-%02d-%02d %02d:%02d:%02d", data[1] | (data[2] << 8), data[3] + 1, data[4], data[5], data[6], data[7]);
+	case SAR_MSG_FILE_CHECKSUM:
+		if (size < 6) break;
+		return Utils::ssprintf("%08X %s", readLE32(data + 1), std::string((const char *)data + 5, strnlen((const char *)data + 5, size - 5)).c_str());
+	case SAR_MSG_CHECKSUM:
+		if (size < 9) break;
+		return Utils::ssprintf("demo %08X sar %08X", readLE32(data + 1), readLE32(data + 5));
+	}
+
+	std::string hex;
+	for (size_t i = 1; i < size; ++i) {
+		hex += Utils::ssprintf(i == 1 ? "%02X" : " %02X", data[i]);
+	}
+	return hex;
+}
+
+namespace {
+	class CustomDataVisitor : public DemoVisitor {
+	public:
+		explicit CustomDataVisitor(const std::string &path)
+			: path(path) {
+		}
+
+		std::string out;
+
+		bool OnCustomData(int32_t tick, int32_t type, const uint8_t *data, int32_t length) override {
+			// SAR data is prefixed with the last radial menu cursor position
+			if (type != 0 || length <= 8) return true;
+			this->out += Utils::ssprintf("%s\t%d\t%02X\t%s\n", this->path.c_str(), tick, data[8], describeCustomData(data + 8, length - 8).c_str());
+			return true;
+		}
+
+	private:
+		const std::string &path;
+	};
+}  // namespace
+
+static JobResult dumpCustomData(const Options &opts, const std::string &path) {
+	Demo demo;
+	DemoParser parser;
+	CustomDataVisitor visitor(path);
+	if (!parser.Parse(path, &demo, &visitor)) {
+		return {visitor.out + Utils::ssprintf("%s: could not parse\n", path.c_str()), false};
+	}
+	return {visitor.out, true};
+}
+
+namespace {
+	// The same positions DemoGhostPlayer takes from a demo: the first
+	// player's view from each tick after the first tick 0
+	class GhostVisitor : public DemoVisitor {
+	public:
+		std::string csv = "tick,x,y,z,pitch,yaw,roll\n";
+		int count = 0;
+
+		bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override {
+			if (nInfos < 1) return true;
+			if (tick == 0) this->waitForNext = true;
+
+			if (tick > 0 && this->waitForNext && this->lastTick != tick) {
+				const DemoCmdInfo &info = infos[0];
+				this->lastTick = tick;
+				this->csv += Utils::ssprintf("%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", tick, info.viewOrigin[0], info.viewOrigin[1], info.viewOrigin[2], info.viewAngles[0], info.viewAngles[1], info.viewAngles[2]);
+				++this->count;
+			}
+			return true;
+		}
+
+	private:
+		bool waitForNext = false;
+		int lastTick = 0;
+	};
+}  // namespace
+
+static JobResult extractGhost(const Options &opts, const std::string &path) {
+	Demo demo;
+	DemoParser parser;
+	GhostVisitor visitor;
+	if (!parser.Parse(path, &demo, &visitor)) {
+		return {Utils::ssprintf("%s: could not parse\n", path.c_str()), false};
+	}
+
+	auto outPath = std::filesystem::path(path).replace_extension(".csv");
+	if (!opts.outputDir.empty()) outPath = std::filesystem::path(opts.outputDir) / outPath.filename();
+
+	FILE *fp = fopen(outPath.string().c_str(), "w");
+	if (!fp) {
+		return {Utils::ssprintf("%s: could not write %s\n", path.c_str(), outPath.string().c_str()), false};
+	}
+	bool ok = fwrite(visitor.csv.data(), 1, visitor.csv.size(), fp) == visitor.csv.size();
+	ok &= fclose(fp) == 0;
+
+	return {Utils::ssprintf("%s -> %s (%d ticks)\n", path.c_str(), outPath.string().c_str(), visitor.count), ok};
+}
+
+// Bakes a whole run into a .sarghost file, the same way ghost_set_demos
+// would load it
+static JobResult bakeTrack(const Options &opts, const std::string &first) {
+	std::string base = first;
+	if (Utils::EndsWith(base, ".dem")) base = base.substr(0, base.size() - 4);
+
+	std::vector<std::string> paths = {base + ".dem"};
+	for (int i = 2; std::filesystem::exists(base + "_" + std::to_string(i) + ".dem"); ++i) {
+		paths.push_back(base + "_" + std::to_string(i) + ".dem");
+	}
+
+	GhostFile::Run run;
+	int ticks = 0;
+	for (auto &path : paths) {
+		Demo demo;
+		DemoParser parser;
+		GhostFile::Level level;
+		GhostTrackVisitor visitor(&demo, &level.track, &level.customDatas);
+		if (!parser.Parse(path, &demo, &visitor)) {
+			return {Utils::ssprintf("%s: could not parse\n", path.c_str()), false};
+		}
+		parser.Adjust(&demo);
+		level.track.ShrinkToFit();
+
+		if (run.levels.empty()) run.clientName = demo.clientName;
+		level.mapName = demo.mapName;
+		level.playbackTicks = demo.playbackTicks;
+		level.playbackTime = demo.playbackTime;
+		ticks += demo.playbackTicks;
+		run.levels.push_back(std::move(level));
+	}
+
+	auto outPath = std::filesystem::path(base + ".sarghost");
+	if (!opts.outputDir.empty()) outPath = std::filesystem::path(opts.outputDir) / outPath.filename();
+
+	if (!GhostFile::Write(outPath.string(), run)) {
+		return {Utils::ssprintf("%s: could not write %s\n", first.c_str(), outPath.string().c_str()), false};
+	}
+
+	return {Utils::ssprintf("%s -> %s (%d levels, %d ticks)\n", first.c_str(), outPath.string().c_str(), (int)run.levels.size(), ticks), true};
+}
+
+int main(int argc, char **argv) {
+	Options opts;
+	std::vector<std::string> args;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-j" && i + 1 < argc) {
+			opts.threads = atoi(argv[++i]);
+		} else if (arg == "--index") {
+			opts.useIndex = true;
+		} else if (arg == "--game" && i + 1 < argc) {
+			opts.gameDir = argv[++i];
+		} else if (arg == "-o" && i + 1 < argc) {
+			opts.outputDir = argv[++i];
+		} else if (arg == "-h" || arg == "--help") {
+			usage();
+			return 0;
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	if (args.size() < 2) {
+		usage();
+		return 2;
+	}
+
+	std::string command = args[0];
+	auto demos = DemoTool::CollectDemos(std::vector<std::string>(args.begin() + 1, args.end()));
+
+	JobFn fn;
+	if (command == "time") {
+		puts("demo,map,client,ticks,time");
+		fn = [&](const std::string &path) { return timeDemo(opts, path); };
+	} else if (command == "verify") {
+		puts("demo,checksum,sar_checksum,bad_files");
+		fn = [&](const std::string &path) { return verifyDemo(opts, path); };
+	} else if (command == "customdata") {
+		fn = [&](const std::string &path) { return dumpCustomData(opts, path); };
+	} else if (command == "ghost") {
+		fn = [&](const std::string &path) { return extractGhost(opts, path); };
+	} else if (command == "track") {
+		// Each argument is the start of a run rather than a single demo
+		demos = std::vector<std::string>(args.begin() + 1, args.end());
+		fn = [&](const std::string &path) { return bakeTrack(opts, path); };
+	} else {
+		fprintf(stderr, "unknown command '%s'\n", command.c_str());
+		usage();
+		return 2;
+	}
+
+	if (demos.empty()) {
+		fprintf(stderr, "no demos found\n");
+		return 1;
+	}
+
+	return runJobs(demos, opts.threads, fn) ? 0 : 1;
+}
@@ -1,21 +1,21 @@
 #include "Demo.hpp"
 
-#include "SAR.hpp"
-
 #include <cstdint>
 
+float Demo::defaultTickrate = 60;
+
 int32_t Demo::LastTick() {
-	return (!this->messageTicks.empty())
-		? this->messageTicks.back()
+	return (this->lastMessageTick >= 0)
+		? this->lastMessageTick
 		: this->playbackTicks;
 }
 float Demo::IntervalPerTick() {
 	return (this->playbackTicks != 0)
 		? this->playbackTime / this->playbackTicks
-		: 1 / sar.game->Tickrate();
+		: 1 / Demo::defaultTickrate;
 }
 float Demo::Tickrate() {
 	return (this->playbackTime != 0)
 		? this->playbackTicks / this->playbackTime
-		: sar.game->Tickrate();
+		: Demo::defaultTickrate;
 }
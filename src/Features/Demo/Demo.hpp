@@ -15,10 +15,14 @@ public:
 	int32_t playbackTicks;
 	int32_t playbackFrames;
 	int32_t signOnLength;
-	std::vector<int32_t> messageTicks;
+	int32_t lastMessageTick;  // -1 if the demo has no messages with a positive tick
 	int32_t firstPositivePacketTick;
 	int32_t segmentTicks;
 
+	// Used for demos with no playback time, e.g. ones cut off while
+	// recording; set from the game on load
+	static float defaultTickrate;
+
 public:
 	int32_t LastTick();
 	float IntervalPerTick();
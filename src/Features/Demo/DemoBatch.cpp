@@ -0,0 +1,354 @@
+#include "DemoBatch.hpp"
+
+#include "Command.hpp"
+#include "Demo.hpp"
+#include "DemoIndex.hpp"
+#include "DemoParser.hpp"
+#include "Event.hpp"
+#include "Modules/Console.hpp"
+#include "Modules/Engine.hpp"
+#include "Scheduler.hpp"
+#include "Utils.hpp"
+#include "Utils/json11.hpp"
+#include "Variable.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <thread>
+
+Variable sar_demo_batch_threads("sar_demo_batch_threads", "0", 0, 64, "Number of threads used to time and verify demos in the background. 0 = one less than the number of CPU cores.\n");
+
+extern Variable sar_demo_index;
+
+namespace {
+	struct Batch {
+		std::string dir;
+		bool persistIndex;
+		bool verify;
+		std::vector<std::string> names;
+		std::vector<DemoBatch::Result> results;  // Each is written by one worker, and only read once it's finished
+		DemoBatch::ResultFn onResult;
+		DemoBatch::DoneFn onDone;
+
+		std::vector<std::thread> threads;
+		std::atomic<size_t> nextJob{0};
+		std::atomic<int> running{0};
+		std::atomic<bool> cancelled{false};
+
+		// Main thread only
+		std::vector<bool> finished;
+		size_t nextToReport = 0;
+	};
+}  // namespace
+
+static std::shared_ptr<Batch> g_batch;
+static std::vector<DemoBatch::Result> g_lastResults;
+
+static void timeDemo(const Batch &b, size_t idx, DemoBatch::Result *out) {
+	std::string path = b.dir + b.names[idx];
+	if (!Utils::EndsWith(path, ".dem")) path += ".dem";
+
+	out->name = b.names[idx];
+	out->parsed = false;
+	out->ticks = 0;
+	out->segmentTicks = -1;
+	out->time = 0;
+	out->tickrate = 0;
+	out->verified = b.verify;
+	out->checksum = VERIFY_NO_CHECKSUM;
+	out->sarChecksum = 0;
+
+	DemoIndex index;
+	if (index.Open(path, b.persistIndex)) {
+		Demo demo;
+		DemoParser parser;
+		index.FillDemo(&demo);
+		parser.Adjust(&demo);
+
+		out->parsed = true;
+		out->map = demo.mapName;
+		out->client = demo.clientName;
+		out->ticks = demo.playbackTicks;
+		out->segmentTicks = demo.segmentTicks;
+		out->time = demo.playbackTime;
+		out->tickrate = demo.Tickrate();
+	}
+
+	if (b.verify) {
+		auto [res, sarSum] = VerifyDemoChecksum(path.c_str());
+		out->checksum = res;
+		out->sarChecksum = sarSum;
+	}
+}
+
+// Reports every finished demo up to the first one that isn't, so results
+// always come out in order
+static void reportFinished(Batch *b, bool all) {
+	while (b->nextToReport < b->names.size()) {
+		size_t idx = b->nextToReport;
+		if (b->finished[idx]) {
+			b->onResult(b->results[idx], idx, b->names.size());
+		} else if (!all) {
+			break;
+		}
+		++b->nextToReport;
+	}
+}
+
+static void finishBatch(std::shared_ptr<Batch> b) {
+	for (auto &t : b->threads) t.join();
+	b->threads.clear();
+
+	// If we were cancelled, there may be gaps; report what we have
+	reportFinished(b.get(), true);
+
+	g_lastResults.clear();
+	for (size_t i = 0; i < b->names.size(); ++i) {
+		if (b->finished[i]) g_lastResults.push_back(std::move(b->results[i]));
+	}
+
+	g_batch.reset();
+	b->onDone(g_lastResults, b->cancelled);
+}
+
+static void workerMain(std::shared_ptr<Batch> b) {
+	while (!b->cancelled) {
+		size_t idx = b->nextJob++;
+		if (idx >= b->names.size()) break;
+
+		timeDemo(*b, idx, &b->results[idx]);
+
+		Scheduler::OnMainThread([b, idx]() {
+			b->finished[idx] = true;
+			reportFinished(b.get(), false);
+		});
+	}
+
+	// The last worker out finishes the batch; this is queued after all of
+	// the results, so they'll all have been reported by then
+	if (--b->running == 0) {
+		Scheduler::OnMainThread([b]() {
+			finishBatch(b);
+		});
+	}
+}
+
+bool DemoBatch::Start(const std::vector<std::string> &names, ResultFn onResult, DoneFn onDone, bool verify) {
+	if (g_batch) return false;
+
+	auto b = std::make_shared<Batch>();
+	b->dir = std::string(engine->GetGameDirectory()) + "/";
+	b->persistIndex = sar_demo_index.GetBool();
+	b->verify = verify;
+	b->names = names;
+	b->results.resize(names.size());
+	b->finished.resize(names.size(), false);
+	b->onResult = onResult;
+	b->onDone = onDone;
+
+	if (names.empty()) {
+		g_lastResults.clear();
+		onDone(g_lastResults, false);
+		return true;
+	}
+
+	int nThreads = sar_demo_batch_threads.GetInt();
+	if (nThreads <= 0) nThreads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+	nThreads = std::min(nThreads, (int)names.size());
+
+	g_batch = b;
+	b->running = nThreads;
+	for (int i = 0; i < nThreads; ++i) {
+		b->threads.emplace_back(workerMain, b);
+	}
+
+	return true;
+}
+
+bool DemoBatch::IsRunning() {
+	return (bool)g_batch;
+}
+
+void DemoBatch::Cancel() {
+	if (g_batch) g_batch->cancelled = true;
+}
+
+static const char *checksumName(VerifyResult res) {
+	switch (res) {
+	case VERIFY_BAD_DEMO: return "bad demo";
+	case VERIFY_NO_CHECKSUM: return "none";
+	case VERIFY_INVALID_CHECKSUM: return "invalid";
+	case VERIFY_VALID_CHECKSUM: return "valid";
+	}
+	return "unknown";
+}
+
+static std::string csvQuote(const std::string &str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"') out += '"';
+		out += c;
+	}
+	return out + "\"";
+}
+
+bool DemoBatch::Export(const std::string &filename) {
+	FILE *fp = fopen(filename.c_str(), "w");
+	if (!fp) return false;
+
+	if (Utils::EndsWith(filename, ".json")) {
+		json11::Json::array demos;
+		for (auto &res : g_lastResults) {
+			demos.push_back(json11::Json::object{
+				{"demo", res.name},
+				{"parsed", res.parsed},
+				{"map", res.map},
+				{"client", res.client},
+				{"ticks", res.ticks},
+				{"time", res.time},
+				{"tickrate", res.tickrate},
+				{"checksum", res.verified ? json11::Json(checksumName(res.checksum)) : json11::Json()},
+				{"sar_checksum", res.verified ? json11::Json(Utils::ssprintf("%08X", res.sarChecksum)) : json11::Json()},
+			});
+		}
+		fputs(json11::Json(demos).dump().c_str(), fp);
+		fputc('\n', fp);
+	} else {
+		fputs("demo,parsed,map,client,ticks,time,tickrate,checksum,sar_checksum\n", fp);
+		for (auto &res : g_lastResults) {
+			// Checksums that weren't checked are left empty
+			fprintf(fp, "%s,%d,%s,%s,%d,%.3f,%.3f,%s,%s\n",
+			        csvQuote(res.name).c_str(),
+			        res.parsed,
+			        csvQuote(res.map).c_str(),
+			        csvQuote(res.client).c_str(),
+			        res.ticks,
+			        res.time,
+			        res.tickrate,
+			        res.verified ? checksumName(res.checksum) : "",
+			        res.verified ? Utils::ssprintf("%08X", res.sarChecksum).c_str() : "");
+		}
+	}
+
+	bool ok = !ferror(fp);
+	return (fclose(fp) == 0) && ok;
+}
+
+std::vector<std::string> DemoBatch::FindDemos(const std::string &folder, bool recursive) {
+	std::vector<std::string> names;
+
+	std::string prefix = folder;
+	if (!prefix.empty() && prefix[prefix.size() - 1] != '/') prefix += "/";
+
+	auto root = std::filesystem::path(std::string(engine->GetGameDirectory()) + "/" + prefix);
+	auto add = [&](const std::filesystem::directory_entry &ent) {
+		if (ent.path().extension() != ".dem" || !ent.is_regular_file()) return;
+		auto name = prefix + std::filesystem::relative(ent.path(), root).string();
+		std::replace(name.begin(), name.end(), '\\', '/');
+		names.push_back(name);
+	};
+
+	try {
+		if (recursive) {
+			for (auto &ent : std::filesystem::recursive_directory_iterator(root)) add(ent);
+		} else {
+			for (auto &ent : std::filesystem::directory_iterator(root)) add(ent);
+		}
+	} catch (std::filesystem::filesystem_error &e) {
+	}
+
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+ON_EVENT(SAR_UNLOAD) {
+	if (!g_batch) return;
+
+	// Any results still waiting for the main thread are dropped
+	g_batch->cancelled = true;
+	for (auto &t : g_batch->threads) t.join();
+	g_batch->threads.clear();
+	g_batch.reset();
+}
+
+// Commands
+
+CON_COMMAND_AUTOCOMPLETEFILE(sar_verify_demos, "sar_verify_demos <folder|demo>... - times and checks the checksums of demos in the background, including every demo in the given folders and their subfolders\n", 0, 0, dem) {
+	if (args.ArgC() < 2) {
+		return console->Print(sar_verify_demos.ThisPtr()->m_pszHelpString);
+	}
+
+	if (DemoBatch::IsRunning()) {
+		return console->Print("Demos are already being processed! Use sar_demo_batch_cancel to stop them.\n");
+	}
+
+	std::vector<std::string> names;
+	auto dir = std::string(engine->GetGameDirectory()) + "/";
+	for (int i = 1; i < args.ArgC(); ++i) {
+		std::error_code ec;
+		if (std::filesystem::is_directory(dir + args[i], ec)) {
+			auto found = DemoBatch::FindDemos(args[i], true);
+			names.insert(names.end(), found.begin(), found.end());
+		} else {
+			names.push_back(args[i]);
+		}
+	}
+
+	console->Print("Verifying %d demos...\n", (int)names.size());
+
+	DemoBatch::Start(
+		names,
+		[](const DemoBatch::Result &res, size_t idx, size_t total) {
+			if (!res.parsed) {
+				console->Warning("[%d/%d] %s: could not parse!\n", (int)idx + 1, (int)total, res.name.c_str());
+				return;
+			}
+
+			auto msg = Utils::ssprintf("[%d/%d] %s: %s, %d ticks (%.3f), checksum %s\n", (int)idx + 1, (int)total, res.name.c_str(), res.map.c_str(), res.ticks, res.time, checksumName(res.checksum));
+			if (res.checksum == VERIFY_VALID_CHECKSUM) {
+				console->Print("%s", msg.c_str());
+			} else {
+				console->Warning("%s", msg.c_str());
+			}
+		},
+		[](const std::vector<DemoBatch::Result> &results, bool cancelled) {
+			int valid = 0, bad = 0;
+			for (auto &res : results) {
+				if (res.parsed && res.checksum == VERIFY_VALID_CHECKSUM) {
+					++valid;
+				} else {
+					++bad;
+				}
+			}
+			console->Print("%s: %d demos verified, %d with problems. Use sar_demo_batch_export to save the results.\n", cancelled ? "Cancelled" : "Done", valid, bad);
+		},
+		true);
+}
+
+CON_COMMAND(sar_demo_batch_cancel, "sar_demo_batch_cancel - stops timing or verifying demos in the background\n") {
+	if (!DemoBatch::IsRunning()) {
+		return console->Print("No demos are being processed.\n");
+	}
+
+	DemoBatch::Cancel();
+}
+
+CON_COMMAND(sar_demo_batch_export, "sar_demo_batch_export <file> - saves the results of the last sar_verify_demos or sar_time_demos as CSV, or as JSON if the file ends in .json\n") {
+	if (args.ArgC() != 2) {
+		return console->Print(sar_demo_batch_export.ThisPtr()->m_pszHelpString);
+	}
+
+	if (DemoBatch::IsRunning()) {
+		return console->Print("Wait for the demos to finish processing first!\n");
+	}
+
+	auto filename = std::string(engine->GetGameDirectory()) + "/" + args[1];
+	if (!DemoBatch::Export(filename)) {
+		return console->Print("Could not write \"%s\"!\n", filename.c_str());
+	}
+
+	console->Print("Saved results to \"%s\".\n", filename.c_str());
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "Checksum.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Times and checksum-verifies lots of demos at once on a pool of worker
+// threads, so that auditing a folder of runs doesn't freeze the game
+namespace DemoBatch {
+	struct Result {
+		std::string name;  // As given to Start, relative to the game directory
+		bool parsed;
+		std::string map;
+		std::string client;
+		int ticks;
+		int segmentTicks;  // Tick of __END__, or -1 if there isn't one
+		float time;
+		float tickrate;
+		bool verified;  // Whether the checksums were checked at all
+		VerifyResult checksum;
+		uint32_t sarChecksum;
+	};
+
+	using ResultFn = std::function<void(const Result &res, size_t idx, size_t total)>;
+	using DoneFn = std::function<void(const std::vector<Result> &results, bool cancelled)>;
+
+	// Starts a batch. onResult is run on the main thread for each demo in
+	// the order they were given, and onDone once they've all been
+	// processed or the batch was cancelled. Only one batch can run at a
+	// time; returns false if one already is. Checking the checksums means
+	// reading every demo in full, so it's only done if verify is set;
+	// otherwise the timing mostly comes from the demos' indexes.
+	bool Start(const std::vector<std::string> &names, ResultFn onResult, DoneFn onDone, bool verify = false);
+	bool IsRunning();
+	void Cancel();
+
+	// Writes the results of the last batch as CSV, or as JSON if the
+	// filename ends in .json
+	bool Export(const std::string &filename);
+
+	// Every demo in a folder relative to the game directory, sorted
+	std::vector<std::string> FindDemos(const std::string &folder, bool recursive);
+}  // namespace DemoBatch
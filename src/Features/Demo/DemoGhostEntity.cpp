@@ -20,22 +20,31 @@ DemoGhostEntity::DemoGhostEntity(unsigned int ID, std::string name, DataGhost da
 }
 
 void DemoGhostEntity::ChangeDemo() {
-	this->currentDatas = this->datasByLevel[this->currentDemo].levelDatas;
 	this->nbDemoTicks = this->datasByLevel[this->currentDemo].demo.playbackTicks;
 	this->currentMap = this->datasByLevel[this->currentDemo].demo.mapName;
 	this->sameMap = engine->GetCurrentMapName() == this->currentMap;
 	this->isAhead = engine->GetMapIndex(this->currentMap) > engine->GetMapIndex(engine->GetCurrentMapName());
 }
 
-void DemoGhostEntity::AddLevelDatas(DemoDatas &datas) {
-	this->datasByLevel.push_back(datas);
+void DemoGhostEntity::AddLevelDatas(DemoDatas datas) {
+	this->datasByLevel.push_back(std::move(datas));
 }
 
-void DemoGhostEntity::SetFirstLevelDatas(DemoDatas &datas) {
+void DemoGhostEntity::SetFirstLevelDatas(DemoDatas datas) {
 	if (this->datasByLevel.size() > 0) {
-		this->datasByLevel[0] = datas;
+		this->datasByLevel[0] = std::move(datas);
 	} else {
-		this->datasByLevel.push_back(datas);
+		this->datasByLevel.push_back(std::move(datas));
+	}
+}
+
+void DemoGhostEntity::SetLevelDatas(size_t idx, DemoDatas datas) {
+	// totalTicks was calculated from the header
+	this->totalTicks += datas.demo.playbackTicks - this->datasByLevel[idx].demo.playbackTicks;
+	this->datasByLevel[idx] = std::move(datas);
+
+	if (idx == this->currentDemo) {
+		this->ChangeDemo();
 	}
 }
 
@@ -67,22 +76,25 @@ void DemoGhostEntity::UpdateDemoGhost() {
 		--this->demoTick;
 	}
 
-	if (this->demoTick > this->nbDemoTicks && demoGhostPlayer.IsFullGame()) {  // if played the whole demo
+	bool loaded = this->currentDemo < this->datasByLevel.size() && this->datasByLevel[this->currentDemo].loaded;
+
+	if (!loaded) {
+		// Still being loaded in the background; keep counting ticks so
+		// the ghost is in the right place once it's ready
+	} else if (this->demoTick > this->nbDemoTicks && demoGhostPlayer.IsFullGame()) {  // if played the whole demo
 		this->NextDemo();
 	} else if (this->demoTick > this->nbDemoTicks) {  // If played the whole CM demo
 		this->DeleteGhost();
 	} else if (this->demoTick < this->nbDemoTicks && this->demoTick >= 0) {
-		auto data = this->currentDatas.find(this->demoTick);
-		if (data != this->currentDatas.end()) {
-			this->data = data->second;
-		} else {
+		auto &track = this->datasByLevel[this->currentDemo].levelDatas;
+		DataGhost next;
+		if (!track.Get(this->demoTick, &this->data)) {
 			// No data for this tick! Chances are it's an alternateticks
 			// demo. Try to interpolate the position to smooth movement
 			// a bit
-			data = this->currentDatas.find(this->demoTick + 1);
-			if (data != this->currentDatas.end()) {
+			if (track.Get(this->demoTick + 1, &next)) {
 				this->oldPos = this->data;
-				this->data = data->second;
+				this->data = next;
 				Math::Lerp(this->oldPos.position, this->data.position, 0.5, this->data.position);
 			}
 		}
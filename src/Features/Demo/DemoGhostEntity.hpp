@@ -1,19 +1,16 @@
 #pragma once
 #include "Demo.hpp"
+#include "DemoParser.hpp"
 #include "GhostEntity.hpp"
 
-#include <unordered_map>
-
 struct DemoDatas {
-	std::map<int, DataGhost> levelDatas;
+	GhostTrack levelDatas;
 	Demo demo;
+	bool loaded = true;  // If not, only the header of the demo has been read so far
 };
 
-typedef std::unordered_map<std::string, std::tuple<int, bool>> CustomDatas;
-
 class DemoGhostEntity : public GhostEntity {
 private:
-	std::map<int, DataGhost> currentDatas;  //Pos and ang of ghost
 	unsigned int currentDemo;
 
 public:
@@ -35,8 +32,10 @@ public:
 	DemoGhostEntity(unsigned int ID, std::string name, DataGhost data, std::string currentMap);
 	void ChangeDemo();  //Change demo for FullGame ghosts
 	//Add demo for full game ghost
-	void AddLevelDatas(DemoDatas &datas);
-	void SetFirstLevelDatas(DemoDatas &datas);
+	void AddLevelDatas(DemoDatas datas);
+	void SetFirstLevelDatas(DemoDatas datas);
+	//Fill in a level which was added before it had been loaded
+	void SetLevelDatas(size_t idx, DemoDatas datas);
 	//Setup the ghost in order to play next demo
 	void NextDemo();
 	//Update position of the ghost
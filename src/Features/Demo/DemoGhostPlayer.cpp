@@ -3,14 +3,19 @@
 #include "Event.hpp"
 #include "Features/Demo/Demo.hpp"
 #include "Features/Demo/DemoParser.hpp"
+#include "Features/Demo/GhostFile.hpp"
 #include "Features/Session.hpp"
 #include "Modules/Client.hpp"
 #include "Modules/Engine.hpp"
 #include "NetworkGhostPlayer.hpp"
 #include "Utils.hpp"
 
+#include <atomic>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <thread>
 
 
 Variable ghost_sync("ghost_sync", "0", "When loading a new level, pauses the game until other players load it.\n");
@@ -59,6 +64,7 @@ void DemoGhostPlayer::ResumeAllGhosts() {
 }
 
 void DemoGhostPlayer::DeleteAllGhosts() {
+	this->CancelAllLoading();
 	this->ghostPool.clear();
 	this->isPlaying = false;
 }
@@ -70,6 +76,7 @@ void DemoGhostPlayer::DeleteAllGhostModels() {
 }
 
 void DemoGhostPlayer::DeleteGhostsByID(const unsigned int ID) {
+	this->CancelLoading(ID);
 	for (int i = 0; i < this->ghostPool.size(); ++i) {
 		if (this->ghostPool[i].ID == ID) {
 			this->ghostPool[i].DeleteGhost();
@@ -137,25 +144,27 @@ DemoGhostEntity *DemoGhostPlayer::GetGhostByID(int ID) {
 bool DemoGhostPlayer::SetupGhostFromDemo(const std::string &demo_path, const unsigned int ghost_ID, bool fullGame) {
 	DemoParser parser;
 	Demo demo;
-	std::map<int, DataGhost> datas;
+	DemoDatas demoDatas;
 	CustomDatas customDatas;
+	GhostTrackVisitor visitor(&demo, &demoDatas.levelDatas, &customDatas);
 
-	if (parser.Parse(demo_path, &demo, true, &datas, &customDatas)) {
+	if (parser.Parse(demo_path, &demo, &visitor)) {
 		parser.Adjust(&demo);
 
-		DemoDatas demoDatas{datas, demo};
+		demoDatas.levelDatas.ShrinkToFit();
+		demoDatas.demo = demo;
 
 		DemoGhostEntity *ghost = demoGhostPlayer.GetGhostByID(ghost_ID);
 		if (ghost == nullptr) {  //New fullgame or CM ghost
 			DemoGhostEntity new_ghost = {ghost_ID, demo.clientName, DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false}, demo.mapName};
-			new_ghost.SetFirstLevelDatas(demoDatas);
+			new_ghost.SetFirstLevelDatas(std::move(demoDatas));
 			new_ghost.firstLevel = demo.mapName;
 			new_ghost.lastLevel = demo.mapName;
 			new_ghost.totalTicks = demo.playbackTicks;
 			new_ghost.customDatas = customDatas;
 			demoGhostPlayer.AddGhost(new_ghost);
 		} else {  //Only fullGame
-			ghost->AddLevelDatas(demoDatas);
+			ghost->AddLevelDatas(std::move(demoDatas));
 			ghost->lastLevel = demo.mapName;
 			ghost->totalTicks += demo.playbackTicks;
 		}
@@ -164,6 +173,233 @@ bool DemoGhostPlayer::SetupGhostFromDemo(const std::string &demo_path, const uns
 	return false;
 }
 
+bool DemoGhostPlayer::SetupGhostFromTrack(const std::string &track_path, const unsigned int ghost_ID) {
+	GhostFile::Run run;
+	if (!GhostFile::Read(track_path, &run) || run.levels.empty()) return false;
+
+	DemoGhostEntity new_ghost = {ghost_ID, run.clientName, DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false}, run.levels[0].mapName};
+	new_ghost.firstLevel = run.levels.front().mapName;
+	new_ghost.lastLevel = run.levels.back().mapName;
+	new_ghost.totalTicks = 0;
+	new_ghost.customDatas = run.levels[0].customDatas;
+
+	for (auto &level : run.levels) {
+		DemoDatas datas;
+		memset(&datas.demo, 0, sizeof datas.demo);
+		strncpy(datas.demo.clientName, run.clientName.c_str(), sizeof datas.demo.clientName - 1);
+		strncpy(datas.demo.mapName, level.mapName.c_str(), sizeof datas.demo.mapName - 1);
+		datas.demo.playbackTicks = level.playbackTicks;
+		datas.demo.playbackTime = level.playbackTime;
+		datas.levelDatas = std::move(level.track);
+
+		new_ghost.totalTicks += level.playbackTicks;
+		new_ghost.AddLevelDatas(std::move(datas));
+	}
+
+	this->AddGhost(new_ghost);
+	return true;
+}
+
+bool DemoGhostPlayer::ExportGhostTrack(const unsigned int ghost_ID, const std::string &track_path) {
+	auto ghost = this->GetGhostByID(ghost_ID);
+	if (!ghost) return false;
+
+	GhostFile::Run run;
+	run.clientName = ghost->name;
+	for (size_t i = 0; i < ghost->datasByLevel.size(); ++i) {
+		auto &datas = ghost->datasByLevel[i];
+		if (!datas.loaded) return false;
+
+		// Only the first level's custom data is kept for splits
+		run.levels.push_back({datas.demo.mapName, datas.demo.playbackTicks, datas.demo.playbackTime, datas.levelDatas, i == 0 ? ghost->customDatas : CustomDatas()});
+	}
+
+	return GhostFile::Write(track_path, run);
+}
+
+// Background loading {{{
+
+namespace {
+	struct GhostLoadLevel {
+		std::string path;
+		DemoDatas datas;
+		CustomDatas customDatas;
+		bool ok = false;
+		std::atomic<bool> ready{false};  // Set once the loader has written everything above
+		bool installed = false;          // Main thread only
+	};
+
+	struct GhostLoad {
+		unsigned int ghostID;
+		std::string ghostName;
+		std::vector<std::unique_ptr<GhostLoadLevel>> levels;
+		std::vector<size_t> order;
+		std::atomic<bool> cancelled{false};
+		std::thread thread;
+		size_t installed = 0;  // Main thread only
+	};
+}  // namespace
+
+static std::vector<std::unique_ptr<GhostLoad>> g_ghostLoads;
+
+// Each level only belongs to the main thread once its ready flag is set,
+// so nothing needs locking
+static void loadGhostMain(GhostLoad *load) {
+	for (size_t idx : load->order) {
+		if (load->cancelled) break;
+
+		auto &level = *load->levels[idx];
+		DemoParser parser;
+		Demo demo;
+		GhostTrackVisitor visitor(&demo, &level.datas.levelDatas, &level.customDatas, &load->cancelled);
+
+		level.ok = parser.Parse(level.path, &demo, &visitor) && !load->cancelled;
+		if (level.ok) {
+			parser.Adjust(&demo);
+			level.datas.levelDatas.ShrinkToFit();
+			level.datas.demo = demo;
+		}
+
+		level.ready.store(true, std::memory_order_release);
+	}
+}
+
+bool DemoGhostPlayer::LoadGhostFromDemos(const std::vector<std::string> &demo_paths, const unsigned int ghost_ID) {
+	if (demo_paths.empty()) return false;
+
+	auto load = std::make_unique<GhostLoad>();
+	load->ghostID = ghost_ID;
+
+	DemoGhostEntity new_ghost = {ghost_ID, "", DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false}, ""};
+	new_ghost.totalTicks = 0;
+
+	// The headers are tiny, and give us the maps and a rough length to
+	// show until each level is parsed properly
+	for (auto &path : demo_paths) {
+		DemoParser parser;
+		parser.headerOnly = true;
+		DemoVisitor visitor;
+
+		DemoDatas datas;
+		if (!parser.Parse(path, &datas.demo, &visitor)) {
+			console->Print("Could not parse \"%s\"!\n", path.c_str());
+			return false;
+		}
+		datas.loaded = false;
+		new_ghost.totalTicks += datas.demo.playbackTicks;
+
+		auto level = std::make_unique<GhostLoadLevel>();
+		level->path = path;
+		load->levels.push_back(std::move(level));
+		new_ghost.AddLevelDatas(std::move(datas));
+	}
+
+	auto &first = new_ghost.datasByLevel.front().demo;
+	new_ghost.name = first.clientName;
+	new_ghost.firstLevel = first.mapName;
+	new_ghost.lastLevel = new_ghost.datasByLevel.back().demo.mapName;
+	load->ghostName = new_ghost.name;
+
+	// Whatever map we're on is the one needed first
+	auto curMap = engine->GetCurrentMapName();
+	for (size_t i = 0; i < demo_paths.size(); ++i) {
+		if (new_ghost.datasByLevel[i].demo.mapName == curMap) {
+			load->order.push_back(i);
+			break;
+		}
+	}
+	for (size_t i = 0; i < demo_paths.size(); ++i) {
+		if (load->order.empty() || load->order[0] != i) load->order.push_back(i);
+	}
+
+	this->AddGhost(new_ghost);
+
+	toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("Loading %d demos of %s...", (int)demo_paths.size(), load->ghostName.c_str()));
+
+	load->thread = std::thread(loadGhostMain, load.get());
+	g_ghostLoads.push_back(std::move(load));
+
+	return true;
+}
+
+void DemoGhostPlayer::UpdateLoading() {
+	for (size_t i = 0; i < g_ghostLoads.size();) {
+		auto &load = *g_ghostLoads[i];
+		auto ghost = this->GetGhostByID(load.ghostID);
+		std::string failedPath;
+
+		size_t total = load.levels.size();
+		for (size_t idx = 0; idx < total && ghost && failedPath.empty(); ++idx) {
+			auto &level = *load.levels[idx];
+			if (level.installed || !level.ready.load(std::memory_order_acquire)) continue;
+
+			level.installed = true;
+			++load.installed;
+
+			if (!level.ok) {
+				failedPath = level.path;
+				break;
+			}
+
+			if (idx == 0) ghost->customDatas = std::move(level.customDatas);
+			std::string map = level.datas.demo.mapName;
+			level.datas.loaded = true;
+			ghost->SetLevelDatas(idx, std::move(level.datas));
+
+			if (load.installed == total) break;
+			if (map == engine->GetCurrentMapName()) {
+				toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("%s is ready on %s", load.ghostName.c_str(), map.c_str()));
+			} else if (load.installed * 4 / total != (load.installed - 1) * 4 / total) {
+				toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("Loaded %d/%d demos of %s", (int)load.installed, (int)total, load.ghostName.c_str()), false);
+			}
+		}
+
+		if (ghost && failedPath.empty() && load.installed < total) {
+			++i;
+			continue;
+		}
+
+		load.cancelled = true;
+		load.thread.join();
+		unsigned int ID = load.ghostID;
+		g_ghostLoads.erase(g_ghostLoads.begin() + i);
+
+		if (!failedPath.empty()) {
+			console->Print("Could not parse \"%s\"!\n", failedPath.c_str());
+			this->DeleteGhostsByID(ID);
+		} else if (ghost) {
+			toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("%s has loaded! Final time of the ghost: %s", ghost->name.c_str(), SpeedrunTimer::Format(ghost->GetTotalTime()).c_str()));
+		}
+	}
+}
+
+void DemoGhostPlayer::CancelLoading(const unsigned int ID) {
+	for (size_t i = 0; i < g_ghostLoads.size(); ++i) {
+		if (g_ghostLoads[i]->ghostID == ID) {
+			g_ghostLoads[i]->cancelled = true;
+			g_ghostLoads[i]->thread.join();
+			g_ghostLoads.erase(g_ghostLoads.begin() + i);
+			return;
+		}
+	}
+}
+
+void DemoGhostPlayer::CancelAllLoading() {
+	for (auto &load : g_ghostLoads) load->cancelled = true;
+	for (auto &load : g_ghostLoads) load->thread.join();
+	g_ghostLoads.clear();
+}
+
+ON_EVENT(FRAME) {
+	demoGhostPlayer.UpdateLoading();
+}
+
+ON_EVENT(SAR_UNLOAD) {
+	demoGhostPlayer.CancelAllLoading();
+}
+
+// }}}
+
 void DemoGhostPlayer::AddGhost(DemoGhostEntity &ghost) {
 	this->ghostPool.push_back(ghost);
 }
@@ -235,30 +471,77 @@ CON_COMMAND_AUTOCOMPLETEFILE(ghost_set_demos,
 	auto dir = engine->GetGameDirectory() + std::string("/") + args[1];
 	int counter = firstDemoId > 1 ? firstDemoId : 2;
 
-	bool ok = true;
-
+	std::vector<std::string> paths;
 	if (firstDemoId < 2) {
-		ok = std::filesystem::exists(dir + ".dem");
-		if (!ok || !demoGhostPlayer.SetupGhostFromDemo(dir, ID, true)) {
-			return console->Print("Could not parse \"%s\"!\n", engine->GetGameDirectory() + std::string("/") + args[1]);
+		if (!std::filesystem::exists(dir + ".dem")) {
+			return console->Print("Could not parse \"%s\"!\n", (dir + ".dem").c_str());
 		}
+		paths.push_back(dir + ".dem");
 	}
 
-	while (ok) {
+	while (true) {
 		auto tmp_dir = dir + "_" + std::to_string(counter) + ".dem";
-		ok = std::filesystem::exists(tmp_dir);
-		if (ok && !demoGhostPlayer.SetupGhostFromDemo(tmp_dir, ID, true)) {
-			return console->Print("Could not parse \"%s\"!\n", tmp_dir.c_str());
-		}
+		if (!std::filesystem::exists(tmp_dir)) break;
+		paths.push_back(tmp_dir);
 		++counter;
 	}
 
-	console->Print("Ghost successfully created! Final time of the ghost: %s\n", SpeedrunTimer::Format(demoGhostPlayer.GetGhostByID(ID)->GetTotalTime()).c_str());
+	if (paths.empty()) {
+		return console->Print("Could not find \"%s_%d.dem\"!\n", dir.c_str(), firstDemoId);
+	}
+
+	if (!demoGhostPlayer.LoadGhostFromDemos(paths, ID)) return;
 
 	demoGhostPlayer.UpdateGhostsSameMap();
 	demoGhostPlayer.isFullGame = true;
 }
 
+CON_COMMAND_AUTOCOMPLETEFILE(ghost_set_track, "ghost_set_track <file> [ID] - ghost will use this track, as saved by ghost_export_track or sar-demotool. If ID is specified, will create or modify the ID-th ghost\n", 0, 0, sarghost) {
+	if (args.ArgC() < 2) {
+		return console->Print(ghost_set_track.ThisPtr()->m_pszHelpString);
+	}
+
+	auto path = engine->GetGameDirectory() + std::string("/") + args[1];
+	if (!Utils::EndsWith(path, ".sarghost")) path += ".sarghost";
+
+	sf::Uint32 ID = args.ArgC() > 2 ? std::atoi(args[2]) : 0;
+	demoGhostPlayer.DeleteGhostsByID(ID);
+	if (!demoGhostPlayer.SetupGhostFromTrack(path, ID)) {
+		return console->Print("Could not load \"%s\"!\n", path.c_str());
+	}
+
+	auto ghost = demoGhostPlayer.GetGhostByID(ID);
+	console->Print("Ghost successfully created! Final time of the ghost: %s\n", SpeedrunTimer::Format(ghost->GetTotalTime()).c_str());
+
+	demoGhostPlayer.UpdateGhostsSameMap();
+	demoGhostPlayer.isFullGame = ghost->datasByLevel.size() > 1;
+}
+
+CON_COMMAND(ghost_export_track, "ghost_export_track <file> [ID] - saves a demo ghost as a .sarghost track, which ghost_set_track loads instantly\n") {
+	if (args.ArgC() < 2) {
+		return console->Print(ghost_export_track.ThisPtr()->m_pszHelpString);
+	}
+
+	auto path = engine->GetGameDirectory() + std::string("/") + args[1];
+	if (!Utils::EndsWith(path, ".sarghost")) path += ".sarghost";
+
+	sf::Uint32 ID = args.ArgC() > 2 ? std::atoi(args[2]) : 0;
+	auto ghost = demoGhostPlayer.GetGhostByID(ID);
+	if (!ghost) {
+		return console->Print("No ghost with that ID\n");
+	}
+
+	if (std::any_of(ghost->datasByLevel.begin(), ghost->datasByLevel.end(), [](const DemoDatas &datas) { return !datas.loaded; })) {
+		return console->Print("Ghost %d is still loading!\n", ID);
+	}
+
+	if (!demoGhostPlayer.ExportGhostTrack(ID, path)) {
+		return console->Print("Could not save \"%s\"!\n", path.c_str());
+	}
+
+	console->Print("Saved ghost %d to \"%s\".\n", ID, path.c_str());
+}
+
 CON_COMMAND(ghost_delete_by_ID, "ghost_delete_by_ID <ID> - delete the ghost selected\n") {
 	if (args.ArgC() < 2) {
 		return console->Print(ghost_delete_by_ID.ThisPtr()->m_pszHelpString);
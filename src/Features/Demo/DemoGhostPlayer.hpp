@@ -42,6 +42,16 @@ public:
 	DemoGhostEntity *GetGhostByID(int ID);
 
 	bool SetupGhostFromDemo(const std::string &demo_path, const unsigned int ghost_ID, bool fullGame);
+	// Sets up a full game ghost from the demos in order. Only their headers
+	// are read straight away; the rest is parsed in the background,
+	// starting with the current map, and each level is added to the ghost
+	// as soon as it's ready.
+	bool LoadGhostFromDemos(const std::vector<std::string> &demo_paths, const unsigned int ghost_ID);
+	void CancelLoading(const unsigned int ID);
+	bool SetupGhostFromTrack(const std::string &track_path, const unsigned int ghost_ID);
+	bool ExportGhostTrack(const unsigned int ghost_ID, const std::string &track_path);
+	void CancelAllLoading();
+	void UpdateLoading();
 	void AddGhost(DemoGhostEntity &ghost);
 	bool IsPlaying();
 	bool IsFullGame();
@@ -82,6 +92,8 @@ void DemoGhostPlayer::TestInputRule(Ts... args) {
 extern Variable ghost_sync;
 extern Command ghost_set_demo;
 extern Command ghost_set_demos;
+extern Command ghost_set_track;
+extern Command ghost_export_track;
 extern Command ghost_delete_all;
 extern Command ghost_delete_by_ID;
 extern Command ghost_recap;
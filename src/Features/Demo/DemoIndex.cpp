@@ -0,0 +1,194 @@
+#include "DemoIndex.hpp"
+
+#include "Demo.hpp"
+#include "DemoParser.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#define INDEX_VERSION 2
+#define DEMO_HEADER_SIZE 1072
+#define HASH_SPAN (64 * 1024)
+
+namespace {
+	// The whole index file
+	struct IndexHeader {
+		char magic[4];  // "SDIX"
+		uint32_t version;
+		uint64_t demoSize;
+		int64_t demoMtime;
+		uint64_t demoHash;
+		uint32_t parseOk;
+		int32_t lastMessageTick;
+		int32_t firstPositivePacketTick;
+		int32_t segmentTicks;
+		uint8_t demoHeader[DEMO_HEADER_SIZE];
+	};
+	static_assert(sizeof(IndexHeader) == 48 + DEMO_HEADER_SIZE, "IndexHeader must not be padded");
+
+	class IndexVisitor : public DemoVisitor {
+	public:
+		int32_t lastMessageTick = -1;
+		int32_t firstPositivePacketTick = 0;
+		int32_t segmentTicks = -1;
+
+		bool OnMessage(uint8_t type, int32_t tick, size_t offset) override {
+			if (tick >= 0) this->lastMessageTick = tick;
+			return true;
+		}
+
+		bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override {
+			if (tick > 0 && this->gotSync && !this->gotFirstPositivePacket) {
+				this->firstPositivePacketTick = tick;
+				this->gotFirstPositivePacket = true;
+			}
+			return true;
+		}
+
+		bool OnSyncTick(int32_t tick) override {
+			this->gotSync = true;
+			return true;
+		}
+
+		bool OnConsoleCmd(int32_t tick, const char *cmd, int32_t length) override {
+			static const char end[] = "__END__";
+			if (std::search(cmd, cmd + length, end, end + sizeof end - 1) != cmd + length) {
+				this->segmentTicks = tick;
+			}
+			return true;
+		}
+
+	private:
+		bool gotSync = false;
+		bool gotFirstPositivePacket = false;
+	};
+
+	uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t size) {
+		for (size_t i = 0; i < size; ++i) {
+			hash ^= data[i];
+			hash *= 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	const IndexHeader *header(const uint8_t *data) {
+		return (const IndexHeader *)data;
+	}
+}  // namespace
+
+std::string DemoIndex::IndexPath(const std::string &demoPath) {
+	return demoPath + ".idx";
+}
+
+// Hashing the whole demo would cost as much as parsing it, so only the
+// ends are hashed; together with the size and mtime, that's plenty to
+// notice a demo being replaced
+bool DemoIndex::ComputeKey(const std::string &demoPath, const MappedFile &demo, Key *out) {
+	std::error_code ec;
+	auto mtime = std::filesystem::last_write_time(demoPath, ec);
+	if (ec) return false;
+
+	out->size = demo.Size();
+	out->mtime = mtime.time_since_epoch().count();
+
+	size_t span = std::min(demo.Size(), (size_t)HASH_SPAN);
+	out->hash = 0xcbf29ce484222325ULL;
+	out->hash = fnv1a(out->hash, demo.Data(), span);
+	out->hash = fnv1a(out->hash, demo.Data() + demo.Size() - span, span);
+
+	return true;
+}
+
+bool DemoIndex::Validate(const uint8_t *data, size_t size, const Key &key) const {
+	if (size < sizeof(IndexHeader)) return false;
+
+	const IndexHeader *hdr = header(data);
+	if (memcmp(hdr->magic, "SDIX", 4) || hdr->version != INDEX_VERSION) return false;
+	if (hdr->demoSize != key.size || hdr->demoMtime != key.mtime || hdr->demoHash != key.hash) return false;
+
+	return size == sizeof(IndexHeader);
+}
+
+bool DemoIndex::Build(const MappedFile &demo, const Key &key, std::vector<uint8_t> *out) const {
+	IndexVisitor visitor;
+	DemoParser parser;
+	Demo parsed;
+	bool ok = parser.ParseBuffer(demo.Data(), demo.Size(), &parsed, &visitor);
+
+	IndexHeader hdr = {};
+	memcpy(hdr.magic, "SDIX", 4);
+	hdr.version = INDEX_VERSION;
+	hdr.demoSize = key.size;
+	hdr.demoMtime = key.mtime;
+	hdr.demoHash = key.hash;
+	hdr.parseOk = ok;
+	hdr.lastMessageTick = visitor.lastMessageTick;
+	hdr.firstPositivePacketTick = visitor.firstPositivePacketTick;
+	hdr.segmentTicks = visitor.segmentTicks;
+	if (ok) memcpy(hdr.demoHeader, demo.Data(), DEMO_HEADER_SIZE);
+
+	out->resize(sizeof hdr);
+	memcpy(out->data(), &hdr, sizeof hdr);
+
+	return true;
+}
+
+bool DemoIndex::Open(const std::string &demoPath, bool persist) {
+	this->Close();
+
+	MappedFile demo;
+	if (!demo.Open(demoPath)) return false;
+
+	Key key;
+	if (!ComputeKey(demoPath, demo, &key)) return false;
+
+	std::string indexPath = IndexPath(demoPath);
+
+	if (persist && this->file.Open(indexPath) && this->Validate(this->file.Data(), this->file.Size(), key)) {
+		this->data = this->file.Data();
+		this->size = this->file.Size();
+	} else {
+		this->file.Close();
+		this->Build(demo, key, &this->memory);
+		this->data = this->memory.data();
+		this->size = this->memory.size();
+		this->rebuilt = true;
+
+		// Save it for next time. This can fail, e.g. if the demo is in
+		// a read-only folder, in which case we just use it from memory.
+		std::string tmpPath = indexPath + ".tmp";
+		FILE *fp = persist ? fopen(tmpPath.c_str(), "wb") : nullptr;
+		if (fp) {
+			bool ok = fwrite(this->memory.data(), 1, this->memory.size(), fp) == this->memory.size();
+			ok &= fclose(fp) == 0;
+			std::error_code ec;
+			if (ok) std::filesystem::rename(tmpPath, indexPath, ec);
+			if (!ok || ec) std::filesystem::remove(tmpPath, ec);
+		}
+	}
+
+	return header(this->data)->parseOk;
+}
+
+void DemoIndex::Close() {
+	this->file.Close();
+	this->memory.clear();
+	this->data = nullptr;
+	this->size = 0;
+	this->rebuilt = false;
+}
+
+void DemoIndex::FillDemo(Demo *demo) const {
+	const IndexHeader *hdr = header(this->data);
+
+	DemoParser parser;
+	DemoVisitor visitor;
+	parser.headerOnly = true;
+	parser.ParseBuffer(hdr->demoHeader, DEMO_HEADER_SIZE, demo, &visitor);
+
+	demo->lastMessageTick = hdr->lastMessageTick;
+	demo->firstPositivePacketTick = hdr->firstPositivePacketTick;
+	demo->segmentTicks = hdr->segmentTicks;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "Utils/MappedFile.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Demo;
+
+// A compact summary of a demo which is stored next to it (as
+// <demo>.dem.idx) the first time it's parsed, so that later header and
+// timing queries only have to map that rather than parse the demo again.
+// The index is keyed by the demo's size, modification time and a hash
+// of its first and last 64 KiB, and is rebuilt if any of them change.
+class DemoIndex {
+public:
+	DemoIndex() = default;
+	DemoIndex(const DemoIndex &) = delete;
+	DemoIndex &operator=(const DemoIndex &) = delete;
+
+	// Opens the index for a demo, building (and if possible writing) it
+	// first if it's missing or stale. If persist is false, any existing
+	// index is ignored and the new one is only kept in memory. Fails if
+	// the demo can't be parsed.
+	bool Open(const std::string &demoPath, bool persist = true);
+	void Close();
+
+	// Fills in the header and timing fields of a Demo, as Parse would
+	void FillDemo(Demo *demo) const;
+
+	bool WasRebuilt() const { return this->rebuilt; }
+
+	static std::string IndexPath(const std::string &demoPath);
+
+private:
+	struct Key {
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash;
+	};
+
+	static bool ComputeKey(const std::string &demoPath, const MappedFile &demo, Key *out);
+	bool Validate(const uint8_t *data, size_t size, const Key &key) const;
+	bool Build(const MappedFile &demo, const Key &key, std::vector<uint8_t> *out) const;
+
+	MappedFile file;
+	std::vector<uint8_t> memory;  // Used instead of the mapping if the index couldn't be written
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	bool rebuilt = false;
+};
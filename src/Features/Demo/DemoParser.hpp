@@ -1,11 +1,104 @@
 #pragma once
-#include "DemoGhostPlayer.hpp"
-#include "Variable.hpp"
-
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <map>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+
+// The engine-facing parts of demo parsing are in DemoTiming.cpp
 
 class Demo;
+class Variable;
+
+typedef std::unordered_map<std::string, std::tuple<int, bool>> CustomDatas;
+
+// Bounds-checked reads over an in-memory demo. Once a read runs off the
+// end of the buffer the cursor is marked as failed and every read after
+// it fails too, so callers can check once after a group of reads.
+class DemoCursor {
+public:
+	DemoCursor(const uint8_t *data, size_t size)
+		: data(data)
+		, size(size)
+		, offset(0)
+		, failed(false) {
+	}
+
+	bool Read(void *out, size_t len) {
+		const uint8_t *ptr = this->Take(len);
+		if (ptr) memcpy(out, ptr, len);
+		return ptr != nullptr;
+	}
+
+	template <typename T>
+	bool Read(T &out) {
+		return this->Read(&out, sizeof out);
+	}
+
+	// Returns a pointer to the next len bytes and skips over them, or
+	// nullptr if there aren't that many left
+	const uint8_t *Take(size_t len) {
+		if (this->failed || len > this->size - this->offset) {
+			this->failed = true;
+			return nullptr;
+		}
+		const uint8_t *ptr = this->data + this->offset;
+		this->offset += len;
+		return ptr;
+	}
+
+	bool Skip(size_t len) {
+		return this->Take(len) != nullptr;
+	}
+
+	size_t Offset() const { return this->offset; }
+	size_t Remaining() const { return this->size - this->offset; }
+	bool AtEnd() const { return this->offset == this->size; }
+	bool Failed() const { return this->failed; }
+
+private:
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+	bool failed;
+};
+
+// The view information stored with each player in a packet message
+struct DemoCmdInfo {
+	int32_t flags;
+	float viewOrigin[3];
+	float viewAngles[3];
+	float localViewAngles[3];
+	float viewOrigin2[3];
+	float viewAngles2[3];
+	float localViewAngles2[3];
+};
+static_assert(sizeof(DemoCmdInfo) == 76, "DemoCmdInfo must match the on-disk layout");
+
+// Receives the messages of a demo as it's parsed. Data pointers point
+// into the demo file and are only valid for the duration of the call.
+// Any callback can return false to stop parsing there.
+class DemoVisitor {
+public:
+	virtual ~DemoVisitor() {}
+
+	virtual bool OnHeader(const Demo &demo) { return true; }
+	// Called for every message except Stop, before the callback for its
+	// type; offset is where the message starts in the file
+	virtual bool OnMessage(uint8_t type, int32_t tick, size_t offset) { return true; }
+	// SignOn and Packet messages; 'infos' has one entry per split screen
+	// player
+	virtual bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) { return true; }
+	virtual bool OnSyncTick(int32_t tick) { return true; }
+	virtual bool OnConsoleCmd(int32_t tick, const char *cmd, int32_t length) { return true; }
+	virtual bool OnUserCmd(int32_t tick, int32_t cmd, const uint8_t *data, int32_t length) { return true; }
+	virtual bool OnDataTables(int32_t tick, const uint8_t *data, int32_t length) { return true; }
+	virtual bool OnCustomData(int32_t tick, int32_t type, const uint8_t *data, int32_t length) { return true; }
+	virtual bool OnStringTables(int32_t tick, const uint8_t *data, int32_t length) { return true; }
+	virtual void OnStop(int32_t tick) {}
+};
 
 // Basic demo parser which can handle Portal 2 and Half-Life 2 demos
 class DemoParser {
@@ -17,9 +110,13 @@ public:
 
 public:
 	DemoParser();
-	static std::string DecodeCustomData(char *data);
+	static std::string DecodeCustomData(const char *data, size_t size);
 	void Adjust(Demo *demo);
-	bool Parse(std::string filePath, Demo *demo, bool ghostRequest = false, std::map<int, DataGhost> *datas = nullptr, CustomDatas *customDatas = nullptr);
+	bool Parse(std::string filePath, Demo *demo);
+	// Maps the file and parses it in one pass, passing every message to
+	// the visitor
+	bool Parse(std::string filePath, Demo *demo, DemoVisitor *visitor);
+	bool ParseBuffer(const uint8_t *data, size_t size, Demo *demo, DemoVisitor *visitor);
 };
 
 extern Variable sar_time_demo_dev;
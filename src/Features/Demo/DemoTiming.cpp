@@ -0,0 +1,287 @@
+#include "DemoParser.hpp"
+
+#include "Command.hpp"
+#include "Demo.hpp"
+#include "DemoBatch.hpp"
+#include "DemoIndex.hpp"
+#include "Features/Demo/DemoGhostPlayer.hpp"
+#include "Features/Hud/Hud.hpp"
+#include "Modules/Console.hpp"
+#include "Modules/Engine.hpp"
+#include "Utils.hpp"
+#include "Variable.hpp"
+
+#include <string>
+
+Variable sar_time_demo_dev("sar_time_demo_dev", "0", 0,
+                           "Printing mode when using sar_time_demo.\n"
+                           "0 = Default,\n"
+                           "1 = Console commands,\n"
+                           "2 = Console commands & packets.\n");
+Variable sar_demo_index("sar_demo_index", "1", "Store the timing of each demo parsed by sar_time_demo(s) in a .idx file next to it, so it only has to be parsed once.\n");
+
+namespace {
+	// What Parse has always done: collects message ticks for timing and
+	// prints the sar_time_demo_dev output
+	class TimingVisitor : public DemoVisitor {
+	public:
+		TimingVisitor(Demo *demo, int outputMode)
+			: demo(demo)
+			, outputMode(outputMode) {
+		}
+
+		bool OnMessage(uint8_t type, int32_t tick, size_t offset) override {
+			// Only count positive ticks to keep adjustments simple
+			if (tick >= 0)
+				this->demo->lastMessageTick = tick;
+			return true;
+		}
+
+		bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override {
+			if (tick > 0 && this->gotSync && !this->gotFirstPositivePacket) {
+				this->demo->firstPositivePacketTick = tick;
+				this->gotFirstPositivePacket = true;
+			}
+
+			if (nInfos < 1) return true;
+			const DemoCmdInfo &info = infos[0];
+
+			if (this->outputMode == 2) {
+				console->Msg(
+					"[%i] flags: %i | "
+					"view origin: %.3f/%.3f/%.3f | "
+					"view angles: %.3f/%.3f/%.3f | "
+					"local view angles: %.3f/%.3f/%.3f\n",
+					tick,
+					info.flags,
+					info.viewOrigin[0],
+					info.viewOrigin[1],
+					info.viewOrigin[2],
+					info.viewAngles[0],
+					info.viewAngles[1],
+					info.viewAngles[2],
+					info.localViewAngles[0],
+					info.localViewAngles[1],
+					info.localViewAngles[2]);
+			}
+
+			return true;
+		}
+
+		bool OnSyncTick(int32_t tick) override {
+			this->gotSync = true;
+			return true;
+		}
+
+		bool OnConsoleCmd(int32_t tick, const char *data, int32_t length) override {
+			std::string cmd(data, length);
+			if (this->outputMode >= 1) {
+				console->Msg("[%i] %s\n", tick, cmd.c_str());
+			}
+
+			if (cmd.find("__END__") != std::string::npos) {
+				console->ColorMsg(Color(0, 255, 0, 255), "Segment length -> %d ticks: %.3fs\n", tick, tick / 60.f);
+				this->demo->segmentTicks = tick;
+			}
+
+			return true;
+		}
+
+	private:
+		Demo *demo;
+		int outputMode;
+
+		bool gotSync = false;
+		bool gotFirstPositivePacket = false;
+	};
+}  // namespace
+
+bool DemoParser::Parse(std::string filePath, Demo *demo) {
+	if (!Utils::EndsWith(filePath, ".dem"))
+		filePath += ".dem";
+
+	// Plain timing queries don't need anything the index doesn't have
+	if (this->outputMode == 0 && !this->headerOnly && sar_demo_index.GetBool()) {
+		console->DevMsg("Trying to parse \"%s\" from its index...\n", filePath.c_str());
+
+		DemoIndex index;
+		if (!index.Open(filePath))
+			return false;
+
+		index.FillDemo(demo);
+		if (demo->segmentTicks != -1) {
+			console->ColorMsg(Color(0, 255, 0, 255), "Segment length -> %d ticks: %.3fs\n", demo->segmentTicks, demo->segmentTicks / 60.f);
+		}
+		return true;
+	}
+
+	console->DevMsg("Trying to parse \"%s\"...\n", filePath.c_str());
+
+	TimingVisitor visitor(demo, this->outputMode);
+	return this->Parse(filePath, demo, &visitor);
+}
+
+// Commands
+
+CON_COMMAND_AUTOCOMPLETEFILE(sar_time_demo, "sar_time_demo <demo_name> - parses a demo and prints some information about it\n", 0, 0, dem) {
+	if (args.ArgC() != 2) {
+		return console->Print(sar_time_demo.ThisPtr()->m_pszHelpString);
+	}
+
+	std::string name;
+	if (args[1][0] == '\0') {
+		if (engine->demoplayer->DemoName[0] != '\0') {
+			name = std::string(engine->demoplayer->DemoName);
+		} else {
+			return console->Print("No demo was recorded or played back!\n");
+		}
+	} else {
+		name = std::string(args[1]);
+	}
+
+	DemoParser parser;
+	parser.outputMode = sar_time_demo_dev.GetInt();
+
+	Demo demo;
+	auto dir = std::string(engine->GetGameDirectory()) + std::string("/") + name;
+	if (parser.Parse(dir, &demo)) {
+		parser.Adjust(&demo);
+		console->Print("Demo:     %s\n", name.c_str());
+		console->Print("Client:   %s\n", demo.clientName);
+		console->Print("Map:      %s\n", demo.mapName);
+		console->Print("Ticks:    %i\n", demo.playbackTicks);
+		console->Print("Time:     %.3f\n", demo.playbackTime);
+		console->Print("Tickrate: %.3f\n", demo.Tickrate());
+	} else {
+		console->Print("Could not parse \"%s\"!\n", name.c_str());
+	}
+}
+CON_COMMAND_AUTOCOMPLETEFILE(sar_time_demos, "sar_time_demos <demo_name> [demo_name2]... - parses multiple demos and prints the total sum of them\n", 0, 0, dem) {
+	if (args.ArgC() <= 1) {
+		return console->Print(sar_time_demos.ThisPtr()->m_pszHelpString);
+	}
+
+	// Without the dev output, there's nothing that needs the main thread,
+	// so do it in the background
+	if (sar_time_demo_dev.GetInt() == 0) {
+		if (DemoBatch::IsRunning()) {
+			return console->Print("Demos are already being processed! Use sar_demo_batch_cancel to stop them.\n");
+		}
+
+		std::vector<std::string> names;
+		for (auto i = 1; i < args.ArgC(); ++i) {
+			names.push_back(args[i]);
+		}
+
+		DemoBatch::Start(
+			names,
+			[](const DemoBatch::Result &res, size_t idx, size_t total) {
+				if (!res.parsed) {
+					console->Print("Could not parse \"%s\"!\n", res.name.c_str());
+					return;
+				}
+				if (res.segmentTicks != -1) {
+					console->ColorMsg(Color(0, 255, 0, 255), "Segment length -> %d ticks: %.3fs\n", res.segmentTicks, res.segmentTicks / 60.f);
+				}
+				console->Print("Demo:     %s\n", res.name.c_str());
+				console->Print("Client:   %s\n", res.client.c_str());
+				console->Print("Map:      %s\n", res.map.c_str());
+				console->Print("Ticks:    %i\n", res.ticks);
+				console->Print("Time:     %.3f\n", res.time);
+				console->Print("Tickrate: %.3f\n", res.tickrate);
+				console->Print("---------------\n");
+			},
+			[](const std::vector<DemoBatch::Result> &results, bool cancelled) {
+				auto totalTicks = 0;
+				auto totalTime = 0.f;
+				auto printTotal = false;
+				for (auto &res : results) {
+					if (!res.parsed) continue;
+					totalTicks += res.ticks;
+					totalTime += res.time;
+					printTotal = true;
+				}
+
+				if (cancelled) {
+					console->Print("Cancelled!\n");
+				} else if (printTotal) {
+					console->Print("Total Ticks: %i\n", totalTicks);
+					console->Print("Total Time: %.3f\n", totalTime);
+				}
+			});
+		return;
+	}
+
+	auto totalTicks = 0;
+	auto totalTime = 0.f;
+	auto printTotal = false;
+
+	DemoParser parser;
+	parser.outputMode = sar_time_demo_dev.GetInt();
+
+	auto name = std::string();
+	auto dir = std::string(engine->GetGameDirectory()) + std::string("/");
+	for (auto i = 1; i < args.ArgC(); ++i) {
+		name = std::string(args[i]);
+
+		Demo demo;
+		if (parser.Parse(dir + name, &demo)) {
+			parser.Adjust(&demo);
+			console->Print("Demo:     %s\n", name.c_str());
+			console->Print("Client:   %s\n", demo.clientName);
+			console->Print("Map:      %s\n", demo.mapName);
+			console->Print("Ticks:    %i\n", demo.playbackTicks);
+			console->Print("Time:     %.3f\n", demo.playbackTime);
+			console->Print("Tickrate: %.3f\n", demo.Tickrate());
+			console->Print("---------------\n");
+			totalTicks += demo.playbackTicks;
+			totalTime += demo.playbackTime;
+			printTotal = true;
+		} else {
+			console->Print("Could not parse \"%s\"!\n", name.c_str());
+		}
+	}
+
+	if (printTotal) {
+		console->Print("Total Ticks: %i\n", totalTicks);
+		console->Print("Total Time: %.3f\n", totalTime);
+	}
+}
+
+// HUD
+
+HUD_ELEMENT_MODE2(demo, "0", 0, 2, "Draws name, tick and time of current demo.\n", HudType_InGame | HudType_Paused | HudType_LoadingScreen) {
+	int tick;
+	float time;
+	const char *demoName;
+
+	if (!*engine->m_bLoadgame && *engine->demorecorder->m_bRecording && !engine->demorecorder->currentDemo.empty()) {
+		tick = engine->demorecorder->GetTick();
+		time = engine->ToTime(tick);
+		demoName = engine->demorecorder->currentDemo.c_str();
+	} else if (!*engine->m_bLoadgame && engine->demoplayer->IsPlaying()) {
+		tick = engine->demoplayer->GetTick();
+		time = engine->ToTime(tick);
+		demoName = engine->demoplayer->DemoName;
+	} else {
+		ctx->DrawElement("demo: -");
+		return;
+	}
+
+	if (mode == 1) {
+		ctx->DrawElement("demo: %s %i (%.3f)", demoName, tick, time);
+	} else { // mode == 2
+		const char *name = demoName;
+
+		while (*name) ++name; // Find end of path
+
+		// Go back until slash
+		while (name >= demoName && *name != '/' && *name != '\\') {
+			--name;
+		}
+
+		++name;
+
+		ctx->DrawElement("demo: %s %.3f", name, time);
+	}
+}
@@ -0,0 +1,159 @@
+#include "GhostCapture.hpp"
+
+#include "DemoParser.hpp"
+#include "Utils/MappedFile.hpp"
+
+#include <cstring>
+
+#define GHOST_CAPTURE_VERSION 1
+
+namespace {
+	// The file is this header, then each record's header followed by its
+	// packet, in the order they happened
+	struct FileHeader {
+		char magic[4];  // "SRNC"
+		uint32_t version;
+		uint64_t startTime;
+	};
+	static_assert(sizeof(FileHeader) == 16, "FileHeader must not be padded");
+
+	struct RecordHeader {
+		uint64_t time;
+		uint32_t size;
+		uint8_t kind;
+		uint8_t pad[3];
+	};
+	static_assert(sizeof(RecordHeader) == 16, "RecordHeader must not be padded");
+}  // namespace
+
+using namespace GhostCapture;
+
+// Writing {{{
+
+Writer::~Writer() {
+	this->Close();
+}
+
+bool Writer::Open(const std::string &path) {
+	this->Close();
+
+	this->fp = fopen(path.c_str(), "wb");
+	if (!this->fp) return false;
+
+	FileHeader hdr{};
+	memcpy(hdr.magic, "SRNC", 4);
+	hdr.version = GHOST_CAPTURE_VERSION;
+	hdr.startTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	if (fwrite(&hdr, sizeof hdr, 1, this->fp) != 1) {
+		fclose(this->fp);
+		this->fp = nullptr;
+		return false;
+	}
+
+	this->buffer.clear();
+	this->stopping = false;
+	this->failed = false;
+	this->stats = {};
+	this->start = std::chrono::steady_clock::now();
+	this->thread = std::thread(&Writer::Run, this);
+	this->isOpen = true;
+	return true;
+}
+
+bool Writer::Close() {
+	if (!this->thread.joinable()) return true;
+
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		this->isOpen = false;
+		this->stopping = true;
+	}
+	this->wake.notify_one();
+	this->thread.join();
+
+	bool ok = !this->failed && fclose(this->fp) == 0;
+	this->fp = nullptr;
+	return ok;
+}
+
+bool Writer::Add(Kind kind, const void *data, size_t size) {
+	auto now = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(this->lock);
+	if (!this->isOpen) return false;
+
+	if (size > UINT32_MAX || this->buffer.size() + sizeof(RecordHeader) + size > BUFFER_SIZE) {
+		++this->stats.dropped;
+		return false;
+	}
+
+	RecordHeader hdr{};
+	hdr.time = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->start).count();
+	hdr.size = (uint32_t)size;
+	hdr.kind = (uint8_t)kind;
+
+	// Only the first record since the thread last looked needs to wake it
+	bool wasEmpty = this->buffer.empty();
+	auto bytes = (const uint8_t *)&hdr;
+	this->buffer.insert(this->buffer.end(), bytes, bytes + sizeof hdr);
+	this->buffer.insert(this->buffer.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+	++this->stats.records;
+	this->stats.bytes += size;
+	if (wasEmpty) this->wake.notify_one();
+	return true;
+}
+
+Stats Writer::GetStats() {
+	std::lock_guard<std::mutex> lock(this->lock);
+	return this->stats;
+}
+
+// Takes the whole buffer each time it wakes, leaving an empty one with
+// the same capacity in its place, so adding rarely allocates
+void Writer::Run() {
+	std::vector<uint8_t> out;
+	std::unique_lock<std::mutex> lock(this->lock);
+	while (true) {
+		this->wake.wait(lock, [this] { return this->stopping || !this->buffer.empty(); });
+		if (this->buffer.empty()) break;
+
+		out.clear();
+		std::swap(out, this->buffer);
+		lock.unlock();
+		bool ok = fwrite(out.data(), 1, out.size(), this->fp) == out.size();
+		lock.lock();
+		if (!ok) this->failed = true;
+	}
+}
+
+// }}}
+
+// Reading {{{
+
+bool GhostCapture::Read(const std::string &path, Capture *capture) {
+	auto file = std::make_shared<MappedFile>();
+	if (!file->Open(path)) return false;
+
+	DemoCursor cur(file->Data(), file->Size());
+	FileHeader fileHdr;
+	if (!cur.Read(fileHdr)) return false;
+	if (memcmp(fileHdr.magic, "SRNC", 4) || fileHdr.version != GHOST_CAPTURE_VERSION) return false;
+
+	Capture out;
+	out.startTime = fileHdr.startTime;
+
+	// A capture cut short (by a crash, say) is fine up to its last whole
+	// record
+	RecordHeader hdr;
+	while (cur.Read(hdr)) {
+		const uint8_t *data = cur.Take(hdr.size);
+		if (!data) break;
+		out.records.push_back({hdr.time, (Kind)hdr.kind, data, hdr.size});
+	}
+
+	out.file = std::move(file);
+	*capture = std::move(out);
+	return true;
+}
+
+// }}}
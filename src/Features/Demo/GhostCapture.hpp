@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MappedFile;
+
+// .sarnet files hold every packet that went between a player and a ghost
+// server over one connection, each with when it was sent or received to
+// the nanosecond, so that the session can be played back later exactly
+// as it arrived.
+namespace GhostCapture {
+	enum class Kind : uint8_t {
+		RECV_UDP,
+		RECV_TCP,
+		SENT_UDP,
+		SENT_TCP,
+		// The server's reply to CONNECT, which has no header
+		CONNECT_REPLY,
+	};
+
+	struct Record {
+		uint64_t time;  // ns since the capture started
+		Kind kind;
+		const uint8_t *data;
+		uint32_t size;
+	};
+
+	struct Stats {
+		uint64_t records;
+		uint64_t bytes;
+		uint64_t dropped;
+	};
+
+	// Writes a capture without whoever adds a packet ever waiting for the
+	// disk: records go into a buffer in memory, which a thread of its own
+	// writes out. If that thread falls more than BUFFER_SIZE bytes behind,
+	// new records are dropped and counted rather than the buffer growing.
+	class Writer {
+	public:
+		static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+		Writer() = default;
+		~Writer();
+
+		Writer(const Writer &) = delete;
+		Writer &operator=(const Writer &) = delete;
+
+		bool Open(const std::string &path);
+		// Waits for everything added so far to be written; returns false if
+		// any of it couldn't be
+		bool Close();
+		bool IsOpen() const { return this->isOpen; }
+
+		// Any thread; the time is taken here. Returns false if the record
+		// was dropped or the capture isn't open.
+		bool Add(Kind kind, const void *data, size_t size);
+
+		Stats GetStats();
+
+	private:
+		void Run();
+
+		std::mutex lock;
+		std::condition_variable wake;
+		std::vector<uint8_t> buffer;
+		bool stopping = false;
+		bool failed = false;
+		std::atomic<bool> isOpen{false};
+		std::chrono::steady_clock::time_point start;
+		Stats stats{};
+
+		FILE *fp = nullptr;
+		std::thread thread;
+	};
+
+	// A whole capture; the records point into a mapping of the file, which
+	// is kept for as long as the capture is
+	struct Capture {
+		uint64_t startTime;  // Wall clock, in ms since the Unix epoch
+		std::vector<Record> records;
+		std::shared_ptr<MappedFile> file;
+	};
+
+	bool Read(const std::string &path, Capture *capture);
+}  // namespace GhostCapture
@@ -110,27 +110,9 @@ void GhostEntity::DeleteGhost() {
 	}
 }
 
-void GhostEntity::SetData(DataGhost data, bool network) {
-	this->oldPos = this->newPos;
-	this->newPos = data;
-
-	auto now = NOW_STEADY();
-	long long newLoopTime = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->lastUpdate).count();
-	if (network) {
-		// Loop time could do strange things due to network latency etc.
-		// Try to smooth it using a biased average of the new time with
-		// the old one
-		if (this->loopTime == 0) {
-			this->loopTime = newLoopTime;
-		} else {
-			this->loopTime = (2 * this->loopTime + 1 * newLoopTime) / 3;
-		}
-	} else {
-		this->loopTime = newLoopTime;
-	}
-	this->lastUpdate = now;
-
-	this->velocity = (this->newPos.position - this->oldPos.position) / this->loopTime * 1000.0f;
+void GhostEntity::SetData(DataGhost data, std::optional<uint16_t> sentAt, std::chrono::steady_clock::time_point received) {
+	this->lastUpdate = received;
+	this->snapshots.Push(std::chrono::duration<double>(this->lastUpdate.time_since_epoch()).count(), data, sentAt);
 }
 
 void GhostEntity::SetupGhost(unsigned int &ID, std::string &name, DataGhost &data, std::string &current_map) {
@@ -144,98 +126,14 @@ void GhostEntity::Display() {
 	Color col = GetColor();
 	float opacity = col.a();
 
-	col._color[0] = Utils::ConvertFromSrgb(col._color[0]);
-	col._color[1] = Utils::ConvertFromSrgb(col._color[1]);
-	col._color[2] = Utils::ConvertFromSrgb(col._color[2]);
-
-	if (ghost_shading.GetBool()) OverlayRender::startShading(this->data.position + Vector{0, 0, 5}); // Use a point slightly above the floor
-
-#define TRIANGLE(p1, p2, p3) OverlayRender::addTriangle(p1, p2, p3, col, true)
-	switch (GhostEntity::ghost_type) {
-	case GhostType::CIRCLE: {
-		double rad = ghost_height.GetFloat() / 2;
-		Vector origin = this->data.position + Vector(0, 0, rad);
-
-		const int tris = 30;
-
-		auto player = client->GetPlayer(GET_SLOT() + 1);
-		Vector pos = player ? client->GetAbsOrigin(player) + client->GetViewOffset(player) : Vector{0, 0, 0};
-
-		float dx = origin.x - pos.x;
-		float dy = origin.y - pos.y;
-		float hdist = sqrt(dx * dx + dy * dy);
-
-		double yaw =
-			origin.x == pos.x && origin.y == pos.y ? M_PI / 2 : atan2(origin.y - pos.y, origin.x - pos.x) + M_PI;
-
-		double pitch =
-			hdist == 0 && origin.z == pos.z ? M_PI / 2 : atan2(origin.z - pos.z, hdist);
-
-		double syaw = sin(yaw);
-		double cyaw = cos(yaw);
-		double spitch = sin(pitch);
-		double cpitch = cos(pitch);
-
-		// yaw+pitch rotation matrix
-		Matrix rot{3, 3, 0};
-		rot(0, 0) = cyaw * cpitch;
-		rot(0, 1) = -syaw;
-		rot(0, 2) = cyaw * spitch;
-		rot(1, 0) = syaw * cpitch;
-		rot(1, 1) = cyaw;
-		rot(1, 2) = syaw * spitch;
-		rot(2, 0) = -spitch;
-		rot(2, 1) = 0;
-		rot(2, 2) = cpitch;
-
-		for (int i = 0; i < tris; ++i) {
-			double lang = M_PI * 2 * i / tris;
-			double rang = M_PI * 2 * (i + 1) / tris;
-
-			Vector dl(0, cos(lang) * rad, sin(lang) * rad);
-			Vector dr(0, cos(rang) * rad, sin(rang) * rad);
-
-			Vector l = origin + rot * dl;
-			Vector r = origin + rot * dr;
-
-			TRIANGLE(r, l, origin);
-		}
-
-		break;
+	// Bendy has always been drawn in the colour as it's set
+	if (GhostEntity::ghost_type != GhostType::BENDY) {
+		col._color[0] = Utils::ConvertFromSrgb(col._color[0]);
+		col._color[1] = Utils::ConvertFromSrgb(col._color[1]);
+		col._color[2] = Utils::ConvertFromSrgb(col._color[2]);
 	}
 
-	case GhostType::PYRAMID:
-	case GhostType::PYRAMID_PGUN: {
-		Vector top = this->data.position + Vector{0, 0, ghost_height.GetFloat()};
-
-		Vector a = this->data.position + Vector{5, 5, 0};
-		Vector b = this->data.position + Vector{5, -5, 0};
-		Vector c = this->data.position + Vector{-5, -5, 0};
-		Vector d = this->data.position + Vector{-5, 5, 0};
-
-		TRIANGLE(a, b, top);
-		TRIANGLE(b, c, top);
-		TRIANGLE(c, d, top);
-		TRIANGLE(d, a, top);
-		TRIANGLE(b, a, c);
-		TRIANGLE(c, a, d);
-
-		break;
-	}
-	case GhostType::BENDY: {
-		// idk, some weird shit was happening when I was setting it in a constructor
-		// so I'm just leaving that here
-		renderer.SetGhost(this);
-		renderer.Draw();
-		break;
-	}
-
-	default:
-		break;
-	}
-#undef TRIANGLE
-
-	if (ghost_shading.GetBool()) OverlayRender::endShading();
+	bool visible = ghostBatch.Add(this, col);
 
 	if (this->prop_entity) {
 		if (GhostEntity::ghost_type == GhostType::MODEL) {
@@ -251,33 +149,14 @@ void GhostEntity::Display() {
 		}
 	}
 
-	if (ghost_show_names.GetBool()) this->DrawName();
+	if (visible && ghost_show_names.GetBool()) this->DrawName();
 
 	this->lastOpacity = opacity;
 }
 
-void GhostEntity::Lerp(float time) {
-	if (time > 1) time = 1;
-	if (time < 0) time = 0;
-
-	// Try to detect teleportations; if we've moved a massive distance,
-	// just teleport to the destination
-	bool should_tp = (this->oldPos.position - this->newPos.position).SquaredLength() > 300 * 300;
-
-	if (should_tp) {
-		this->data = time < 0.5 ? this->oldPos : this->newPos;
-	} else {
-		this->data.position.x = (1 - time) * this->oldPos.position.x + time * this->newPos.position.x;
-		this->data.position.y = (1 - time) * this->oldPos.position.y + time * this->newPos.position.y;
-		this->data.position.z = (1 - time) * this->oldPos.position.z + time * this->newPos.position.z;
-
-		this->data.view_angle.x = (1 - time) * this->oldPos.view_angle.x + time * this->newPos.view_angle.x;
-		this->data.view_angle.y = (1 - time) * this->oldPos.view_angle.y + time * this->newPos.view_angle.y;
-		this->data.view_angle.z = (1 - time) * this->oldPos.view_angle.z + time * this->newPos.view_angle.z;
-
-		this->data.view_offset = (1 - time) * this->oldPos.view_offset + time * this->newPos.view_offset;
-		this->data.grounded = time < 0.5 ? this->oldPos.grounded : this->newPos.grounded;
-	}
+void GhostEntity::Interpolate(float fixedDelay, float maxExtrapolate) {
+	double now = std::chrono::duration<double>(NOW_STEADY().time_since_epoch()).count();
+	if (!this->snapshots.Sample(now, fixedDelay, maxExtrapolate, &this->data, &this->velocity)) return;
 
 	// HACK: when using network ghosts, 0,0,0 is used as a sort of
 	// "unknown position" identifier, implying that the player hasn't sent
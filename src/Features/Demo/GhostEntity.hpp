@@ -1,6 +1,8 @@
 #pragma once
 #include "Command.hpp"
 #include "Features/Hud/Hud.hpp"
+#include "GhostSnapshotBuffer.hpp"
+#include "GhostTrack.hpp"
 #include "SFML/Network.hpp"
 #include "Utils/SDK.hpp"
 #include "Variable.hpp"
@@ -12,13 +14,6 @@
 
 #define GHOST_TOAST_TAG "ghost"
 
-struct DataGhost {
-	Vector position;
-	QAngle view_angle;
-	float view_offset;
-	bool grounded;
-};
-
 enum class GhostType {
 	CIRCLE = 0,
 	PYRAMID = 1,
@@ -44,16 +39,15 @@ public:
 	GhostRenderer renderer;
 
 	DataGhost oldPos;
-	DataGhost newPos;
 	std::chrono::time_point<std::chrono::steady_clock> lastUpdate;
-	long long loopTime;
+	GhostSnapshotBuffer snapshots;  // Network ghosts only
 	Vector velocity;
 
 	static GhostType ghost_type;
 	static std::string defaultModelName;
 	static Color set_color;
 
-	bool isDestroyed;  // used by NetworkGhostPlayer for sync reasons
+	bool isDestroyed;  // used by NetworkGhostPlayer for sync reasons; only touched on the main thread
 
 	static void KillAllGhosts();
 
@@ -63,10 +57,10 @@ public:
 
 	void Spawn();
 	void DeleteGhost();
-	void SetData(DataGhost data, bool network = false);
+	void SetData(DataGhost data, std::optional<uint16_t> sentAt = {}, std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now());
 	void SetupGhost(unsigned int &ID, std::string &name, DataGhost &data, std::string &current_map);
 	void Display();
-	void Lerp(float time);
+	void Interpolate(float fixedDelay, float maxExtrapolate);
 	float GetOpacity();
 	Color GetColor();
 	void DrawName();
@@ -75,6 +69,7 @@ public:
 extern Variable ghost_height;
 extern Variable ghost_opacity;
 extern Variable ghost_text_offset;
+extern Variable ghost_shading;
 extern Variable ghost_show_advancement;
 extern Command ghost_prop_model;
 extern Command ghost_type;
@@ -0,0 +1,172 @@
+#include "GhostFile.hpp"
+
+#include "Utils/MappedFile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+
+#define GHOST_FILE_VERSION 1
+
+namespace {
+	// The file is this header, then a LevelHeader for each level, then
+	// each level's frames and custom data. Frames are kept 4-byte
+	// aligned so that they can be read in place.
+	struct FileHeader {
+		char magic[4];  // "SRGH"
+		uint32_t version;
+		uint32_t levelCount;
+		uint32_t frameSize;
+		char clientName[260];
+	};
+	static_assert(sizeof(FileHeader) == 276, "FileHeader must not be padded");
+
+	// Custom data is a list of (int32 tick, uint32 length, string) entries
+	struct LevelHeader {
+		uint64_t framesOffset;
+		uint64_t customDataOffset;
+		char mapName[260];
+		int32_t playbackTicks;
+		float playbackTime;
+		int32_t firstTick;
+		uint32_t frameCount;  // Including gaps
+		uint32_t tickCount;   // Only ticks with data
+		uint32_t customDataCount;
+		uint32_t customDataSize;
+	};
+	static_assert(sizeof(LevelHeader) == 304, "LevelHeader must not be padded");
+}  // namespace
+
+static void copyName(char (&dst)[260], const std::string &src) {
+	memset(dst, 0, sizeof dst);
+	strncpy(dst, src.c_str(), sizeof dst - 1);
+}
+
+bool GhostFile::Write(const std::string &path, const Run &run) {
+	std::vector<LevelHeader> levels(run.levels.size());
+	std::vector<std::vector<uint8_t>> customData(run.levels.size());
+
+	uint64_t offset = sizeof(FileHeader) + levels.size() * sizeof(LevelHeader);
+	for (size_t i = 0; i < run.levels.size(); ++i) {
+		auto &level = run.levels[i];
+		auto &hdr = levels[i];
+
+		// Sorted so that the same ghost always gives the same file
+		std::vector<std::pair<std::string, int>> events;
+		for (auto &[str, val] : level.customDatas) events.push_back({str, std::get<0>(val)});
+		std::sort(events.begin(), events.end());
+
+		auto &data = customData[i];
+		for (auto &[str, tick] : events) {
+			int32_t t = tick;
+			uint32_t len = str.size();
+			data.insert(data.end(), (uint8_t *)&t, (uint8_t *)&t + 4);
+			data.insert(data.end(), (uint8_t *)&len, (uint8_t *)&len + 4);
+			data.insert(data.end(), str.begin(), str.end());
+		}
+		while (data.size() % 4) data.push_back(0);
+
+		memset(&hdr, 0, sizeof hdr);
+		copyName(hdr.mapName, level.mapName);
+		hdr.playbackTicks = level.playbackTicks;
+		hdr.playbackTime = level.playbackTime;
+		hdr.firstTick = level.track.FirstTick();
+		hdr.frameCount = level.track.EndTick() - level.track.FirstTick();
+		hdr.tickCount = level.track.Count();
+		hdr.customDataCount = events.size();
+		hdr.customDataSize = data.size();
+
+		hdr.framesOffset = offset;
+		offset += (uint64_t)hdr.frameCount * GhostTrack::FRAME_SIZE;
+		hdr.customDataOffset = offset;
+		offset += data.size();
+	}
+
+	FileHeader fileHdr;
+	memset(&fileHdr, 0, sizeof fileHdr);
+	memcpy(fileHdr.magic, "SRGH", 4);
+	fileHdr.version = GHOST_FILE_VERSION;
+	fileHdr.levelCount = levels.size();
+	fileHdr.frameSize = GhostTrack::FRAME_SIZE;
+	copyName(fileHdr.clientName, run.clientName);
+
+	// Written to a temporary file first so that a ghost which is being
+	// raced with is never replaced by half a file
+	std::string tmpPath = path + ".tmp";
+	FILE *fp = fopen(tmpPath.c_str(), "wb");
+	if (!fp) return false;
+
+	bool ok = fwrite(&fileHdr, sizeof fileHdr, 1, fp) == 1;
+	if (!levels.empty()) ok = ok && fwrite(levels.data(), sizeof levels[0], levels.size(), fp) == levels.size();
+	for (size_t i = 0; i < levels.size() && ok; ++i) {
+		size_t frameBytes = (size_t)levels[i].frameCount * GhostTrack::FRAME_SIZE;
+		if (frameBytes) ok = fwrite(run.levels[i].track.FrameData(), 1, frameBytes, fp) == frameBytes;
+		if (ok && !customData[i].empty()) ok = fwrite(customData[i].data(), 1, customData[i].size(), fp) == customData[i].size();
+	}
+
+	if (fclose(fp) != 0 || !ok) {
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+	if (ec) {
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool GhostFile::Read(const std::string &path, Run *run) {
+	auto file = std::make_shared<MappedFile>();
+	if (!file->Open(path)) return false;
+
+	const uint8_t *data = file->Data();
+	size_t size = file->Size();
+
+	DemoCursor cur(data, size);
+	FileHeader fileHdr;
+	if (!cur.Read(fileHdr)) return false;
+	if (memcmp(fileHdr.magic, "SRGH", 4) || fileHdr.version != GHOST_FILE_VERSION || fileHdr.frameSize != GhostTrack::FRAME_SIZE) return false;
+	if (fileHdr.levelCount > (size - sizeof fileHdr) / sizeof(LevelHeader)) return false;
+
+	Run out;
+	fileHdr.clientName[sizeof fileHdr.clientName - 1] = 0;
+	out.clientName = fileHdr.clientName;
+	out.levels.resize(fileHdr.levelCount);
+
+	for (auto &level : out.levels) {
+		LevelHeader hdr;
+		if (!cur.Read(hdr)) return false;
+
+		uint64_t frameBytes = (uint64_t)hdr.frameCount * GhostTrack::FRAME_SIZE;
+		if (hdr.framesOffset > size || frameBytes > size - hdr.framesOffset) return false;
+		if (hdr.customDataOffset > size || hdr.customDataSize > size - hdr.customDataOffset) return false;
+
+		hdr.mapName[sizeof hdr.mapName - 1] = 0;
+		level.mapName = hdr.mapName;
+		level.playbackTicks = hdr.playbackTicks;
+		level.playbackTime = hdr.playbackTime;
+
+		if (!level.track.SetView(hdr.firstTick, data + hdr.framesOffset, hdr.frameCount, hdr.tickCount, file)) return false;
+
+		DemoCursor events(data + hdr.customDataOffset, hdr.customDataSize);
+		for (uint32_t i = 0; i < hdr.customDataCount; ++i) {
+			int32_t tick;
+			uint32_t len;
+			events.Read(tick);
+			events.Read(len);
+			const uint8_t *str = events.Take(len);
+			if (events.Failed()) return false;
+
+			level.customDatas[std::string((const char *)str, len)] = std::make_tuple(tick, false);
+		}
+	}
+
+	*run = std::move(out);
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "DemoParser.hpp"
+#include "GhostTrack.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// .sarghost files hold a ghost's whole run, already extracted from its
+// demos: one track per level, in the order they were played. The tracks
+// are laid out so they can be used straight from a memory mapping, so
+// loading one doesn't depend on how long the run is.
+namespace GhostFile {
+	struct Level {
+		std::string mapName;
+		int32_t playbackTicks;  // Adjusted, as by DemoParser::Adjust
+		float playbackTime;
+		GhostTrack track;
+		CustomDatas customDatas;
+	};
+
+	struct Run {
+		std::string clientName;
+		std::vector<Level> levels;
+	};
+
+	bool Write(const std::string &path, const Run &run);
+	// The tracks keep the file mapped for as long as they're around
+	bool Read(const std::string &path, Run *run);
+}  // namespace GhostFile
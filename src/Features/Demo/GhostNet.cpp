@@ -0,0 +1,347 @@
+#include "GhostNet.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace GhostNet;
+
+#define POSITION_SCALE 32.0f
+
+// Packet flags
+#define PACKET_HAS_ACK (1 << 0)
+#define PACKET_HAS_BASE (1 << 1)
+
+// Which fields of a state follow; a full state has all of them, and isn't
+// relative to anything
+#define FIELD_POSITION(i) (1 << (i))
+#define FIELD_ANGLE(i) (1 << (3 + (i)))
+#define FIELD_VIEW (1 << 6)
+#define FIELD_FULL (1 << 7)
+
+// Encoding {{{
+
+// Fixed-size fields are big-endian, to match the rest of the protocol
+namespace {
+	class Writer {
+	public:
+		Writer(std::vector<uint8_t> &buf)
+			: buf(buf) {
+		}
+
+		void U8(uint8_t val) {
+			this->buf.push_back(val);
+		}
+		void U16(uint16_t val) {
+			this->buf.push_back(val >> 8);
+			this->buf.push_back(val & 0xFF);
+		}
+		void VarInt(uint32_t val) {
+			while (val >= 0x80) {
+				this->buf.push_back((val & 0x7F) | 0x80);
+				val >>= 7;
+			}
+			this->buf.push_back(val);
+		}
+		void SVarInt(int32_t val) {
+			this->VarInt(((uint32_t)val << 1) ^ (uint32_t)(val >> 31));
+		}
+
+	private:
+		std::vector<uint8_t> &buf;
+	};
+
+	class Reader {
+	public:
+		Reader(const uint8_t *data, size_t size)
+			: cur(data)
+			, end(data + size) {
+		}
+
+		bool U8(uint8_t *val) {
+			if (this->end - this->cur < 1) return false;
+			*val = *this->cur++;
+			return true;
+		}
+		bool U16(uint16_t *val) {
+			if (this->end - this->cur < 2) return false;
+			*val = (this->cur[0] << 8) | this->cur[1];
+			this->cur += 2;
+			return true;
+		}
+		bool VarInt(uint32_t *val) {
+			*val = 0;
+			for (int shift = 0; shift < 35; shift += 7) {
+				uint8_t b;
+				if (!this->U8(&b)) return false;
+				*val |= (uint32_t)(b & 0x7F) << shift;
+				if (!(b & 0x80)) return true;
+			}
+			return false;
+		}
+		bool SVarInt(int32_t *val) {
+			uint32_t raw;
+			if (!this->VarInt(&raw)) return false;
+			*val = (int32_t)(raw >> 1) ^ -(int32_t)(raw & 1);
+			return true;
+		}
+
+		bool AtEnd() const { return this->cur == this->end; }
+
+	private:
+		const uint8_t *cur;
+		const uint8_t *end;
+	};
+}  // namespace
+
+static void writeState(Writer &w, const State &state, const State *base) {
+	if (!base) {
+		w.U8(FIELD_FULL);
+		for (int i = 0; i < 3; ++i) w.SVarInt(state.position[i]);
+		for (int i = 0; i < 3; ++i) w.U16(state.view_angle[i]);
+		w.U8(state.view);
+		w.U16(state.time);
+		return;
+	}
+
+	uint8_t fields = 0;
+	for (int i = 0; i < 3; ++i) {
+		if (state.position[i] != base->position[i]) fields |= FIELD_POSITION(i);
+		if (state.view_angle[i] != base->view_angle[i]) fields |= FIELD_ANGLE(i);
+	}
+	if (state.view != base->view) fields |= FIELD_VIEW;
+
+	w.U8(fields);
+	for (int i = 0; i < 3; ++i) {
+		if (fields & FIELD_POSITION(i)) w.SVarInt((int32_t)((uint32_t)state.position[i] - (uint32_t)base->position[i]));
+	}
+	// Angle deltas wrap, so turning through 180 is still a small change
+	for (int i = 0; i < 3; ++i) {
+		if (fields & FIELD_ANGLE(i)) w.SVarInt((int16_t)(state.view_angle[i] - base->view_angle[i]));
+	}
+	if (fields & FIELD_VIEW) w.U8(state.view);
+	// Always there, since it's always moving on
+	w.SVarInt((int16_t)(state.time - base->time));
+}
+
+static bool readState(Reader &r, State *state, const State *base) {
+	uint8_t fields;
+	if (!r.U8(&fields)) return false;
+
+	if (fields & FIELD_FULL) {
+		for (int i = 0; i < 3; ++i) {
+			if (!r.SVarInt(&state->position[i])) return false;
+		}
+		for (int i = 0; i < 3; ++i) {
+			if (!r.U16(&state->view_angle[i])) return false;
+		}
+		return r.U8(&state->view) && r.U16(&state->time);
+	}
+
+	if (!base) return false;
+	*state = *base;
+
+	for (int i = 0; i < 3; ++i) {
+		int32_t delta;
+		if (!(fields & FIELD_POSITION(i))) continue;
+		if (!r.SVarInt(&delta)) return false;
+		state->position[i] = (int32_t)((uint32_t)state->position[i] + (uint32_t)delta);
+	}
+	for (int i = 0; i < 3; ++i) {
+		int32_t delta;
+		if (!(fields & FIELD_ANGLE(i))) continue;
+		if (!r.SVarInt(&delta)) return false;
+		state->view_angle[i] = (uint16_t)(state->view_angle[i] + delta);
+	}
+	if (fields & FIELD_VIEW) {
+		if (!r.U8(&state->view)) return false;
+	}
+
+	int32_t timeDelta;
+	if (!r.SVarInt(&timeDelta)) return false;
+	state->time = (uint16_t)(state->time + timeDelta);
+
+	return true;
+}
+
+// }}}
+
+// States {{{
+
+bool State::operator==(const State &other) const {
+	return std::equal(this->position, this->position + 3, other.position)
+		&& std::equal(this->view_angle, this->view_angle + 3, other.view_angle)
+		&& this->view == other.view
+		&& this->time == other.time;
+}
+
+static int32_t packPosition(float pos) {
+	if (!std::isfinite(pos)) return 0;
+	// Far beyond the edge of any map, but keeps the multiply in range
+	return (int32_t)std::lround(std::clamp(pos, -1e6f, 1e6f) * POSITION_SCALE);
+}
+
+static uint16_t packAngle(float ang) {
+	if (!std::isfinite(ang)) return 0;
+	return (uint16_t)(int32_t)std::lround(std::fmod(ang, 360.0f) * (65536.0f / 360.0f));
+}
+
+static float unpackAngle(uint16_t ang) {
+	// Back to [-180, 180), which is what the engine gives us
+	return (int16_t)ang * (360.0f / 65536.0f);
+}
+
+State GhostNet::Quantise(const DataGhost &data, uint16_t time) {
+	State state;
+	state.position[0] = packPosition(data.position.x);
+	state.position[1] = packPosition(data.position.y);
+	state.position[2] = packPosition(data.position.z);
+	state.view_angle[0] = packAngle(data.view_angle.x);
+	state.view_angle[1] = packAngle(data.view_angle.y);
+	state.view_angle[2] = packAngle(data.view_angle.z);
+	// Same packing as the original protocol; the view offset should never
+	// exceed 64
+	state.view = ((int)data.view_offset & 0x7F) | (data.grounded ? 0x80 : 0x00);
+	state.time = time;
+	return state;
+}
+
+DataGhost GhostNet::Dequantise(const State &state) {
+	DataGhost data;
+	data.position = {state.position[0] / POSITION_SCALE, state.position[1] / POSITION_SCALE, state.position[2] / POSITION_SCALE};
+	data.view_angle = {unpackAngle(state.view_angle[0]), unpackAngle(state.view_angle[1]), unpackAngle(state.view_angle[2])};
+	data.view_offset = (float)(state.view & 0x7F);
+	data.grounded = (state.view & 0x80) != 0;
+	return data;
+}
+
+const State *Snapshot::Find(uint32_t id) const {
+	for (auto &ghost : this->ghosts) {
+		if (ghost.first == id) return &ghost.second;
+	}
+	return nullptr;
+}
+
+// }}}
+
+// Streams {{{
+
+void Stream::Reset() {
+	*this = Stream();
+}
+
+const Snapshot *Stream::Find(const Slot *slots, uint16_t seq) {
+	const Slot &slot = slots[seq % HISTORY];
+	return slot.valid && slot.seq == seq ? &slot.snap : nullptr;
+}
+
+// Kept sorted by ID, so every ghost in a packet can find itself in the
+// baseline without going through all of them
+void Stream::Put(Slot *slots, uint16_t seq, Snapshot &&snap) {
+	Slot &slot = slots[seq % HISTORY];
+	slot.valid = true;
+	slot.seq = seq;
+	slot.snap = std::move(snap);
+	std::sort(slot.snap.ghosts.begin(), slot.snap.ghosts.end(), [](auto &a, auto &b) { return a.first < b.first; });
+}
+
+const State *Stream::FindInBase(const Snapshot *base, uint32_t id) {
+	if (!base) return nullptr;
+	auto it = std::lower_bound(base->ghosts.begin(), base->ghosts.end(), id, [](auto &ghost, uint32_t id) { return ghost.first < id; });
+	return it != base->ghosts.end() && it->first == id ? &it->second : nullptr;
+}
+
+// Packets are the sequence number, the acknowledgement and the baseline
+// (each only if the flags say so), then a count of ghosts and their IDs
+// and states
+void Stream::Encode(const Snapshot &snap, std::vector<uint8_t> &out) {
+	uint16_t seq = this->nextSeq++;
+
+	// If the other end hasn't acknowledged anything for a while, it may not
+	// have the baseline any more either
+	const Snapshot *base = nullptr;
+	if (this->haveAck && (uint16_t)(seq - this->ackedSeq) < HISTORY) base = Find(this->sent, this->ackedSeq);
+
+	Writer w(out);
+	size_t start = out.size();
+
+	w.U16(seq);
+	w.U16(this->haveReceived ? this->receivedSeq : 0);
+	w.U16(base ? this->ackedSeq : 0);
+	w.U8((this->haveReceived ? PACKET_HAS_ACK : 0) | (base ? PACKET_HAS_BASE : 0));
+
+	w.VarInt(snap.ghosts.size());
+	for (auto &[id, state] : snap.ghosts) {
+		w.VarInt(id);
+		writeState(w, state, FindInBase(base, id));
+	}
+
+	++this->stats.sent;
+	this->stats.sentBytes += out.size() - start;
+	if (base) ++this->stats.sentDeltas;
+
+	Put(this->sent, seq, Snapshot(snap));
+}
+
+bool Stream::Decode(const uint8_t *data, size_t size, Snapshot *out) {
+	Reader r(data, size);
+
+	++this->stats.received;
+	this->stats.receivedBytes += size;
+
+	uint16_t seq, ack, baseSeq;
+	uint8_t flags;
+	if (!r.U16(&seq) || !r.U16(&ack) || !r.U16(&baseSeq) || !r.U8(&flags)) {
+		++this->stats.undecodable;
+		return false;
+	}
+
+	if (this->haveReceived && !SeqNewer(seq, this->receivedSeq)) {
+		++this->stats.stale;
+		return false;
+	}
+
+	const Snapshot *base = nullptr;
+	if (flags & PACKET_HAS_BASE) {
+		base = Find(this->received, baseSeq);
+		if (!base) {
+			++this->stats.undecodable;
+			return false;
+		}
+	}
+
+	Snapshot snap;
+	uint32_t count;
+	bool ok = r.VarInt(&count);
+	// Each ghost takes at least 2 bytes, so this stops a bad count from
+	// making us allocate loads
+	ok = ok && count <= size / 2;
+	if (ok) snap.ghosts.resize(count);
+	for (uint32_t i = 0; ok && i < count; ++i) {
+		auto &[id, state] = snap.ghosts[i];
+		ok = r.VarInt(&id) && readState(r, &state, FindInBase(base, id));
+	}
+	if (!ok || !r.AtEnd()) {
+		++this->stats.undecodable;
+		return false;
+	}
+
+	// Only take acknowledgements for packets we've actually sent
+	if (flags & PACKET_HAS_ACK) {
+		bool sent = this->stats.sent > 0 && !SeqNewer(ack, this->nextSeq - 1);
+		if (sent && (!this->haveAck || SeqNewer(ack, this->ackedSeq))) {
+			this->haveAck = true;
+			this->ackedSeq = ack;
+		}
+	}
+
+	if (this->haveReceived) this->stats.lost += (uint16_t)(seq - this->receivedSeq - 1);
+	this->haveReceived = true;
+	this->receivedSeq = seq;
+
+	*out = snap;
+	Put(this->received, seq, std::move(snap));
+
+	return true;
+}
+
+// }}}
@@ -0,0 +1,124 @@
+#pragma once
+#include "GhostTrack.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// The first byte of every packet between the ghost server and its
+// players, over TCP or UDP; everything but CONNECT's first packet to the
+// server then has an ID, which is 0 when it's from the server itself
+enum class HEADER {
+	NONE,
+	PING,
+	CONNECT,
+	DISCONNECT,
+	STOP_SERVER,
+	MAP_CHANGE,
+	HEART_BEAT,
+	MESSAGE,
+	COUNTDOWN,
+	UPDATE,
+	SPEEDRUN_FINISH,
+	MODEL_CHANGE,
+	COLOR_CHANGE,
+	UPDATE_DELTA,
+};
+
+// The compact format for network ghost updates. Every update packet is
+// numbered and carries the number of the newest packet received from
+// the other end, and each ghost's state is quantised and sent as a delta
+// against its state in the newest packet the other end has acknowledged,
+// falling back to the full state when there isn't one.
+namespace GhostNet {
+	// Exchanged on CONNECT: the client appends the newest version it
+	// speaks, and the server appends the one it picked to its reply.
+	// Servers which don't know about this send nothing, which means the
+	// original protocol, where updates are whole DataGhosts.
+	enum : uint32_t {
+		PROTOCOL_LEGACY = 0,
+		PROTOCOL_DELTA = 1,
+		PROTOCOL_CURRENT = PROTOCOL_DELTA,
+	};
+
+	// Positions are in 1/32 units, angles in 1/65536 turns, and the view
+	// offset and grounded flag share a byte like in the original protocol.
+	// The time is when the player sent it, in ms on their own clock; it
+	// wraps around, so only the differences between states mean anything.
+	struct State {
+		int32_t position[3];
+		uint16_t view_angle[3];
+		uint8_t view;
+		uint16_t time;
+
+		bool operator==(const State &other) const;
+		bool operator!=(const State &other) const { return !(*this == other); }
+	};
+
+	State Quantise(const DataGhost &data, uint16_t time);
+	DataGhost Dequantise(const State &state);
+
+	// The states of every ghost in one packet, by ID
+	struct Snapshot {
+		std::vector<std::pair<uint32_t, State>> ghosts;
+
+		const State *Find(uint32_t id) const;
+	};
+
+	struct Stats {
+		uint32_t sent = 0;
+		uint32_t sentBytes = 0;
+		uint32_t sentDeltas = 0;  // Packets encoded against an acknowledged one
+		uint32_t received = 0;
+		uint32_t receivedBytes = 0;
+		uint32_t lost = 0;        // Skipped over in the sequence
+		uint32_t stale = 0;       // Arrived after a newer one, so were dropped
+		uint32_t undecodable = 0; // Malformed, or against a baseline we don't have
+	};
+
+	// Both directions of one connection's updates. Not thread-safe.
+	class Stream {
+	public:
+		// How many packets back a delta can refer to; at the default
+		// update rate, that's a few seconds
+		static const size_t HISTORY = 64;
+
+		void Reset();
+
+		// Appends the packet body for a snapshot to out
+		void Encode(const Snapshot &snap, std::vector<uint8_t> &out);
+		// Returns false if the packet was malformed, older than one we've
+		// already decoded, or refers to a packet we don't have
+		bool Decode(const uint8_t *data, size_t size, Snapshot *out);
+
+		const Stats &GetStats() const { return this->stats; }
+
+	private:
+		struct Slot {
+			bool valid = false;
+			uint16_t seq;
+			Snapshot snap;
+		};
+
+		static const Snapshot *Find(const Slot *slots, uint16_t seq);
+		static void Put(Slot *slots, uint16_t seq, Snapshot &&snap);
+		static const State *FindInBase(const Snapshot *base, uint32_t id);
+
+		uint16_t nextSeq = 0;
+		bool haveAck = false;
+		uint16_t ackedSeq = 0;  // The newest of our packets the other end has
+		Slot sent[HISTORY];
+
+		bool haveReceived = false;
+		uint16_t receivedSeq = 0;
+		Slot received[HISTORY];
+
+		Stats stats;
+	};
+
+	// Whether sequence number a comes after b, allowing for wrap-around
+	inline bool SeqNewer(uint16_t a, uint16_t b) {
+		return (int16_t)(a - b) > 0;
+	}
+}  // namespace GhostNet
@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// The set of ghosts in a server, indexed by ID. Readers take the current
+// snapshot and use it for as long as they like without locking; changes
+// are made to a copy, which then replaces it, so a reader never sees a
+// half-made change and an old snapshot lives on until its last reader
+// lets go of it. Changes are rare (players joining and leaving) next to
+// lookups, which happen for every update. T needs an ID member.
+//
+// Taking a snapshot costs a lock and a reference count, so per-frame code
+// should Load() once and look everything up in that, rather than calling
+// GhostPool::Get for each ghost.
+template <typename T>
+class GhostPool {
+public:
+	struct Snapshot {
+		// Sorted by ID, so lookups only touch the ghosts a frame draws
+		// anyway rather than a separate index
+		std::vector<std::shared_ptr<T>> ghosts;
+
+		// Only good for as long as the snapshot is held
+		T *Get(uint32_t id) const {
+			auto slot = this->Find(id);
+			return slot ? slot->get() : nullptr;
+		}
+
+		const std::shared_ptr<T> *Find(uint32_t id) const {
+			auto it = LowerBound(this->ghosts, id);
+			return it == this->ghosts.end() || (*it)->ID != id ? nullptr : &*it;
+		}
+
+		size_t Size() const { return this->ghosts.size(); }
+		auto begin() const { return this->ghosts.begin(); }
+		auto end() const { return this->ghosts.end(); }
+	};
+
+	GhostPool()
+		: current(std::make_shared<const Snapshot>()) {
+	}
+
+	// Keep hold of the result for as long as you use it; in particular,
+	// `for (auto &g : *pool.Load())` lets go of it before the loop starts
+	std::shared_ptr<const Snapshot> Load() const {
+		return std::atomic_load(&this->current);
+	}
+
+	// For keeping a ghost beyond the snapshot it came from
+	std::shared_ptr<T> Get(uint32_t id) const {
+		auto snap = this->Load();
+		auto slot = snap->Find(id);
+		return slot ? *slot : nullptr;
+	}
+
+	// Replaces any ghost with the same ID
+	void Add(std::shared_ptr<T> ghost) {
+		std::lock_guard<std::mutex> lock(this->writeLock);
+		Snapshot next = *this->current;
+		auto it = LowerBound(next.ghosts, ghost->ID);
+		if (it != next.ghosts.end() && (*it)->ID == ghost->ID) {
+			*it = std::move(ghost);
+		} else {
+			next.ghosts.insert(it, std::move(ghost));
+		}
+		this->Publish(std::move(next));
+	}
+
+	// Returns the ghost that was removed, if there was one
+	std::shared_ptr<T> Remove(uint32_t id) {
+		std::lock_guard<std::mutex> lock(this->writeLock);
+		if (!this->current->Find(id)) return nullptr;
+
+		Snapshot next = *this->current;
+		auto it = LowerBound(next.ghosts, id);
+		auto removed = std::move(*it);
+		next.ghosts.erase(it);
+
+		this->Publish(std::move(next));
+		return removed;
+	}
+
+	void Clear() {
+		std::lock_guard<std::mutex> lock(this->writeLock);
+		this->Publish(Snapshot());
+	}
+
+private:
+	template <typename Vec>
+	static auto LowerBound(Vec &ghosts, uint32_t id) {
+		return std::lower_bound(ghosts.begin(), ghosts.end(), id, [](const std::shared_ptr<T> &ghost, uint32_t id) { return ghost->ID < id; });
+	}
+
+	// Only called with writeLock held; readers only ever load. The old
+	// snapshot is kept until the next change, so that it's almost always
+	// freed here rather than by whichever reader lets go of it last,
+	// which would usually be the game thread in the middle of a frame.
+	void Publish(Snapshot &&next) {
+		this->retired = std::atomic_exchange(&this->current, std::shared_ptr<const Snapshot>(std::make_shared<const Snapshot>(std::move(next))));
+	}
+
+	std::mutex writeLock;
+	std::shared_ptr<const Snapshot> current;
+	std::shared_ptr<const Snapshot> retired;  // Guarded by writeLock
+};
@@ -1,11 +1,16 @@
 #include "GhostRenderer.hpp"
 
+#include "Modules/Client.hpp"
 #include "Modules/Engine.hpp"
+#include "Modules/Server.hpp"
 #include "Event.hpp"
 #include "Features/Camera.hpp"
 #include "Features/OverlayRender.hpp"
 #include "GhostEntity.hpp"
+#include "Utils/Math.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 
@@ -25,8 +30,12 @@ const short* BENDY_MODELS[] = {BENDY_MODEL_1, BENDY_MODEL_2, BENDY_MODEL_3};
 const short BENDY_LOD_LEVELS[] = {3, 3, 3, 3, 1, 1, 2, 2, 3, 3, 2, 2, 1, 1, 3, 3, 1, 2, 3, 2, 1, 3, 1, 2, 3, 2, 1, 3, 1, 2, 3, 2, 1, 3, 1, 2, 3, 2, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 1, 2, 1, 3, 1, 2, 1, 1, 2, 1, 3, 1, 2, 1};
 
 
-Variable ghost_bendy_lod_proximity("ghost_bendy_lod_proximity", "512", 0, 99999, "Distance from which Bendy ghosts should be drawn in lower level of detail.\n");
+Variable ghost_bendy_lod_proximity("ghost_bendy_lod_proximity", "512", 0, 99999, "Distance from which Bendy and circle ghosts should be drawn in lower level of detail.\n");
 Variable ghost_bendy_force_lod("ghost_bendy_force_lod", "0", 0, 2, "LOD level that should be enforced for Bendy ghosts drawing.");
+Variable ghost_draw_distance("ghost_draw_distance", "0", 0, "Distance beyond which ghosts aren't drawn at all. 0 = no limit.\n");
+Variable ghost_cull("ghost_cull", "0", "Skip building ghosts that are outside the view. Ghosts only seen through a portal, or in the other view in split screen, need this off.\n");
+
+GhostBatch ghostBatch;
 
 
 
@@ -35,7 +44,7 @@ GhostRenderer::GhostRenderer() {
 	animatedVerts.resize(vertCount);
 }
 
-void GhostRenderer::UpdateAnimatedVerts() {
+void GhostRenderer::UpdateAnimatedVerts(int lod) {
 	
 	// time
 	float time = engine->GetClientTime();
@@ -71,7 +80,6 @@ void GhostRenderer::UpdateAnimatedVerts() {
 	}
 
 	// update model
-	int lod = GetLODLevel();
 	for (int v = 0; v < animatedVerts.size(); v++) {
 		// do not waste time on vertices that won't be used for drawing
 		if (BENDY_LOD_LEVELS[v] < lod) continue;
@@ -144,21 +152,16 @@ void GhostRenderer::UpdateAnimatedVerts() {
 }
 
 
-void GhostRenderer::Draw() {
+void GhostRenderer::Draw(std::vector<Vector> &out, int lod) {
 	if (ghost == nullptr) return;
 
 	//update verts before drawing
-	UpdateAnimatedVerts();
+	UpdateAnimatedVerts(lod);
 
-	Vector camPos = camera->GetPosition(GET_SLOT());
-	Vector camForward = camera->GetForwardVector(GET_SLOT());
-	
 	// get model depending on assigned LOD level
 	// each LOD is sharing the same vertices table
-	const short *model = BENDY_MODELS[GetLODLevel()];
+	const short *model = BENDY_MODELS[lod];
 
-	Color col = ghost->GetColor();
-#define TRIANGLE(p1, p2, p3) OverlayRender::addTriangle(p1, p2, p3, col, false)
 	// draw each triangle
 	for (int t = 0; model[t] >= 0; t+=3) {
 		Vector p1 = animatedVerts[model[t]]; 
@@ -166,24 +169,18 @@ void GhostRenderer::Draw() {
 		Vector p3 = animatedVerts[model[t+2]]; 
 
 		// triangles are drawn only from one side. draw both sides.
-		TRIANGLE(p1, p2, p3);
+		out.insert(out.end(), {p1, p2, p3, p1, p3, p2});
 	}
-#undef TRIANGLE
 }
 
 void GhostRenderer::SetGhost(GhostEntity* ghost) {
 	this->ghost = ghost;
 }
 
-int GhostRenderer::GetLODLevel() {
-	if (ghost == nullptr) return 0;
-
+int GhostRenderer::GetLODLevel(float dist) {
 	int forceLod = ghost_bendy_force_lod.GetInt();
 	if (forceLod > 0) return forceLod;
 
-	Vector camPos = camera->GetPosition(GET_SLOT());
-	float dist = (camPos - ghost->data.position).Length();
-
 	float lodDist = ghost_bendy_lod_proximity.GetFloat();
 	if (dist < lodDist) {
 		return 0;
@@ -200,4 +197,217 @@ void GhostRenderer::StartGesture(int id) {
 
 float GhostRenderer::GetHeight() {
 	return 72.0f;
-}
\ No newline at end of file
+}
+
+// Batching {{{
+
+void GhostBatch::UpdateView() {
+	int slot = GET_SLOT();
+	bool cam_control = sar_cam_control.GetInt() == 1 && sv_cheats.GetBool();
+
+	// There's no server player while a demo plays back, so go by the
+	// client's there
+	this->haveView = true;
+	if (cam_control) {
+		this->viewPos = camera->currentState.origin;
+	} else if (server->GetPlayer(slot + 1)) {
+		this->viewPos = camera->GetPosition(slot);
+	} else if (auto player = client->GetPlayer(slot + 1)) {
+		this->viewPos = client->GetAbsOrigin(player) + client->GetViewOffset(player);
+	} else {
+		this->viewKnown = false;
+		return;
+	}
+	this->viewKnown = true;
+	this->viewForward = camera->GetForwardVector(slot);
+
+	// An orthographic view sees everything in front of it, near enough
+	bool ortho = sar_cam_ortho.GetBool() && sv_cheats.GetBool();
+	this->viewCull = ghost_cull.GetBool() && !ortho;
+
+	// The fov is horizontal at 4:3 and widened to fit the screen, so
+	// the cone has to reach the corners of that
+	int width, height;
+	engine->GetScreenSize(nullptr, width, height);
+	float aspect = height > 0 ? (float)width / height : 4.0f / 3.0f;
+	float fov = cam_control ? camera->currentState.fov : cl_fov.GetFloat();
+	float tanY = tanf(DEG2RAD(fminf(fmaxf(fov, 1.0f), 179.0f)) / 2) * 0.75f;
+	float tanX = tanY * aspect;
+	this->viewHalfAngle = atanf(sqrtf(tanX * tanX + tanY * tanY));
+}
+
+bool GhostBatch::IsVisible(Vector center, float radius, float *dist) {
+	if (!this->viewKnown) {
+		*dist = 0;
+		return true;
+	}
+
+	Vector delta = center - this->viewPos;
+	*dist = delta.Length();
+
+	float maxDist = ghost_draw_distance.GetFloat();
+	if (maxDist > 0 && *dist - radius > maxDist) return false;
+
+	if (!this->viewCull || *dist <= radius) return true;
+
+	// Whether the sphere touches the cone of the view
+	float angle = acosf(fminf(fmaxf(delta.Dot(this->viewForward) / *dist, -1.0f), 1.0f));
+	return angle <= this->viewHalfAngle + asinf(radius / *dist);
+}
+
+std::vector<Vector> &GhostBatch::GetVerts(Color col) {
+	uint32_t key;
+	memcpy(&key, col._color, sizeof key);
+
+	auto it = this->bucketIdx.find(key);
+	if (it != this->bucketIdx.end()) return this->buckets[it->second].verts;
+
+	this->bucketIdx[key] = this->buckets.size();
+	this->buckets.push_back({col, {}});
+	return this->buckets.back().verts;
+}
+
+bool GhostBatch::Add(GhostEntity *ghost, Color col) {
+	if (!this->haveView) this->UpdateView();
+
+	float height = ghost_height.GetFloat();
+	bool bendy = GhostEntity::ghost_type == GhostType::BENDY;
+	Vector pos = ghost->data.position;
+
+	// Bendy flops about a bit past its height
+	Vector center = pos + Vector{0, 0, bendy ? 36.0f : height / 2};
+	float radius = bendy ? 56.0f : fabsf(height) / 2 + 8;
+
+	float dist;
+	if (!this->IsVisible(center, radius, &dist)) return false;
+	if (col.a() == 0 || GhostEntity::ghost_type == GhostType::MODEL) return true;
+
+	if (ghost_shading.GetBool()) {
+		// In steps, so ghosts lit about the same share a mesh
+		Vector shade = OverlayRender::getShade(pos + Vector{0, 0, 5}); // Use a point slightly above the floor
+		for (int i = 0; i < 3; ++i) {
+			float f = roundf(shade[i] * 16) / 16;
+			col._color[i] = (unsigned char)fminf(col._color[i] * f, 255.0f);
+		}
+	}
+
+	auto &verts = this->GetVerts(col);
+
+	switch (GhostEntity::ghost_type) {
+	case GhostType::CIRCLE: {
+		double rad = height / 2;
+		Vector origin = pos + Vector(0, 0, rad);
+
+		// Fewer sides the further away it is
+		float lodDist = ghost_bendy_lod_proximity.GetFloat();
+		int tris = dist > 0 ? (int)fminf(fmaxf(30 * lodDist / dist, 8), 30) : 30;
+
+		auto player = client->GetPlayer(GET_SLOT() + 1);
+		Vector eye = player ? client->GetAbsOrigin(player) + client->GetViewOffset(player) : Vector{0, 0, 0};
+
+		float dx = origin.x - eye.x;
+		float dy = origin.y - eye.y;
+		float hdist = sqrt(dx * dx + dy * dy);
+
+		double yaw =
+			origin.x == eye.x && origin.y == eye.y ? M_PI / 2 : atan2(origin.y - eye.y, origin.x - eye.x) + M_PI;
+
+		double pitch =
+			hdist == 0 && origin.z == eye.z ? M_PI / 2 : atan2(origin.z - eye.z, hdist);
+
+		double syaw = sin(yaw);
+		double cyaw = cos(yaw);
+		double spitch = sin(pitch);
+		double cpitch = cos(pitch);
+
+		// yaw+pitch rotation matrix
+		Matrix rot{3, 3, 0};
+		rot(0, 0) = cyaw * cpitch;
+		rot(0, 1) = -syaw;
+		rot(0, 2) = cyaw * spitch;
+		rot(1, 0) = syaw * cpitch;
+		rot(1, 1) = cyaw;
+		rot(1, 2) = syaw * spitch;
+		rot(2, 0) = -spitch;
+		rot(2, 1) = 0;
+		rot(2, 2) = cpitch;
+
+		for (int i = 0; i < tris; ++i) {
+			double lang = M_PI * 2 * i / tris;
+			double rang = M_PI * 2 * (i + 1) / tris;
+
+			Vector dl(0, cos(lang) * rad, sin(lang) * rad);
+			Vector dr(0, cos(rang) * rad, sin(rang) * rad);
+
+			Vector l = origin + rot * dl;
+			Vector r = origin + rot * dr;
+
+			verts.insert(verts.end(), {r, l, origin});
+		}
+
+		break;
+	}
+
+	case GhostType::PYRAMID:
+	case GhostType::PYRAMID_PGUN: {
+		Vector top = pos + Vector{0, 0, height};
+
+		Vector a = pos + Vector{5, 5, 0};
+		Vector b = pos + Vector{5, -5, 0};
+		Vector c = pos + Vector{-5, -5, 0};
+		Vector d = pos + Vector{-5, 5, 0};
+
+		verts.insert(verts.end(), {
+			a, b, top,
+			b, c, top,
+			c, d, top,
+			d, a, top,
+			b, a, c,
+			c, a, d,
+		});
+
+		break;
+	}
+
+	case GhostType::BENDY: {
+		// idk, some weird shit was happening when I was setting it in a constructor
+		// so I'm just leaving that here
+		ghost->renderer.SetGhost(ghost);
+		ghost->renderer.Draw(verts, ghost->renderer.GetLODLevel(this->viewKnown ? (this->viewPos - pos).Length() : 0));
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+void GhostBatch::Flush() {
+	this->haveView = false;
+
+	// Colours nobody's used this frame are dropped; the rest keep their
+	// space for the next
+	size_t n = 0;
+	this->bucketIdx.clear();
+	for (auto &bucket : this->buckets) {
+		if (bucket.verts.empty()) continue;
+		OverlayRender::addTriangles(bucket.verts.data(), bucket.verts.size(), bucket.col);
+
+		uint32_t key;
+		memcpy(&key, bucket.col._color, sizeof key);
+		this->bucketIdx[key] = n;
+		bucket.verts.clear();
+		if (&this->buckets[n] != &bucket) std::swap(this->buckets[n], bucket);
+		++n;
+	}
+	this->buckets.resize(n);
+}
+
+// After every ghost player has added its ghosts
+ON_EVENT_P(RENDER, -1000) {
+	ghostBatch.Flush();
+}
+
+// }}}
@@ -1,6 +1,8 @@
 #pragma once
 #include <Utils/SDK.hpp>
 
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
 class GhostEntity;
@@ -16,12 +18,44 @@ private:
 	bool oldGroundedState;
 
 private:
-	void UpdateAnimatedVerts();
+	void UpdateAnimatedVerts(int lod);
 public:
 	GhostRenderer();
 	void SetGhost(GhostEntity *ghost);
-	void Draw();
-	int GetLODLevel();
+	void Draw(std::vector<Vector> &out, int lod);
+	int GetLODLevel(float dist);
 	void StartGesture(int id);
 	float GetHeight();
-};
\ No newline at end of file
+};
+
+// Collects every ghost drawn in a frame, skipping those that can't be
+// seen, and hands them to OverlayRender as a few big meshes - one for each
+// colour - rather than a triangle at a time
+class GhostBatch {
+private:
+	struct Bucket {
+		Color col;
+		std::vector<Vector> verts;
+	};
+
+	std::unordered_map<uint32_t, size_t> bucketIdx;
+	std::vector<Bucket> buckets;
+
+	bool haveView = false;
+	bool viewKnown;
+	bool viewCull;
+	Vector viewPos;
+	Vector viewForward;
+	float viewHalfAngle;
+
+	void UpdateView();
+	bool IsVisible(Vector center, float radius, float *dist);
+	std::vector<Vector> &GetVerts(Color col);
+
+public:
+	// Returns whether the ghost is in view
+	bool Add(GhostEntity *ghost, Color col);
+	void Flush();
+};
+
+extern GhostBatch ghostBatch;
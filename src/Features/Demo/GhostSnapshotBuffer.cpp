@@ -0,0 +1,218 @@
+#include "GhostSnapshotBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// How many arrivals the update interval is averaged over
+#define ARRIVAL_WINDOW 32
+// States beyond this many are thrown away, oldest first
+#define MAX_SNAPSHOTS 32
+// A gap longer than this (the game being paused or loading, say) starts a
+// new timeline rather than counting as jitter
+#define MAX_ARRIVAL_GAP 1.0
+// How far each update's place on the timeline is pulled towards when it
+// arrived
+#define TIMED_NUDGE 0.05
+#define UNTIMED_NUDGE 0.1
+// If the smoothed timeline drifts this far from when updates actually
+// arrive, jump back to it
+#define MAX_TIMELINE_DRIFT 0.25
+// Moving further than this between two states is a teleport, and isn't
+// interpolated
+#define TELEPORT_DISTANCE 300.0f
+// The adaptive delay is a couple of intervals' worth of jitter on top of
+// the interval itself, within these bounds
+#define MIN_DELAY 0.02
+#define MAX_DELAY 0.5
+#define JITTER_MARGIN 2.5
+// The delay only changes by this much per second, so the ghost speeds up
+// or slows down a little rather than jumping. It's only brought down once
+// it's well above what's needed, so it doesn't wander with every estimate.
+#define DELAY_SLEW 0.1
+#define DELAY_HYSTERESIS 1.5
+
+static bool isTeleport(const DataGhost &a, const DataGhost &b) {
+	return (a.position - b.position).SquaredLength() > TELEPORT_DISTANCE * TELEPORT_DISTANCE;
+}
+
+static float lerpAngle(float a, float b, float t) {
+	return a + std::remainder(b - a, 360.0f) * t;
+}
+
+void GhostSnapshotBuffer::Push(double now, const DataGhost &data, std::optional<uint16_t> sentAt) {
+	// How long after the last update the player sent this one, if we know
+	std::optional<double> elapsed;
+	if (sentAt && this->lastSentAt) {
+		int16_t ms = (int16_t)(*sentAt - *this->lastSentAt);
+		if (ms == 0) return;  // The server sent the same state again
+		if (ms < 0) {
+			// Overtaken by a newer one
+			++this->received;
+			++this->dropped;
+			return;
+		}
+		elapsed = ms / 1000.0;
+	}
+	this->lastSentAt = sentAt;
+
+	++this->received;
+
+	double gap = this->arrivals.empty() ? 0 : now - this->arrivals.back();
+	if (this->arrivals.empty() || gap > MAX_ARRIVAL_GAP || gap < 0 || (elapsed && *elapsed > MAX_ARRIVAL_GAP)) {
+		// Everything we had is from before a break, so it's of no use for
+		// timing; anything not shown yet never will be
+		for (auto &snap : this->snaps) {
+			if (snap.time > this->playTime) ++this->dropped;
+		}
+		this->snaps.clear();
+		this->arrivals.clear();
+		this->jitter = 0;
+		this->playing = false;
+
+		this->arrivals.push_back(now);
+		this->snaps.push_back({now, data});
+		return;
+	}
+
+	this->arrivals.push_back(now);
+	if (this->arrivals.size() > ARRIVAL_WINDOW) this->arrivals.pop_front();
+
+	// The median gap, since lost updates make for the odd long one and
+	// late ones come in short and long pairs
+	if (this->arrivals.size() >= 2) {
+		std::vector<double> gaps;
+		for (size_t i = 1; i < this->arrivals.size(); ++i) gaps.push_back(this->arrivals[i] - this->arrivals[i - 1]);
+		std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+		this->interval = gaps[gaps.size() / 2];
+	}
+
+	// Place the update as far after the last one as it was sent, nudged a
+	// little towards when it actually arrived so we don't drift. Without
+	// the send time, guess from the usual interval how many updates went
+	// missing in between; jitter can fool that, so it's nudged harder.
+	double last = this->snaps.empty() ? now - gap : this->snaps.back().time;
+	double predicted, nudge;
+	if (elapsed) {
+		predicted = last + *elapsed;
+		nudge = TIMED_NUDGE;
+	} else {
+		double steps = this->interval > 0 ? std::max(1.0, std::round(gap / this->interval)) : 1.0;
+		predicted = last + steps * this->interval;
+		nudge = UNTIMED_NUDGE;
+	}
+
+	double deviation = now - predicted;
+	this->jitter += (std::abs(deviation) - this->jitter) / 16;
+
+	double time = predicted + deviation * nudge;
+	if (std::abs(now - time) > MAX_TIMELINE_DRIFT) time = now;
+	time = std::max(time, last + this->interval * 0.25);
+
+	if (this->playing && time < this->playTime) ++this->late;
+
+	this->snaps.push_back({time, data});
+	while (this->snaps.size() > MAX_SNAPSHOTS) {
+		if (this->snaps.front().time > this->playTime) ++this->dropped;
+		this->snaps.pop_front();
+	}
+}
+
+// Finite differences through the neighbouring states, except across a
+// teleport
+Vector GhostSnapshotBuffer::Tangent(size_t idx) const {
+	const Snap &cur = this->snaps[idx];
+	const Snap *prev = idx > 0 ? &this->snaps[idx - 1] : nullptr;
+	const Snap *next = idx + 1 < this->snaps.size() ? &this->snaps[idx + 1] : nullptr;
+
+	if (prev && isTeleport(prev->data, cur.data)) prev = nullptr;
+	if (next && isTeleport(cur.data, next->data)) next = nullptr;
+
+	const Snap &a = prev ? *prev : cur;
+	const Snap &b = next ? *next : cur;
+	if (b.time <= a.time) return Vector{0, 0, 0};
+
+	return (b.data.position - a.data.position) / (float)(b.time - a.time);
+}
+
+bool GhostSnapshotBuffer::Sample(double now, float fixedDelay, float maxExtrapolate, DataGhost *out, Vector *velocity) {
+	if (this->snaps.empty()) return false;
+
+	double target = fixedDelay > 0 ? fixedDelay : std::clamp(this->interval + JITTER_MARGIN * this->jitter, MIN_DELAY, MAX_DELAY);
+	if (!this->playing) {
+		this->playing = true;
+		this->delay = target;
+		this->playTime = now - target;
+	} else {
+		double maxChange = DELAY_SLEW * std::max(now - this->lastSample, 0.0);
+		if (target > this->delay) {
+			this->delay = std::min(target, this->delay + maxChange);
+		} else if (target * DELAY_HYSTERESIS < this->delay) {
+			this->delay = std::max(target * DELAY_HYSTERESIS, this->delay - maxChange);
+		}
+		this->playTime = std::max(this->playTime, now - this->delay);
+	}
+	this->lastSample = now;
+
+	double t = this->playTime;
+
+	// Keep one state before the current one for its tangent
+	while (this->snaps.size() > 2 && this->snaps[2].time <= t) this->snaps.pop_front();
+
+	size_t idx = 0;
+	while (idx + 1 < this->snaps.size() && this->snaps[idx + 1].time <= t) ++idx;
+
+	const Snap &a = this->snaps[idx];
+
+	if (t <= a.time || idx + 1 == this->snaps.size()) {
+		// Before the first state, or past the last: carry on at the speed
+		// we were going for a little, then wait
+		*out = a.data;
+		*velocity = {0, 0, 0};
+		if (t > a.time && idx > 0 && !isTeleport(this->snaps[idx - 1].data, a.data)) {
+			const Snap &prev = this->snaps[idx - 1];
+			Vector vel = (a.data.position - prev.data.position) / (float)(a.time - prev.time);
+			float dt = (float)std::min(t - a.time, (double)maxExtrapolate);
+			out->position = a.data.position + vel * dt;
+			if (t - a.time < maxExtrapolate) *velocity = vel;
+		}
+		return true;
+	}
+
+	const Snap &b = this->snaps[idx + 1];
+	float dt = (float)(b.time - a.time);
+	float s = (float)((t - a.time) / dt);
+
+	if (isTeleport(a.data, b.data)) {
+		*out = s < 0.5f ? a.data : b.data;
+		*velocity = {0, 0, 0};
+		return true;
+	}
+
+	Vector m0 = this->Tangent(idx) * dt;
+	Vector m1 = this->Tangent(idx + 1) * dt;
+
+	float s2 = s * s, s3 = s2 * s;
+	float h00 = 2 * s3 - 3 * s2 + 1, h10 = s3 - 2 * s2 + s, h01 = -2 * s3 + 3 * s2, h11 = s3 - s2;
+	float d00 = 6 * s2 - 6 * s, d10 = 3 * s2 - 4 * s + 1, d01 = -6 * s2 + 6 * s, d11 = 3 * s2 - 2 * s;
+
+	out->position = a.data.position * h00 + m0 * h10 + b.data.position * h01 + m1 * h11;
+	*velocity = (a.data.position * d00 + m0 * d10 + b.data.position * d01 + m1 * d11) / dt;
+
+	out->view_angle.x = lerpAngle(a.data.view_angle.x, b.data.view_angle.x, s);
+	out->view_angle.y = lerpAngle(a.data.view_angle.y, b.data.view_angle.y, s);
+	out->view_angle.z = lerpAngle(a.data.view_angle.z, b.data.view_angle.z, s);
+	out->view_offset = a.data.view_offset + (b.data.view_offset - a.data.view_offset) * s;
+	out->grounded = s < 0.5f ? a.data.grounded : b.data.grounded;
+
+	return true;
+}
+
+GhostSnapshotBuffer::Stats GhostSnapshotBuffer::GetStats() const {
+	size_t depth = 0;
+	for (auto &snap : this->snaps) {
+		if (snap.time > this->playTime) ++depth;
+	}
+
+	return {depth, (float)this->delay, (float)this->jitter, (float)this->interval, this->received, this->late, this->dropped};
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "GhostTrack.hpp"
+#include "Utils/BaseTypes.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+
+// A jitter buffer for the states of a network ghost. Updates are given
+// times on a smoothed timeline as they arrive, and the ghost is shown a
+// little behind the newest of them, so there's usually one to move
+// towards even when packets arrive unevenly. The delay adapts to the
+// jitter measured between arrivals unless a fixed one is given. Between
+// states, positions follow a Hermite curve through the neighbouring
+// ones; past the newest, they're extrapolated for a short while.
+// Pushing and sampling both happen on the game thread (updates from the
+// network thread wait in NetworkManager's queue until then), so nothing
+// here locks. Times are in seconds, from any epoch.
+class GhostSnapshotBuffer {
+public:
+	struct Stats {
+		size_t depth;       // States waiting to be shown
+		float delay;        // Current playout delay
+		float jitter;
+		float interval;     // Usual time between updates
+		uint32_t received;
+		uint32_t late;      // Arrived after they should have been shown
+		uint32_t dropped;   // Thrown away before they could be shown, or overtaken
+	};
+
+	// sentAt is when the player sent the update in ms on their clock, if
+	// the protocol says; it's used to space updates out exactly
+	void Push(double now, const DataGhost &data, std::optional<uint16_t> sentAt = {});
+	// fixedDelay is the playout delay to use, or 0 to adapt it. Returns
+	// false if there aren't any states yet.
+	bool Sample(double now, float fixedDelay, float maxExtrapolate, DataGhost *out, Vector *velocity);
+
+	Stats GetStats() const;
+
+private:
+	struct Snap {
+		double time;
+		DataGhost data;
+	};
+
+	Vector Tangent(size_t idx) const;
+
+	std::deque<Snap> snaps;
+	std::deque<double> arrivals;  // Recent arrival times, for the interval
+	std::optional<uint16_t> lastSentAt;
+	double interval = 0;
+	double jitter = 0;
+
+	bool playing = false;
+	double delay = 0;
+	double lastSample = 0;
+	double playTime = 0;
+
+	uint32_t received = 0;
+	uint32_t late = 0;
+	uint32_t dropped = 0;
+};
@@ -0,0 +1,148 @@
+#include "GhostTrack.hpp"
+
+#include "Demo.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <tuple>
+
+// Over 3 days at 60 ticks per second; anything further apart is a broken
+// demo, and would otherwise make us allocate a huge track
+#define MAX_TRACK_TICKS (1 << 24)
+
+#define FRAME_PRESENT (1 << 0)
+#define FRAME_GROUNDED (1 << 1)
+
+static int16_t packAngle(float ang) {
+	if (!std::isfinite(ang)) return 0;
+	// Wraps around, which is fine since it's an angle anyway
+	return (int16_t)(uint16_t)(int32_t)std::lround(std::fmod(ang, 360.0f) * (65536.0f / 360.0f));
+}
+
+static float unpackAngle(int16_t ang) {
+	return ang * (360.0f / 65536.0f);
+}
+
+bool GhostTrack::Set(int tick, const DataGhost &data) {
+	if (this->view) {
+		this->frames.assign(this->view, this->view + this->viewSize);
+		this->view = nullptr;
+		this->viewSize = 0;
+		this->viewOwner.reset();
+	}
+
+	if (this->frames.empty()) {
+		this->firstTick = tick;
+	} else if (tick < this->firstTick) {
+		if (this->EndTick() - tick > MAX_TRACK_TICKS) return false;
+		this->frames.insert(this->frames.begin(), this->firstTick - tick, Frame{});
+		this->firstTick = tick;
+	} else if (tick - this->firstTick >= MAX_TRACK_TICKS) {
+		return false;
+	}
+
+	size_t idx = tick - this->firstTick;
+	if (idx >= this->frames.size()) this->frames.resize(idx + 1, Frame{});
+
+	Frame &f = this->frames[idx];
+	if (!(f.flags & FRAME_PRESENT)) ++this->count;
+
+	f.position[0] = data.position.x;
+	f.position[1] = data.position.y;
+	f.position[2] = data.position.z;
+	f.view_angle[0] = packAngle(data.view_angle.x);
+	f.view_angle[1] = packAngle(data.view_angle.y);
+	f.view_angle[2] = packAngle(data.view_angle.z);
+	f.view_offset = (uint8_t)std::clamp((int)std::lround(data.view_offset), 0, 255);
+	f.flags = FRAME_PRESENT | (data.grounded ? FRAME_GROUNDED : 0);
+
+	return true;
+}
+
+bool GhostTrack::Get(int tick, DataGhost *out) const {
+	if (tick < this->firstTick || tick >= this->EndTick()) return false;
+
+	const Frame &f = this->Frames()[tick - this->firstTick];
+	if (!(f.flags & FRAME_PRESENT)) return false;
+
+	out->position = {f.position[0], f.position[1], f.position[2]};
+	out->view_angle = {unpackAngle(f.view_angle[0]), unpackAngle(f.view_angle[1]), unpackAngle(f.view_angle[2])};
+	out->view_offset = f.view_offset;
+	out->grounded = f.flags & FRAME_GROUNDED;
+
+	return true;
+}
+
+size_t GhostTrack::MemoryUsage() const {
+	// Views are mapped files, which are only paged in as they're used
+	return this->frames.capacity() * sizeof(Frame);
+}
+
+bool GhostTrack::SetView(int firstTick, const void *frames, size_t nFrames, size_t count, std::shared_ptr<const void> owner) {
+	if (nFrames > MAX_TRACK_TICKS || count > nFrames || (nFrames > 0 && (uintptr_t)frames % alignof(Frame) != 0)) return false;
+
+	const Frame *view = (const Frame *)frames;
+
+	this->frames.clear();
+	this->frames.shrink_to_fit();
+	this->firstTick = firstTick;
+	this->count = count;
+	this->view = nFrames > 0 ? view : nullptr;
+	this->viewSize = nFrames;
+	this->viewOwner = std::move(owner);
+
+	return true;
+}
+
+bool GhostTrackVisitor::OnMessage(uint8_t type, int32_t tick, size_t offset) {
+	if (this->cancel && *this->cancel) return false;
+
+	// Only count positive ticks to keep adjustments simple
+	if (tick >= 0)
+		this->demo->lastMessageTick = tick;
+	return true;
+}
+
+bool GhostTrackVisitor::OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) {
+	if (tick > 0 && this->gotSync && !this->gotFirstPositivePacket) {
+		this->demo->firstPositivePacketTick = tick;
+		this->gotFirstPositivePacket = true;
+	}
+
+	if (nInfos < 1) return true;
+	const DemoCmdInfo &info = infos[0];
+
+	if (tick == 0) {
+		this->waitForNext = true;
+	}
+
+	if (tick > 0 && this->waitForNext && this->lastTick != tick) {
+		this->lastTick = tick;
+		this->track->Set(tick, DataGhost{{info.viewOrigin[0], info.viewOrigin[1], info.viewOrigin[2]}, {info.viewAngles[0], info.viewAngles[1], info.viewAngles[2]}, 64, true});  // TODO: is there a way to get this data that's not just a guess?
+	}
+
+	return true;
+}
+
+bool GhostTrackVisitor::OnSyncTick(int32_t tick) {
+	this->gotSync = true;
+	return true;
+}
+
+bool GhostTrackVisitor::OnConsoleCmd(int32_t tick, const char *cmd, int32_t length) {
+	if (std::string(cmd, length).find("__END__") != std::string::npos) {
+		this->demo->segmentTicks = tick;
+	}
+	return true;
+}
+
+bool GhostTrackVisitor::OnCustomData(int32_t tick, int32_t type, const uint8_t *data, int32_t length) {
+	if (this->customDatas && length > 8) {
+		std::string str = DemoParser::DecodeCustomData((const char *)data + 8, length - 8);
+		if (!str.empty()) {
+			(*this->customDatas)[str] = std::make_tuple(tick, false);
+		}
+	}
+	return true;
+}
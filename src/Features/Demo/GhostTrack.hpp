@@ -0,0 +1,99 @@
+#pragma once
+#include "DemoParser.hpp"
+#include "Utils/BaseTypes.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct DataGhost {
+	Vector position;
+	QAngle view_angle;
+	float view_offset;
+	bool grounded;
+};
+
+// The path of a demo ghost, with a slot for every tick between the first
+// and last ones with data, so looking up a tick is just an index. Ticks
+// without data (like every other tick of an alternateticks demo) are
+// left as gaps. Angles are quantised to 16 bits and the rest is packed,
+// so each tick takes 20 bytes.
+class GhostTrack {
+public:
+	// Returns false if the tick is too far from the others to be stored
+	bool Set(int tick, const DataGhost &data);
+	// Returns false if there's no data for the tick
+	bool Get(int tick, DataGhost *out) const;
+
+	bool Empty() const { return this->count == 0; }
+	size_t Count() const { return this->count; }
+	int FirstTick() const { return this->firstTick; }
+	int EndTick() const { return this->firstTick + (int)this->NumFrames(); }
+
+	size_t MemoryUsage() const;
+	void ShrinkToFit() { this->frames.shrink_to_fit(); }
+
+	// The packed frames, FRAME_SIZE bytes each, one for every tick from
+	// FirstTick to EndTick; this is what .sarghost files store
+	static const size_t FRAME_SIZE = 20;
+	const void *FrameData() const { return this->Frames(); }
+
+	// Makes this track read frames stored somewhere else, like a mapped
+	// .sarghost file, without copying them; count is how many of them have
+	// data. owner keeps the frames alive, and they must be 4-byte aligned.
+	// Setting a tick copies the frames first.
+	bool SetView(int firstTick, const void *frames, size_t nFrames, size_t count, std::shared_ptr<const void> owner);
+
+private:
+	struct Frame {
+		float position[3];
+		int16_t view_angle[3];
+		uint8_t view_offset;
+		uint8_t flags;
+	};
+	static_assert(sizeof(Frame) == FRAME_SIZE, "GhostTrack::Frame must not be padded");
+
+	const Frame *Frames() const { return this->view ? this->view : this->frames.data(); }
+	size_t NumFrames() const { return this->view ? this->viewSize : this->frames.size(); }
+
+	int firstTick = 0;
+	size_t count = 0;
+	std::vector<Frame> frames;
+
+	const Frame *view = nullptr;
+	size_t viewSize = 0;
+	std::shared_ptr<const void> viewOwner;
+};
+
+// Takes what a demo ghost needs from a demo: the first player's view on
+// each tick after the first tick 0, the SAR custom data its splits are
+// compared against, and the ticks DemoParser::Adjust needs. If cancel is
+// given, parsing stops as soon as it's set.
+class GhostTrackVisitor : public DemoVisitor {
+public:
+	GhostTrackVisitor(Demo *demo, GhostTrack *track, CustomDatas *customDatas, const std::atomic<bool> *cancel = nullptr)
+		: demo(demo)
+		, track(track)
+		, customDatas(customDatas)
+		, cancel(cancel) {
+	}
+
+	bool OnMessage(uint8_t type, int32_t tick, size_t offset) override;
+	bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override;
+	bool OnSyncTick(int32_t tick) override;
+	bool OnConsoleCmd(int32_t tick, const char *cmd, int32_t length) override;
+	bool OnCustomData(int32_t tick, int32_t type, const uint8_t *data, int32_t length) override;
+
+private:
+	Demo *demo;
+	GhostTrack *track;
+	CustomDatas *customDatas;
+	const std::atomic<bool> *cancel;
+
+	bool gotSync = false;
+	bool gotFirstPositivePacket = false;
+	bool waitForNext = false;
+	int lastTick = 0;
+};
@@ -0,0 +1,66 @@
+#pragma once
+#include "GhostTrack.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// A ghost position as it arrived from the server, waiting for the game
+// thread to apply it
+struct GhostUpdate {
+	uint32_t id;
+	DataGhost data;
+	std::optional<uint16_t> sentAt;
+	std::chrono::steady_clock::time_point received;
+};
+
+// Takes position updates from the network thread to the game thread
+// without either of them ever waiting on the other. head and tail count
+// updates and only ever increase; the slot is the counter modulo the
+// capacity. The network thread is the only writer of head and the game
+// thread the only writer of tail. If the game thread stops draining it
+// (while loading, say), new updates are dropped until it catches up;
+// the snapshot buffers start afresh after a gap like that anyway.
+class GhostUpdateQueue {
+public:
+	// Several seconds of updates from a full server
+	static const uint32_t CAPACITY = 4096;
+	static_assert((CAPACITY & (CAPACITY - 1)) == 0, "GhostUpdateQueue::CAPACITY must be a power of two");
+
+	// Network thread; returns false if the queue was full
+	bool Push(const GhostUpdate &update) {
+		uint32_t head = this->head.load(std::memory_order_relaxed);
+		if (head - this->tail.load(std::memory_order_acquire) >= CAPACITY) {
+			this->dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		this->slots[head & (CAPACITY - 1)] = update;
+		this->head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Game thread; calls fn on everything queued so far, oldest first, and
+	// returns how many there were
+	template <typename Fn>
+	size_t Drain(Fn fn) {
+		uint32_t tail = this->tail.load(std::memory_order_relaxed);
+		uint32_t head = this->head.load(std::memory_order_acquire);
+		for (uint32_t i = tail; i != head; ++i) fn(this->slots[i & (CAPACITY - 1)]);
+		this->tail.store(head, std::memory_order_release);
+		return head - tail;
+	}
+
+	// How many are waiting; only exact on the network thread, and only an
+	// upper bound there
+	uint32_t Size() const { return this->head.load(std::memory_order_relaxed) - this->tail.load(std::memory_order_acquire); }
+
+	uint32_t Dropped() const { return this->dropped.load(std::memory_order_relaxed); }
+
+private:
+	GhostUpdate slots[CAPACITY];
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+	std::atomic<uint32_t> dropped{0};
+};
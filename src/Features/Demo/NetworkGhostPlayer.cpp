@@ -14,6 +14,7 @@
 #include "Modules/Surface.hpp"
 #include "Modules/Scheme.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <queue>
@@ -92,6 +93,7 @@ public:
 			}
 		} else {
 			int height = surface->GetFontHeight(font);
+			auto pool = networkManager.ghostPool.Load();
 
 			{
 				int y = 100;
@@ -99,7 +101,7 @@ public:
 				y += height + 15;
 
 				for (uint32_t id : this->waiting) {
-					auto ghost = networkManager.GetGhostByID(id);
+					auto ghost = pool->Get(id);
 					if (ghost) {
 						DrawTxtRightAlign(font, screenWidth / 2 - 20, y, grey, ghost->name.c_str());
 						y += height + 5;
@@ -113,7 +115,7 @@ public:
 				y += height + 15;
 
 				for (uint32_t id : this->ready) {
-					auto ghost = networkManager.GetGhostByID(id);
+					auto ghost = pool->Get(id);
 					if (ghost) {
 						surface->DrawTxt(font, screenWidth / 2 + 20, y, grey, ghost->name.c_str());
 						y += height + 5;
@@ -154,13 +156,13 @@ public:
 		if (!networkManager.isConnected) return;
 
 		std::set<std::string> players;
-		networkManager.ghostPoolLock.lock();
 		if (ghost_list_show_map.GetBool()) {
 			players.insert(Utils::ssprintf("%s (%s)", networkManager.name.c_str(), engine->GetCurrentMapName().c_str()));
 		} else {
 			players.insert(networkManager.name);
 		}
-		for (auto &g : networkManager.ghostPool) {
+		auto pool = networkManager.ghostPool.Load();
+		for (auto &g : *pool) {
 			if (g->isDestroyed) continue;
 			if (ghost_list_mode.GetInt() == 1 && !g->sameMap) continue;
 			if (ghost_list_show_map.GetBool()) {
@@ -169,7 +171,6 @@ public:
 				players.insert(g->name);
 			}
 		}
-		networkManager.ghostPoolLock.unlock();
 
 		long font = scheme->GetDefaultFont() + ghost_list_font.GetInt();
 
@@ -276,6 +277,9 @@ sf::Packet &operator<<(sf::Packet &packet, const Color &col) {
 
 Variable ghost_TCP_only("ghost_TCP_only", "0", "Lathil's special command :).\n");
 Variable ghost_update_rate("ghost_update_rate", "50", 1, "Adjust the update rate. For people with lathil's internet.\n");
+Variable ghost_net_delta("ghost_net_delta", "1", "Send and receive position updates in the compact delta format, if the server supports it. Takes effect on the next connection.\n");
+Variable ghost_net_interp_delay("ghost_net_interp_delay", "0", 0, 1000, "How far behind their latest updates to show network ghosts, in ms, so late packets don't make them stutter. 0 = adapt to the connection.\n");
+Variable ghost_net_extrapolate("ghost_net_extrapolate", "100", 0, 1000, "How long to keep network ghosts moving when their updates are late, in ms.\n");
 Variable ghost_net_dump("ghost_net_dump", "0", "Dump all ghost network activity to a file for debugging.\n");
 
 static FILE *g_dumpFile;
@@ -305,6 +309,14 @@ CON_COMMAND(ghost_net_dump_mark, "Mark a point of interest in the ghost network
 	addToNetDump("mark", nullptr);
 }
 
+Variable ghost_net_capture("ghost_net_capture", "0", "Record every ghost network packet to ghost_net_capture.sarnet, to play back with ghost_net_replay. Takes effect on the next connection.\n");
+
+static GhostCapture::Writer g_capture;
+
+static void capturePacket(GhostCapture::Kind kind, const sf::Packet &packet) {
+	if (g_capture.IsOpen()) g_capture.Add(kind, packet.getData(), packet.getDataSize());
+}
+
 std::mutex mutex;
 
 NetworkManager networkManager;
@@ -318,6 +330,8 @@ NetworkManager::NetworkManager()
 }
 
 void NetworkManager::Connect(sf::IpAddress ip, unsigned short int port) {
+	this->WaitForNetworkThread();
+
 	if (this->tcpSocket.connect(ip, port, sf::seconds(5))) {
 		toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("Connection timed out! Cannot connect to the server at %s:%d", ip.toString().c_str(), port));
 		return;
@@ -334,8 +348,12 @@ void NetworkManager::Connect(sf::IpAddress ip, unsigned short int port) {
 	this->serverIP = ip;
 	this->serverPort = port;
 
+	// The protocol version goes on the end, where servers which don't know
+	// about it will ignore it
+	sf::Uint32 offeredProtocol = ghost_net_delta.GetBool() ? GhostNet::PROTOCOL_CURRENT : GhostNet::PROTOCOL_LEGACY;
+
 	sf::Packet connection_packet;
-	connection_packet << HEADER::CONNECT << this->udpSocket.getLocalPort() << this->name.c_str() << DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false} << this->modelName.c_str() << engine->GetCurrentMapName().c_str() << ghost_TCP_only.GetBool() << GhostEntity::set_color;
+	connection_packet << HEADER::CONNECT << this->udpSocket.getLocalPort() << this->name.c_str() << DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false} << this->modelName.c_str() << engine->GetCurrentMapName().c_str() << ghost_TCP_only.GetBool() << GhostEntity::set_color << offeredProtocol;
 	this->tcpSocket.send(connection_packet);
 
 	{
@@ -353,40 +371,29 @@ void NetworkManager::Connect(sf::IpAddress ip, unsigned short int port) {
 			return;
 		}
 
-		//Get our ID
-		confirm_connection >> this->ID;
-
-		//Add every player connected to the ghostPool
-		sf::Uint32 nb_players;
-		confirm_connection >> nb_players;
-		for (sf::Uint32 i = 0; i < nb_players; ++i) {
-			sf::Uint32 ID;
-			std::string name;
-			DataGhost data;
-			std::string model_name;
-			std::string current_map;
-			Color color;
-			confirm_connection >> ID >> name >> data >> model_name >> current_map >> color;
-
-			auto ghost = std::make_shared<GhostEntity>(ID, name, data, current_map);
-			ghost->modelName = model_name;
-			ghost->color = color;
-			this->ghostPoolLock.lock();
-			this->ghostPool.push_back(ghost);
-			this->ghostPoolLock.unlock();
-		}
-		this->UpdateGhostsSameMap();
-		if (engine->isRunning()) {
-			this->SpawnAllGhosts();
+		// Only now do we know the connection's going ahead. The first two
+		// packets are captured a little late, but it's the ones from the
+		// server after them which matter.
+		if (ghost_net_capture.GetBool()) {
+			if (g_capture.Open("ghost_net_capture.sarnet")) {
+				capturePacket(GhostCapture::Kind::SENT_TCP, connection_packet);
+				capturePacket(GhostCapture::Kind::CONNECT_REPLY, confirm_connection);
+			} else {
+				console->Warning("Could not open ghost_net_capture.sarnet\n");
+			}
 		}
+
+		sf::Uint32 nb_players = this->AcceptConnection(confirm_connection, offeredProtocol);
 		toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("Successfully connected to the server!\n%d other players connected\n", nb_players));
 	}  //End of the scope. Will kill the Selector
 
+	// From now on, the network thread only ever takes what's there
+	this->tcpSocket.setBlocking(false);
+
 	this->isConnected = true;
 	this->runThread = true;
 	this->waitForRunning.notify_one();
 	this->networkThread = std::thread(&NetworkManager::RunNetwork, this);
-	this->networkThread.detach();
 
 	if (ghost_net_dump.GetBool()) {
 		startNetDump();
@@ -394,31 +401,142 @@ void NetworkManager::Connect(sf::IpAddress ip, unsigned short int port) {
 	}
 }
 
+// Reads the server's reply to CONNECT: our ID, then everyone already
+// there, then the protocol it picked. Returns how many others there are.
+sf::Uint32 NetworkManager::AcceptConnection(sf::Packet &reply, sf::Uint32 offeredProtocol) {
+	//Get our ID
+	reply >> this->ID;
+
+	//Add every player connected to the ghostPool
+	sf::Uint32 nb_players;
+	reply >> nb_players;
+	for (sf::Uint32 i = 0; i < nb_players; ++i) {
+		sf::Uint32 ID;
+		std::string name;
+		DataGhost data;
+		std::string model_name;
+		std::string current_map;
+		Color color;
+		reply >> ID >> name >> data >> model_name >> current_map >> color;
+
+		auto ghost = std::make_shared<GhostEntity>(ID, name, data, current_map);
+		ghost->modelName = model_name;
+		ghost->color = color;
+		this->ghostPool.Add(ghost);
+	}
+
+	// Older servers don't say which protocol to use
+	sf::Uint32 protocol;
+	if (!(reply >> protocol)) protocol = GhostNet::PROTOCOL_LEGACY;
+	this->protocol = std::min(protocol, offeredProtocol);
+	this->updateStream.Reset();
+	this->PublishStreamStats();
+
+	// Nothing from a previous connection should carry over
+	this->inbound.Drain([](const GhostUpdate &) {});
+	{
+		std::lock_guard<std::mutex> lock(this->outboundLock);
+		this->outboundTcp.clear();
+		this->outboundMessages = 0;
+		this->pingQueued = false;
+	}
+	this->pendingTcp.clear();
+
+	this->UpdateGhostsSameMap();
+	if (engine->isRunning()) {
+		this->SpawnAllGhosts();
+	}
+
+	return nb_players;
+}
+
+// Connects to a capture from ghost_net_capture instead of a server: a
+// thread of its own plays what the server sent back through Treat, just
+// as the network thread would, so interpolation and the ghost pool can
+// be measured against the same traffic again and again
+void NetworkManager::Replay(const std::string &path, float speed) {
+	this->WaitForNetworkThread();
+
+	auto capture = std::make_shared<GhostCapture::Capture>();
+	if (!GhostCapture::Read(path, capture.get())) {
+		return console->Print("Could not read the capture %s\n", path.c_str());
+	}
+
+	auto reply = std::find_if(capture->records.begin(), capture->records.end(), [](const GhostCapture::Record &record) {
+		return record.kind == GhostCapture::Kind::CONNECT_REPLY;
+	});
+	if (reply == capture->records.end()) {
+		return console->Print("%s doesn't start with a connection\n", path.c_str());
+	}
+
+	sf::Packet packet;
+	packet.append(reply->data, reply->size);
+	// The reply already has the protocol the capture was made with
+	sf::Uint32 nb_players = this->AcceptConnection(packet, GhostNet::PROTOCOL_CURRENT);
+	console->Print("Replaying %s: %d other players, %d packets\n", path.c_str(), nb_players, (int)capture->records.size());
+
+	this->isReplaying = true;
+	this->isConnected = true;
+	this->runThread = true;
+	this->waitForRunning.notify_one();
+	this->networkThread = std::thread(&NetworkManager::ReplayNetwork, this, capture, speed);
+}
+
+// Can be called from the network thread (when the connection drops) and
+// the main thread (ghost_disconnect) at once; only the first one to clear
+// isConnected does anything. The sockets are left to the network thread,
+// which closes them as it stops; anywhere else waits for that.
 void NetworkManager::Disconnect() {
-	if (this->isConnected) {
+	bool connected = true;
+	if (this->isConnected.compare_exchange_strong(connected, false)) {
 		addToNetDump("disconnect", nullptr);
 		endNetDump();
 
-		this->isConnected = false;
+		{
+			// So the network thread can't miss this between checking and waiting
+			std::lock_guard<std::mutex> lck(mutex);
+		}
 		this->waitForRunning.notify_one();
-		this->ghostPoolLock.lock();
-		this->ghostPool.clear();
-		this->ghostPoolLock.unlock();
+		this->ghostPool.Clear();
 
-		sf::Packet packet;
-		packet << HEADER::DISCONNECT << this->ID;
-		this->tcpSocket.send(packet);
+		if (this->isReplaying) {
+			this->isReplaying = false;
+			Scheduler::OnMainThread([=]() {
+				toastHud.AddToast(GHOST_TOAST_TAG, "The replay has finished");
+			});
+		}
+	}
 
-		this->selector.clear();
-		this->tcpSocket.disconnect();
-		this->udpSocket.unbind();
+	this->WaitForNetworkThread();
+}
 
-		Scheduler::OnMainThread([=]() {
-			toastHud.AddToast(GHOST_TOAST_TAG, "You have been disconnected");
-		});
+void NetworkManager::WaitForNetworkThread() {
+	if (this->networkThread.joinable() && this->networkThread.get_id() != std::this_thread::get_id()) {
+		this->networkThread.join();
 	}
 }
 
+// Only called by the network thread once it's stopped. Whatever's still
+// queued goes first, including the rest of any message the socket only
+// took part of, so DISCONNECT doesn't land in the middle of one.
+void NetworkManager::CloseConnection() {
+	sf::Packet packet;
+	packet << HEADER::DISCONNECT << this->ID;
+	this->QueueTCP(packet);
+	this->tcpSocket.setBlocking(true);
+	this->FlushTCP();
+	this->pendingTcp.clear();
+	g_capture.Close();
+
+	this->selector.clear();
+	this->tcpSocket.disconnect();
+	this->udpSocket.unbind();
+
+	Scheduler::OnMainThread([=]() {
+		toastHud.AddToast(GHOST_TOAST_TAG, "You have been disconnected");
+	});
+}
+
 void NetworkManager::StopServer() {
 	this->Disconnect();
 }
@@ -432,70 +550,238 @@ void NetworkManager::ResumeNetwork() {
 	this->waitForRunning.notify_one();
 }
 
+// Sends happen on their own clock, every ghost_update_rate ms from when
+// we connected, however busy receiving is; in between, the thread sleeps
+// until either something arrives or the next send is due. Everything
+// queued to go over TCP since the last send tick goes in one write.
 void NetworkManager::RunNetwork() {
 	this->selector.add(this->tcpSocket);
 	this->selector.add(this->udpSocket);
 
+	auto nextSend = NOW_STEADY();
+
 	while (this->isConnected) {
 		{
 			std::unique_lock<std::mutex> lck(mutex);
-			this->waitForRunning.wait(lck, [this] { return this->runThread.load(); });
+			this->waitForRunning.wait(lck, [this] { return this->runThread.load() || !this->isConnected; });
 		}
+		if (!this->isConnected) break;
 
 		auto now = NOW_STEADY();
+		auto interval = std::chrono::milliseconds(ghost_update_rate.GetInt());
 
-		if (now > this->lastUpdateTime + std::chrono::milliseconds(ghost_update_rate.GetInt())) {
-			// It's been one update rate interval - send our data again
-			// if we need to
-
+		if (now >= nextSend) {
 			if (engine->isRunning() && !engine->IsGamePaused()) {
 				this->SendPlayerData();
 			}
+			if (!this->FlushTCP()) {
+				this->Disconnect();
+				break;
+			}
+			++this->statSendTicks;
 
-			this->lastUpdateTime = now;
+			// If we've fallen behind (after a pause, say), carry on from now
+			// rather than sending a burst to catch up
+			nextSend += interval;
+			if (nextSend <= now) nextSend = now + interval;
 		}
 
-		if (this->selector.wait(sf::milliseconds(ghost_update_rate.GetInt()))) {
-			if (this->selector.isReady(this->udpSocket)) {  //UDP
-				std::vector<sf::Packet> buffer;
-				this->ReceiveUDPUpdates(buffer);
-				for (auto &packet : buffer) {
-					this->Treat(packet, true);
-				}
+		// A zero timeout means forever to SFML
+		auto wait = std::chrono::duration_cast<std::chrono::microseconds>(nextSend - NOW_STEADY()).count();
+		if (!this->selector.wait(sf::microseconds(std::max<sf::Int64>(wait, 1)))) continue;
+
+		if (this->selector.isReady(this->udpSocket)) {  //UDP
+			std::vector<sf::Packet> buffer;
+			this->ReceiveUDPUpdates(buffer);
+			for (auto &packet : buffer) {
+				capturePacket(GhostCapture::Kind::RECV_UDP, packet);
+				this->Treat(packet, true);
 			}
+		}
 
-			if (this->selector.isReady(this->tcpSocket)) {  //TCP
-				sf::Packet packet;
-				sf::Socket::Status status;
-				status = this->tcpSocket.receive(packet);
-				if (status != sf::Socket::Done) {
-					if (status == sf::Socket::Disconnected) {  //If connection with the server lost (crash for e.g.)
-						this->Disconnect();
-						break;
-					}
-					continue;
-				}
-				this->Treat(packet, false);
+		if (this->selector.isReady(this->tcpSocket)) {  //TCP
+			this->ReceiveTCP();
+		}
+	}
+
+	this->CloseConnection();
+}
+
+// Packets go at their original times, relative to the connection, scaled
+// by speed; at 0, they go as fast as the game applies the updates in
+// them. Time spent paused doesn't count. Nothing is sent in reply.
+void NetworkManager::ReplayNetwork(std::shared_ptr<GhostCapture::Capture> capture, float speed) {
+	auto start = NOW_STEADY();
+	uint64_t first = 0;
+	uint32_t packets = 0;
+
+	for (auto &record : capture->records) {
+		if (!this->isConnected) break;
+
+		if (record.kind == GhostCapture::Kind::CONNECT_REPLY) first = record.time;
+		if (record.kind != GhostCapture::Kind::RECV_UDP && record.kind != GhostCapture::Kind::RECV_TCP) continue;
+
+		if (!this->runThread) {
+			auto paused = NOW_STEADY();
+			std::unique_lock<std::mutex> lck(mutex);
+			this->waitForRunning.wait(lck, [this] { return this->runThread.load() || !this->isConnected; });
+			start += NOW_STEADY() - paused;
+		}
+
+		if (speed > 0) {
+			auto due = start + std::chrono::nanoseconds((int64_t)((record.time - std::min(record.time, first)) / speed));
+			std::unique_lock<std::mutex> lck(mutex);
+			this->waitForRunning.wait_until(lck, due, [this] { return !this->isConnected; });
+		} else {
+			while (this->isConnected && this->inbound.Size() > GhostUpdateQueue::CAPACITY / 2) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		if (!this->isConnected) break;
+
+		sf::Packet packet;
+		packet.append(record.data, record.size);
+		this->Treat(packet, record.kind == GhostCapture::Kind::RECV_UDP);
+		++packets;
+	}
+
+	if (!this->isConnected) return;
+
+	float took = std::chrono::duration<float>(NOW_STEADY() - start).count();
+	float length = capture->records.empty() ? 0 : (capture->records.back().time - first) / 1e9f;
+	Scheduler::OnMainThread([=]() {
+		console->Print("Replayed %u packets, %.1f s of traffic, in %.2f s\n", packets, length, took);
+	});
+	this->Disconnect();
+}
+
+// The socket is non-blocking once we're connected, so this takes every
+// whole packet that's arrived; SFML holds on to any partial one
+void NetworkManager::ReceiveTCP() {
+	while (this->isConnected) {
+		sf::Packet packet;
+		sf::Socket::Status status = this->tcpSocket.receive(packet);
+		if (status == sf::Socket::Done) {
+			capturePacket(GhostCapture::Kind::RECV_TCP, packet);
+			this->Treat(packet, false);
+		} else {
+			if (status == sf::Socket::Disconnected) {  //If connection with the server lost (crash for e.g.)
+				this->Disconnect();
 			}
+			break;
 		}
 	}
 }
 
+// Only the network thread sends over UDP
+void NetworkManager::SendUDP(sf::Packet &packet) {
+	if (this->isReplaying) return;
+	capturePacket(GhostCapture::Kind::SENT_UDP, packet);
+	this->udpSocket.send(packet, this->serverIP, this->serverPort);
+}
+
+// Captured as it's queued rather than when it goes, which is at most a
+// send tick later
+void NetworkManager::QueueTCP(const sf::Packet &packet, bool ping) {
+	if (this->isReplaying) return;
+	capturePacket(GhostCapture::Kind::SENT_TCP, packet);
+
+	// The same framing as sf::TcpSocket::send(sf::Packet &): the size,
+	// big-endian, then the data
+	size_t size = packet.getDataSize();
+	uint8_t header[4] = {(uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size};
+	auto data = (const uint8_t *)packet.getData();
+
+	std::lock_guard<std::mutex> lock(this->outboundLock);
+	this->outboundTcp.insert(this->outboundTcp.end(), header, header + 4);
+	this->outboundTcp.insert(this->outboundTcp.end(), data, data + size);
+	++this->outboundMessages;
+	if (ping) this->pingQueued = true;
+}
+
+// Returns false if the connection's gone
+bool NetworkManager::FlushTCP() {
+	bool ping;
+	{
+		std::lock_guard<std::mutex> lock(this->outboundLock);
+		this->pendingTcp.insert(this->pendingTcp.end(), this->outboundTcp.begin(), this->outboundTcp.end());
+		this->outboundTcp.clear();
+		this->statTcpMessages += this->outboundMessages;
+		this->outboundMessages = 0;
+		ping = this->pingQueued;
+		this->pingQueued = false;
+	}
+
+	if (this->pendingTcp.empty()) return true;
+
+	// Time the ping from when it actually goes, not from when it was asked for
+	if (ping) this->pingClock.restart();
+
+	size_t sent = 0;
+	auto status = this->tcpSocket.send(this->pendingTcp.data(), this->pendingTcp.size(), sent);
+	if (status == sf::Socket::Disconnected || status == sf::Socket::Error) return false;
+
+	this->pendingTcp.erase(this->pendingTcp.begin(), this->pendingTcp.begin() + sent);
+	++this->statTcpWrites;
+	return true;
+}
+
+void NetworkManager::PublishStreamStats() {
+	std::lock_guard<std::mutex> lock(this->streamStatsLock);
+	this->streamStats = this->updateStream.GetStats();
+}
+
+GhostNet::Stats NetworkManager::GetStreamStats() {
+	std::lock_guard<std::mutex> lock(this->streamStatsLock);
+	return this->streamStats;
+}
+
+// Called on the game thread; positions from the network thread go to
+// their ghosts' snapshot buffers with the time they arrived, so it
+// doesn't matter how long they waited here
+void NetworkManager::ApplyUpdates() {
+	this->ApplyUpdates(*this->ghostPool.Load());
+}
+
+void NetworkManager::ApplyUpdates(const GhostPool<GhostEntity>::Snapshot &pool) {
+	size_t n = this->inbound.Drain([&](const GhostUpdate &update) {
+		auto ghost = pool.Get(update.id);
+		if (ghost) ghost->SetData(update.data, update.sentAt, update.received);
+	});
+	this->statUpdatesApplied += n;
+}
+
 void NetworkManager::SendPlayerData() {
-	sf::Packet packet;
-	packet << HEADER::UPDATE << this->ID;
+	DataGhost data = {{0, 0, 0}, {0, 0, 0}, 0, false};
 	auto player = client->GetPlayer(GET_SLOT() + 1);
 	if (player) {
 		bool grounded = *(unsigned int *)((uintptr_t)player + Offsets::C_m_hGroundEntity) != 0xFFFFFFFF;
-		packet << DataGhost{client->GetAbsOrigin(player), engine->GetAngles(GET_SLOT()), client->GetViewOffset(player).z, grounded};
+		data = DataGhost{client->GetAbsOrigin(player), engine->GetAngles(GET_SLOT()), client->GetViewOffset(player).z, grounded};
+	}
+
+	sf::Packet packet;
+
+	// Deltas are only worth it over UDP, where updates can go missing and
+	// get acknowledged; over TCP, every update gets there anyway
+	if (this->protocol >= GhostNet::PROTOCOL_DELTA && !ghost_TCP_only.GetBool()) {
+		GhostNet::Snapshot snap;
+		auto sentAt = std::chrono::duration_cast<std::chrono::milliseconds>(NOW_STEADY().time_since_epoch()).count();
+		snap.ghosts.push_back({this->ID, GhostNet::Quantise(data, (uint16_t)sentAt)});
+
+		std::vector<uint8_t> body;
+		this->updateStream.Encode(snap, body);
+		this->PublishStreamStats();
+
+		packet << HEADER::UPDATE_DELTA << this->ID;
+		packet.append(body.data(), body.size());
 	} else {
-		packet << DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false};
+		packet << HEADER::UPDATE << this->ID << data;
 	}
 
 	if (!ghost_TCP_only.GetBool()) {
-		this->udpSocket.send(packet, this->serverIP, this->serverPort);
+		this->SendUDP(packet);
 	} else {
-		this->tcpSocket.send(packet);
+		this->QueueTCP(packet);
 	}
 }
 
@@ -518,7 +804,7 @@ void NetworkManager::NotifyMapChange() {
 	addToNetDump("send-map-change", engine->GetCurrentMapName().c_str());
 
 	packet << HEADER::MAP_CHANGE << this->ID << engine->GetCurrentMapName().c_str() << this->splitTicks << this->splitTicksTotal;
-	this->tcpSocket.send(packet);
+	this->QueueTCP(packet);
 }
 
 void NetworkManager::NotifySpeedrunFinished(const bool CM) {
@@ -542,14 +828,14 @@ void NetworkManager::NotifySpeedrunFinished(const bool CM) {
 
 	packet << time.c_str();
 
-	this->tcpSocket.send(packet);
+	this->QueueTCP(packet);
 }
 
 void NetworkManager::SendMessageToAll(std::string msg) {
 	addToNetDump("send-message", msg.c_str());
 	sf::Packet packet;
 	packet << HEADER::MESSAGE << this->ID << msg.c_str();
-	this->tcpSocket.send(packet);
+	this->QueueTCP(packet);
 	client->NameChat(GhostEntity::set_color, this->name.c_str(), {255,255,255}, msg.c_str());
 }
 
@@ -557,8 +843,7 @@ void NetworkManager::SendPing() {
 	addToNetDump("send-ping", nullptr);
 	sf::Packet packet;
 	packet << HEADER::PING << this->ID;
-	this->tcpSocket.send(packet);
-	this->pingClock.restart();
+	this->QueueTCP(packet, true);
 }
 
 void NetworkManager::ReceiveUDPUpdates(std::vector<sf::Packet> &buffer) {
@@ -575,6 +860,7 @@ void NetworkManager::ReceiveUDPUpdates(std::vector<sf::Packet> &buffer) {
 }
 
 void NetworkManager::Treat(sf::Packet &packet, bool udp) {
+	auto received = NOW_STEADY();
 	HEADER header;
 	sf::Uint32 ID;
 	packet >> header >> ID;
@@ -603,9 +889,7 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 
 		addToNetDump("recv-connect", Utils::ssprintf("%d;%s;%s", ID, name.c_str(), current_map.c_str()).c_str());
 
-		this->ghostPoolLock.lock();
-		this->ghostPool.push_back(ghost);
-		this->ghostPoolLock.unlock();
+		this->ghostPool.Add(ghost);
 
 		Scheduler::OnMainThread([=]() {
 			if (!strcmp("", current_map.c_str())) {
@@ -624,23 +908,14 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 	}
 	case HEADER::DISCONNECT: {
 		addToNetDump("recv-disconnect", Utils::ssprintf("%d", ID).c_str());
-		this->ghostPoolLock.lock();
-		int toErase = -1;
-		for (int i = 0; i < this->ghostPool.size(); ++i) {
-			if (this->ghostPool[i]->ID == ID) {
-				auto ghost = this->ghostPool[i];
-				Scheduler::OnMainThread([=]() {
-					toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("%s has disconnected!", ghost->name.c_str()));
-					ghost->DeleteGhost();
-				});
-				this->ghostPool[i]->isDestroyed = true;
-				toErase = i;
-				break;
-			}
+		auto ghost = this->ghostPool.Remove(ID);
+		if (ghost) {
+			Scheduler::OnMainThread([=]() {
+				ghost->isDestroyed = true;
+				toastHud.AddToast(GHOST_TOAST_TAG, Utils::ssprintf("%s has disconnected!", ghost->name.c_str()));
+				ghost->DeleteGhost();
+			});
 		}
-		if (toErase != -1)
-			this->ghostPool.erase(this->ghostPool.begin() + toErase);
-		this->ghostPoolLock.unlock();
 
 		Scheduler::OnMainThread([=]() {
 			if (ghost_sync.GetBool()) {
@@ -666,7 +941,7 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 
 			Scheduler::OnMainThread([=]() {
 				if (ghost->isDestroyed)
-					return;  // FIXME: this probably works in practice, but it isn't entirely thread-safe
+					return;
 
 				this->UpdateGhostsSameMap();
 				if (ghost_show_advancement.GetInt() >= 3) {
@@ -705,10 +980,10 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 		response << HEADER::HEART_BEAT << this->ID << token;
 		if (udp) {
 			addToNetDump("send-heartbeat", Utils::ssprintf("UDP;%X", token).c_str());
-			this->udpSocket.send(response, this->serverIP, this->serverPort);
+			this->SendUDP(response);
 		} else {
 			addToNetDump("send-heartbeat", Utils::ssprintf("TCP;%X", token).c_str());
-			this->tcpSocket.send(response);
+			this->QueueTCP(response);
 		}
 		break;
 	}
@@ -747,7 +1022,7 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 			sf::Packet confirm_packet;
 			confirm_packet << HEADER::COUNTDOWN << this->ID << sf::Uint8(1);
 			addToNetDump("send-countdown", "1");
-			this->tcpSocket.send(confirm_packet);
+			this->QueueTCP(confirm_packet);
 		} else if (step == 1) {  //Exec
 			this->StartCountdown();
 		}
@@ -776,7 +1051,7 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 			ghost->modelName = modelName;
 			Scheduler::OnMainThread([=]() {
 				if (ghost->isDestroyed)
-					return;  // FIXME: this probably works in practice, but it isn't entirely thread-safe
+					return;
 				if (ghost->sameMap && engine->isRunning()) {
 					ghost->DeleteGhost();
 					ghost->Spawn();
@@ -804,10 +1079,26 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 				packet >> ghost_id >> data;
 
 				if (ghost_id == this->ID) continue;
-				auto ghost = this->GetGhostByID(ghost_id);
-				if (!ghost) continue;
+				this->inbound.Push({ghost_id, data, {}, received});
+			}
+		}
+		break;
+	}
+	case HEADER::UPDATE_DELTA: {
+		if (ID == 0) {
+			// SFML can't tell us where it's read up to, but it's always just
+			// past the header and ID
+			size_t offset = sizeof(sf::Uint8) + sizeof(sf::Uint32);
+			if (packet.getDataSize() < offset) break;
 
-				ghost->SetData(data, true);
+			GhostNet::Snapshot snap;
+			bool ok = this->updateStream.Decode((const uint8_t *)packet.getData() + offset, packet.getDataSize() - offset, &snap);
+			this->PublishStreamStats();
+			if (!ok) break;
+
+			for (auto &[ghost_id, state] : snap.ghosts) {
+				if (ghost_id == this->ID) continue;
+				this->inbound.Push({ghost_id, GhostNet::Dequantise(state), state.time, received});
 			}
 		}
 		break;
@@ -818,39 +1109,31 @@ void NetworkManager::Treat(sf::Packet &packet, bool udp) {
 }
 
 void NetworkManager::UpdateGhostsPosition() {
-	this->ghostPoolLock.lock();
-	for (auto ghost : this->ghostPool) {
+	auto pool = this->ghostPool.Load();
+	this->ApplyUpdates(*pool);
+	float delay = ghost_net_interp_delay.GetFloat() / 1000.0f;
+	float extrapolate = ghost_net_extrapolate.GetFloat() / 1000.0f;
+	for (auto &ghost : *pool) {
 		if (ghost->sameMap) {
-			auto time = std::chrono::duration_cast<std::chrono::milliseconds>(NOW_STEADY() - ghost->lastUpdate).count();
-			ghost->Lerp(((float)time / (ghost->loopTime)));
+			ghost->Interpolate(delay, extrapolate);
 		}
 	}
-	this->ghostPoolLock.unlock();
 }
 
 std::shared_ptr<GhostEntity> NetworkManager::GetGhostByID(sf::Uint32 ID) {
-	this->ghostPoolLock.lock();
-	for (auto ghost : this->ghostPool) {
-		if (ghost->ID == ID) {
-			this->ghostPoolLock.unlock();
-			return ghost;
-		}
-	}
-	this->ghostPoolLock.unlock();
-	return nullptr;
+	return this->ghostPool.Get(ID);
 }
 
 void NetworkManager::UpdateGhostsSameMap() {
 	int mapIdx = engine->GetMapIndex(engine->GetCurrentMapName());
-	this->ghostPoolLock.lock();
-	for (auto ghost : this->ghostPool) {
+	auto pool = this->ghostPool.Load();
+	for (auto &ghost : *pool) {
 		ghost->sameMap = strcmp(ghost->currentMap.c_str(), "") && ghost->currentMap == engine->GetCurrentMapName();
 		if (mapIdx == -1)
 			ghost->isAhead = false;  // Fallback - unknown map
 		else
 			ghost->isAhead = engine->GetMapIndex(ghost->currentMap) > mapIdx;
 	}
-	this->ghostPoolLock.unlock();
 }
 
 void NetworkManager::UpdateModel(const std::string modelName) {
@@ -859,7 +1142,7 @@ void NetworkManager::UpdateModel(const std::string modelName) {
 		sf::Packet packet;
 		addToNetDump("send-model-change", modelName.c_str());
 		packet << HEADER::MODEL_CHANGE << this->ID << this->modelName.c_str();
-		this->tcpSocket.send(packet);
+		this->QueueTCP(packet);
 	}
 }
 
@@ -869,15 +1152,15 @@ void NetworkManager::UpdateColor() {
 	addToNetDump("send-color-change", Utils::ssprintf("%02X%02X%02X", col.r(), col.g(), col.b()).c_str());
 	sf::Packet packet;
 	packet << HEADER::COLOR_CHANGE << this->ID << col;
-	this->tcpSocket.send(packet);
+	this->QueueTCP(packet);
 }
 
 bool NetworkManager::AreAllGhostsAheadOrSameMap() {
-	this->ghostPoolLock.lock();
 	syncUi.ready.clear();
 	syncUi.waiting.clear();
 	bool allReady = true;
-	for (auto ghost : this->ghostPool) {
+	auto pool = this->ghostPool.Load();
+	for (auto &ghost : *pool) {
 		if (!ghost->isAhead && !ghost->sameMap) {
 			syncUi.waiting.push_back(ghost->ID);
 			allReady = false;
@@ -885,27 +1168,24 @@ bool NetworkManager::AreAllGhostsAheadOrSameMap() {
 			syncUi.ready.push_back(ghost->ID);
 		}
 	}
-	this->ghostPoolLock.unlock();
 
 	return allReady;
 }
 
 void NetworkManager::SpawnAllGhosts() {
-	this->ghostPoolLock.lock();
-	for (auto ghost : this->ghostPool) {
+	auto pool = this->ghostPool.Load();
+	for (auto &ghost : *pool) {
 		if (ghost->sameMap) {
 			ghost->Spawn();
 		}
 	}
-	this->ghostPoolLock.unlock();
 }
 
 void NetworkManager::DeleteAllGhosts() {
-	this->ghostPoolLock.lock();
-	for (auto ghost : this->ghostPool) {
+	auto pool = this->ghostPool.Load();
+	for (auto &ghost : *pool) {
 		ghost->DeleteGhost();
 	}
-	this->ghostPoolLock.unlock();
 }
 
 void NetworkManager::SetupCountdown(std::string preCommands, std::string postCommands, sf::Uint32 duration) {
@@ -954,6 +1234,14 @@ ON_EVENT(RENDER) {
 	}
 }
 
+// Keep up with updates in menus and while loading too, so they don't pile
+// up in the queue
+ON_EVENT(FRAME) {
+	if (networkManager.isConnected) {
+		networkManager.ApplyUpdates();
+	}
+}
+
 ON_EVENT(PRE_TICK) {
 	if (networkManager.isConnected && engine->isRunning()) {
 		if (networkManager.isCountdownReady) {
@@ -1007,6 +1295,20 @@ CON_COMMAND(ghost_disconnect, "ghost_disconnect - disconnect\n") {
 	networkManager.Disconnect();
 }
 
+CON_COMMAND(ghost_net_replay,
+            "ghost_net_replay <file> [speed] - play back a capture made with ghost_net_capture as if connected to its server\n"
+            "speed defaults to 1; 0 plays it as fast as the ghosts can take it. ghost_disconnect stops it.\n") {
+	if (args.ArgC() != 2 && args.ArgC() != 3) {
+		return console->Print(ghost_net_replay.ThisPtr()->m_pszHelpString);
+	}
+
+	if (networkManager.isConnected) {
+		return console->Print("You must disconnect from your current ghost server before replaying a capture.\n");
+	}
+
+	networkManager.Replay(args[1], args.ArgC() == 3 ? std::max(0.0f, (float)std::atof(args[2])) : 1.0f);
+}
+
 CON_COMMAND(ghost_name, "ghost_name - change your online name\n") {
 	if (networkManager.isConnected) {
 		return console->Print("Cannot change name while connected to a server.\n");
@@ -1073,21 +1375,42 @@ CON_COMMAND(ghost_debug, "ghost_debug - output a fuckton of debug info about net
 		return console->Print("Not connected to a server\n");
 	}
 
-	console->Print("Connected to %s:%hu with name \"%s\" and id 0x%02X\n", networkManager.serverIP.toString().c_str(), networkManager.serverPort, networkManager.name.c_str(), networkManager.ID);
+	if (networkManager.isReplaying) {
+		console->Print("Replaying a capture as id 0x%02X\n", networkManager.ID);
+	} else {
+		console->Print("Connected to %s:%hu with name \"%s\" and id 0x%02X\n", networkManager.serverIP.toString().c_str(), networkManager.serverPort, networkManager.name.c_str(), networkManager.ID);
+	}
+
+	if (networkManager.protocol >= GhostNet::PROTOCOL_DELTA) {
+		auto stats = networkManager.GetStreamStats();
+		console->Print("Using the delta protocol (version %d):\n", networkManager.protocol);
+		console->Print("  sent %u updates (%u bytes, %u as deltas)\n", stats.sent, stats.sentBytes, stats.sentDeltas);
+		console->Print("  received %u updates (%u bytes); %u lost, %u out of order, %u undecodable\n", stats.received, stats.receivedBytes, stats.lost, stats.stale, stats.undecodable);
+	} else {
+		console->Print("Using the original protocol\n");
+	}
+
+	console->Print("Network thread: %u send ticks, %u TCP messages in %u writes; %u updates applied, %u dropped\n", networkManager.statSendTicks.load(), networkManager.statTcpMessages.load(), networkManager.statTcpWrites.load(), networkManager.statUpdatesApplied.load(), networkManager.inbound.Dropped());
+
+	if (g_capture.IsOpen()) {
+		auto stats = g_capture.GetStats();
+		console->Print("Capturing to ghost_net_capture.sarnet: %llu packets (%llu bytes), %llu dropped\n", (unsigned long long)stats.records, (unsigned long long)stats.bytes, (unsigned long long)stats.dropped);
+	}
 
 	console->Print("Current ghost pool:\n");
 
 	auto now = NOW_STEADY();
 
-	networkManager.ghostPoolLock.lock();
-	for (int i = 0; i < networkManager.ghostPool.size(); ++i) {
-		auto ghost = networkManager.ghostPool[i];
+	auto pool = networkManager.ghostPool.Load();
+	for (int i = 0; i < pool->Size(); ++i) {
+		auto &ghost = pool->ghosts[i];
 		uint32_t update_delta = std::chrono::duration_cast<std::chrono::milliseconds>(now - ghost->lastUpdate).count();
 		console->Print("  [0x%02X] 0x%02X: \"%s\" on \"%s\" (%s), last updated %dms ago", i, ghost->ID, ghost->name.c_str(), ghost->currentMap.c_str(), ghost->sameMap ? "same map" : ghost->isAhead ? "ahead" : "behind", update_delta);
+		auto stats = ghost->snapshots.GetStats();
+		console->Print(", %d buffered, delay %.0fms, jitter %.0fms, every %.0fms, %u received, %u late, %u dropped", (int)stats.depth, stats.delay * 1000, stats.jitter * 1000, stats.interval * 1000, stats.received, stats.late, stats.dropped);
 		if (ghost->isDestroyed) console->Print(" [DESTROYED]\n");
 		else console->Print("\n");
 	}
-	networkManager.ghostPoolLock.unlock();
 }
 
 CON_COMMAND(ghost_list, "ghost_list - list all players in the current ghost server\n") {
@@ -1095,11 +1418,9 @@ CON_COMMAND(ghost_list, "ghost_list - list all players in the current ghost serv
 		return console->Print("Not connected to a server\n");
 	}
 
-	networkManager.ghostPoolLock.lock();
-	console->Print("%d ghosts connected:\n", networkManager.ghostPool.size());
-	for (int i = 0; i < networkManager.ghostPool.size(); ++i) {
-		auto ghost = networkManager.ghostPool[i];
+	auto pool = networkManager.ghostPool.Load();
+	console->Print("%d ghosts connected:\n", (int)pool->Size());
+	for (auto &ghost : *pool) {
 		if (!ghost->isDestroyed) console->Print("  %s (%s)\n", ghost->name.c_str(), ghost->currentMap.size() == 0 ? "menu" : ghost->currentMap.c_str());
 	}
-	networkManager.ghostPoolLock.unlock();
 }
@@ -1,6 +1,10 @@
 #pragma once
 #include "Command.hpp"
+#include "Features/Demo/GhostCapture.hpp"
 #include "Features/Demo/GhostEntity.hpp"
+#include "Features/Demo/GhostNet.hpp"
+#include "Features/Demo/GhostPool.hpp"
+#include "Features/Demo/GhostUpdateQueue.hpp"
 #include "Features/Hud/Hud.hpp"
 #include "SFML/Network.hpp"
 #include "Utils/SDK.hpp"
@@ -11,25 +15,10 @@
 #include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
-enum class HEADER {
-	NONE,
-	PING,
-	CONNECT,
-	DISCONNECT,
-	STOP_SERVER,
-	MAP_CHANGE,
-	HEART_BEAT,
-	MESSAGE,
-	COUNTDOWN,
-	UPDATE,
-	SPEEDRUN_FINISH,
-	MODEL_CHANGE,
-	COLOR_CHANGE,
-};
-
 class NetworkManager {
 public:
 	sf::TcpSocket tcpSocket;
@@ -39,8 +28,7 @@ public:
 	unsigned short int serverPort;
 	sf::Uint32 ID;
 
-	std::mutex ghostPoolLock;
-	std::vector<std::shared_ptr<GhostEntity>> ghostPool;
+	GhostPool<GhostEntity> ghostPool;
 
 	std::thread networkThread;
 	std::condition_variable waitForRunning;
@@ -53,10 +41,37 @@ public:
 	int countdownStep;
 	bool countdownShow;
 
-	std::chrono::time_point<std::chrono::steady_clock> lastUpdateTime;
+	// Positions received on the network thread, for the game thread to
+	// apply
+	GhostUpdateQueue inbound;
+
+	// TCP messages from any thread, framed as SFML would, for the network
+	// thread to send together on its next send tick. pendingTcp is what the
+	// socket didn't take last time, and is only touched by the network
+	// thread.
+	std::mutex outboundLock;
+	std::vector<uint8_t> outboundTcp;
+	uint32_t outboundMessages = 0;
+	bool pingQueued = false;
+	std::vector<uint8_t> pendingTcp;
+
+	std::atomic<uint32_t> statSendTicks{0};
+	std::atomic<uint32_t> statTcpWrites{0};
+	std::atomic<uint32_t> statTcpMessages{0};
+	std::atomic<uint32_t> statUpdatesApplied{0};
+
+	// Agreed with the server on CONNECT; the stream is only used by the
+	// network thread, which copies its stats out for ghost_debug after
+	// each use
+	sf::Uint32 protocol = GhostNet::PROTOCOL_LEGACY;
+	GhostNet::Stream updateStream;
+	std::mutex streamStatsLock;
+	GhostNet::Stats streamStats;
 
 public:
 	std::atomic<bool> isConnected;
+	// Connected to a capture rather than a server: nothing gets sent
+	std::atomic<bool> isReplaying{false};
 	std::atomic<bool> runThread;
 	std::string name;
 	bool isCountdownReady;
@@ -71,11 +86,14 @@ public:
 	NetworkManager();
 
 	void Connect(sf::IpAddress ip, unsigned short int port);
+	sf::Uint32 AcceptConnection(sf::Packet &reply, sf::Uint32 offeredProtocol);
+	void Replay(const std::string &path, float speed);
 	void Disconnect();
 	void StopServer();
 	void PauseNetwork();
 	void ResumeNetwork();
 	void RunNetwork();
+	void ReplayNetwork(std::shared_ptr<GhostCapture::Capture> capture, float speed);
 
 	void SendPlayerData();
 	void NotifyMapChange();
@@ -83,8 +101,19 @@ public:
 	void SendMessageToAll(std::string msg);
 	void SendPing();
 	void ReceiveUDPUpdates(std::vector<sf::Packet> &buffer);
+	void ReceiveTCP();
 	void Treat(sf::Packet &packet, bool udp);
 
+	void WaitForNetworkThread();
+	void CloseConnection();
+	void SendUDP(sf::Packet &packet);
+	void QueueTCP(const sf::Packet &packet, bool ping = false);
+	bool FlushTCP();
+	void PublishStreamStats();
+	GhostNet::Stats GetStreamStats();
+	void ApplyUpdates();
+	void ApplyUpdates(const GhostPool<GhostEntity>::Snapshot &pool);
+
 	void UpdateGhostsPosition();
 	std::shared_ptr<GhostEntity> GetGhostByID(sf::Uint32 ID);
 	void UpdateGhostsSameMap();
@@ -108,6 +137,8 @@ extern NetworkManager networkManager;
 
 extern Variable ghost_TCP_only;
 extern Variable ghost_update_rate;
+extern Variable ghost_net_delta;
+extern Variable ghost_net_capture;
 extern Command ghost_connect;
 extern Command ghost_disconnect;
 extern Command ghost_message;
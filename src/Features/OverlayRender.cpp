@@ -8,8 +8,12 @@
 #include "Features/Session.hpp"
 #include "Features/Timer/PauseTimer.hpp"
 
+#include <algorithm>
 #include <map>
 
+// Per mesh from addTriangles; a dynamic mesh can't go past 32767 verts
+#define MAX_BATCH_VERTS 6144
+
 // The address of this variable is used as a placeholder to be detected
 // by createMeshInternal and friends. We use g_group_idx to keep track
 // of which mesh (overlay group) we're actually rendering.
@@ -57,13 +61,18 @@ static size_t g_group_idx;
 
 static std::optional<Vector> g_shade_color;
 
-static size_t g_last_group = SIZE_MAX;
-static std::vector<Vector> &getGroupVertVector(Color col, bool wireframe, bool line, bool noz = false) {
+static Color applyShading(Color col) {
 	if (g_shade_color) {
 		col._color[0] *= g_shade_color->x;
 		col._color[1] *= g_shade_color->y;
 		col._color[2] *= g_shade_color->z;
 	}
+	return col;
+}
+
+static size_t g_last_group = SIZE_MAX;
+static std::vector<Vector> &getGroupVertVector(Color col, bool wireframe, bool line, bool noz = false) {
+	col = applyShading(col);
 	static Color last_col;
 	static bool last_wireframe;
 	static bool last_line;
@@ -134,7 +143,7 @@ ON_EVENT(FRAME) {
 	g_last_group = SIZE_MAX;
 }
 
-void OverlayRender::startShading(Vector point) {
+Vector OverlayRender::getShade(Vector point) {
 #ifdef _WIN32
 	// MSVC bug workaround - COM interfaces apparently don't quite follow
 	// the behaviour implemented by '__thiscall' in some cases, and
@@ -166,7 +175,11 @@ void OverlayRender::startShading(Vector point) {
 	if (light.y < 0.2f) light.y = 0.2f;
 	if (light.z < 0.2f) light.z = 0.2f;
 
-	g_shade_color = light;
+	return light;
+}
+
+void OverlayRender::startShading(Vector point) {
+	g_shade_color = getShade(point);
 }
 
 void OverlayRender::endShading() {
@@ -179,6 +192,35 @@ void OverlayRender::addTriangle(Vector a, Vector b, Vector c, Color col, bool cu
 	if (!cullBack) vs.insert(vs.end(), { a, c, b });
 }
 
+// Triangles are taken as they are, so give both windings for them to be
+// seen from both sides. Rather than a mesh per thousand verts, these go
+// into as few meshes as possible.
+void OverlayRender::addTriangles(const Vector *verts, size_t count, Color col) {
+	col = applyShading(col);
+	count -= count % 3;
+
+	while (count > 0) {
+		size_t n = std::min(count, (size_t)MAX_BATCH_VERTS);
+
+		OverlayGroup *group = nullptr;
+		for (auto &g : g_groups) {
+			if (g.col == col && !g.wireframe && !g.noz && !g.line && g.verts.size() + n <= MAX_BATCH_VERTS) {
+				group = &g;
+				break;
+			}
+		}
+		if (!group) {
+			g_groups.push_back({col, false, false, false, {}, true});
+			group = &g_groups.back();
+		}
+
+		group->was_used = true;
+		group->verts.insert(group->verts.end(), verts, verts + n);
+		verts += n;
+		count -= n;
+	}
+}
+
 void OverlayRender::addQuad(Vector a, Vector b, Vector c, Vector d, Color col, bool cullBack) {
 	OverlayRender::addTriangle(a, b, c, col, cullBack);
 	OverlayRender::addTriangle(a, c, d, col, cullBack);
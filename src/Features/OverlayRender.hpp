@@ -11,10 +11,14 @@ namespace OverlayRender {
 	bool destroyMeshInternal(Vector *verts, size_t nverts);
 	void drawMeshes();
 
+	// How much light there is at the point, as a multiplier for each
+	// colour channel
+	Vector getShade(Vector point);
 	void startShading(Vector point);
 	void endShading();
 
 	void addTriangle(Vector a, Vector b, Vector c, Color col, bool cullBack = false);
+	void addTriangles(const Vector *verts, size_t count, Color col);
 	void addQuad(Vector a, Vector b, Vector c, Vector d, Color col, bool cullBack = false);
 	void addLine(Vector a, Vector b, Color col, bool throughWalls = false);
 	void addBox(Vector origin, Vector mins, Vector maxs, QAngle ang, Color col, bool wireframe = true, bool wireframeThroughWalls = false);
@@ -0,0 +1,205 @@
+#include "RenderAudio.hpp"
+
+#include "Utils/Cpu.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+
+// Conversion {{{
+
+static inline int16_t clip16(int x) {
+	if (x < -32768) return -32768;  // Source uses -32767, but that's, like, not how two's complement works
+	if (x > 32767) return 32767;
+	return x;
+}
+
+void RenderAudio::PaintToS16Scalar(int16_t *const *out, const int *paint, size_t frames, int channels, int vol) {
+	for (size_t i = 0; i < frames; ++i) {
+		for (int c = 0; c < channels; ++c) {
+			out[c][i] = clip16((paint[i * channels + c] * vol) >> 8);
+		}
+	}
+}
+
+// }}}
+
+// SIMD kernels {{{
+
+// Only stereo is vectorised, since that's the only speaker configuration
+// renders allow. Both kernels scale four or eight L/R pairs at a time,
+// split them into left and right halves, and let packs_epi32 do the
+// saturation.
+
+CPU_TARGET_SSE41 static inline void scaleSplitSSE41(const int *paint, __m128i vol, __m128i &l, __m128i &r) {
+	__m128i a = _mm_loadu_si128((const __m128i *)paint);
+	__m128i b = _mm_loadu_si128((const __m128i *)(paint + 4));
+	a = _mm_srai_epi32(_mm_mullo_epi32(a, vol), 8);
+	b = _mm_srai_epi32(_mm_mullo_epi32(b, vol), 8);
+	// l0 r0 l1 r1 -> l0 l1 r0 r1
+	a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+	l = _mm_unpacklo_epi64(a, b);
+	r = _mm_unpackhi_epi64(a, b);
+}
+
+CPU_TARGET_SSE41 static void paintStereoSSE41(int16_t *const *out, const int *paint, size_t frames, int vol) {
+	const __m128i v = _mm_set1_epi32(vol);
+	size_t i = 0;
+	for (; i + 8 <= frames; i += 8) {
+		__m128i l0, r0, l1, r1;
+		scaleSplitSSE41(paint + 2 * i, v, l0, r0);
+		scaleSplitSSE41(paint + 2 * i + 8, v, l1, r1);
+		_mm_storeu_si128((__m128i *)(out[0] + i), _mm_packs_epi32(l0, l1));
+		_mm_storeu_si128((__m128i *)(out[1] + i), _mm_packs_epi32(r0, r1));
+	}
+	int16_t *rest[2] = {out[0] + i, out[1] + i};
+	RenderAudio::PaintToS16Scalar(rest, paint + 2 * i, frames - i, 2, vol);
+}
+
+CPU_TARGET_AVX2 static inline void scaleSplitAVX2(const int *paint, __m256i vol, __m256i &l, __m256i &r) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)paint);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(paint + 8));
+	a = _mm256_srai_epi32(_mm256_mullo_epi32(a, vol), 8);
+	b = _mm256_srai_epi32(_mm256_mullo_epi32(b, vol), 8);
+	a = _mm256_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm256_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+	// Everything so far has been within 128-bit lanes, so this leaves
+	// frames 0 1 4 5 | 2 3 6 7
+	l = _mm256_unpacklo_epi64(a, b);
+	r = _mm256_unpackhi_epi64(a, b);
+}
+
+CPU_TARGET_AVX2 static void paintStereoAVX2(int16_t *const *out, const int *paint, size_t frames, int vol) {
+	const __m256i v = _mm256_set1_epi32(vol);
+	// After packing, the 32-bit units hold frames 01 45 89 CD | 23 67 AB EF
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i = 0;
+	for (; i + 16 <= frames; i += 16) {
+		__m256i l0, r0, l1, r1;
+		scaleSplitAVX2(paint + 2 * i, v, l0, r0);
+		scaleSplitAVX2(paint + 2 * i + 16, v, l1, r1);
+		__m256i l = _mm256_permutevar8x32_epi32(_mm256_packs_epi32(l0, l1), order);
+		__m256i r = _mm256_permutevar8x32_epi32(_mm256_packs_epi32(r0, r1), order);
+		_mm256_storeu_si256((__m256i *)(out[0] + i), l);
+		_mm256_storeu_si256((__m256i *)(out[1] + i), r);
+	}
+	int16_t *rest[2] = {out[0] + i, out[1] + i};
+	paintStereoSSE41(rest, paint + 2 * i, frames - i, vol);
+}
+
+// }}}
+
+// Dispatch {{{
+
+namespace {
+	struct Kernels {
+		void (*stereo)(int16_t *const *, const int *, size_t, int);
+		const char *name;
+	};
+
+	void paintStereoScalar(int16_t *const *out, const int *paint, size_t frames, int vol) {
+		RenderAudio::PaintToS16Scalar(out, paint, frames, 2, vol);
+	}
+
+	const Kernels &kernels() {
+		static Kernels k = []() -> Kernels {
+			if (Cpu::HasAVX2()) return {&paintStereoAVX2, "avx2"};
+			if (Cpu::HasSSE41()) return {&paintStereoSSE41, "sse4.1"};
+			return {&paintStereoScalar, "scalar"};
+		}();
+		return k;
+	}
+}  // namespace
+
+void RenderAudio::PaintToS16(int16_t *const *out, const int *paint, size_t frames, int channels, int vol) {
+	if (channels == 2) {
+		kernels().stereo(out, paint, frames, vol);
+	} else {
+		PaintToS16Scalar(out, paint, frames, channels, vol);
+	}
+}
+
+const char *RenderAudio::KernelName() {
+	return kernels().name;
+}
+
+// }}}
+
+// Ring {{{
+
+bool RenderAudio::Ring::Init(int channels, size_t minCapacity) {
+	if (channels < 1 || channels > MAX_CHANNELS) return false;
+
+	size_t capacity = 1;
+	while (capacity < minCapacity) capacity <<= 1;
+
+	this->channels = channels;
+	this->capacity = capacity;
+	for (int c = 0; c < channels; ++c) {
+		this->buf[c] = (int16_t *)malloc(capacity * sizeof this->buf[c][0]);
+		if (!this->buf[c]) {
+			this->Free();
+			return false;
+		}
+	}
+
+	this->head.store(0);
+	this->tail.store(0);
+
+	return true;
+}
+
+void RenderAudio::Ring::Free() {
+	for (int c = 0; c < MAX_CHANNELS; ++c) {
+		free(this->buf[c]);
+		this->buf[c] = nullptr;
+	}
+	this->channels = 0;
+	this->capacity = 0;
+}
+
+size_t RenderAudio::Ring::Write(const int *paint, size_t frames, int vol) {
+	uint32_t head = this->head.load(std::memory_order_relaxed);
+	uint32_t tail = this->tail.load(std::memory_order_acquire);
+
+	frames = std::min(frames, this->capacity - (head - tail));
+
+	// Write up to the end of the buffers, then wrap around to the start
+	size_t idx = head & (this->capacity - 1);
+	size_t first = std::min(frames, this->capacity - idx);
+
+	int16_t *out[MAX_CHANNELS];
+	for (int c = 0; c < this->channels; ++c) out[c] = this->buf[c] + idx;
+	PaintToS16(out, paint, first, this->channels, vol);
+
+	if (first < frames) {
+		for (int c = 0; c < this->channels; ++c) out[c] = this->buf[c];
+		PaintToS16(out, paint + first * this->channels, frames - first, this->channels, vol);
+	}
+
+	this->head.store(head + frames, std::memory_order_release);
+
+	return frames;
+}
+
+size_t RenderAudio::Ring::Available() const {
+	return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_relaxed);
+}
+
+void RenderAudio::Ring::Read(int16_t *const *out, size_t frames) {
+	uint32_t tail = this->tail.load(std::memory_order_relaxed);
+
+	size_t idx = tail & (this->capacity - 1);
+	size_t first = std::min(frames, this->capacity - idx);
+
+	for (int c = 0; c < this->channels; ++c) {
+		memcpy(out[c], this->buf[c] + idx, first * sizeof out[c][0]);
+		memcpy(out[c] + first, this->buf[c], (frames - first) * sizeof out[c][0]);
+	}
+
+	this->tail.store(tail + frames, std::memory_order_release);
+}
+
+// }}}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Audio capture for renders. The sound mixer's paint buffer holds
+// interleaved 32-bit samples which are scaled by the volume and
+// saturated to 16 bits on the way out; we store them planar, as the
+// encoder wants them, in a single-producer single-consumer ring which
+// the mixer thread writes and the render worker reads whole encoder
+// frames out of.
+namespace RenderAudio {
+	constexpr int MAX_CHANNELS = 8;
+
+	// out[c][i] = clamp((paint[i * channels + c] * vol) >> 8, -32768, 32767)
+	void PaintToS16(int16_t *const *out, const int *paint, size_t frames, int channels, int vol);
+	// Reference implementation; the SIMD kernels must produce exactly
+	// the same output as this
+	void PaintToS16Scalar(int16_t *const *out, const int *paint, size_t frames, int channels, int vol);
+
+	const char *KernelName();
+
+	// head and tail count frames and only ever increase; the position in
+	// the buffers is the counter modulo the capacity. The producer is the
+	// only writer of head and the consumer the only writer of tail.
+	class Ring {
+	public:
+		bool Init(int channels, size_t minCapacity);
+		void Free();
+
+		// Producer side. Returns how many frames were written, which is
+		// less than 'frames' if the ring filled up.
+		size_t Write(const int *paint, size_t frames, int vol);
+
+		// Consumer side. 'frames' must not be more than Available().
+		size_t Available() const;
+		void Read(int16_t *const *out, size_t frames);
+
+		size_t Capacity() const { return this->capacity; }
+
+	private:
+		int channels = 0;
+		size_t capacity = 0;  // Always a power of two
+		int16_t *buf[MAX_CHANNELS] = {};
+		std::atomic<uint32_t> head{0};
+		std::atomic<uint32_t> tail{0};
+	};
+}  // namespace RenderAudio
@@ -0,0 +1,258 @@
+#include "RenderBlend.hpp"
+
+#include "Utils/Cpu.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+
+// Profiles {{{
+
+bool RenderBlend::ProfileFromName(const char *name, Profile &out) {
+	if (!strcmp(name, "box")) {
+		out = Profile::BOX;
+	} else if (!strcmp(name, "triangle")) {
+		out = Profile::TRIANGLE;
+	} else if (!strcmp(name, "gaussian")) {
+		out = Profile::GAUSSIAN;
+	} else if (!strcmp(name, "custom")) {
+		out = Profile::CUSTOM;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+const char *RenderBlend::ProfileName(Profile profile) {
+	switch (profile) {
+	case Profile::BOX: return "box";
+	case Profile::TRIANGLE: return "triangle";
+	case Profile::GAUSSIAN: return "gaussian";
+	case Profile::CUSTOM: return "custom";
+	}
+	return "unknown";
+}
+
+std::vector<float> RenderBlend::ParseCustomWeights(const char *str) {
+	std::vector<float> weights;
+	while (*str) {
+		char *end;
+		float w = strtof(str, &end);
+		if (end == str) {
+			++str;
+			continue;
+		}
+		weights.push_back(w < 0 ? 0 : w);
+		str = end;
+	}
+	return weights;
+}
+
+// Samples the profile at x in [0, 1] across the shutter
+static float sampleProfile(RenderBlend::Profile profile, float x, const std::vector<float> &custom) {
+	switch (profile) {
+	case RenderBlend::Profile::BOX:
+		return 1.0f;
+	case RenderBlend::Profile::TRIANGLE:
+		return 1.0f - fabsf(2.0f * x - 1.0f);
+	case RenderBlend::Profile::GAUSSIAN: {
+		// sigma of 1/6 of the shutter, so the shutter covers +-3 sigma
+		float d = (x - 0.5f) * 6.0f;
+		return expf(-0.5f * d * d);
+	}
+	case RenderBlend::Profile::CUSTOM: {
+		if (custom.empty()) return 1.0f;
+		if (custom.size() == 1) return custom[0];
+		float pos = x * (custom.size() - 1);
+		size_t i = (size_t)pos;
+		if (i >= custom.size() - 1) return custom.back();
+		float t = pos - i;
+		return custom[i] * (1 - t) + custom[i + 1] * t;
+	}
+	}
+	return 1.0f;
+}
+
+std::vector<uint16_t> RenderBlend::ComputeWeights(Profile profile, int frames, int start, int end, const std::vector<float> &custom) {
+	std::vector<uint16_t> weights(frames, 0);
+	int n = end - start;
+	if (n <= 0) return weights;
+
+	if (profile == Profile::BOX) {
+		// Unit weights, so the result is the plain average like it always
+		// has been
+		for (int i = start; i < end; ++i) weights[i] = 1;
+		return weights;
+	}
+
+	std::vector<float> f(n);
+	float total = 0;
+	for (int i = 0; i < n; ++i) {
+		f[i] = sampleProfile(profile, (i + 0.5f) / n, custom);
+		total += f[i];
+	}
+
+	if (total <= 0) {
+		// Degenerate profile; fall back to a box
+		for (int i = start; i < end; ++i) weights[i] = 1;
+		return weights;
+	}
+
+	// Quantize to a fixed-point total of 256
+	uint32_t sum = 0;
+	for (int i = 0; i < n; ++i) {
+		weights[start + i] = (uint16_t)lroundf(256.0f * f[i] / total);
+		sum += weights[start + i];
+	}
+
+	// Rounding may push us over the accumulator limit; take the excess
+	// off the heaviest subframes
+	while (sum > MAX_WEIGHT_SUM) {
+		int heaviest = start;
+		for (int i = start; i < end; ++i) {
+			if (weights[i] > weights[heaviest]) heaviest = i;
+		}
+		--weights[heaviest];
+		--sum;
+	}
+
+	// Very long blends can quantize every weight to 0; keep at least the
+	// center subframe
+	if (sum == 0) weights[start + n / 2] = 1;
+
+	return weights;
+}
+
+// }}}
+
+// Scalar kernels {{{
+
+void RenderBlend::AccumulateScalar(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight) {
+	for (size_t i = 0; i < size; ++i) {
+		acc[i] += weight * src[i];
+	}
+}
+
+void RenderBlend::ResolveScalar(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor) {
+	for (size_t i = 0; i < size; ++i) {
+		dst[i] = acc[i] / divisor;
+		acc[i] = 0;
+	}
+}
+
+// }}}
+
+// SIMD kernels {{{
+
+// The resolve kernels divide in single precision as (acc + 0.5) * (1 /
+// divisor), truncated. Since acc < 2^16, the total rounding error is far
+// smaller than the 0.5 / divisor margin the offset gives us, so this is
+// exactly equal to the integer division.
+
+CPU_TARGET_SSE2 static void accumulateSSE2(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16(weight);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), w);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), w);
+		__m128i *a = (__m128i *)(acc + i);
+		_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), lo));
+		_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), hi));
+	}
+	RenderBlend::AccumulateScalar(acc + i, src + i, size - i, weight);
+}
+
+CPU_TARGET_SSE2 static inline __m128i resolve8SSE2(__m128i v, __m128 half, __m128 inv) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+	__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+	__m128i qlo = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(lo, half), inv));
+	__m128i qhi = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(hi, half), inv));
+	return _mm_packs_epi32(qlo, qhi);
+}
+
+CPU_TARGET_SSE2 static void resolveSSE2(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 inv = _mm_set1_ps(1.0f / divisor);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i *a = (__m128i *)(acc + i);
+		__m128i q0 = resolve8SSE2(_mm_loadu_si128(a), half, inv);
+		__m128i q1 = resolve8SSE2(_mm_loadu_si128(a + 1), half, inv);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(q0, q1));
+		_mm_storeu_si128(a, zero);
+		_mm_storeu_si128(a + 1, zero);
+	}
+	RenderBlend::ResolveScalar(dst + i, acc + i, size - i, divisor);
+}
+
+CPU_TARGET_AVX2 static void accumulateAVX2(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight) {
+	const __m256i w = _mm256_set1_epi16(weight);
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		__m128i px0 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i px1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m256i lo = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(px0), w);
+		__m256i hi = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(px1), w);
+		__m256i *a = (__m256i *)(acc + i);
+		_mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), lo));
+		_mm256_storeu_si256(a + 1, _mm256_add_epi16(_mm256_loadu_si256(a + 1), hi));
+	}
+	accumulateSSE2(acc + i, src + i, size - i, weight);
+}
+
+CPU_TARGET_AVX2 static void resolveAVX2(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 inv = _mm256_set1_ps(1.0f / divisor);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m256i *a = (__m256i *)(acc + i);
+		__m256i v = _mm256_loadu_si256(a);
+		__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+		__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+		__m256i qlo = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(lo, half), inv));
+		__m256i qhi = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(hi, half), inv));
+		// packus works per 128-bit lane, so fix up the order afterwards
+		__m256i q = _mm256_permute4x64_epi64(_mm256_packus_epi32(qlo, qhi), 0xD8);
+		__m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+		_mm_storeu_si128((__m128i *)(dst + i), bytes);
+		_mm256_storeu_si256(a, zero);
+	}
+	resolveSSE2(dst + i, acc + i, size - i, divisor);
+}
+
+// }}}
+
+// Dispatch {{{
+
+std::vector<RenderBlend::Kernel> RenderBlend::AvailableKernels() {
+	std::vector<Kernel> out;
+	if (Cpu::HasAVX2()) out.push_back({"avx2", &accumulateAVX2, &resolveAVX2});
+	if (Cpu::HasSSE2()) out.push_back({"sse2", &accumulateSSE2, &resolveSSE2});
+	out.push_back({"scalar", &AccumulateScalar, &ResolveScalar});
+	return out;
+}
+
+static const RenderBlend::Kernel &kernels() {
+	static RenderBlend::Kernel k = RenderBlend::AvailableKernels()[0];
+	return k;
+}
+
+void RenderBlend::Accumulate(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight) {
+	kernels().accumulate(acc, src, size, weight);
+}
+
+void RenderBlend::Resolve(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor) {
+	kernels().resolve(dst, acc, size, divisor);
+}
+
+const char *RenderBlend::KernelName() {
+	return kernels().name;
+}
+
+// }}}
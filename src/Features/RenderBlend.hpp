@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Frame blending for renders. Blended frames are accumulated into a
+// uint16 buffer as a weighted sum of the input frames, then resolved by
+// dividing by the total weight. Weights are small integers, so the sum
+// of the weights for a blend must not exceed MAX_WEIGHT_SUM or the
+// accumulator could overflow.
+namespace RenderBlend {
+	enum class Profile {
+		BOX,
+		TRIANGLE,
+		GAUSSIAN,
+		CUSTOM,
+	};
+
+	constexpr uint32_t MAX_WEIGHT_SUM = 65535 / 255;
+
+	bool ProfileFromName(const char *name, Profile &out);
+	const char *ProfileName(Profile profile);
+
+	// Computes the weight of each of 'frames' subframes. Only subframes in
+	// [start, end) are inside the shutter; the others get weight 0. For
+	// the custom profile, 'custom' is a list of relative weights which is
+	// stretched over the shutter.
+	std::vector<uint16_t> ComputeWeights(Profile profile, int frames, int start, int end, const std::vector<float> &custom);
+	std::vector<float> ParseCustomWeights(const char *str);
+
+	// acc[i] += weight * src[i]
+	void Accumulate(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight);
+	// dst[i] = acc[i] / divisor, then acc[i] = 0
+	void Resolve(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor);
+
+	// Reference implementations; the SIMD kernels must produce exactly
+	// the same output as these
+	void AccumulateScalar(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight);
+	void ResolveScalar(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor);
+
+	const char *KernelName();
+
+	struct Kernel {
+		const char *name;
+		void (*accumulate)(uint16_t *acc, const uint8_t *src, size_t size, uint16_t weight);
+		void (*resolve)(uint8_t *dst, uint16_t *acc, size_t size, uint32_t divisor);
+	};
+
+	// Every kernel this CPU can run, fastest first; the first is the one
+	// Accumulate and Resolve use
+	std::vector<Kernel> AvailableKernels();
+}  // namespace RenderBlend
@@ -0,0 +1,163 @@
+#include "RenderConvert.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+FrameConverter::~FrameConverter() {
+	this->Shutdown();
+}
+
+bool FrameConverter::Init(int width, int height, AVPixelFormat dstFmt, int swsFlags, int threads) {
+	this->Shutdown();
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(dstFmt);
+	if (!desc) return false;
+	this->width = width;
+	this->dstFmt = dstFmt;
+	this->chromaShift = desc->log2_chroma_h;
+
+	// Slice boundaries have to land on chroma rows, and there's no point
+	// in slices so thin the threading overhead dominates
+	int align = 1 << this->chromaShift;
+	int maxSlices = std::max(1, height / std::max(align, 64));
+	int count = std::max(1, std::min(threads, maxSlices));
+	int sliceHeight = (height / count) & ~(align - 1);
+
+	for (int i = 0; i < count; ++i) {
+		Slice slice = {};
+		slice.y = i * sliceHeight;
+		slice.height = i == count - 1 ? height - slice.y : sliceHeight;
+
+		// Keep the overlap aligned, so the slice's chroma rows line up
+		// with the whole image's
+		slice.srcY = std::max(0, slice.y - SLICE_OVERLAP) & ~(SLICE_OVERLAP - 1);
+		slice.srcHeight = std::min(height, slice.y + slice.height + SLICE_OVERLAP) - slice.srcY;
+		if (count == 1) {
+			slice.srcY = 0;
+			slice.srcHeight = height;
+		}
+
+		slice.ctx = sws_getContext(width, slice.srcHeight, AV_PIX_FMT_BGR24, width, slice.srcHeight, dstFmt, swsFlags, NULL, NULL, NULL);
+		if (!slice.ctx) {
+			this->Shutdown();
+			return false;
+		}
+		if (slice.srcHeight != slice.height && av_image_alloc(slice.buf, slice.bufLinesize, width, slice.srcHeight, dstFmt, 32) < 0) {
+			sws_freeContext(slice.ctx);
+			this->Shutdown();
+			return false;
+		}
+		this->slices.push_back(slice);
+	}
+
+	this->quit = false;
+	this->generation = 0;
+	for (size_t i = 1; i < this->slices.size(); ++i) {
+		this->helpers.push_back(std::thread(&FrameConverter::HelperThread, this, i));
+	}
+
+	return true;
+}
+
+void FrameConverter::Shutdown() {
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->quit = true;
+	}
+	this->jobReady.notify_all();
+	for (auto &t : this->helpers) {
+		t.join();
+	}
+	this->helpers.clear();
+
+	for (auto &slice : this->slices) {
+		sws_freeContext(slice.ctx);
+		av_freep(&slice.buf[0]);
+	}
+	this->slices.clear();
+}
+
+void FrameConverter::ConvertSlice(const Slice &slice) {
+	const uint8_t *srcSlice[1] = {this->src + slice.srcY * this->srcStride};
+	int srcStride[1] = {this->srcStride};
+
+	if (!slice.buf[0]) {
+		// No overlap; convert straight into the frame
+		uint8_t *dstSlice[AV_NUM_DATA_POINTERS];
+		for (int p = 0; p < AV_NUM_DATA_POINTERS; ++p) {
+			if (!this->dst->data[p]) {
+				dstSlice[p] = NULL;
+				continue;
+			}
+			int y = p == 0 || p == 3 ? slice.y : slice.y >> this->chromaShift;
+			dstSlice[p] = this->dst->data[p] + y * this->dst->linesize[p];
+		}
+
+		sws_scale(slice.ctx, srcSlice, srcStride, 0, slice.srcHeight, dstSlice, this->dst->linesize);
+		return;
+	}
+
+	sws_scale(slice.ctx, srcSlice, srcStride, 0, slice.srcHeight, slice.buf, slice.bufLinesize);
+
+	for (int p = 0; p < 4 && slice.buf[p]; ++p) {
+		bool chroma = p == 1 || p == 2;
+		int shift = chroma ? this->chromaShift : 0;
+		int skip = (slice.y - slice.srcY) >> shift;
+		int rows = AV_CEIL_RSHIFT(slice.height, shift);
+		av_image_copy_plane(
+			this->dst->data[p] + (slice.y >> shift) * this->dst->linesize[p],
+			this->dst->linesize[p],
+			slice.buf[p] + skip * slice.bufLinesize[p],
+			slice.bufLinesize[p],
+			av_image_get_linesize(this->dstFmt, this->width, p),
+			rows);
+	}
+}
+
+void FrameConverter::HelperThread(size_t idx) {
+	uint32_t seen = 0;
+	std::unique_lock<std::mutex> guard(this->lock);
+	while (true) {
+		this->jobReady.wait(guard, [&]() { return this->quit || this->generation != seen; });
+		if (this->quit) return;
+		seen = this->generation;
+
+		guard.unlock();
+		this->ConvertSlice(this->slices[idx]);
+		guard.lock();
+
+		if (--this->remaining == 0) this->jobDone.notify_one();
+	}
+}
+
+void FrameConverter::Convert(const uint8_t *src, int srcStride, AVFrame *dst) {
+	if (this->slices.empty()) return;
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->src = src;
+		this->srcStride = srcStride;
+		this->dst = dst;
+		this->remaining = (int)this->helpers.size();
+		++this->generation;
+	}
+	this->jobReady.notify_all();
+
+	this->ConvertSlice(this->slices[0]);
+
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->jobDone.wait(guard, [&]() { return this->remaining == 0; });
+}
+
+int ScalerFlagsFromName(const char *name) {
+	if (!strcmp(name, "point")) return SWS_POINT;
+	if (!strcmp(name, "bilinear")) return SWS_BILINEAR;
+	if (!strcmp(name, "bicubic")) return SWS_BICUBIC;
+	return -1;
+}
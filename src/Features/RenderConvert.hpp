@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+// Converts packed BGR24 screen captures into the encoder's pixel format.
+// The image is split into horizontal slices, each with its own swscale
+// context; slice 0 is converted on the calling thread and the rest on a
+// set of helper threads, so a single conversion pass is spread over
+// several cores. Chroma is filtered vertically, so each slice converts
+// SLICE_OVERLAP extra rows either side into a buffer of its own and only
+// copies out its own rows, which come out the same as converting the
+// whole image in one go.
+class FrameConverter {
+public:
+	// Rows each slice converts past its edges; more than the reach of
+	// the widest vertical chroma filter swscale uses
+	static constexpr int SLICE_OVERLAP = 16;
+
+	FrameConverter() = default;
+	~FrameConverter();
+
+	FrameConverter(const FrameConverter &) = delete;
+	FrameConverter &operator=(const FrameConverter &) = delete;
+
+	bool Init(int width, int height, AVPixelFormat dstFmt, int swsFlags, int threads);
+	void Shutdown();
+
+	// src is a BGR24 image of the size given to Init
+	void Convert(const uint8_t *src, int srcStride, AVFrame *dst);
+
+	int SliceCount() const { return (int)this->slices.size(); }
+
+private:
+	struct Slice {
+		SwsContext *ctx;
+		int y;
+		int height;
+
+		// The rows actually converted, including the overlap. If there
+		// is any, they're converted into buf and the slice's own rows
+		// are copied out of it.
+		int srcY;
+		int srcHeight;
+		uint8_t *buf[4];
+		int bufLinesize[4];
+	};
+
+	void ConvertSlice(const Slice &slice);
+	void HelperThread(size_t idx);
+
+	std::vector<Slice> slices;
+	std::vector<std::thread> helpers;
+	int width = 0;
+	AVPixelFormat dstFmt = AV_PIX_FMT_NONE;
+	int chromaShift = 0;
+
+	// Job state, protected by lock
+	std::mutex lock;
+	std::condition_variable jobReady;
+	std::condition_variable jobDone;
+	uint32_t generation = 0;
+	int remaining = 0;
+	bool quit = false;
+	const uint8_t *src = nullptr;
+	int srcStride = 0;
+	AVFrame *dst = nullptr;
+};
+
+// Parses a sar_render_scaler value into swscale flags; returns -1 if
+// the name is unknown
+int ScalerFlagsFromName(const char *name);
@@ -0,0 +1,1198 @@
+#include "RenderEncoder.hpp"
+
+#include "Features/RenderBlend.hpp"
+#include "Features/RenderConvert.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+};
+
+RenderEncoder::RenderEncoder(LogFn log)
+	: log(log) {
+}
+
+RenderEncoder::~RenderEncoder() {
+	if (this->outCtx) this->Free();
+}
+
+// Utilities {{{
+
+AVCodecID RenderEncoder::VideoCodecFromName(const char *name) {
+	if (!strcmp(name, "h264")) return AV_CODEC_ID_H264;
+	if (!strcmp(name, "hevc")) return AV_CODEC_ID_HEVC;
+	if (!strcmp(name, "vp8")) return AV_CODEC_ID_VP8;
+	if (!strcmp(name, "vp9")) return AV_CODEC_ID_VP9;
+	if (!strcmp(name, "dnxhd")) return AV_CODEC_ID_DNXHD;
+	return AV_CODEC_ID_NONE;
+}
+
+std::string RenderEncoder::ResumeFileName(const std::string &filename) {
+	return filename + ".resume";
+}
+
+AVCodecID RenderEncoder::AudioCodecFromName(const char *name) {
+	if (!strcmp(name, "aac")) return AV_CODEC_ID_AAC;
+	if (!strcmp(name, "ac3")) return AV_CODEC_ID_AC3;
+	if (!strcmp(name, "vorbis")) return AV_CODEC_ID_VORBIS;
+	if (!strcmp(name, "opus")) return AV_CODEC_ID_OPUS;
+	if (!strcmp(name, "flac")) return AV_CODEC_ID_FLAC;
+	return AV_CODEC_ID_NONE;
+}
+
+// }}}
+
+// AVFrame allocators {{{
+
+static AVFrame *allocPicture(AVPixelFormat pixFmt, int width, int height) {
+	AVFrame *picture = av_frame_alloc();
+	if (!picture) {
+		return NULL;
+	}
+
+	picture->format = pixFmt;
+	picture->width = width;
+	picture->height = height;
+
+	if (av_frame_get_buffer(picture, 32) < 0) {
+		av_frame_free(&picture);
+		return NULL;
+	}
+
+	return picture;
+}
+
+// Like allocPicture, but the buffer comes from a pool so per-frame
+// allocations don't hit the system allocator
+static AVFrame *allocPooledPicture(AVBufferPool *pool, AVPixelFormat pixFmt, int width, int height) {
+	AVFrame *picture = av_frame_alloc();
+	if (!picture) {
+		return NULL;
+	}
+
+	picture->format = pixFmt;
+	picture->width = width;
+	picture->height = height;
+	picture->buf[0] = av_buffer_pool_get(pool);
+	if (!picture->buf[0]) {
+		av_frame_free(&picture);
+		return NULL;
+	}
+
+	if (av_image_fill_arrays(picture->data, picture->linesize, picture->buf[0]->data, pixFmt, width, height, 32) < 0) {
+		av_frame_free(&picture);
+		return NULL;
+	}
+
+	return picture;
+}
+
+static AVFrame *allocAudioFrame(AVSampleFormat sampleFmt, uint64_t channelLayout, int sampleRate, int nbSamples) {
+	AVFrame *frame = av_frame_alloc();
+	if (!frame) {
+		return NULL;
+	}
+
+	frame->format = sampleFmt;
+	frame->channel_layout = channelLayout;
+	frame->sample_rate = sampleRate;
+	frame->nb_samples = nbSamples;
+
+	if (nbSamples) {
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			return NULL;
+		}
+	}
+
+	return frame;
+}
+
+AVFrame *RenderEncoder::AllocCaptureFrame() {
+	AVFrame *picture = av_frame_alloc();
+	if (!picture) {
+		return NULL;
+	}
+
+	picture->format = AV_PIX_FMT_BGR24;
+	picture->width = this->settings.width;
+	picture->height = this->settings.height;
+	picture->buf[0] = av_buffer_pool_get(this->video.pool);
+	if (!picture->buf[0]) {
+		av_frame_free(&picture);
+		return NULL;
+	}
+	picture->data[0] = picture->buf[0]->data;
+	picture->linesize[0] = 3 * this->settings.width;
+
+	return picture;
+}
+
+// }}}
+
+// Stream creation and destruction {{{
+
+// framerate is sample rate for audio streams
+bool RenderEncoder::AddStream(Stream *out, AVCodecID codecId, int64_t bitrate, int framerate, int ptsOff, int width, int height) {
+	out->codec = avcodec_find_encoder(codecId);
+	if (!out->codec) {
+		this->log("Failed to find encoder for '%s'!\n", avcodec_get_name(codecId));
+		return false;
+	}
+
+	// dnxhd bitrate selection {{{
+
+	if (codecId == AV_CODEC_ID_DNXHD) {
+		// dnxhd is fussy and won't just allow any bitrate or
+		// resolution, so check our resolution is supported and find the
+		// closest bitrate to what was requested
+
+		// rates here are in Mbps
+		int64_t *rates;
+		size_t nrates;
+
+		if (width == 1920 && height == 1080) {  // 1080p 16:9
+			static int64_t rates1080[] = {
+				36,
+				45,
+				75,
+				90,
+				115,
+				120,
+				145,
+				175,
+				180,
+				190,
+				220,
+				240,
+				365,
+				440,
+			};
+			rates = rates1080;
+			nrates = sizeof rates1080 / sizeof rates1080[0];
+		} else if (width == 1280 && height == 720) {  // 720p 16:9
+			static int64_t rates720[] = {
+				60,
+				75,
+				90,
+				110,
+				120,
+				145,
+				180,
+				220,
+			};
+			rates = rates720;
+			nrates = sizeof rates720 / sizeof rates720[0];
+		} else if (width == 1440 && height == 1080) {  // 1080p 4:3
+			static int64_t rates1080[] = {
+				63,
+				84,
+				100,
+				110,
+			};
+			rates = rates1080;
+			nrates = sizeof rates1080 / sizeof rates1080[0];
+		} else if (width == 960 && height == 720) {  // 720p 4:3
+			static int64_t rates720[] = {
+				42,
+				60,
+				75,
+				115,
+			};
+			rates = rates720;
+			nrates = sizeof rates720 / sizeof rates720[0];
+		} else {
+			this->log("Resolution not supported by dnxhd\n");
+			return false;
+		}
+
+		int64_t realBitrate = -1;
+		int64_t lastDelta = INT64_MAX;
+
+		for (size_t i = 0; i < nrates; ++i) {
+			int64_t rate = rates[i] * 1000000;
+			int64_t delta = rate > bitrate ? rate - bitrate : bitrate - rate;
+			if (delta < lastDelta) {
+				realBitrate = rate;
+			}
+		}
+
+		if (realBitrate != bitrate) {
+			this->log("dnxhd does not support the given bitrate; encoding at %d kb/s instead\n", realBitrate / 1000);
+			bitrate = realBitrate;
+		}
+	}
+
+	// }}}
+
+	out->stream = avformat_new_stream(this->outCtx, NULL);
+	if (!out->stream) {
+		this->log("Failed to allocate stream\n");
+		return false;
+	}
+
+	out->enc = avcodec_alloc_context3(out->codec);
+	if (!out->enc) {
+		this->log("Failed to allocate an encoding context\n");
+		return false;
+	}
+
+	out->enc->bit_rate = bitrate;
+	out->stream->time_base = {1, framerate};
+
+	switch (out->codec->type) {
+	case AVMEDIA_TYPE_AUDIO:
+		out->enc->sample_fmt = out->codec->sample_fmts ? out->codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;  // don't really care about sample format
+		out->enc->sample_rate = framerate;
+		out->enc->channel_layout = AV_CH_LAYOUT_STEREO;
+		out->enc->channels = av_get_channel_layout_nb_channels(out->enc->channel_layout);
+
+		if (out->codec->channel_layouts) {
+			bool foundStereo = false;
+			for (const uint64_t *layout = out->codec->channel_layouts; *layout; ++layout) {
+				if (*layout == AV_CH_LAYOUT_STEREO) {
+					foundStereo = true;
+					break;
+				}
+			}
+
+			if (!foundStereo) {
+				this->log("Stereo not supported by audio encoder\n");
+				avcodec_free_context(&out->enc);
+				return false;
+			}
+		}
+
+		if (out->codec->supported_samplerates) {
+			bool foundRate = false;
+			for (const int *rate = out->codec->supported_samplerates; *rate; ++rate) {
+				if (*rate == framerate) {
+					foundRate = true;
+					break;
+				}
+			}
+
+			if (!foundRate) {
+				this->log("Sample rate %d not supported by audio encoder\n", framerate);
+				avcodec_free_context(&out->enc);
+				return false;
+			}
+		}
+
+		break;
+
+	case AVMEDIA_TYPE_VIDEO:
+		out->enc->codec_id = codecId;
+		out->enc->width = width;
+		out->enc->height = height;
+		out->enc->time_base = out->stream->time_base;
+		out->enc->gop_size = GOP_SIZE;
+		out->enc->pix_fmt = codecId == AV_CODEC_ID_DNXHD ? AV_PIX_FMT_YUV422P : AV_PIX_FMT_YUV420P;
+		if (this->segmented) {
+			// Segments are encoded independently and concatenated, so
+			// decode order has to match presentation order for the
+			// timestamps to line up across the joins
+			out->enc->max_b_frames = 0;
+		}
+
+		break;
+
+	default:
+		break;
+	}
+
+	if (this->outCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+		out->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+
+	out->nextPts = ptsOff;
+	out->muxedEndUs = 0;
+
+	return true;
+}
+
+void RenderEncoder::CloseStream(Stream *s) {
+	avcodec_free_context(&s->enc);
+	av_frame_free(&s->frame);
+	av_frame_free(&s->tmpFrame);
+	delete s->converter;
+	s->converter = NULL;
+	av_buffer_pool_uninit(&s->pool);
+	swr_free(&s->swrCtx);
+}
+
+// }}}
+
+// Flushing streams {{{
+
+bool RenderEncoder::FlushStream(Stream *s, bool isEnd) {
+	if (isEnd) {
+		avcodec_send_frame(s->enc, NULL);
+	}
+
+	while (true) {
+		AVPacket pkt = {0};
+		int ret = avcodec_receive_packet(s->enc, &pkt);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			return true;
+		} else if (ret < 0) {
+			return false;
+		}
+		this->TrackMuxed(s, &pkt);
+		av_packet_rescale_ts(&pkt, s->enc->time_base, s->stream->time_base);
+		pkt.stream_index = s->stream->index;
+		{
+			RenderStats::ScopedTimer timer(s->muxMicros);
+			av_interleaved_write_frame(this->outCtx, &pkt);
+		}
+		av_packet_unref(&pkt);
+	}
+}
+
+void RenderEncoder::TrackMuxed(Stream *s, const AVPacket *pkt) {
+	if (pkt->pts == AV_NOPTS_VALUE) return;
+
+	// Video encoders don't always fill in the duration, but it's always
+	// one frame
+	int64_t duration = pkt->duration ? pkt->duration : s == &this->video ? 1 : 0;
+	int64_t end = av_rescale_q(pkt->pts + duration, s->enc->time_base, AV_TIME_BASE_Q);
+	s->muxedEndUs = std::max(s->muxedEndUs, end);
+}
+
+// }}}
+
+// Opening streams {{{
+
+bool RenderEncoder::OpenVideo(Stream *s, AVDictionary **options) {
+	if (avcodec_open2(s->enc, s->codec, options) < 0) {
+		this->log("Failed to open video codec\n");
+		return false;
+	}
+
+	s->frame = allocPicture(s->enc->pix_fmt, s->enc->width, s->enc->height);
+	if (!s->frame) {
+		this->log("Failed to allocate video frame\n");
+		return false;
+	}
+
+	s->pool = av_buffer_pool_init(3 * s->enc->width * s->enc->height, av_buffer_alloc);
+	if (!s->pool) {
+		this->log("Failed to allocate frame pool\n");
+		return false;
+	}
+
+	s->tmpFrame = this->AllocCaptureFrame();
+	if (!s->tmpFrame) {
+		this->log("Failed to allocate intermediate video frame\n");
+		return false;
+	}
+
+	if (avcodec_parameters_from_context(s->stream->codecpar, s->enc) < 0) {
+		this->log("Failed to copy stream parameters\n");
+		return false;
+	}
+
+	s->converter = new FrameConverter();
+	if (!s->converter->Init(s->enc->width, s->enc->height, s->enc->pix_fmt, this->settings.scalerFlags, this->settings.convertThreads)) {
+		this->log("Failed to initialize conversion context\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool RenderEncoder::OpenAudio(Stream *s, AVDictionary **options) {
+	if (avcodec_open2(s->enc, s->codec, options) < 0) {
+		this->log("Failed to open audio codec\n");
+		return false;
+	}
+
+	s->frame = allocAudioFrame(s->enc->sample_fmt, s->enc->channel_layout, s->enc->sample_rate, s->enc->frame_size);
+	s->tmpFrame = allocAudioFrame(AV_SAMPLE_FMT_S16P, s->enc->channel_layout, s->enc->sample_rate, s->enc->frame_size);
+
+	if (avcodec_parameters_from_context(s->stream->codecpar, s->enc) < 0) {
+		this->log("Failed to copy stream parameters\n");
+		return false;
+	}
+
+	s->swrCtx = swr_alloc();
+	if (!s->swrCtx) {
+		this->log("Failed to allocate resampler context\n");
+		return false;
+	}
+
+	av_opt_set_int(s->swrCtx, "in_channel_count", s->enc->channels, 0);
+	av_opt_set_int(s->swrCtx, "in_sample_rate", INPUT_SAMPLE_RATE, 0);
+	av_opt_set_sample_fmt(s->swrCtx, "in_sample_fmt", AV_SAMPLE_FMT_S16P, 0);
+	av_opt_set_int(s->swrCtx, "out_channel_count", s->enc->channels, 0);
+	av_opt_set_int(s->swrCtx, "out_sample_rate", s->enc->sample_rate, 0);
+	av_opt_set_sample_fmt(s->swrCtx, "out_sample_fmt", s->enc->sample_fmt, 0);
+
+	if (swr_init(s->swrCtx) < 0) {
+		this->log("Failed to initialize resampler context\n");
+		return false;
+	}
+
+	return true;
+}
+
+// }}}
+
+// Open and close {{{
+
+bool RenderEncoder::Open(const RenderSettings &settings) {
+	this->settings = settings;
+
+	AVDictionary *options = NULL;
+
+	// Quality options
+	{
+		// TODO: CRF scales non-linearly. Do we make this conversion
+		// non-linear to better reflect that?
+
+		int quality = std::max(0, std::min(50, settings.quality));
+		int min = 0;
+		int max = 63;
+		if (settings.videoCodec == AV_CODEC_ID_H264 || settings.videoCodec == AV_CODEC_ID_HEVC) {
+			max = 51;
+		} else if (settings.videoCodec == AV_CODEC_ID_VP8) {
+			min = 4;
+		}
+		int crf = min + (max - min) * (50 - quality) / 50;
+		std::string crfStr = std::to_string(crf);
+		av_dict_set(&options, "crf", crfStr.c_str(), 0);
+
+		if (settings.videoCodec == AV_CODEC_ID_H264 || settings.videoCodec == AV_CODEC_ID_HEVC) {
+			av_dict_set(&options, "preset", "slower", 0);
+		}
+	}
+
+	this->segmented = settings.encodeThreads > 1;
+	this->segmentFrames = GOP_SIZE * std::max(1, settings.segmentGops);
+	this->segmentError = false;
+	this->isMov = false;
+	this->resumable = false;
+	this->fragmentFrames = 0;
+
+	const char *filename = settings.filename.c_str();
+
+	if (avformat_alloc_output_context2(&this->outCtx, NULL, NULL, filename) == AVERROR(EINVAL)) {
+		this->log("Failed to deduce output format from file extension - using MP4\n");
+		avformat_alloc_output_context2(&this->outCtx, NULL, "mp4", filename);
+	}
+
+	if (!this->outCtx) {
+		this->log("Failed to allocate output context\n");
+		av_dict_free(&options);
+		return false;
+	}
+
+	bool ok = false;
+	ResumeInfo resumeInfo = {};
+
+	if (!this->AddStream(&this->video, settings.videoCodec, settings.videoBitrate, settings.fps, 0, settings.width, settings.height)) {
+		this->log("Failed to create video stream\n");
+	} else if (!this->AddStream(&this->audio, settings.audioCodec, settings.audioBitrate, settings.samplerate, settings.samplerate / 10)) {  // offset the start by 0.1s because idk
+		this->log("Failed to create audio stream\n");
+	} else if ((settings.fragmented || settings.resume) && !this->SetupFragmenting(&options, &resumeInfo)) {
+		this->log("Failed to set up fragmented output\n");
+	} else if (this->segmented && av_dict_copy(&this->videoOptions, options, 0) < 0) {
+		this->log("Failed to copy video options\n");
+	} else if (!this->OpenVideo(&this->video, &options)) {
+		this->log("Failed to open video stream\n");
+	} else if (!this->OpenAudio(&this->audio, &options)) {
+		this->log("Failed to open audio stream\n");
+	} else if (!settings.resume && avio_open(&this->outCtx->pb, filename, AVIO_FLAG_WRITE) < 0) {
+		this->log("Failed to open output file\n");
+	} else if (settings.resume && !this->OpenHeaderBuffer()) {
+		this->log("Failed to allocate header buffer\n");
+	} else if (avformat_write_header(this->outCtx, &options) < 0) {
+		this->log("Failed to write output file\n");
+	} else if (settings.resume && !this->OpenResumedFile(resumeInfo)) {
+		this->log("Failed to reopen output file for resuming\n");
+	} else if (this->segmented && !this->StartSegmentWorkers()) {
+		this->log("Failed to start segment encoders\n");
+	} else {
+		ok = true;
+	}
+
+	av_dict_free(&options);
+
+	if (!ok) {
+		this->Free();
+		return false;
+	}
+
+	// A resumed render doesn't start at 0
+	this->nextSegmentToMux = this->video.nextPts / this->segmentFrames;
+	this->nextFragmentFlush = this->video.nextPts + this->fragmentFrames;
+
+	this->nextBlendIdx = 0;
+	if (settings.toBlend > 1) {
+		this->blendSumBuf = (uint16_t *)calloc(3 * settings.width * settings.height, sizeof this->blendSumBuf[0]);
+	}
+
+	return true;
+}
+
+bool RenderEncoder::Close() {
+	bool ok = true;
+	if (this->segmented) {
+		this->StopSegmentWorkers();
+		ok &= this->MuxFinishedSegments();
+		ok &= !this->segmentError;
+
+		int segments = (this->video.nextPts + this->segmentFrames - 1) / this->segmentFrames;
+		if (this->nextSegmentToMux != segments) {
+			this->log("Only %d of %d video segments were encoded!\n", this->nextSegmentToMux, segments);
+			ok = false;
+		}
+	} else {
+		ok &= this->FlushStream(&this->video, true);
+	}
+	ok &= this->FlushStream(&this->audio, true);
+	if (this->settings.fragmented) {
+		// Records the end of the file before the trailer, so the
+		// trailer is overwritten if the render is resumed
+		ok &= this->FlushFragment();
+	}
+	ok &= av_write_trailer(this->outCtx) == 0;
+
+	this->Free();
+
+	return ok;
+}
+
+void RenderEncoder::Free() {
+	this->StopSegmentWorkers();
+	for (auto &seg : this->finishedSegments) {
+		for (AVPacket *pkt : seg.second) {
+			av_packet_free(&pkt);
+		}
+	}
+	this->finishedSegments.clear();
+	av_buffer_pool_uninit(&this->segmentPool);
+	av_dict_free(&this->videoOptions);
+
+	this->CloseStream(&this->video);
+	this->CloseStream(&this->audio);
+	if (this->outCtx) {
+		if (this->headerInMemory) {
+			this->CloseHeaderBuffer();
+		}
+		avio_closep(&this->outCtx->pb);
+		avformat_free_context(this->outCtx);
+		this->outCtx = NULL;
+	}
+	free(this->blendSumBuf);
+	this->blendSumBuf = NULL;
+}
+
+void RenderEncoder::PrintInfo() {
+	this->log(
+		"    video: %s (%dx%d @ %d fps, %" PRId64 " kb/s, %s)\n",
+		this->video.codec->name,
+		this->settings.width,
+		this->settings.height,
+		this->settings.fps,
+		this->video.enc->bit_rate / 1000,
+		av_get_pix_fmt_name(this->video.enc->pix_fmt));
+
+	this->log("    conversion: %d slices\n", this->video.converter->SliceCount());
+
+	if (this->segmented) {
+		this->log("    encoding: %d segments of %d frames at a time\n", (int)this->segmentWorkers.size(), this->segmentFrames);
+	}
+
+	this->log(
+		"    audio: %s (%d Hz, %" PRId64 " kb/s, %s)\n",
+		this->audio.codec->name,
+		this->audio.enc->sample_rate,
+		this->audio.enc->bit_rate / 1000,
+		av_get_sample_fmt_name(this->audio.enc->sample_fmt));
+}
+
+// }}}
+
+// Submitting frames {{{
+
+bool RenderEncoder::SubmitVideo(const uint8_t *image, RenderStats::FrameRow *row) {
+	Stream *s = &this->video;
+
+	const uint8_t *finalImage = image;
+
+	if (this->settings.toBlend > 1) {
+		bool blendDone;
+
+		{
+			RenderStats::ScopedTimer timer(row->micros[RenderStats::STAGE_BLEND]);
+
+			size_t size = 3 * this->settings.width * this->settings.height;
+
+			uint16_t weight = this->settings.blendWeights[this->nextBlendIdx];
+			if (weight) {
+				RenderBlend::Accumulate(this->blendSumBuf, image, size, weight);
+			}
+
+			blendDone = ++this->nextBlendIdx == this->settings.toBlend;
+			if (blendDone) {
+				RenderBlend::Resolve(s->tmpFrame->data[0], this->blendSumBuf, size, this->settings.blendWeightSum);
+				this->nextBlendIdx = 0;
+			}
+		}
+
+		// We've added in this frame, but not done blending yet. The blend
+		// timer has stopped, so the row is complete for the caller.
+		if (!blendDone) return true;
+
+		finalImage = s->tmpFrame->data[0];
+	}
+
+	// Convert the final frame to the output format and process it. When
+	// encoding in segments the frame is handed off to a worker, so it
+	// needs a buffer of its own
+
+	AVFrame *frame = s->frame;
+	if (this->segmented) {
+		frame = allocPooledPicture(this->segmentPool, s->enc->pix_fmt, s->enc->width, s->enc->height);
+		if (!frame) {
+			this->log("Failed to allocate video frame!\n");
+			return false;
+		}
+	} else if (av_frame_make_writable(frame) < 0) {
+		this->log("Failed to make video frame writable!\n");
+		return false;
+	}
+
+	{
+		RenderStats::ScopedTimer timer(row->micros[RenderStats::STAGE_CONVERT]);
+		s->converter->Convert(finalImage, 3 * this->settings.width, frame);
+	}
+
+	frame->pts = s->nextPts;
+	s->muxMicros = 0;
+
+	{
+		RenderStats::ScopedTimer timer(row->micros[RenderStats::STAGE_ENCODE]);
+
+		if (this->segmented) {
+			// Encode time here is time spent waiting for a worker to
+			// have room for the frame
+			if (!this->QueueSegmentFrame(frame)) {
+				this->log("Failed to encode video segment!\n");
+				return false;
+			}
+
+			if (!this->MuxFinishedSegments()) {
+				this->log("Failed to write video segment!\n");
+				return false;
+			}
+		} else {
+			if (avcodec_send_frame(s->enc, frame) < 0) {
+				this->log("Failed to send video frame for encoding!\n");
+				return false;
+			}
+
+			if (!this->FlushStream(s)) {
+				this->log("Failed to flush video stream!\n");
+				return false;
+			}
+		}
+
+		if (this->settings.fragmented && s->nextPts >= this->nextFragmentFlush) {
+			this->nextFragmentFlush = s->nextPts + this->fragmentFrames;
+
+			RenderStats::ScopedTimer timer(s->muxMicros);
+			if (!this->FlushFragment()) {
+				this->log("Failed to flush output fragment!\n");
+				return false;
+			}
+		}
+	}
+
+	// The encode timer includes the time spent muxing, so take it back out
+	row->micros[RenderStats::STAGE_MUX] = s->muxMicros;
+	row->micros[RenderStats::STAGE_ENCODE] -= std::min(row->micros[RenderStats::STAGE_ENCODE], row->micros[RenderStats::STAGE_MUX]);
+	row->output = s->nextPts;
+
+	++s->nextPts;
+
+	return true;
+}
+
+bool RenderEncoder::SubmitAudio(const int16_t *const *planes) {
+	Stream *s = &this->audio;
+
+	for (int i = 0; i < s->enc->channels; ++i) {
+		memcpy(s->tmpFrame->data[i], planes[i], s->tmpFrame->nb_samples * sizeof planes[i][0]);
+	}
+
+	s->tmpFrame->pts = s->nextPts;
+	s->nextPts += s->frame->nb_samples;
+
+	if (av_frame_make_writable(s->frame) < 0) {
+		this->log("Failed to make audio frame writable!\n");
+		return false;
+	}
+
+	if (swr_convert(s->swrCtx, s->frame->data, s->frame->nb_samples, (const uint8_t **)s->tmpFrame->data, s->tmpFrame->nb_samples) < 0) {
+		this->log("Failed to resample audio frame!\n");
+		return false;
+	}
+
+	s->frame->pts = av_rescale_q(s->tmpFrame->pts, {1, s->enc->sample_rate}, s->enc->time_base);
+
+	if (avcodec_send_frame(s->enc, s->frame) < 0) {
+		this->log("Failed to send audio frame for encoding!\n");
+		return false;
+	}
+
+	if (!this->FlushStream(s)) {
+		this->log("Failed to flush audio stream!\n");
+		return false;
+	}
+
+	return true;
+}
+
+// }}}
+
+// Segmented encoding {{{
+
+// Every worker can have a whole segment queued, so what's in flight is
+// encodeThreads * segmentFrames converted frames - far too much for a
+// 32-bit process at high resolutions. Segments are shortened to fit
+// SEGMENT_QUEUE_BUDGET, then workers dropped; if even two workers with
+// a GOP each won't fit, the video is encoded in one pass instead.
+bool RenderEncoder::StartSegmentWorkers() {
+	Stream *s = &this->video;
+
+	int size = av_image_get_buffer_size(s->enc->pix_fmt, s->enc->width, s->enc->height, 32);
+	if (size < 0) {
+		return false;
+	}
+
+	int budgetFrames = (int)std::min<int64_t>(SEGMENT_QUEUE_BUDGET / size, INT_MAX);
+	int threads = this->settings.encodeThreads;
+	int gops = this->segmentFrames / GOP_SIZE;
+	while (gops > 1 && threads * gops * GOP_SIZE > budgetFrames) --gops;
+	while (threads > 2 && threads * gops * GOP_SIZE > budgetFrames) --threads;
+
+	if (threads * gops * GOP_SIZE > budgetFrames) {
+		this->log("Frames are too big to encode in segments; encoding in one pass\n");
+		this->segmented = false;
+		return true;
+	}
+	if (threads != this->settings.encodeThreads || gops * GOP_SIZE != this->segmentFrames) {
+		this->log("Encoding %d segments of %d GOPs at a time to save memory\n", threads, gops);
+	}
+	this->segmentFrames = gops * GOP_SIZE;
+
+	this->segmentPool = av_buffer_pool_init(size, av_buffer_alloc);
+	if (!this->segmentPool) {
+		return false;
+	}
+
+	for (int i = 0; i < threads; ++i) {
+		this->segmentWorkers.emplace_back(new SegmentWorker());
+	}
+
+	for (auto &w : this->segmentWorkers) {
+		SegmentWorker *worker = w.get();
+		worker->thread = std::thread([this, worker]() { this->SegmentWorkerMain(worker); });
+	}
+
+	return true;
+}
+
+void RenderEncoder::StopSegmentWorkers() {
+	for (auto &w : this->segmentWorkers) {
+		{
+			std::lock_guard<std::mutex> lock(w->lock);
+			w->queue.push_back(NULL);
+		}
+		w->cond.notify_all();
+	}
+
+	for (auto &w : this->segmentWorkers) {
+		if (w->thread.joinable()) w->thread.join();
+		for (AVFrame *frame : w->queue) {
+			av_frame_free(&frame);
+		}
+	}
+
+	this->segmentWorkers.clear();
+}
+
+AVCodecContext *RenderEncoder::OpenSegmentEncoder() {
+	const AVCodecContext *ref = this->video.enc;
+
+	AVCodecContext *enc = avcodec_alloc_context3(this->video.codec);
+	if (!enc) {
+		return NULL;
+	}
+
+	// Same settings as the stream's own encoder, which only exists to
+	// provide the stream parameters, so that every segment's bitstream
+	// is compatible with the header
+	enc->codec_id = ref->codec_id;
+	enc->bit_rate = ref->bit_rate;
+	enc->width = ref->width;
+	enc->height = ref->height;
+	enc->time_base = ref->time_base;
+	enc->gop_size = ref->gop_size;
+	enc->max_b_frames = ref->max_b_frames;
+	enc->pix_fmt = ref->pix_fmt;
+	enc->flags = ref->flags;
+
+	// Share the cores between the workers rather than letting each
+	// encoder assume it has the whole machine
+	enc->thread_count = std::max(1, (int)std::thread::hardware_concurrency() / (int)this->segmentWorkers.size());
+
+	// Opening an encoder for every segment isn't free: x264 and x265 at
+	// the slower preset look 60 frames ahead, holding a full copy of each
+	// of them on top of the queue. Nothing past the end of the segment
+	// can be looked at anyway, so keep that within it.
+	AVDictionary *options = NULL;
+	av_dict_copy(&options, this->videoOptions, 0);
+	int lookahead = std::min(this->segmentFrames, SEGMENT_LOOKAHEAD);
+	if (enc->codec_id == AV_CODEC_ID_H264) {
+		av_dict_set_int(&options, "rc-lookahead", lookahead, 0);
+	} else if (enc->codec_id == AV_CODEC_ID_HEVC) {
+		std::string params = "rc-lookahead=" + std::to_string(lookahead);
+		av_dict_set(&options, "x265-params", params.c_str(), 0);
+	} else if (enc->codec_id == AV_CODEC_ID_VP8 || enc->codec_id == AV_CODEC_ID_VP9) {
+		av_dict_set_int(&options, "lag-in-frames", lookahead, 0);
+	}
+	int ret = avcodec_open2(enc, this->video.codec, &options);
+	av_dict_free(&options);
+
+	if (ret < 0) {
+		avcodec_free_context(&enc);
+		return NULL;
+	}
+
+	return enc;
+}
+
+// Segment n goes to worker n % encodeThreads. Each worker's queue holds
+// up to a segment's worth of frames, which is enough for the workers to
+// all be busy at once while still bounding how far ahead of the
+// slowest one we can get.
+bool RenderEncoder::QueueSegmentFrame(AVFrame *frame) {
+	int segment = frame->pts / this->segmentFrames;
+	SegmentWorker *w = this->segmentWorkers[segment % this->segmentWorkers.size()].get();
+
+	{
+		std::unique_lock<std::mutex> lock(w->lock);
+		w->cond.wait(lock, [&]() { return (int)w->queue.size() < this->segmentFrames; });
+		w->queue.push_back(frame);
+	}
+	w->cond.notify_all();
+
+	return !this->segmentError;
+}
+
+void RenderEncoder::SegmentWorkerMain(SegmentWorker *w) {
+	AVCodecContext *enc = NULL;
+	int segment = -1;
+	std::vector<AVPacket *> packets;
+
+	auto receive = [&]() {
+		while (true) {
+			AVPacket *pkt = av_packet_alloc();
+			if (!pkt) return false;
+			int ret = avcodec_receive_packet(enc, pkt);
+			if (ret < 0) {
+				av_packet_free(&pkt);
+				return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+			}
+			packets.push_back(pkt);
+		}
+	};
+
+	// Every segment gets a fresh encoder, so it starts on a keyframe
+	// and references nothing outside itself
+	auto finishSegment = [&]() {
+		if (!enc) return;
+
+		avcodec_send_frame(enc, NULL);
+		if (!receive()) this->segmentError = true;
+		avcodec_free_context(&enc);
+
+		std::lock_guard<std::mutex> lock(this->segmentLock);
+		this->finishedSegments[segment] = std::move(packets);
+		packets.clear();
+	};
+
+	while (true) {
+		AVFrame *frame;
+
+		{
+			std::unique_lock<std::mutex> lock(w->lock);
+			w->cond.wait(lock, [&]() { return !w->queue.empty(); });
+			frame = w->queue.front();
+			w->queue.pop_front();
+		}
+		w->cond.notify_all();
+
+		if (!frame) {
+			finishSegment();
+			return;
+		}
+
+		int frameSegment = frame->pts / this->segmentFrames;
+		if (frameSegment != segment) {
+			finishSegment();
+			segment = frameSegment;
+			enc = this->OpenSegmentEncoder();
+			if (!enc) this->segmentError = true;
+		}
+
+		// After an error we keep taking frames so the submitter never
+		// blocks on us, but don't bother encoding them
+		if (enc && !this->segmentError) {
+			if (avcodec_send_frame(enc, frame) < 0 || !receive()) {
+				this->segmentError = true;
+			}
+		}
+
+		av_frame_free(&frame);
+	}
+}
+
+// Writes out finished segments in order, stopping at the first one that
+// isn't done yet
+bool RenderEncoder::MuxFinishedSegments() {
+	Stream *s = &this->video;
+
+	while (true) {
+		std::vector<AVPacket *> packets;
+
+		{
+			std::lock_guard<std::mutex> lock(this->segmentLock);
+			auto it = this->finishedSegments.find(this->nextSegmentToMux);
+			if (it == this->finishedSegments.end()) return true;
+			packets = std::move(it->second);
+			this->finishedSegments.erase(it);
+		}
+
+		++this->nextSegmentToMux;
+
+		bool ok = true;
+		for (AVPacket *pkt : packets) {
+			if (ok) {
+				this->TrackMuxed(s, pkt);
+				av_packet_rescale_ts(pkt, s->enc->time_base, s->stream->time_base);
+				pkt->stream_index = s->stream->index;
+				RenderStats::ScopedTimer timer(s->muxMicros);
+				ok = av_interleaved_write_frame(this->outCtx, pkt) >= 0;
+			}
+			av_packet_free(&pkt);
+		}
+
+		if (!ok) return false;
+	}
+}
+
+// }}}
+
+// Fragmented output {{{
+
+// MP4/MOV are written as an empty moov followed by a moof+mdat pair per
+// fragment, which we cut ourselves in FlushFragment. Matroska is
+// already written front to back, so it only needs flushing.
+bool RenderEncoder::SetupFragmenting(AVDictionary **options, ResumeInfo *resumeInfo) {
+	const char *name = this->outCtx->oformat->name;
+	this->isMov = !strcmp(name, "mp4") || !strcmp(name, "mov");
+	bool isMkv = !strcmp(name, "matroska") || !strcmp(name, "webm");
+
+	if (this->settings.resume && !this->isMov) {
+		this->log("Only MP4 and MOV renders can be resumed\n");
+		return false;
+	}
+
+	if (!this->isMov && !isMkv) {
+		this->log("Fragmented output is not supported for '%s'; writing a regular file\n", name);
+		this->settings.fragmented = false;
+		return true;
+	}
+
+	this->settings.fragmented = true;
+	this->fragmentFrames = std::max(1, (int)round(this->settings.fragmentSeconds * this->settings.fps));
+
+	if (isMkv) {
+		// Don't let clusters get longer than our flush interval
+		av_dict_set_int(options, "cluster_time_limit", (int64_t)(this->settings.fragmentSeconds * 1000), 0);
+		return true;
+	}
+
+	if (!this->settings.resume) {
+		av_dict_set(options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+		this->resumable = true;
+		return true;
+	}
+
+	if (!this->ReadResumeInfo(resumeInfo)) {
+		this->log("Failed to read '%s'\n", ResumeFileName(this->settings.filename).c_str());
+		return false;
+	}
+
+	if (resumeInfo->width != this->settings.width || resumeInfo->height != this->settings.height) {
+		this->log("Cannot resume a %dx%d render at %dx%d\n", resumeInfo->width, resumeInfo->height, this->settings.width, this->settings.height);
+		return false;
+	}
+
+	if (resumeInfo->fps != this->settings.fps || resumeInfo->samplerate != this->settings.samplerate || resumeInfo->videoCodec != this->settings.videoCodec || resumeInfo->audioCodec != this->settings.audioCodec) {
+		this->log("Render settings do not match the file being resumed\n");
+		return false;
+	}
+
+	// frag_discont makes the new fragments start at the timestamps we
+	// give them rather than at 0
+	av_dict_set(options, "movflags", "frag_custom+empty_moov+default_base_moof+frag_discont", 0);
+	av_dict_set_int(options, "fragment_index", resumeInfo->nextFragment, 0);
+
+	// Pick up both streams from whichever one got further, leaving a
+	// short gap in the other
+	int64_t startUs = std::max(resumeInfo->videoEndUs, resumeInfo->audioEndUs);
+	this->video.nextPts = av_rescale_q_rnd(startUs, AV_TIME_BASE_Q, {1, this->settings.fps}, AV_ROUND_UP);
+	this->audio.nextPts = av_rescale_q_rnd(startUs, AV_TIME_BASE_Q, {1, this->settings.samplerate}, AV_ROUND_UP);
+	this->video.muxedEndUs = startUs;
+	this->audio.muxedEndUs = startUs;
+
+	this->log("Resuming render at %.3f seconds\n", startUs / 1000000.0);
+
+	this->resumable = true;
+	return true;
+}
+
+bool RenderEncoder::OpenHeaderBuffer() {
+	this->headerInMemory = avio_open_dyn_buf(&this->outCtx->pb) >= 0;
+	return this->headerInMemory;
+}
+
+void RenderEncoder::CloseHeaderBuffer() {
+	uint8_t *buf;
+	avio_close_dyn_buf(this->outCtx->pb, &buf);
+	av_free(buf);
+	this->outCtx->pb = NULL;
+	this->headerInMemory = false;
+}
+
+// The header has been written to memory so the muxer is set up; the
+// file already starts with the same one, so drop it and carry on from
+// the end of the last complete fragment
+bool RenderEncoder::OpenResumedFile(const ResumeInfo &info) {
+	this->CloseHeaderBuffer();
+
+	const char *filename = this->settings.filename.c_str();
+
+	// Anything past the recorded offset is a fragment which was cut off
+	// part way through, or the trailer from when the render was stopped
+	std::error_code ec;
+	std::filesystem::resize_file(filename, info.offset, ec);
+	if (ec) {
+		return false;
+	}
+
+	AVDictionary *options = NULL;
+	av_dict_set(&options, "truncate", "0", 0);
+	int ret = avio_open2(&this->outCtx->pb, filename, AVIO_FLAG_WRITE, NULL, &options);
+	av_dict_free(&options);
+	if (ret < 0) {
+		return false;
+	}
+
+	return avio_seek(this->outCtx->pb, info.offset, SEEK_SET) == info.offset;
+}
+
+bool RenderEncoder::FlushFragment() {
+	// Drain the interleaving queue, then have the muxer write out
+	// everything it's holding
+	if (av_interleaved_write_frame(this->outCtx, NULL) < 0) return false;
+	if (av_write_frame(this->outCtx, NULL) < 0) return false;
+	avio_flush(this->outCtx->pb);
+
+	if (this->resumable) {
+		return this->WriteResumeInfo();
+	}
+
+	return true;
+}
+
+bool RenderEncoder::WriteResumeInfo() {
+	int64_t nextFragment = 1;
+	av_opt_get_int(this->outCtx->priv_data, "fragment_index", 0, &nextFragment);
+
+	std::string path = ResumeFileName(this->settings.filename);
+	std::string tmpPath = path + ".tmp";
+
+	FILE *fp = fopen(tmpPath.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+
+	fprintf(fp, "width %d\n", this->settings.width);
+	fprintf(fp, "height %d\n", this->settings.height);
+	fprintf(fp, "fps %d\n", this->settings.fps);
+	fprintf(fp, "samplerate %d\n", this->settings.samplerate);
+	fprintf(fp, "vcodec %d\n", (int)this->settings.videoCodec);
+	fprintf(fp, "acodec %d\n", (int)this->settings.audioCodec);
+	fprintf(fp, "offset %" PRId64 "\n", avio_tell(this->outCtx->pb));
+	fprintf(fp, "fragment %" PRId64 "\n", nextFragment);
+	fprintf(fp, "video_end_us %" PRId64 "\n", this->video.muxedEndUs);
+	fprintf(fp, "audio_end_us %" PRId64 "\n", this->audio.muxedEndUs);
+
+	bool ok = !ferror(fp);
+	ok &= fclose(fp) == 0;
+	if (!ok) {
+		return false;
+	}
+
+	// Replace the old file in one go so a crash never leaves it half
+	// written
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+	return !ec;
+}
+
+bool RenderEncoder::ReadResumeInfo(ResumeInfo *info) {
+	FILE *fp = fopen(ResumeFileName(this->settings.filename).c_str(), "r");
+	if (!fp) {
+		return false;
+	}
+
+	int found = 0;
+	char key[32];
+	int64_t val;
+	while (fscanf(fp, "%31s %" SCNd64, key, &val) == 2) {
+		if (!strcmp(key, "width")) info->width = val;
+		else if (!strcmp(key, "height")) info->height = val;
+		else if (!strcmp(key, "fps")) info->fps = val;
+		else if (!strcmp(key, "samplerate")) info->samplerate = val;
+		else if (!strcmp(key, "vcodec")) info->videoCodec = val;
+		else if (!strcmp(key, "acodec")) info->audioCodec = val;
+		else if (!strcmp(key, "offset")) info->offset = val;
+		else if (!strcmp(key, "fragment")) info->nextFragment = val;
+		else if (!strcmp(key, "video_end_us")) info->videoEndUs = val;
+		else if (!strcmp(key, "audio_end_us")) info->audioEndUs = val;
+		else continue;
+		++found;
+	}
+
+	fclose(fp);
+
+	return found == 10;
+}
+
+// }}}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "Features/RenderStats.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+}
+
+class FrameConverter;
+
+// Everything needed to set up an encoder; filled in from the sar_render
+// cvars by the Renderer
+struct RenderSettings {
+	std::string filename;
+	AVCodecID videoCodec;
+	AVCodecID audioCodec;
+	int64_t videoBitrate;  // bit/s
+	int64_t audioBitrate;  // bit/s
+	int quality;           // 0-50, see sar_render_quality
+	int width, height;
+	int fps;
+	int samplerate;
+	int scalerFlags;
+	int convertThreads;
+
+	// Segmented encoding; if encodeThreads > 1, the video is split into
+	// runs of segmentGops closed GOPs which are encoded concurrently
+	int encodeThreads;
+	int segmentGops;
+
+	// Crash-safe output; the muxer is flushed every fragmentSeconds so
+	// an interrupted render leaves a playable file. For MP4/MOV, resume
+	// continues writing at the end of such a file rather than replacing
+	// it.
+	bool fragmented;
+	float fragmentSeconds;
+	bool resume;
+
+	// Blending; toBlend == 1 means every submitted frame is an output
+	// frame
+	int toBlend;
+	std::vector<uint16_t> blendWeights;
+	uint32_t blendWeightSum;
+};
+
+// The encoding half of the renderer: blends captured frames, converts
+// them to the output pixel format, encodes audio and video and muxes
+// them into a file. This has no dependencies on the engine, so it takes
+// a log function rather than printing to the console directly.
+class RenderEncoder {
+public:
+	using LogFn = void (*)(const char *fmt, ...);
+
+	// The sample rate of audio given to SubmitAudio
+	static constexpr int INPUT_SAMPLE_RATE = 44100;
+	// Frames between keyframes; segments are always a whole number of these
+	static constexpr int GOP_SIZE = 12;
+	// Most converted frames that segment workers can have queued between
+	// them, in bytes; 4K 4:2:0 frames are about 12 MB each
+	static constexpr int64_t SEGMENT_QUEUE_BUDGET = 512 << 20;
+	// Most frames each segment's encoder looks ahead
+	static constexpr int SEGMENT_LOOKAHEAD = 2 * GOP_SIZE;
+
+	explicit RenderEncoder(LogFn log);
+	~RenderEncoder();
+
+	RenderEncoder(const RenderEncoder &) = delete;
+	RenderEncoder &operator=(const RenderEncoder &) = delete;
+
+	bool Open(const RenderSettings &settings);
+	// Flushes the encoders, writes the trailer and frees everything.
+	// Returns false if anything failed along the way.
+	bool Close();
+
+	// Allocates a frame suitable for SubmitVideo. The rows are never
+	// padded, so the image can be treated as one contiguous buffer.
+	AVFrame *AllocCaptureFrame();
+
+	// Submits a captured BGR24 frame of the configured size. The stage
+	// timings in row are filled in, and row->output is set if this
+	// completed an output frame; the row is only complete once this
+	// returns, so record it afterwards.
+	bool SubmitVideo(const uint8_t *image, RenderStats::FrameRow *row);
+	// Submits AudioFrameSize() samples of planar signed 16-bit audio for
+	// each of Channels() channels
+	bool SubmitAudio(const int16_t *const *planes);
+
+	void PrintInfo();
+
+	int AudioFrameSize() const { return this->audio.tmpFrame->nb_samples; }
+	int Channels() const { return this->audio.enc->channels; }
+	int VideoFrames() const { return this->video.nextPts; }
+
+	static AVCodecID VideoCodecFromName(const char *name);
+	static AVCodecID AudioCodecFromName(const char *name);
+
+	// The file next to a fragmented render recording where it can be
+	// resumed from
+	static std::string ResumeFileName(const std::string &filename);
+	bool IsResumable() const { return this->resumable; }
+
+private:
+	struct Stream {
+		AVStream *stream;
+		AVCodecContext *enc;
+		AVCodec *codec;
+		AVFrame *frame, *tmpFrame;
+		AVBufferPool *pool;         // Video only; backs the capture frames
+		FrameConverter *converter;  // Video only
+		SwrContext *swrCtx;
+		int nextPts;
+		uint32_t muxMicros;  // Time spent writing packets, accumulated by FlushStream
+		int64_t muxedEndUs;  // End time of the last packet given to the muxer
+	};
+
+	// What's needed to continue a fragmented render; stored in the
+	// resume file after every fragment
+	struct ResumeInfo {
+		int width, height;
+		int fps;
+		int samplerate;
+		int videoCodec, audioCodec;
+		int64_t offset;  // Size of the file up to the end of the last complete fragment
+		int64_t nextFragment;
+		int64_t videoEndUs, audioEndUs;
+	};
+
+	bool AddStream(Stream *out, AVCodecID codecId, int64_t bitrate, int framerate, int ptsOff, int width = 0, int height = 0);
+	void CloseStream(Stream *s);
+	bool FlushStream(Stream *s, bool isEnd = false);
+	bool OpenVideo(Stream *s, AVDictionary **options);
+	bool OpenAudio(Stream *s, AVDictionary **options);
+	void Free();
+	void TrackMuxed(Stream *s, const AVPacket *pkt);
+
+	// Fragmented output
+	bool SetupFragmenting(AVDictionary **options, ResumeInfo *resumeInfo);
+	bool OpenHeaderBuffer();
+	void CloseHeaderBuffer();
+	bool OpenResumedFile(const ResumeInfo &info);
+	bool FlushFragment();
+	bool WriteResumeInfo();
+	bool ReadResumeInfo(ResumeInfo *info);
+
+	// Segmented encoding
+
+	// Each worker encodes every encodeThreads'th segment with an encoder
+	// of its own. Frames are queued in submission order; a null frame
+	// tells the worker to finish its segment and exit.
+	struct SegmentWorker {
+		std::thread thread;
+		std::mutex lock;
+		std::condition_variable cond;
+		std::deque<AVFrame *> queue;
+	};
+
+	bool StartSegmentWorkers();
+	void StopSegmentWorkers();
+	void SegmentWorkerMain(SegmentWorker *w);
+	AVCodecContext *OpenSegmentEncoder();
+	bool QueueSegmentFrame(AVFrame *frame);
+	bool MuxFinishedSegments();
+
+	bool segmented = false;
+	int segmentFrames = 0;
+	AVDictionary *videoOptions = nullptr;  // Copy of the video options, used to open each segment's encoder
+	AVBufferPool *segmentPool = nullptr;   // Backs the converted frames queued to the workers
+	std::vector<std::unique_ptr<SegmentWorker>> segmentWorkers;
+	std::mutex segmentLock;                                         // Protects finishedSegments
+	std::map<int, std::vector<AVPacket *>> finishedSegments;       // Encoded segments waiting for their turn to be muxed
+	int nextSegmentToMux = 0;
+	std::atomic<bool> segmentError{false};
+
+	LogFn log;
+	RenderSettings settings;
+	AVFormatContext *outCtx = nullptr;
+	Stream video = {};
+	Stream audio = {};
+
+	bool isMov = false;          // Fragments are written by us rather than by the muxer
+	bool resumable = false;
+	bool headerInMemory = false;  // When resuming, the header is written to a buffer that's thrown away
+	int fragmentFrames = 0;
+	int nextFragmentFlush = 0;  // Video frame at which to flush the next fragment
+
+	int nextBlendIdx = 0;             // How many frames in this blend have we seen so far?
+	uint16_t *blendSumBuf = nullptr;  // Blending buffer - contains the weighted sum of the pixel values during blending (we only divide at the end of the blend to prevent rounding errors). Not allocated if toBlend == 1.
+};
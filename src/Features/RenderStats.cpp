@@ -0,0 +1,162 @@
+#include "RenderStats.hpp"
+
+#include "Features/Hud/Hud.hpp"
+#include "Modules/Console.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#define WINDOW_SIZE 256
+// Most rows kept for sar_render_stats_export; about 2 MB, or 18
+// minutes of 60 fps without blending. Older rows are overwritten.
+#define MAX_ROWS 65536
+
+static const char *g_stageNames[RenderStats::STAGE_COUNT] = {
+	"readback",
+	"blend",
+	"convert",
+	"encode",
+	"mux",
+	"audio",
+};
+
+static struct {
+	std::mutex lock;
+
+	// Rolling window of the last WINDOW_SIZE samples of each stage
+	uint32_t window[RenderStats::STAGE_COUNT][WINDOW_SIZE];
+	uint32_t windowCount[RenderStats::STAGE_COUNT];
+
+	// Ring of the last MAX_ROWS rows; rowCount is how many were ever pushed
+	std::vector<RenderStats::FrameRow> rows;
+	uint32_t rowCount;
+	int queueDepth;
+	int lastOccupancy;
+	uint32_t outputFrames;
+
+	std::atomic<uint32_t> droppedFrames;
+	std::atomic<int> audioFill;  // Per mille
+} g_stats;
+
+static void pushSample(int stage, uint32_t micros) {
+	g_stats.window[stage][g_stats.windowCount[stage]++ % WINDOW_SIZE] = micros;
+}
+
+void RenderStats::Reset(int queueDepth) {
+	std::lock_guard<std::mutex> lock(g_stats.lock);
+	for (int i = 0; i < STAGE_COUNT; ++i) g_stats.windowCount[i] = 0;
+	g_stats.rows.clear();
+	g_stats.rowCount = 0;
+	g_stats.queueDepth = queueDepth;
+	g_stats.lastOccupancy = 0;
+	g_stats.outputFrames = 0;
+	g_stats.droppedFrames.store(0);
+	g_stats.audioFill.store(0);
+}
+
+void RenderStats::PushFrame(const FrameRow &row) {
+	std::lock_guard<std::mutex> lock(g_stats.lock);
+
+	pushSample(STAGE_READBACK, row.micros[STAGE_READBACK]);
+	pushSample(STAGE_BLEND, row.micros[STAGE_BLEND]);
+	if (row.output != -1) {
+		// The output stages only run once per output frame, so don't
+		// water down their stats with zeroes from blended subframes
+		pushSample(STAGE_CONVERT, row.micros[STAGE_CONVERT]);
+		pushSample(STAGE_ENCODE, row.micros[STAGE_ENCODE]);
+		pushSample(STAGE_MUX, row.micros[STAGE_MUX]);
+		++g_stats.outputFrames;
+	}
+
+	g_stats.lastOccupancy = row.queueOccupancy;
+	if (g_stats.rows.size() < MAX_ROWS) {
+		g_stats.rows.push_back(row);
+	} else {
+		g_stats.rows[g_stats.rowCount % MAX_ROWS] = row;
+	}
+	++g_stats.rowCount;
+}
+
+void RenderStats::RecordAudio(uint32_t micros) {
+	std::lock_guard<std::mutex> lock(g_stats.lock);
+	pushSample(STAGE_AUDIO, micros);
+}
+
+void RenderStats::RecordDroppedFrame() {
+	g_stats.droppedFrames.fetch_add(1);
+}
+
+void RenderStats::SetAudioFill(float fill) {
+	g_stats.audioFill.store((int)(fill * 1000));
+}
+
+bool RenderStats::ExportCsv(const char *filename, uint32_t *skipped) {
+	FILE *f = fopen(filename, "w");
+	if (!f) return false;
+
+#ifdef _WIN32
+	fputs(MICROSOFT_PLEASE_FIX_YOUR_SOFTWARE_SMHMYHEAD "\n", f);
+#endif
+	fputs("capture,output,readback_us,blend_us,convert_us,encode_us,mux_us,queue,audio_fill\n", f);
+
+	std::lock_guard<std::mutex> lock(g_stats.lock);
+	size_t n = g_stats.rows.size();
+	size_t first = g_stats.rowCount > n ? g_stats.rowCount % n : 0;
+	if (skipped) *skipped = g_stats.rowCount - n;
+	for (size_t i = 0; i < n; ++i) {
+		auto &row = g_stats.rows[(first + i) % n];
+		fprintf(
+			f,
+			"%u,%d,%u,%u,%u,%u,%u,%u,%.3f\n",
+			row.capture,
+			row.output,
+			row.micros[STAGE_READBACK],
+			row.micros[STAGE_BLEND],
+			row.micros[STAGE_CONVERT],
+			row.micros[STAGE_ENCODE],
+			row.micros[STAGE_MUX],
+			row.queueOccupancy,
+			row.audioFill / 1000.0f);
+	}
+
+	fclose(f);
+	return true;
+}
+
+// HUD
+
+HUD_ELEMENT_MODE2(render, "0", 0, 2, "Draws render pipeline statistics; 1 = summary, 2 = per-stage timings (p50/p95/max in ms). Note that it is visible in the render itself.\n", HudType_InGame | HudType_Paused | HudType_LoadingScreen) {
+	std::lock_guard<std::mutex> lock(g_stats.lock);
+
+	if (g_stats.windowCount[RenderStats::STAGE_READBACK] == 0) {
+		ctx->DrawElement("render: -");
+		return;
+	}
+
+	ctx->DrawElement("render: %u frames, %u dropped", g_stats.outputFrames, g_stats.droppedFrames.load());
+	ctx->DrawElement("queue: %d/%d, audio: %d%%", g_stats.lastOccupancy, g_stats.queueDepth, g_stats.audioFill.load() / 10);
+
+	if (mode < 2) return;
+
+	uint32_t samples[WINDOW_SIZE];
+	for (int stage = 0; stage < RenderStats::STAGE_COUNT; ++stage) {
+		size_t n = std::min<uint32_t>(g_stats.windowCount[stage], WINDOW_SIZE);
+		if (n == 0) {
+			ctx->DrawElement("%s: -", g_stageNames[stage]);
+			continue;
+		}
+
+		std::copy(g_stats.window[stage], g_stats.window[stage] + n, samples);
+		std::sort(samples, samples + n);
+		ctx->DrawElement(
+			"%s: %.2f / %.2f / %.2f",
+			g_stageNames[stage],
+			samples[n / 2] / 1000.0f,
+			samples[n * 95 / 100] / 1000.0f,
+			samples[n - 1] / 1000.0f);
+	}
+}
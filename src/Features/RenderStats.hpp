@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Timing instrumentation for the render pipeline. Stage timings are kept
+// in a rolling window for the HUD, and every captured frame also gets a
+// row which can be exported as CSV with sar_render_stats_export. Only the
+// most recent rows are kept, so long renders export a window of the end.
+namespace RenderStats {
+	enum Stage {
+		STAGE_READBACK,  // Game thread: reading the screen into a frame slot
+		STAGE_BLEND,     // Accumulating and resolving blended frames
+		STAGE_CONVERT,   // Pixel format conversion
+		STAGE_ENCODE,    // Sending frames to and receiving packets from the encoder
+		STAGE_MUX,       // Writing packets to the output file
+		STAGE_AUDIO,     // Resampling and encoding an audio frame
+		STAGE_COUNT,
+	};
+
+	struct FrameRow {
+		uint32_t capture;  // Index of the captured frame
+		int32_t output;    // Index of the output frame this completed, or -1
+		uint32_t micros[STAGE_AUDIO];
+		uint16_t queueOccupancy;
+		uint16_t audioFill;  // Per mille
+	};
+
+	void Reset(int queueDepth);
+
+	// Called by the worker once it's done with a captured frame
+	void PushFrame(const FrameRow &row);
+	void RecordAudio(uint32_t micros);
+	void RecordDroppedFrame();
+	void SetAudioFill(float fill);
+
+	// Writes the rows kept; skipped is set to how many earlier rows have
+	// been dropped
+	bool ExportCsv(const char *filename, uint32_t *skipped = nullptr);
+
+	class ScopedTimer {
+	public:
+		ScopedTimer(uint32_t &out)
+			: out(out)
+			, start(std::chrono::steady_clock::now()) {
+		}
+		~ScopedTimer() {
+			this->out += (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start).count();
+		}
+
+	private:
+		uint32_t &out;
+		std::chrono::steady_clock::time_point start;
+	};
+}  // namespace RenderStats
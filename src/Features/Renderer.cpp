@@ -5,27 +5,31 @@
 #include "Hook.hpp"
 #include "Modules/Engine.hpp"
 #include "Modules/Server.hpp"
+#include "Features/RenderAudio.hpp"
+#include "Features/RenderBlend.hpp"
+#include "Features/RenderConvert.hpp"
+#include "Features/RenderEncoder.hpp"
+#include "Features/RenderStats.hpp"
 #include "Features/Session.hpp"
+#include "Utils.hpp"
 #include "Utils/SDK.hpp"
 
+#include <algorithm>
 #include <atomic>
-#include <cinttypes>
+#include <chrono>
 #include <condition_variable>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libavutil/avutil.h>
-#include <libavutil/opt.h>
-#include <libavutil/pixdesc.h>
-#include <libswresample/swresample.h>
-#include <libswscale/swscale.h>
+#include <libavutil/frame.h>
 };
 
 // Stuff pulled from the engine
@@ -64,8 +68,17 @@ static Variable sar_render_autostart("sar_render_autostart", "0", "Whether to au
 static Variable sar_render_autostart_extension("sar_render_autostart_extension", "mp4", "The file extension (and hence container format) to use for automatically started renders.\n", 0);
 static Variable sar_render_autostop("sar_render_autostop", "1", "Whether to automatically stop when __END__ is seen in demo playback\n");
 static Variable sar_render_shutter_angle("sar_render_shutter_angle", "180", 30, 360, "The shutter angle to use for rendering in degrees.\n");
+static Variable sar_render_blend_profile("sar_render_blend_profile", "box", "How blended frames are weighted across the shutter (box, triangle, gaussian, custom)\n", 0);
+static Variable sar_render_blend_weights("sar_render_blend_weights", "1", "Space-separated relative weights stretched across the shutter when sar_render_blend_profile is custom\n", 0);
 static Variable sar_render_merge("sar_render_merge", "0", "When set, merge all the renders until sar_render_finish is entered\n");
 static Variable sar_render_skip_coop_videos("sar_render_skip_coop_videos", "1", "When set, don't include coop loading time in renders\n");
+static Variable sar_render_scaler("sar_render_scaler", "bilinear", "Filter used when converting captured frames to the video pixel format (point, bilinear, bicubic)\n", 0);
+static Variable sar_render_convert_threads("sar_render_convert_threads", "0", 0, 16, "How many threads to use for pixel format conversion in renders; 0 = automatic\n");
+static Variable sar_render_encode_threads("sar_render_encode_threads", "0", 0, 16, "How many segments of the video to encode concurrently; 0 or 1 = encode the whole video in one pass. Fewer are used if their queued frames wouldn't fit in memory\n");
+static Variable sar_render_segment_gops("sar_render_segment_gops", "4", 1, 100, "How many GOPs long each concurrently encoded segment is when sar_render_encode_threads is set. Shortened if the queued frames wouldn't fit in memory\n");
+static Variable sar_render_fragmented("sar_render_fragmented", "0", "When set, write renders in fragments so that an interrupted render is still playable; MP4 and MOV renders can then be continued with sar_render_resume\n");
+static Variable sar_render_fragment_interval("sar_render_fragment_interval", "2", 0.1, "How often to flush a fragment of the output when sar_render_fragmented is set (seconds)\n");
+static Variable sar_render_queue_depth("sar_render_queue_depth", "4", 1, 64, "How many captured frames can be queued for the encoder before the game waits for it\n");
 
 // g_videomode VMT wrappers {{{
 
@@ -83,20 +96,8 @@ static inline void ReadScreenPixels(int x, int y, int w, int h, void *buf, Image
 
 // }}}
 
-struct Stream {
-	AVStream *stream;
-	AVCodecContext *enc;
-	AVCodec *codec;
-	AVFrame *frame, *tmpFrame;
-	SwsContext *swsCtx;
-	SwrContext *swrCtx;
-	int nextPts;
-};
-
 enum class WorkerMsg {
 	NONE,
-	VIDEO_FRAME_READY,
-	AUDIO_FRAME_READY,
 	STOP_RENDERING_ERROR,
 	STOP_RENDERING_REQUESTED,
 };
@@ -106,38 +107,45 @@ static struct
 {
 	std::atomic<bool> isRendering;
 	std::atomic<bool> isPaused;
-	int fps;
-	int samplerate;
+	RenderSettings settings;
+	RenderEncoder *encoder;
 	int channels;
-	Stream videoStream;
-	Stream audioStream;
-	std::string filename;
-	AVFormatContext *outCtx;
-	int width, height;
-
-	// The audio stream's temporary frame needs nb_samples worth of
-	// audio before we resample and submit, so we keep track of how far
-	// in we are with this
-	int16_t *audioBuf[8];  // Temporary buffer - contains the planar audio info from the game
-	size_t audioBufSz;
-	size_t audioBufIdx;
 
-	// This buffer stores the image data
-	uint8_t *imageBuf;  // Temporary buffer - contains the raw pixel data read from the screen
-
-	int toBlend;
-	int toBlendStart;       // Inclusive
-	int toBlendEnd;         // Exclusive
-	int nextBlendIdx;       // How many frames in this blend have we seen so far?
-	uint16_t *blendSumBuf;  // Blending buffer - contains the sum of the pixel values during blending (we only divide at the end of the blend to prevent rounding errors). Not allocated if toBlend == 1.
+	// Audio ring. The sound mixer thread converts its paint buffer
+	// straight into this, and the worker takes audio out of it once
+	// there's a whole frame's worth (audioBufSz samples) for the encoder
+	RenderAudio::Ring audioRing;
+	int16_t *audioBuf[RenderAudio::MAX_CHANNELS];  // The frame being submitted, read out of the ring by the worker
+	size_t audioBufSz;
+	std::atomic<uint32_t> statAudioOverflows;  // Times the mixer had to wait for space in the ring
+
+	// Frame queue. This is a single-producer single-consumer ring of
+	// preallocated BGR24 frames which the screen is read straight into.
+	// The game thread is the only writer of frameQueueHead and the worker
+	// is the only writer of frameQueueTail; both only ever increase, and
+	// the slot index is the counter modulo queueDepth.
+	int queueDepth;
+	AVFrame **frameSlots;
+	uint32_t *slotReadbackMicros;  // How long it took to read each slot from the screen
+	std::atomic<uint32_t> frameQueueHead;
+	std::atomic<uint32_t> frameQueueTail;
+
+	// Frame queue statistics, written by the game thread
+	std::atomic<uint32_t> statQueuedFrames;
+	std::atomic<uint64_t> statQueueOccupancySum;
+	std::atomic<uint32_t> statQueueOccupancyMax;
+	std::atomic<uint32_t> statStalledFrames;
+	std::atomic<uint64_t> statStallMicros;
+
+	RenderBlend::Profile blendProfile;
 
 	// Synchronisation
 	std::thread worker;
 	std::mutex workerUpdateLock;
 	std::condition_variable workerUpdate;
 	std::atomic<WorkerMsg> workerMsg;
-	std::mutex imageBufLock;
-	std::mutex audioBufLock;
+	std::mutex imageBufLock;  // Only contended when the frame slots are freed at the end of a render
+	std::mutex audioRingLock;  // Likewise, for the audio ring
 	std::atomic<bool> workerFailedToStart;
 } g_render;
 
@@ -151,28 +159,6 @@ static inline void msgStopRender(bool error) {
 	g_render.workerUpdate.notify_all();
 }
 
-// Utilities {{{
-
-static AVCodecID videoCodecFromName(const char *name) {
-	if (!strcmp(name, "h264")) return AV_CODEC_ID_H264;
-	if (!strcmp(name, "hevc")) return AV_CODEC_ID_HEVC;
-	if (!strcmp(name, "vp8")) return AV_CODEC_ID_VP8;
-	if (!strcmp(name, "vp9")) return AV_CODEC_ID_VP9;
-	if (!strcmp(name, "dnxhd")) return AV_CODEC_ID_DNXHD;
-	return AV_CODEC_ID_NONE;
-}
-
-static AVCodecID audioCodecFromName(const char *name) {
-	if (!strcmp(name, "aac")) return AV_CODEC_ID_AAC;
-	if (!strcmp(name, "ac3")) return AV_CODEC_ID_AC3;
-	if (!strcmp(name, "vorbis")) return AV_CODEC_ID_VORBIS;
-	if (!strcmp(name, "opus")) return AV_CODEC_ID_OPUS;
-	if (!strcmp(name, "flac")) return AV_CODEC_ID_FLAC;
-	return AV_CODEC_ID_NONE;
-}
-
-// }}}
-
 // Movie command hooks {{{
 
 // We want to stop use of the normal movie system while a SAR render is
@@ -199,404 +185,54 @@ static void endmovie_cbk(const CCommand &args) {
 
 // }}}
 
-// AVFrame allocators {{{
-
-static AVFrame *allocPicture(AVPixelFormat pixFmt, int width, int height) {
-	AVFrame *picture = av_frame_alloc();
-	if (!picture) {
-		return NULL;
-	}
-
-	picture->format = pixFmt;
-	picture->width = width;
-	picture->height = height;
-
-	if (av_frame_get_buffer(picture, 32) < 0) {
-		console->Print("Failed to allocate frame data\n");
-		av_frame_free(&picture);
-		return NULL;
-	}
-
-	return picture;
-}
-
-static AVFrame *allocAudioFrame(AVSampleFormat sampleFmt, uint64_t channelLayout, int sampleRate, int nbSamples) {
-	AVFrame *frame = av_frame_alloc();
-	if (!frame) {
-		return NULL;
-	}
-
-	frame->format = sampleFmt;
-	frame->channel_layout = channelLayout;
-	frame->sample_rate = sampleRate;
-	frame->nb_samples = nbSamples;
-
-	if (nbSamples) {
-		if (av_frame_get_buffer(frame, 0) < 0) {
-			return NULL;
-		}
-	}
-
-	return frame;
-}
-
-// }}}
-
-// Stream creation and destruction {{{
-
-// framerate is sample rate for audio streams
-static bool addStream(Stream *out, AVFormatContext *outputCtx, AVCodecID codecId, int64_t bitrate, int framerate, int ptsOff, int width = 0, int height = 0) {
-	out->codec = avcodec_find_encoder(codecId);
-	if (!out->codec) {
-		console->Print("Failed to find encoder for '%s'!\n", avcodec_get_name(codecId));
-		return false;
-	}
-
-	// dnxhd bitrate selection {{{
-
-	if (codecId == AV_CODEC_ID_DNXHD) {
-		// dnxhd is fussy and won't just allow any bitrate or
-		// resolution, so check our resolution is supported and find the
-		// closest bitrate to what was requested
-
-		// rates here are in Mbps
-		int64_t *rates;
-		size_t nrates;
-
-		if (width == 1920 && height == 1080) {  // 1080p 16:9
-			static int64_t rates1080[] = {
-				36,
-				45,
-				75,
-				90,
-				115,
-				120,
-				145,
-				175,
-				180,
-				190,
-				220,
-				240,
-				365,
-				440,
-			};
-			rates = rates1080;
-			nrates = sizeof rates1080 / sizeof rates1080[0];
-		} else if (width == 1280 && height == 720) {  // 720p 16:9
-			static int64_t rates720[] = {
-				60,
-				75,
-				90,
-				110,
-				120,
-				145,
-				180,
-				220,
-			};
-			rates = rates720;
-			nrates = sizeof rates720 / sizeof rates720[0];
-		} else if (width == 1440 && height == 1080) {  // 1080p 4:3
-			static int64_t rates1080[] = {
-				63,
-				84,
-				100,
-				110,
-			};
-			rates = rates1080;
-			nrates = sizeof rates1080 / sizeof rates1080[0];
-		} else if (width == 960 && height == 720) {  // 720p 4:3
-			static int64_t rates720[] = {
-				42,
-				60,
-				75,
-				115,
-			};
-			rates = rates720;
-			nrates = sizeof rates720 / sizeof rates720[0];
-		} else {
-			console->Print("Resolution not supported by dnxhd\n");
-			return false;
-		}
-
-		int64_t realBitrate = -1;
-		int64_t lastDelta = INT64_MAX;
-
-		for (size_t i = 0; i < nrates; ++i) {
-			int64_t rate = rates[i] * 1000000;
-			int64_t delta = rate > bitrate ? rate - bitrate : bitrate - rate;
-			if (delta < lastDelta) {
-				realBitrate = rate;
-			}
-		}
-
-		if (realBitrate != bitrate) {
-			console->Print("dnxhd does not support the given bitrate; encoding at %d kb/s instead\n", realBitrate / 1000);
-			bitrate = realBitrate;
-		}
-	}
-
-	// }}}
-
-	out->stream = avformat_new_stream(outputCtx, NULL);
-	if (!out->stream) {
-		console->Print("Failed to allocate stream\n");
-		return false;
-	}
-
-	out->enc = avcodec_alloc_context3(out->codec);
-	if (!out->enc) {
-		console->Print("Failed to allocate an encoding context\n");
-		return false;
-	}
-
-	out->enc->bit_rate = bitrate;
-	out->stream->time_base = {1, framerate};
-
-	switch (out->codec->type) {
-	case AVMEDIA_TYPE_AUDIO:
-		out->enc->sample_fmt = out->codec->sample_fmts ? out->codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;  // don't really care about sample format
-		out->enc->sample_rate = framerate;
-		out->enc->channel_layout = AV_CH_LAYOUT_STEREO;
-		out->enc->channels = av_get_channel_layout_nb_channels(out->enc->channel_layout);
-
-		if (out->codec->channel_layouts) {
-			bool foundStereo = false;
-			for (const uint64_t *layout = out->codec->channel_layouts; *layout; ++layout) {
-				if (*layout == AV_CH_LAYOUT_STEREO) {
-					foundStereo = true;
-					break;
-				}
-			}
-
-			if (!foundStereo) {
-				console->Print("Stereo not supported by audio encoder\n");
-				avcodec_free_context(&out->enc);
-				return false;
-			}
-		}
-
-		if (out->codec->supported_samplerates) {
-			bool foundRate = false;
-			for (const int *rate = out->codec->supported_samplerates; *rate; ++rate) {
-				if (*rate == framerate) {
-					foundRate = true;
-					break;
-				}
-			}
-
-			if (!foundRate) {
-				console->Print("Sample rate %d not supported by audio encoder\n", framerate);
-				avcodec_free_context(&out->enc);
-				return false;
-			}
-		}
-
-		break;
-
-	case AVMEDIA_TYPE_VIDEO:
-		out->enc->codec_id = codecId;
-		out->enc->width = width;
-		out->enc->height = height;
-		out->enc->time_base = out->stream->time_base;
-		out->enc->gop_size = 12;
-		out->enc->pix_fmt = codecId == AV_CODEC_ID_DNXHD ? AV_PIX_FMT_YUV422P : AV_PIX_FMT_YUV420P;
-
-		break;
-
-	default:
-		break;
-	}
-
-	if (outputCtx->oformat->flags & AVFMT_GLOBALHEADER) {
-		out->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-	}
-
-	out->nextPts = ptsOff;
-
-	return true;
-}
-
-static void closeStream(Stream *s) {
-	avcodec_free_context(&s->enc);
-	av_frame_free(&s->frame);
-	av_frame_free(&s->tmpFrame);
-	sws_freeContext(s->swsCtx);
-	swr_free(&s->swrCtx);
-}
-
-// }}}
-
-// Flushing streams {{{
-
-static bool flushStream(Stream *s, bool isEnd = false) {
-	if (isEnd) {
-		avcodec_send_frame(s->enc, NULL);
-	}
-
-	while (true) {
-		AVPacket pkt = {0};
-		int ret = avcodec_receive_packet(s->enc, &pkt);
-		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-			return true;
-		} else if (ret < 0) {
-			return false;
-		}
-		av_packet_rescale_ts(&pkt, s->enc->time_base, s->stream->time_base);
-		pkt.stream_index = s->stream->index;
-		av_interleaved_write_frame(g_render.outCtx, &pkt);
-		av_packet_unref(&pkt);
-	}
-}
-
-// }}}
-
-// Opening streams {{{
-
-static bool openVideo(AVFormatContext *outputCtx, Stream *s, AVDictionary **options) {
-	if (avcodec_open2(s->enc, s->codec, options) < 0) {
-		console->Print("Failed to open video codec\n");
-		return false;
-	}
-
-	s->frame = allocPicture(s->enc->pix_fmt, s->enc->width, s->enc->height);
-	if (!s->frame) {
-		console->Print("Failed to allocate video frame\n");
-		return false;
-	}
-
-	s->tmpFrame = allocPicture(AV_PIX_FMT_BGR24, s->enc->width, s->enc->height);
-	if (!s->tmpFrame) {
-		console->Print("Failed to allocate intermediate video frame\n");
-		return false;
-	}
-
-	if (avcodec_parameters_from_context(s->stream->codecpar, s->enc) < 0) {
-		console->Print("Failed to copy stream parameters\n");
-		return false;
-	}
-
-	s->swsCtx = sws_getContext(s->enc->width, s->enc->height, AV_PIX_FMT_BGR24, s->enc->width, s->enc->height, s->enc->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
-	if (!s->swsCtx) {
-		console->Print("Failed to initialize conversion context\n");
-		return false;
-	}
-
-	return true;
-}
-
-static bool openAudio(AVFormatContext *outputCtx, Stream *s, AVDictionary **options) {
-	if (avcodec_open2(s->enc, s->codec, options) < 0) {
-		console->Print("Failed to open audio codec\n");
-		return false;
-	}
-
-	s->frame = allocAudioFrame(s->enc->sample_fmt, s->enc->channel_layout, s->enc->sample_rate, s->enc->frame_size);
-	s->tmpFrame = allocAudioFrame(AV_SAMPLE_FMT_S16P, s->enc->channel_layout, s->enc->sample_rate, s->enc->frame_size);
-
-	if (avcodec_parameters_from_context(s->stream->codecpar, s->enc) < 0) {
-		console->Print("Failed to copy stream parameters\n");
-		return false;
-	}
-
-	s->swrCtx = swr_alloc();
-	if (!s->swrCtx) {
-		console->Print("Failed to allocate resampler context\n");
-		return false;
-	}
-
-	av_opt_set_int(s->swrCtx, "in_channel_count", s->enc->channels, 0);
-	av_opt_set_int(s->swrCtx, "in_sample_rate", 44100, 0);
-	av_opt_set_sample_fmt(s->swrCtx, "in_sample_fmt", AV_SAMPLE_FMT_S16P, 0);
-	av_opt_set_int(s->swrCtx, "out_channel_count", s->enc->channels, 0);
-	av_opt_set_int(s->swrCtx, "out_sample_rate", s->enc->sample_rate, 0);
-	av_opt_set_sample_fmt(s->swrCtx, "out_sample_fmt", s->enc->sample_fmt, 0);
-
-	if (swr_init(s->swrCtx) < 0) {
-		console->Print("Failed to initialize resampler context\n");
-		return false;
-	}
-
-	return true;
-}
-
-// }}}
-
 // Worker thread {{{
 
 // workerStartRender {{{
 
-static void workerStartRender(AVCodecID videoCodec, AVCodecID audioCodec, int64_t videoBitrate, int64_t audioBitrate, AVDictionary *options) {
-	if (avformat_alloc_output_context2(&g_render.outCtx, NULL, NULL, g_render.filename.c_str()) == AVERROR(EINVAL)) {
-		console->Print("Failed to deduce output format from file extension - using MP4\n");
-		avformat_alloc_output_context2(&g_render.outCtx, NULL, "mp4", g_render.filename.c_str());
-	}
+static void renderLog(const char *fmt, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	console->Print("%s", buf);
+}
 
-	if (!g_render.outCtx) {
-		console->Print("Failed to allocate output context\n");
+static void workerStartRender() {
+	g_render.encoder = new RenderEncoder(&renderLog);
+	if (!g_render.encoder->Open(g_render.settings)) {
+		delete g_render.encoder;
+		g_render.encoder = NULL;
 		return;
 	}
 
-	if (!addStream(&g_render.videoStream, g_render.outCtx, videoCodec, videoBitrate, g_render.fps, 0, g_render.width, g_render.height)) {
-		console->Print("Failed to create video stream\n");
-		avformat_free_context(g_render.outCtx);
-		return;
-	}
+	g_render.audioBufSz = g_render.encoder->AudioFrameSize();
 
-	if (!addStream(&g_render.audioStream, g_render.outCtx, audioCodec, audioBitrate, g_render.samplerate, g_render.samplerate / 10)) {  // offset the start by 0.1s because idk
-		console->Print("Failed to create audio stream\n");
-		closeStream(&g_render.videoStream);
-		avformat_free_context(g_render.outCtx);
-		return;
-	}
+	g_render.channels = g_render.encoder->Channels();
 
-	if (!openVideo(g_render.outCtx, &g_render.videoStream, &options)) {
-		console->Print("Failed to open video stream\n");
-		closeStream(&g_render.audioStream);
-		closeStream(&g_render.videoStream);
-		avformat_free_context(g_render.outCtx);
-		return;
-	}
+	// Enough for the worker to fall a couple of seconds behind on audio
+	// before the mixer has to wait for it, which in practice means never:
+	// the game already waits on the frame queue long before that
+	g_render.audioRing.Init(g_render.channels, std::max<size_t>(2 * RenderEncoder::INPUT_SAMPLE_RATE, 4 * g_render.audioBufSz));
+	g_render.statAudioOverflows.store(0);
 
-	if (!openAudio(g_render.outCtx, &g_render.audioStream, &options)) {
-		console->Print("Failed to open audio stream\n");
-		closeStream(&g_render.audioStream);
-		closeStream(&g_render.videoStream);
-		avformat_free_context(g_render.outCtx);
-		return;
-	}
-
-	if (avio_open(&g_render.outCtx->pb, g_render.filename.c_str(), AVIO_FLAG_WRITE) < 0) {
-		console->Print("Failed to open output file\n");
-		closeStream(&g_render.audioStream);
-		closeStream(&g_render.videoStream);
-		avformat_free_context(g_render.outCtx);
-		return;
+	g_render.frameSlots = (AVFrame **)malloc(g_render.queueDepth * sizeof g_render.frameSlots[0]);
+	for (int i = 0; i < g_render.queueDepth; ++i) {
+		g_render.frameSlots[i] = g_render.encoder->AllocCaptureFrame();
 	}
-
-	if (avformat_write_header(g_render.outCtx, &options) < 0) {
-		console->Print("Failed to write output file\n");
-		closeStream(&g_render.audioStream);
-		closeStream(&g_render.videoStream);
-		avio_closep(&g_render.outCtx->pb);
-		avformat_free_context(g_render.outCtx);
-		return;
-	}
-
-	g_render.audioBufIdx = 0;
-	g_render.audioBufSz = g_render.audioStream.tmpFrame->nb_samples;
-
-	g_render.channels = g_render.audioStream.enc->channels;
-
-	g_render.imageBuf = (uint8_t *)malloc(3 * g_render.width * g_render.height);
+	g_render.slotReadbackMicros = (uint32_t *)calloc(g_render.queueDepth, sizeof g_render.slotReadbackMicros[0]);
+	RenderStats::Reset(g_render.queueDepth);
+	g_render.frameQueueHead.store(0);
+	g_render.frameQueueTail.store(0);
+	g_render.statQueuedFrames.store(0);
+	g_render.statQueueOccupancySum.store(0);
+	g_render.statQueueOccupancyMax.store(0);
+	g_render.statStalledFrames.store(0);
+	g_render.statStallMicros.store(0);
 	for (int i = 0; i < g_render.channels; ++i) {
 		g_render.audioBuf[i] = (int16_t *)malloc(g_render.audioBufSz * sizeof g_render.audioBuf[i][0]);
 	}
 
-	g_render.nextBlendIdx = 0;
-	if (g_render.toBlend > 1) {
-		g_render.blendSumBuf = (uint16_t *)calloc(3 * g_render.width * g_render.height, sizeof g_render.blendSumBuf[0]);
-	}
-
 	g_movieInfo->moviename[0] = 'a';  // Just something nonzero to make the game think there's a movie in progress
 	g_movieInfo->moviename[1] = 0;
 	g_movieInfo->movieframe = 0;
@@ -604,23 +240,19 @@ static void workerStartRender(AVCodecID videoCodec, AVCodecID audioCodec, int64_
 
 	g_render.isRendering.store(true);
 
-	console->Print("Started rendering to '%s'\n", g_render.filename.c_str());
+	console->Print("Started rendering to '%s'\n", g_render.settings.filename.c_str());
 
-	console->Print(
-		"    video: %s (%dx%d @ %d fps, %" PRId64 " kb/s, %s)\n",
-		g_render.videoStream.codec->name,
-		g_render.width,
-		g_render.height,
-		g_render.fps,
-		g_render.videoStream.enc->bit_rate / 1000,
-		av_get_pix_fmt_name(g_render.videoStream.enc->pix_fmt));
+	g_render.encoder->PrintInfo();
 
-	console->Print(
-		"    audio: %s (%d Hz, %" PRId64 " kb/s, %s)\n",
-		g_render.audioStream.codec->name,
-		g_render.audioStream.enc->sample_rate,
-		g_render.audioStream.enc->bit_rate / 1000,
-		av_get_sample_fmt_name(g_render.audioStream.enc->sample_fmt));
+	if (g_render.settings.toBlend > 1) {
+		console->Print(
+			"    blend: %d frames (%s profile, %s kernel)\n",
+			g_render.settings.toBlend,
+			RenderBlend::ProfileName(g_render.blendProfile),
+			RenderBlend::KernelName());
+	}
+
+	console->Print("    audio capture: %s kernel\n", RenderAudio::KernelName());
 }
 
 // }}}
@@ -636,30 +268,48 @@ static void workerFinishRender(bool error) {
 
 	g_render.isRendering.store(false);
 
-	flushStream(&g_render.videoStream, true);
-	flushStream(&g_render.audioStream, true);
+	int frames = g_render.encoder->VideoFrames();
+	bool resumable = g_render.encoder->IsResumable();
 
-	av_write_trailer(g_render.outCtx);
+	if (!g_render.encoder->Close()) {
+		console->Print("Failed to finalize the output file\n");
+	}
 
-	console->Print("Rendered %d frames to '%s'\n", g_render.videoStream.nextPts, g_render.filename.c_str());
+	console->Print("Rendered %d frames to '%s'\n", frames, g_render.settings.filename.c_str());
+	if (error && resumable) {
+		console->Print("The render can be continued with 'sar_render_resume %s'\n", g_render.settings.filename.c_str());
+	}
+
+	uint32_t queued = g_render.statQueuedFrames.load();
+	console->Print(
+		"Frame queue: depth %d, average occupancy %.2f, max occupancy %u, game stalled on %u frames for %.1f ms total\n",
+		g_render.queueDepth,
+		queued ? (double)g_render.statQueueOccupancySum.load() / queued : 0.0,
+		g_render.statQueueOccupancyMax.load(),
+		g_render.statStalledFrames.load(),
+		g_render.statStallMicros.load() / 1000.0);
+
+	if (g_render.statAudioOverflows.load()) {
+		console->Print("Audio ring overflowed %u times\n", g_render.statAudioOverflows.load());
+	}
 
 	g_render.imageBufLock.lock();
-	g_render.audioBufLock.lock();
+	g_render.audioRingLock.lock();
 
-	closeStream(&g_render.videoStream);
-	closeStream(&g_render.audioStream);
-	avio_closep(&g_render.outCtx->pb);
-	avformat_free_context(g_render.outCtx);
-	free(g_render.imageBuf);
+	for (int i = 0; i < g_render.queueDepth; ++i) {
+		av_frame_free(&g_render.frameSlots[i]);
+	}
+	free(g_render.frameSlots);
+	free(g_render.slotReadbackMicros);
 	for (int i = 0; i < g_render.channels; ++i) {
 		free(g_render.audioBuf[i]);
 	}
-	if (g_render.toBlend > 1) {
-		free(g_render.blendSumBuf);
-	}
+	g_render.audioRing.Free();
+	delete g_render.encoder;
+	g_render.encoder = NULL;
 
 	g_render.imageBufLock.unlock();
-	g_render.audioBufLock.unlock();
+	g_render.audioRingLock.unlock();
 
 	// Reset all the Source movieinfo struct to its default values
 	g_movieInfo->moviename[0] = 0;
@@ -672,135 +322,111 @@ static void workerFinishRender(bool error) {
 
 // workerHandleVideoFrame {{{
 
+// Consumes the frame at the tail of the frame queue
 static bool workerHandleVideoFrame() {
-	g_render.imageBufLock.lock();
-	g_render.workerMsg.store(WorkerMsg::NONE);  // It's important that we do this *after* locking the image buffer
-	size_t size = g_render.width * g_render.height * 3;
-	if (g_render.toBlend == 1) {
-		// We can just copy the data directly
-		memcpy(g_render.videoStream.tmpFrame->data[0], g_render.imageBuf, size);
-		g_render.imageBufLock.unlock();
-	} else {
-		if (g_render.nextBlendIdx >= g_render.toBlendStart && g_render.nextBlendIdx < g_render.toBlendEnd) {
-			for (size_t i = 0; i < size; ++i) {
-				g_render.blendSumBuf[i] += g_render.imageBuf[i];
-			}
-		}
-		g_render.imageBufLock.unlock();
-
-		if (++g_render.nextBlendIdx != g_render.toBlend) {
-			// We've added in this frame, but not done blending yet
-			return true;
-		}
-
-		int shift = g_render.toBlendEnd - g_render.toBlendStart;
+	uint32_t tail = g_render.frameQueueTail.load(std::memory_order_relaxed);
+	AVFrame *slot = g_render.frameSlots[tail % g_render.queueDepth];
 
-		for (size_t i = 0; i < size; ++i) {
-			g_render.videoStream.tmpFrame->data[0][i] = g_render.blendSumBuf[i] / shift;
-			g_render.blendSumBuf[i] = 0;
-		}
-
-		g_render.nextBlendIdx = 0;
-	}
+	RenderStats::FrameRow row = {};
+	row.capture = tail;
+	row.output = -1;
+	row.micros[RenderStats::STAGE_READBACK] = g_render.slotReadbackMicros[tail % g_render.queueDepth];
+	row.queueOccupancy = g_render.frameQueueHead.load(std::memory_order_acquire) - tail;
+	row.audioFill = 1000 * g_render.audioRing.Available() / g_render.audioRing.Capacity();
 
-	// tmpFrame is now our final frame; convert to the output format and
-	// process it
+	bool ok = g_render.encoder->SubmitVideo(slot->data[0], &row);
 
-	sws_scale(g_render.videoStream.swsCtx, (const uint8_t *const *)g_render.videoStream.tmpFrame->data, g_render.videoStream.tmpFrame->linesize, 0, g_render.height, g_render.videoStream.frame->data, g_render.videoStream.frame->linesize);
+	// The encoder is done with the captured frame now, whether it was
+	// blended or converted directly
+	g_render.frameQueueTail.store(tail + 1, std::memory_order_release);
 
-	g_render.videoStream.frame->pts = g_render.videoStream.nextPts;
-
-	if (avcodec_send_frame(g_render.videoStream.enc, g_render.videoStream.frame) < 0) {
-		console->Print("Failed to send video frame for encoding!\n");
-		return false;
-	}
+	if (ok) RenderStats::PushFrame(row);
 
-	if (!flushStream(&g_render.videoStream)) {
-		console->Print("Failed to flush video stream!\n");
-		return false;
-	}
-
-	++g_render.videoStream.nextPts;
-
-	return true;
+	return ok;
 }
 
 // }}}
 
 // workerHandleAudioFrame {{{
 
+// Consumes one encoder frame's worth of audio from the ring
 static bool workerHandleAudioFrame() {
-	g_render.audioBufLock.lock();
-	g_render.workerMsg.store(WorkerMsg::NONE);  // It's important that we do this *after* locking the audio buffer
-
-	Stream *s = &g_render.audioStream;
-	for (int i = 0; i < g_render.channels; ++i) {
-		memcpy(s->tmpFrame->data[i], g_render.audioBuf[i], g_render.audioBufSz * sizeof g_render.audioBuf[i][0]);
-	}
-	g_render.audioBufLock.unlock();
-
-
-	s->tmpFrame->pts = s->nextPts;
-	s->nextPts += s->frame->nb_samples;
-
-	if (av_frame_make_writable(s->frame) < 0) {
-		console->Print("Failed to make audio frame writable!\n");
-		return false;
-	}
-
-	if (swr_convert(s->swrCtx, s->frame->data, s->frame->nb_samples, (const uint8_t **)s->tmpFrame->data, s->tmpFrame->nb_samples) < 0) {
-		console->Print("Failed to resample audio frame!\n");
-		return false;
-	}
-
-	s->frame->pts = av_rescale_q(s->tmpFrame->pts, {1, s->enc->sample_rate}, s->enc->time_base);
-
-	if (avcodec_send_frame(s->enc, s->frame) < 0) {
-		console->Print("Failed to send audio frame for encoding!\n");
-		return false;
-	}
-
-	if (!flushStream(s)) {
-		console->Print("Failed to flush audio stream!\n");
-		return false;
+	uint32_t micros = 0;
+	bool ok;
+	{
+		RenderStats::ScopedTimer timer(micros);
+		g_render.audioRing.Read(g_render.audioBuf, g_render.audioBufSz);
+		ok = g_render.encoder->SubmitAudio(g_render.audioBuf);
 	}
-
-	return true;
+	if (ok) RenderStats::RecordAudio(micros);
+	return ok;
 }
 
 // }}}
 
-static void worker(AVCodecID videoCodec, AVCodecID audioCodec, int64_t videoBitrate, int64_t audioBitrate, AVDictionary *options) {
-	workerStartRender(videoCodec, audioCodec, videoBitrate, audioBitrate, options);
+static void worker() {
+	workerStartRender();
 	if (!g_render.isRendering.load()) {
 		g_render.workerFailedToStart.store(true);
 		return;
 	}
+	auto framesQueued = []() {
+		return g_render.frameQueueHead.load(std::memory_order_acquire) != g_render.frameQueueTail.load(std::memory_order_relaxed);
+	};
+	auto audioQueued = []() {
+		return g_render.audioRing.Available() >= g_render.audioBufSz;
+	};
 	std::unique_lock<std::mutex> lock(g_render.workerUpdateLock);
 	while (true) {
-		g_render.workerUpdate.wait(lock);
+		g_render.workerUpdate.wait(lock, [&]() {
+			return framesQueued() || audioQueued() || g_render.workerMsg.load() != WorkerMsg::NONE;
+		});
+
 		switch (g_render.workerMsg.load()) {
-		case WorkerMsg::VIDEO_FRAME_READY:
-			if (!workerHandleVideoFrame()) {
-				workerFinishRender(true);
-				return;
-			}
-			break;
-		case WorkerMsg::AUDIO_FRAME_READY:
-			if (!workerHandleAudioFrame()) {
-				workerFinishRender(true);
-				return;
-			}
-			break;
 		case WorkerMsg::STOP_RENDERING_ERROR:
+			lock.unlock();
 			workerFinishRender(true);
 			return;
 		case WorkerMsg::STOP_RENDERING_REQUESTED:
+			// Encode whatever is still queued before finishing; a partial
+			// audio frame at the end is dropped
+			lock.unlock();
+			while (framesQueued() || audioQueued()) {
+				if ((audioQueued() && !workerHandleAudioFrame()) || (framesQueued() && !workerHandleVideoFrame())) {
+					workerFinishRender(true);
+					return;
+				}
+			}
 			workerFinishRender(false);
 			return;
-		case WorkerMsg::NONE:
+		default:
 			break;
 		}
+
+		// Audio frames are cheap, so get them out of the way first to
+		// keep the ring from filling up behind a backlog of video
+		if (audioQueued()) {
+			lock.unlock();
+			bool ok = workerHandleAudioFrame();
+			lock.lock();
+			if (!ok) {
+				lock.unlock();
+				workerFinishRender(true);
+				return;
+			}
+			continue;
+		}
+
+		if (framesQueued()) {
+			lock.unlock();
+			bool ok = workerHandleVideoFrame();
+			lock.lock();
+			if (!ok) {
+				lock.unlock();
+				workerFinishRender(true);
+				return;
+			}
+		}
 	}
 }
 
@@ -808,15 +434,13 @@ static void worker(AVCodecID videoCodec, AVCodecID audioCodec, int64_t videoBitr
 
 // startRender {{{
 
-static void startRender() {
+static void startRender(bool resume = false) {
 	// We can't start rendering if we haven't stopped yet, so make sure
 	// the worker thread isn't running
 	if (g_render.worker.joinable()) {
 		g_render.worker.join();
 	}
 
-	AVDictionary *options = NULL;
-
 	if (g_render.isRendering.load()) {
 		console->Print("Already rendering\n");
 		return;
@@ -827,36 +451,57 @@ static void startRender() {
 		return;
 	}
 
-	g_render.samplerate = sar_render_sample_rate.GetInt();
-	g_render.fps = sar_render_fps.GetInt();
+	RenderSettings &settings = g_render.settings;
+
+	settings.samplerate = sar_render_sample_rate.GetInt();
+	settings.fps = sar_render_fps.GetInt();
 
 	if (sar_render_blend.GetInt() == 0 && host_framerate.GetInt() == 0) {
 		console->Print("host_framerate or sar_render_blend must be nonzero\n");
 		return;
 	} else if (sar_render_blend.GetInt() != 0) {
-		g_render.toBlend = sar_render_blend.GetInt();
-		int framerate = g_render.toBlend * g_render.fps;
+		settings.toBlend = sar_render_blend.GetInt();
+		int framerate = settings.toBlend * settings.fps;
 		if (host_framerate.GetInt() != 0 && host_framerate.GetInt() != framerate) {
 			console->Print("Warning: overriding host_framerate to %d based on sar_render_fps and sar_render_blend\n", framerate);
 		}
 		host_framerate.SetValue(framerate);
 	} else {  // host_framerate nonzero
 		int framerate = host_framerate.GetInt();
-		if (framerate % g_render.fps != 0) {
+		if (framerate % settings.fps != 0) {
 			console->Print("host_framerate must be a multiple of sar_render_fps\n");
 			return;
 		}
-		g_render.toBlend = framerate / g_render.fps;
+		settings.toBlend = framerate / settings.fps;
 	}
 
+	int toBlendStart;  // Inclusive
+	int toBlendEnd;    // Exclusive
 	{
 		float shutter = (float)sar_render_shutter_angle.GetInt() / 360.0f;
-		int toExclude = (int)round(g_render.toBlend * (1 - shutter) / 2);
-		if (toExclude * 2 >= g_render.toBlend) {
-			toExclude = g_render.toBlend / 2 - 1;
+		int toExclude = (int)round(settings.toBlend * (1 - shutter) / 2);
+		if (toExclude * 2 >= settings.toBlend) {
+			toExclude = settings.toBlend / 2 - 1;
+		}
+		toBlendStart = toExclude;
+		toBlendEnd = settings.toBlend - toExclude;
+	}
+
+	if (!RenderBlend::ProfileFromName(sar_render_blend_profile.GetString(), g_render.blendProfile)) {
+		console->Print("Unknown blend profile '%s'\n", sar_render_blend_profile.GetString());
+		return;
+	}
+
+	settings.blendWeights.clear();
+	settings.blendWeightSum = 0;
+	if (settings.toBlend > 1) {
+		auto custom = RenderBlend::ParseCustomWeights(sar_render_blend_weights.GetString());
+		settings.blendWeights = RenderBlend::ComputeWeights(g_render.blendProfile, settings.toBlend, toBlendStart, toBlendEnd, custom);
+		for (uint16_t w : settings.blendWeights) settings.blendWeightSum += w;
+		if (settings.blendWeightSum > RenderBlend::MAX_WEIGHT_SUM) {
+			console->Print("Too many frames to blend (at most %u can be blended)\n", RenderBlend::MAX_WEIGHT_SUM);
+			return;
 		}
-		g_render.toBlendStart = toExclude;
-		g_render.toBlendEnd = g_render.toBlend - toExclude;
 	}
 
 	if (snd_surround_speakers.GetInt() != 2) {
@@ -864,54 +509,50 @@ static void startRender() {
 		snd_surround_speakers.SetValue(2);
 	}
 
-	AVCodecID videoCodec = videoCodecFromName(sar_render_vcodec.GetString());
-	AVCodecID audioCodec = audioCodecFromName(sar_render_acodec.GetString());
+	settings.videoCodec = RenderEncoder::VideoCodecFromName(sar_render_vcodec.GetString());
+	settings.audioCodec = RenderEncoder::AudioCodecFromName(sar_render_acodec.GetString());
 
-	if (videoCodec == AV_CODEC_ID_NONE) {
+	if (settings.videoCodec == AV_CODEC_ID_NONE) {
 		console->Print("Unknown video codec '%s'\n", sar_render_vcodec.GetString());
 		return;
 	}
 
-	if (audioCodec == AV_CODEC_ID_NONE) {
+	if (settings.audioCodec == AV_CODEC_ID_NONE) {
 		console->Print("Unknown audio codec '%s'\n", sar_render_acodec.GetString());
 		return;
 	}
 
-	float videoBitrate = sar_render_vbitrate.GetFloat();
-	float audioBitrate = sar_render_abitrate.GetFloat();
+	settings.videoBitrate = sar_render_vbitrate.GetFloat() * 1000;
+	settings.audioBitrate = sar_render_abitrate.GetFloat() * 1000;
+	settings.quality = sar_render_quality.GetInt();
 
-	int quality = sar_render_quality.GetInt();
-	if (quality < 0) quality = 0;
-	if (quality > 50) quality = 50;
+	settings.width = GetScreenWidth();
+	settings.height = GetScreenHeight();
+	g_render.queueDepth = sar_render_queue_depth.GetInt();
 
-	// Quality options
-	{
-		// TODO: CRF scales non-linearly. Do we make this conversion
-		// non-linear to better reflect that?
-
-		int min = 0;
-		int max = 63;
-		if (videoCodec == AV_CODEC_ID_H264 || videoCodec == AV_CODEC_ID_HEVC) {
-			max = 51;
-		} else if (videoCodec == AV_CODEC_ID_VP8) {
-			min = 4;
-		}
-		int crf = min + (max - min) * (50 - quality) / 50;
-		std::string crfStr = std::to_string(crf);
-		av_dict_set(&options, "crf", crfStr.c_str(), 0);
+	settings.scalerFlags = ScalerFlagsFromName(sar_render_scaler.GetString());
+	if (settings.scalerFlags < 0) {
+		console->Print("Unknown scaler '%s'\n", sar_render_scaler.GetString());
+		return;
+	}
 
-		if (videoCodec == AV_CODEC_ID_H264 || videoCodec == AV_CODEC_ID_HEVC) {
-			av_dict_set(&options, "preset", "slower", 0);
-		}
+	settings.convertThreads = sar_render_convert_threads.GetInt();
+	if (settings.convertThreads <= 0) {
+		// Leave most of the cores to the encoder
+		settings.convertThreads = std::max(1, std::min(4, (int)std::thread::hardware_concurrency() / 2));
 	}
 
-	g_render.width = GetScreenWidth();
-	g_render.height = GetScreenHeight();
+	settings.encodeThreads = sar_render_encode_threads.GetInt();
+	settings.segmentGops = sar_render_segment_gops.GetInt();
+
+	settings.fragmented = resume || sar_render_fragmented.GetBool();
+	settings.fragmentSeconds = sar_render_fragment_interval.GetFloat();
+	settings.resume = resume;
 
 	g_render.workerFailedToStart.store(false);
 
 	g_render.workerMsg.store(WorkerMsg::NONE);
-	g_render.worker = std::thread(worker, videoCodec, audioCodec, videoBitrate * 1000, audioBitrate * 1000, options);
+	g_render.worker = std::thread(worker);
 
 	// Busy-wait until the rendering has started so that we don't miss
 	// any frames
@@ -923,20 +564,24 @@ static void startRender() {
 
 // Audio output {{{
 
-static inline short clip16(int x) {
-	if (x < -32768) return -32768;  // Source uses -32767, but that's, like, not how two's complement works
-	if (x > 32767) return 32767;
-	return x;
-}
-
 static void (*SND_RecordBuffer)();
 static void SND_RecordBuffer_Hook();
 static Hook g_RecordBufferHook(&SND_RecordBuffer_Hook);
+static void (*SND_RecordBuffer_Orig)();  // Trampoline into the original function
+
+// The length of SND_RecordBuffer's prologue, which the trampoline runs
+// before jumping back into the function. On Windows this is 'push ebp;
+// mov ebp, esp; cmp byte ptr [x], 0'; on Linux, 'push ebp; mov ebp,
+// esp; push edi; push esi'.
+#ifdef _WIN32
+#	define SND_RECORDBUFFER_PROLOGUE 10
+#else
+#	define SND_RECORDBUFFER_PROLOGUE 5
+#endif
+
 static void SND_RecordBuffer_Hook() {
 	if (!g_render.isRendering.load()) {
-		g_RecordBufferHook.Disable();
-		SND_RecordBuffer();
-		g_RecordBufferHook.Enable();
+		SND_RecordBuffer_Orig();
 		return;
 	}
 
@@ -945,54 +590,43 @@ static void SND_RecordBuffer_Hook() {
 
 	if (engine->ConsoleVisible()) return;
 
-	// If the worker has received a message it hasn't yet handled,
-	// busy-wait; this is a really obscure race condition that should
-	// never happen
-	while (g_render.isRendering.load() && g_render.workerMsg.load() != WorkerMsg::NONE)
-		;
-
 	if (snd_surround_speakers.GetInt() != 2) {
 		console->Print("Speaker configuration changed!\n");
 		msgStopRender(true);
 		return;
 	}
 
-	g_render.audioBufLock.lock();
-
-	for (int i = 0; i < *g_snd_linear_count; i += g_render.channels) {
-		for (int c = 0; c < g_render.channels; ++c) {
-			g_render.audioBuf[c][g_render.audioBufIdx] = clip16(((*g_snd_p)[i + c] * *g_snd_vol) >> 8);
-		}
-
-		++g_render.audioBufIdx;
-		if (g_render.audioBufIdx == g_render.audioBufSz) {
-			g_render.audioBufLock.unlock();
+	std::lock_guard<std::mutex> ringLock(g_render.audioRingLock);
 
-			g_render.workerUpdateLock.lock();
-			g_render.workerMsg.store(WorkerMsg::AUDIO_FRAME_READY);
-			g_render.workerUpdate.notify_all();
-			g_render.workerUpdateLock.unlock();
-
-			// Busy-wait until the worker locks the audio buffer; not
-			// ideal, but shouldn't take long
-			while (g_render.isRendering.load() && g_render.workerMsg.load() != WorkerMsg::NONE)
-				;
+	// Double check the ring hasn't been freed since we started
+	if (!g_render.isRendering.load()) return;
 
-			if (!g_render.isRendering.load()) {
-				// We shouldn't write to that buffer anymore, it's been
-				// invalidated
-				// We've already unlocked audioBufLock so just return
-				return;
+	const int *paint = *g_snd_p;
+	size_t frames = *g_snd_linear_count / g_render.channels;
+
+	size_t written = g_render.audioRing.Write(paint, frames, *g_snd_vol);
+	if (written < frames) {
+		// The worker is seconds behind; the only thing we can do without
+		// losing audio is wait for it
+		g_render.statAudioOverflows.fetch_add(1);
+		while (written < frames && g_render.isRendering.load()) {
+			{
+				std::lock_guard<std::mutex> lock(g_render.workerUpdateLock);
+				g_render.workerUpdate.notify_all();
 			}
-
-			g_render.audioBufLock.lock();
-			g_render.audioBufIdx = 0;
+			std::this_thread::yield();
+			written += g_render.audioRing.Write(paint + written * g_render.channels, frames - written, *g_snd_vol);
 		}
 	}
 
-	g_render.audioBufLock.unlock();
+	size_t available = g_render.audioRing.Available();
+	RenderStats::SetAudioFill((float)available / g_render.audioRing.Capacity());
 
-	return;
+	// Only wake the worker if there's a whole encoder frame for it
+	if (available >= g_render.audioBufSz) {
+		std::lock_guard<std::mutex> lock(g_render.workerUpdateLock);
+		g_render.workerUpdate.notify_all();
+	}
 }
 
 // }}}
@@ -1012,7 +646,7 @@ void Renderer::Frame() {
 		Renderer::isDemoLoading = false;
 
 		if (!g_render.isRendering.load()) {
-			g_render.filename = std::string(engine->GetGameDirectory()) + "/" + std::string(engine->demoplayer->DemoName) + "." + sar_render_autostart_extension.GetString();
+			g_render.settings.filename = std::string(engine->GetGameDirectory()) + "/" + std::string(engine->demoplayer->DemoName) + "." + sar_render_autostart_extension.GetString();
 			startRender();
 		}
 	} else {
@@ -1043,47 +677,66 @@ void Renderer::Frame() {
 		return;
 
 	// Don't render if the console is visible
-	if (engine->ConsoleVisible()) return;
-
-	// If the worker has received a message it hasn't yet handled,
-	// busy-wait; this is a really obscure race condition that should
-	// never happen
-	while (g_render.isRendering.load() && g_render.workerMsg.load() != WorkerMsg::NONE)
-		;
+	if (engine->ConsoleVisible()) {
+		RenderStats::RecordDroppedFrame();
+		return;
+	}
 
-	if (GetScreenWidth() != g_render.width) {
+	if (GetScreenWidth() != g_render.settings.width) {
 		console->Print("Screen resolution has changed!\n");
 		msgStopRender(true);
 		return;
 	}
 
-	if (GetScreenHeight() != g_render.height) {
+	if (GetScreenHeight() != g_render.settings.height) {
 		console->Print("Screen resolution has changed!\n");
 		msgStopRender(true);
 		return;
 	}
 
-	if (av_frame_make_writable(g_render.videoStream.frame) < 0) {
-		console->Print("Failed to make video frame writable!\n");
-		msgStopRender(true);
-		return;
+	// If the frame queue is full, wait for the worker to free a slot.
+	// This is the only point where the game waits on the encoder, so we
+	// keep track of how often it happens
+	uint32_t head = g_render.frameQueueHead.load(std::memory_order_relaxed);
+	if (head - g_render.frameQueueTail.load(std::memory_order_acquire) >= (uint32_t)g_render.queueDepth) {
+		auto stallStart = std::chrono::steady_clock::now();
+		while (g_render.isRendering.load() && head - g_render.frameQueueTail.load(std::memory_order_acquire) >= (uint32_t)g_render.queueDepth) {
+			std::this_thread::yield();
+		}
+		auto stallTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - stallStart);
+		g_render.statStalledFrames.fetch_add(1);
+		g_render.statStallMicros.fetch_add(stallTime.count());
 	}
 
 	g_render.imageBufLock.lock();
 
-	// Double check the buffer hasn't at some point between the start of
-	// the function and now been invalidated
-	if (!g_render.isRendering.load()) return;
+	// Double check the buffers haven't at some point between the start
+	// of the function and now been invalidated
+	if (!g_render.isRendering.load()) {
+		g_render.imageBufLock.unlock();
+		return;
+	}
 
-	ReadScreenPixels(0, 0, g_render.width, g_render.height, g_render.imageBuf, IMAGE_FORMAT_BGR888);
+	{
+		uint32_t &readbackMicros = g_render.slotReadbackMicros[head % g_render.queueDepth];
+		readbackMicros = 0;
+		RenderStats::ScopedTimer timer(readbackMicros);
+		ReadScreenPixels(0, 0, g_render.settings.width, g_render.settings.height, g_render.frameSlots[head % g_render.queueDepth]->data[0], IMAGE_FORMAT_BGR888);
+	}
 
 	g_render.imageBufLock.unlock();
 
+	g_render.frameQueueHead.store(head + 1, std::memory_order_release);
+
+	uint32_t occupancy = head + 1 - g_render.frameQueueTail.load(std::memory_order_acquire);
+	g_render.statQueuedFrames.fetch_add(1);
+	g_render.statQueueOccupancySum.fetch_add(occupancy);
+	if (occupancy > g_render.statQueueOccupancyMax.load()) g_render.statQueueOccupancyMax.store(occupancy);
+
 	// Signal to the worker thread that there is image data for it to
 	// process
 	{
 		std::lock_guard<std::mutex> lock(g_render.workerUpdateLock);
-		g_render.workerMsg.store(WorkerMsg::VIDEO_FRAME_READY);
 		g_render.workerUpdate.notify_all();
 	}
 }
@@ -1127,7 +780,13 @@ void Renderer::Init(void **videomode) {
 	}
 #endif
 
-	g_RecordBufferHook.SetFunc(SND_RecordBuffer);
+	g_RecordBufferHook.SetFunc(SND_RecordBuffer, false);
+	SND_RecordBuffer_Orig = (void (*)())g_RecordBufferHook.Trampoline(SND_RECORDBUFFER_PROLOGUE);
+	if (SND_RecordBuffer_Orig) {
+		g_RecordBufferHook.Enable();
+	} else {
+		console->Print("Failed to hook SND_RecordBuffer; renders will have no audio\n");
+	}
 
 #ifndef _WIN32
 	if (sar.game->Is(SourceGame_Portal2)) {
@@ -1164,11 +823,22 @@ CON_COMMAND(sar_render_start, "sar_render_start <file> - start rendering frames
 		return;
 	}
 
-	g_render.filename = std::string(args[1]);
+	g_render.settings.filename = std::string(args[1]);
 
 	startRender();
 }
 
+CON_COMMAND(sar_render_resume, "sar_render_resume <file> - continue rendering frames onto the end of a fragmented MP4 or MOV render\n") {
+	if (args.ArgC() != 2) {
+		console->Print(sar_render_resume.ThisPtr()->m_pszHelpString);
+		return;
+	}
+
+	g_render.settings.filename = std::string(args[1]);
+
+	startRender(true);
+}
+
 CON_COMMAND(sar_render_finish, "sar_render_finish - stop rendering frames\n") {
 	if (args.ArgC() != 1) {
 		console->Print(sar_render_finish.ThisPtr()->m_pszHelpString);
@@ -1183,4 +853,25 @@ CON_COMMAND(sar_render_finish, "sar_render_finish - stop rendering frames\n") {
 	msgStopRender(false);
 }
 
+CON_COMMAND(sar_render_stats_export, "sar_render_stats_export <file> - export per-frame timings of the current or last render to a CSV file\n") {
+	if (args.ArgC() != 2) {
+		console->Print(sar_render_stats_export.ThisPtr()->m_pszHelpString);
+		return;
+	}
+
+	std::string filename = args[1];
+	if (!Utils::EndsWith(filename, CSV_EXTENSION)) {
+		filename += CSV_EXTENSION;
+	}
+
+	uint32_t skipped;
+	if (!RenderStats::ExportCsv(filename.c_str(), &skipped)) {
+		console->Print("Could not open file '%s'\n", filename.c_str());
+		return;
+	}
+
+	console->Print("Exported render stats to '%s'\n", filename.c_str());
+	if (skipped) console->Print("The first %u frames weren't kept and are missing from the export\n", skipped);
+}
+
 // }}}
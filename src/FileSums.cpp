@@ -0,0 +1,244 @@
+#include "FileSums.hpp"
+
+#include "Checksum.hpp"
+#include "Command.hpp"
+#include "Event.hpp"
+#include "Modules/Console.hpp"
+#include "Modules/Engine.hpp"
+#include "Scheduler.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#define MAX_FILE_SUM_THREADS 8
+#define FILE_SUM_CACHE "sar_filesums.cache"
+#define FILE_SUM_CACHE_VERSION 1
+
+namespace {
+	struct FileSum {
+		uint64_t size;
+		int64_t mtime;
+		uint64_t inode;  // Always 0 on Windows
+		uint32_t sum;
+	};
+}  // namespace
+
+static std::thread g_scanThread;
+static std::atomic<bool> g_scanDone{false};
+static std::atomic<bool> g_cancelScan{false};
+
+// Only touched by the scan thread until it's been joined
+static std::map<std::string, FileSum> g_filesums;
+
+static bool statFile(const std::string &path, FileSum *out) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st)) return false;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st)) return false;
+#endif
+	out->size = st.st_size;
+	out->mtime = st.st_mtime;
+	out->inode = st.st_ino;
+	return true;
+}
+
+// Cache {{{
+
+// One line per file, "sum size mtime inode path", after a header giving
+// the time the scan that wrote it started
+static std::map<std::string, FileSum> loadCache(int64_t *scanTime) {
+	std::map<std::string, FileSum> cache;
+
+	FILE *fp = fopen(FILE_SUM_CACHE, "r");
+	if (!fp) return cache;
+
+	int version;
+	if (fscanf(fp, "sar_filesums %d %" SCNd64 "\n", &version, scanTime) != 2 || version != FILE_SUM_CACHE_VERSION) {
+		fclose(fp);
+		return cache;
+	}
+
+	char path[1024];
+	FileSum ent;
+	while (fscanf(fp, "%" SCNx32 " %" SCNu64 " %" SCNd64 " %" SCNu64 " %1023[^\n]\n", &ent.sum, &ent.size, &ent.mtime, &ent.inode, path) == 5) {
+		cache[path] = ent;
+	}
+
+	fclose(fp);
+	return cache;
+}
+
+static void saveCache(const std::map<std::string, FileSum> &sums, int64_t scanTime) {
+	std::string tmpPath = FILE_SUM_CACHE ".tmp";
+
+	FILE *fp = fopen(tmpPath.c_str(), "w");
+	if (!fp) return;
+
+	fprintf(fp, "sar_filesums %d %" PRId64 "\n", FILE_SUM_CACHE_VERSION, scanTime);
+	for (auto &[path, ent] : sums) {
+		fprintf(fp, "%08" PRIX32 " %" PRIu64 " %" PRId64 " %" PRIu64 " %s\n", ent.sum, ent.size, ent.mtime, ent.inode, path.c_str());
+	}
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0 || !ok) {
+		std::remove(tmpPath.c_str());
+		return;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, FILE_SUM_CACHE, ec);
+	if (ec) std::remove(tmpPath.c_str());
+}
+
+// }}}
+
+static std::vector<std::string> findFiles() {
+	std::vector<std::string> paths;
+	try {
+		for (auto &ent : std::filesystem::recursive_directory_iterator(".")) {
+			if (g_cancelScan) break;
+			if (ent.status().type() == std::filesystem::file_type::regular || ent.status().type() == std::filesystem::file_type::symlink) {
+				auto path = ent.path().string();
+				std::replace(path.begin(), path.end(), '\\', '/');
+				if (Utils::EndsWith(path, ".nut")
+					|| (Utils::EndsWith(path, ".vpk") && path.find("portal2_dlc3") != std::string::npos)
+					|| path.find("scripts/talker") != std::string::npos)
+				{
+					paths.push_back(path);
+				}
+			}
+		}
+	} catch (...) {
+	}
+	return paths;
+}
+
+// Walks the game directory, then hashes every file which isn't in the
+// cache or has changed since, spread over a few worker threads
+static void scanMain(bool useCache, bool report) {
+	int64_t scanTime = (int64_t)time(nullptr);
+
+	int64_t cacheTime = 0;
+	std::map<std::string, FileSum> cache;
+	if (useCache) cache = loadCache(&cacheTime);
+
+	std::map<std::string, FileSum> sums;
+	std::vector<std::pair<const std::string, FileSum> *> toHash;
+
+	for (auto &path : findFiles()) {
+		FileSum ent = {0, 0, 0, 0};  // if error, just use 0
+		statFile(path, &ent);
+
+		// A file modified in the same second as the last scan may have
+		// changed again after it was hashed, so don't trust its entry
+		auto cached = cache.find(path);
+		if (cached != cache.end() && cached->second.size == ent.size && cached->second.mtime == ent.mtime && cached->second.inode == ent.inode && ent.mtime < cacheTime) {
+			ent.sum = cached->second.sum;
+			sums[path] = ent;
+		} else {
+			toHash.push_back(&*sums.emplace(path, ent).first);
+		}
+	}
+
+	// Workers take the next file as soon as they're done with one, so a
+	// big VPK doesn't hold up everything queued behind it
+	std::atomic<size_t> nextJob{0};
+	auto worker = [&]() {
+		while (!g_cancelScan) {
+			size_t idx = nextJob++;
+			if (idx >= toHash.size()) break;
+
+			auto &[path, ent] = *toHash[idx];
+			FileChecksum(path.c_str(), &ent.sum);
+		}
+	};
+
+	size_t nThreads = std::min({(size_t)std::max(1u, std::thread::hardware_concurrency()), (size_t)MAX_FILE_SUM_THREADS, toHash.size()});
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < nThreads; ++i) threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) t.join();
+
+	if (g_cancelScan) return;
+
+	if (!toHash.empty() || sums.size() != cache.size()) {
+		saveCache(sums, scanTime);
+	}
+
+	g_filesums = std::move(sums);
+
+	if (report) {
+		size_t total = g_filesums.size(), hashed = toHash.size();
+		Scheduler::OnMainThread([=]() {
+			console->Print("Checksummed %d files (%d had changed).\n", (int)total, (int)hashed);
+		});
+	}
+
+	g_scanDone = true;
+}
+
+static bool startScan(bool useCache, bool report) {
+	if (g_scanThread.joinable()) {
+		if (!g_scanDone) return false;
+		g_scanThread.join();
+	}
+
+	g_scanDone = false;
+	g_cancelScan = false;
+	g_scanThread = std::thread(scanMain, useCache, report);
+	return true;
+}
+
+ON_EVENT(SAR_UNLOAD) {
+	if (g_scanThread.joinable()) {
+		g_cancelScan = true;
+		g_scanThread.join();
+	}
+}
+
+void InitFileSums() {
+	startScan(true, false);
+}
+
+static void addFileChecksum(const char *path, uint32_t sum) {
+	size_t bufLen = strlen(path) + 6;
+	uint8_t *buf = new uint8_t[bufLen];
+
+	buf[0] = 0x0C;
+	*(uint32_t *)(buf + 1) = sum;
+	strcpy((char *)(buf + 5), path);
+	engine->demorecorder->RecordData(buf, bufLen);
+
+	delete[] buf;
+}
+
+void AddDemoFileChecksums() {
+	// make sure all file sums are fully calculated first
+	if (g_scanThread.joinable()) g_scanThread.join();
+
+	for (auto &[path, ent] : g_filesums) {
+		addFileChecksum(path.c_str(), ent.sum);
+	}
+}
+
+CON_COMMAND(sar_filesums_rebuild, "sar_filesums_rebuild - re-checksums every game file recorded into demos, ignoring the cache\n") {
+	if (!startScan(false, true)) {
+		return console->Print("Game files are already being checksummed.\n");
+	}
+
+	console->Print("Checksumming game files in the background...\n");
+}
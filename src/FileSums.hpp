@@ -0,0 +1,6 @@
+#pragma once
+
+// Checksums the game's scripts and a few other files in the background
+// on load, so they can be recorded into demos for verification
+void InitFileSums();
+void AddDemoFileChecksums();
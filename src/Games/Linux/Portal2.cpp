@@ -115,6 +115,9 @@ void Portal2::LoadOffsets() {
 	StopRecording = 7;                     // CDemoRecorder
 	RecordCustomData = 14;                 // CDemoRecorder
 	RecordCommand = 8;                     // CDemoRecorder
+	Write = 1;                             // IBaseFileSystem
+	Close = 3;                             // IBaseFileSystem
+	Tell = 5;                              // IBaseFileSystem
 	GetPlaybackTick = 4;                   // CDemoPlayer
 	StartPlayback = 6;                     // CDemoPlayer
 	StopPlayback = 17;                     // CDemoPlayer
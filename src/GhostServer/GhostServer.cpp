@@ -0,0 +1,189 @@
+// sar-ghostserver: a headless ghost server speaking the same protocol as
+// the real one, and a load generator which connects simulated players to
+// it, so NetworkGhostPlayer can be tested and measured without the game
+// or other people. Built by `make sar-ghostserver`; Linux only.
+
+#include "LoadGen.hpp"
+#include "Replay.hpp"
+#include "Server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace GhostServer;
+
+static std::atomic<bool> g_stop{false};
+
+static void usage() {
+	fputs(
+		"usage: sar-ghostserver [options] <command> ...\n"
+		"\n"
+		"commands:\n"
+		"  serve       run a ghost server; type status, stats, countdown, kick or\n"
+		"              stop into it\n"
+		"  load <clients> [run.sarghost|demo.dem]...\n"
+		"              connect simulated players to a server, replaying the\n"
+		"              movement in the runs and demos given, and report the\n"
+		"              bandwidth they used and how long updates took to arrive\n"
+		"  bench <clients> [run.sarghost|demo.dem]...\n"
+		"              do the same against a server in this process on\n"
+		"              localhost, also reporting how long its ticks took\n"
+		"  replay <capture.sarnet>\n"
+		"              play back what a capture from ghost_net_capture received\n"
+		"              through the ghost pool and snapshot buffers on a simulated\n"
+		"              clock, and report how long that took and how smoothly the\n"
+		"              ghosts moved; the same capture always moves them the same\n"
+		"\n"
+		"options:\n"
+		"  --host <h>  load: the server to connect to (default: 127.0.0.1)\n"
+		"  --port <p>  the server's port (default: 53000)\n"
+		"  --tick <ms> serve, bench: how often the server sends updates (default: 50)\n"
+		"  --rate <ms> load, bench: how often players send updates (default: 50)\n"
+		"  -t <s>      load, bench: how long to run for (default: 30)\n"
+		"  --chat <s>  load, bench: how often each player chats and pings (default: 30)\n"
+		"  --legacy    only use the original update format\n"
+		"  --tcp       load, bench: players send everything over TCP, as with\n"
+		"              ghost_TCP_only\n"
+		"  --capture <f>\n"
+		"              load, bench: record the first player's traffic to f, as\n"
+		"              ghost_net_capture does, for ghost_net_replay\n"
+		"  --fps <n>   replay: how often to draw the ghosts (default: 144)\n"
+		"  --delay <ms>\n"
+		"              replay: as ghost_net_interp_delay (default: 0, adapting)\n",
+		stderr);
+}
+
+static void printResult(const LoadResult &res, const ServerStats *server) {
+	double secs = std::max(res.seconds, 0.001);
+	printf("%d clients for %.1f s: %llu updates sent, %llu applied, %u lost, %u clients dropped\n", res.clients, res.seconds, (unsigned long long)res.updatesSent, (unsigned long long)res.statesApplied, res.lost, res.dropped);
+	printf("per client:    %.2f KiB/s up, %.2f KiB/s down\n", res.bytesUp / 1024.0 / secs / res.clients, res.bytesDown / 1024.0 / secs / res.clients);
+	printf("apply latency: %.1f ms mean, %.1f ms median, %.1f ms p99, %.1f ms max\n", res.latencyMean, res.latencyP50, res.latencyP99, res.latencyMax);
+	if (res.pings) printf("ping:          %.2f ms mean over %u\n", res.pingMean, res.pings);
+	if (server) {
+		double ssecs = std::max(server->seconds, 0.001);
+		printf("server ticks:  %u, %.3f ms mean, %.3f ms p99, %.3f ms max\n", server->ticks, server->tickMean, server->tickP99, server->tickMax);
+		printf("server:        %.1f KiB/s out, %.1f KiB/s in, for %u players\n", server->bytesSent / 1024.0 / ssecs, server->bytesReceived / 1024.0 / ssecs, server->players);
+	}
+}
+
+int main(int argc, char **argv) {
+	Server::Options serverOpts;
+	LoadGenerator::Options loadOpts;
+	Replayer::Options replayOpts;
+	std::vector<std::string> args;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--host" && i + 1 < argc) {
+			loadOpts.host = argv[++i];
+		} else if (arg == "--port" && i + 1 < argc) {
+			serverOpts.port = loadOpts.port = (uint16_t)atoi(argv[++i]);
+		} else if (arg == "--tick" && i + 1 < argc) {
+			serverOpts.tickMs = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--rate" && i + 1 < argc) {
+			loadOpts.updateMs = std::max(1, atoi(argv[++i]));
+		} else if (arg == "-t" && i + 1 < argc) {
+			loadOpts.seconds = std::max(0.1, atof(argv[++i]));
+		} else if (arg == "--chat" && i + 1 < argc) {
+			loadOpts.chatSeconds = std::max(0.0, atof(argv[++i]));
+		} else if (arg == "--legacy") {
+			serverOpts.allowDelta = false;
+			loadOpts.delta = false;
+		} else if (arg == "--tcp") {
+			loadOpts.tcpOnly = true;
+		} else if (arg == "--capture" && i + 1 < argc) {
+			loadOpts.capture = argv[++i];
+		} else if (arg == "--fps" && i + 1 < argc) {
+			replayOpts.fps = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--delay" && i + 1 < argc) {
+			replayOpts.delay = std::max(0.0f, (float)atof(argv[++i]) / 1000);
+		} else if (arg == "-h" || arg == "--help") {
+			usage();
+			return 0;
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	if (args.empty()) {
+		usage();
+		return 2;
+	}
+
+	signal(SIGINT, [](int) { g_stop = true; });
+	signal(SIGTERM, [](int) { g_stop = true; });
+	signal(SIGPIPE, SIG_IGN);
+
+	if (args[0] == "serve" && args.size() == 1) {
+		Server server(serverOpts);
+		if (!server.Start()) return 1;
+
+		// Commands come in on another thread so reading them never holds up
+		// the server; it's left behind when the server stops
+		std::thread([&server]() {
+			std::string line;
+			while (std::getline(std::cin, line)) server.Command(line);
+		}).detach();
+
+		server.Run(g_stop);
+		return 0;
+	}
+
+	if ((args[0] == "load" || args[0] == "bench") && args.size() >= 2) {
+		loadOpts.clients = std::max(1, atoi(args[1].c_str()));
+		loadOpts.runs.assign(args.begin() + 2, args.end());
+
+		std::unique_ptr<Server> server;
+		std::atomic<bool> stopServer{false};
+		std::thread serverThread;
+		if (args[0] == "bench") {
+			serverOpts.verbose = false;
+			loadOpts.host = "127.0.0.1";
+			server = std::make_unique<Server>(serverOpts);
+			if (!server->Start()) return 1;
+			serverThread = std::thread([&]() { server->Run(stopServer); });
+		}
+
+		LoadGenerator load(loadOpts);
+		bool ok = load.Start();
+		LoadResult res;
+		ServerStats stats;
+		if (ok) {
+			// Only count the server from once everyone's connected
+			if (server) server->TakeStats();
+			res = load.Run(g_stop);
+			if (server) stats = server->TakeStats();
+		}
+
+		if (server) {
+			stopServer = true;
+			serverThread.join();
+		}
+
+		if (!ok) return 1;
+		printResult(res, server ? &stats : nullptr);
+		return res.dropped == 0 ? 0 : 1;
+	}
+
+	if (args[0] == "replay" && args.size() == 2) {
+		ReplayResult res;
+		if (!Replayer(replayOpts).Run(args[1], &res)) return 1;
+		printf("%.1f s of traffic: %u packets, %llu updates, %u joined, %u left\n", res.seconds, res.packets, (unsigned long long)res.updates, res.joined, res.left);
+		printf("updates:       %.0f ns each to decode and buffer; %u late, %u dropped\n", res.updateNs, res.late, res.dropped);
+		printf("frames:        %llu at %d fps, %.2f us mean, %.2f us p99, %.1f us max\n", (unsigned long long)res.frames, replayOpts.fps, res.frameMean, res.frameP99, res.frameMax);
+		printf("ghosts drawn:  %llu, %llu with nothing to draw yet\n", (unsigned long long)res.samples, (unsigned long long)res.missing);
+		printf("stutter:       %.1f units/s mean, %.1f units/s p99 change in speed between frames\n", res.stutterMean, res.stutterP99);
+		printf("positions:     %08x\n", res.hash);
+		return 0;
+	}
+
+	usage();
+	return 2;
+}
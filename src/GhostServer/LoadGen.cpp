@@ -0,0 +1,503 @@
+#include "LoadGen.hpp"
+
+#include "Features/Demo/Demo.hpp"
+#include "Features/Demo/DemoParser.hpp"
+#include "Features/Demo/GhostFile.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+
+#include <poll.h>
+#include <unistd.h>
+
+using namespace GhostServer;
+
+// Demos are played back at the game's tick rate
+#define TICKS_PER_SECOND 60
+#define HANDSHAKE_TIMEOUT_MS 5000
+// How many of its own positions a client remembers, to work out how long
+// ago it sent one it sees come back in the original format
+#define POSITION_HISTORY 64
+#define LATENCY_BUCKETS_PER_MS 10
+#define LATENCY_MAX_MS 5000
+
+struct LoadGenerator::Client {
+	int index;
+	uint32_t id = 0;
+	std::unique_ptr<TcpConnection> tcp;
+	int udpFd = -1;
+	uint32_t protocol = GhostNet::PROTOCOL_LEGACY;
+	GhostNet::Stream stream;
+	bool alive = true;
+
+	size_t leg = 0;
+	double tick = 0;
+	DataGhost data{};
+	Vector vel{0, 0, 0};
+	std::mt19937 rng;
+
+	Clock::time_point nextSend;
+	Clock::time_point nextChat;
+	std::optional<Clock::time_point> pingSent;
+
+	std::deque<std::pair<Vector, Clock::time_point>> history;
+
+	// What was last applied for each other player, so repeats of it don't
+	// count again
+	struct Seen {
+		Vector position;
+		uint16_t sentAt;
+	};
+	std::unordered_map<uint32_t, Seen> seen;
+
+	uint64_t udpBytesUp = 0;
+	uint64_t udpBytesDown = 0;
+	uint64_t updatesSent = 0;
+	uint64_t statesApplied = 0;
+
+	~Client() {
+		if (this->udpFd >= 0) close(this->udpFd);
+	}
+};
+
+static uint16_t nowMs(std::chrono::steady_clock::time_point now) {
+	return (uint16_t)std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+}
+
+static bool samePosition(const Vector &a, const Vector &b) {
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+LoadGenerator::LoadGenerator(const Options &opts)
+	: opts(opts)
+	, latencyHistogram(LATENCY_MAX_MS * LATENCY_BUCKETS_PER_MS + 1) {
+}
+
+LoadGenerator::~LoadGenerator() {
+}
+
+// Setup {{{
+
+// A .sarghost run gives a leg for every level; a demo gives one for itself
+bool LoadGenerator::LoadRun(const std::string &path) {
+	if (Utils::EndsWith(path, ".sarghost")) {
+		GhostFile::Run run;
+		if (!GhostFile::Read(path, &run)) {
+			fprintf(stderr, "%s: could not read\n", path.c_str());
+			return false;
+		}
+		for (auto &level : run.levels) {
+			if (!level.track.Empty()) this->legs.push_back({level.mapName, std::move(level.track)});
+		}
+		return true;
+	}
+
+	Demo demo;
+	DemoParser parser;
+	Leg leg;
+	CustomDatas customDatas;
+	GhostTrackVisitor visitor(&demo, &leg.track, &customDatas);
+	if (!parser.Parse(path, &demo, &visitor)) {
+		fprintf(stderr, "%s: could not parse\n", path.c_str());
+		return false;
+	}
+	leg.map = demo.mapName;
+	if (!leg.track.Empty()) this->legs.push_back(std::move(leg));
+	return true;
+}
+
+bool LoadGenerator::Start() {
+	for (auto &path : this->opts.runs) {
+		if (!this->LoadRun(path)) return false;
+	}
+
+	if (!ResolveIPv4(this->opts.host, this->opts.port, &this->server)) return false;
+
+	if (!this->opts.capture.empty() && !this->capture.Open(this->opts.capture)) {
+		fprintf(stderr, "%s: could not create\n", this->opts.capture.c_str());
+		return false;
+	}
+
+	for (int i = 0; i < this->opts.clients; ++i) {
+		auto client = std::make_unique<Client>();
+		client->index = i;
+		client->rng.seed(1000 + i);
+		if (!this->ConnectClient(*client, i)) return false;
+		this->byId[client->id] = client.get();
+		this->clients.push_back(std::move(client));
+	}
+
+	return true;
+}
+
+// Connects the way NetworkManager::Connect does, and waits for the reply
+bool LoadGenerator::ConnectClient(Client &client, int index) {
+	// Spread everyone out over the runs, so they're on different maps and
+	// at different points in them
+	if (!this->legs.empty()) {
+		client.leg = index % this->legs.size();
+		auto &track = this->legs[client.leg].track;
+		int length = track.EndTick() - track.FirstTick();
+		client.tick = track.FirstTick() + (double)((index * 7919) % std::max(length, 1));
+		track.Get((int)client.tick, &client.data);
+	} else {
+		std::uniform_real_distribution<float> unit(-1, 1);
+		client.data = {{unit(client.rng) * 2000, unit(client.rng) * 2000, unit(client.rng) * 500}, {0, unit(client.rng) * 180, 0}, 64, true};
+	}
+
+	int fd = Connect(this->server);
+	if (fd < 0) return false;
+	client.tcp = std::make_unique<TcpConnection>(fd);
+
+	client.udpFd = BindUdp(0);
+	if (client.udpFd < 0) return false;
+
+	std::string map = this->legs.empty() ? "sp_a1_intro1" : this->legs[client.leg].map;
+	uint32_t offered = this->opts.delta ? GhostNet::PROTOCOL_CURRENT : GhostNet::PROTOCOL_LEGACY;
+	Rgb color{(uint8_t)(index * 37), (uint8_t)(index * 91), (uint8_t)(index * 53)};
+
+	Packet hello;
+	hello << HEADER::CONNECT << LocalPort(client.udpFd) << Utils::ssprintf("loadtest-%d", index) << client.data;
+	hello << std::string("models/props/food_can/food_can_open.mdl") << map << this->opts.tcpOnly << color << offered;
+	this->SendTcp(client, hello);
+
+	auto deadline = Clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+	std::vector<Packet> packets;
+	while (packets.empty()) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+		pollfd pfd{fd, POLLIN, 0};
+		if (left <= 0 || poll(&pfd, 1, (int)left) <= 0 || !client.tcp->Receive(packets)) {
+			fprintf(stderr, "client %d: no reply from the server\n", index);
+			return false;
+		}
+	}
+
+	// The reply has no header: our ID, then everyone already there
+	Packet &reply = packets[0];
+	this->Capture(client, GhostCapture::Kind::CONNECT_REPLY, reply);
+	uint32_t nPlayers;
+	reply >> client.id >> nPlayers;
+	for (uint32_t i = 0; reply && i < nPlayers; ++i) {
+		uint32_t id;
+		std::string name, model, otherMap;
+		DataGhost data;
+		Rgb col;
+		reply >> id >> name >> data >> model >> otherMap >> col;
+	}
+	if (!reply) {
+		fprintf(stderr, "client %d: bad reply from the server\n", index);
+		return false;
+	}
+	uint32_t protocol;
+	if (!(reply >> protocol)) protocol = GhostNet::PROTOCOL_LEGACY;
+	client.protocol = std::min(protocol, offered);
+
+	auto now = Clock::now();
+	for (size_t i = 1; i < packets.size(); ++i) {
+		this->Capture(client, GhostCapture::Kind::RECV_TCP, packets[i]);
+		this->HandleTcp(client, packets[i], now);
+	}
+
+	return true;
+}
+
+// }}}
+
+// Simulation {{{
+
+void LoadGenerator::Move(Client &client, double dt) {
+	if (this->legs.empty()) {
+		// Run around at up to 300 units/s, like netTest in sar-demotool
+		std::uniform_real_distribution<float> unit(-1, 1);
+		auto &rng = client.rng;
+		client.vel = {client.vel.x * 0.9f + unit(rng) * 30, client.vel.y * 0.9f + unit(rng) * 30, 0};
+		float speed = std::sqrt(client.vel.x * client.vel.x + client.vel.y * client.vel.y);
+		if (speed > 300) client.vel = client.vel * (300 / speed);
+		client.data.position = client.data.position + client.vel * (float)dt;
+		client.data.view_angle = {std::clamp(client.data.view_angle.x + unit(rng) * 3, -89.0f, 89.0f), std::remainder(client.data.view_angle.y + unit(rng) * 10, 360.0f), 0};
+		client.data.grounded = unit(rng) > -0.9f;
+		return;
+	}
+
+	client.tick += dt * TICKS_PER_SECOND;
+	if (client.tick >= this->legs[client.leg].track.EndTick()) {
+		// On to the next level, telling the server as SAR does on load
+		std::string oldMap = this->legs[client.leg].map;
+		client.leg = (client.leg + 1) % this->legs.size();
+		client.tick = this->legs[client.leg].track.FirstTick();
+		auto &newMap = this->legs[client.leg].map;
+		if (newMap != oldMap) {
+			Packet packet;
+			packet << HEADER::MAP_CHANGE << client.id << newMap << (uint32_t)-1 << (uint32_t)-1;
+			this->SendTcp(client, packet);
+		}
+	}
+
+	// Ticks without data keep the last position
+	this->legs[client.leg].track.Get((int)client.tick, &client.data);
+}
+
+// Sends our position as NetworkManager::SendPlayerData does
+void LoadGenerator::SendUpdate(Client &client) {
+	auto now = Clock::now();
+	Packet packet;
+
+	if (client.protocol >= GhostNet::PROTOCOL_DELTA && !this->opts.tcpOnly) {
+		GhostNet::Snapshot snap;
+		snap.ghosts.push_back({client.id, GhostNet::Quantise(client.data, nowMs(now))});
+		std::vector<uint8_t> body;
+		client.stream.Encode(snap, body);
+		packet << HEADER::UPDATE_DELTA << client.id;
+		packet.Append(body.data(), body.size());
+	} else {
+		packet << HEADER::UPDATE << client.id << client.data;
+		client.history.push_back({client.data.position, now});
+		if (client.history.size() > POSITION_HISTORY) client.history.pop_front();
+	}
+
+	if (this->opts.tcpOnly) {
+		this->SendTcp(client, packet);
+	} else {
+		this->Capture(client, GhostCapture::Kind::SENT_UDP, packet);
+		client.udpBytesUp += SendTo(client.udpFd, this->server, packet);
+	}
+	++client.updatesSent;
+}
+
+void LoadGenerator::SendTcp(Client &client, const Packet &packet) {
+	this->Capture(client, GhostCapture::Kind::SENT_TCP, packet);
+	client.tcp->Send(packet);
+}
+
+// Only the first client is captured: it sees everything the others do
+void LoadGenerator::Capture(const Client &client, GhostCapture::Kind kind, const Packet &packet) {
+	if (client.index == 0 && this->capture.IsOpen()) this->capture.Add(kind, packet.Data(), packet.Size());
+}
+
+void LoadGenerator::HandleUdp(Client &client, Packet &packet, Clock::time_point now) {
+	HEADER header;
+	uint32_t id;
+	if (!(packet >> header >> id) || id != 0) return;
+
+	if (header == HEADER::UPDATE) {
+		uint32_t count;
+		packet >> count;
+		for (uint32_t i = 0; packet && i < count; ++i) {
+			uint32_t ghostId;
+			DataGhost data;
+			if (!(packet >> ghostId >> data)) break;
+			if (ghostId != client.id) this->Applied(client, ghostId, data, nullptr, now);
+		}
+	} else if (header == HEADER::UPDATE_DELTA) {
+		GhostNet::Snapshot snap;
+		if (!client.stream.Decode(packet.Data() + packet.Offset(), packet.Size() - packet.Offset(), &snap)) return;
+		for (auto &[ghostId, state] : snap.ghosts) {
+			if (ghostId != client.id) this->Applied(client, ghostId, GhostNet::Dequantise(state), &state.time, now);
+		}
+	}
+}
+
+void LoadGenerator::HandleTcp(Client &client, Packet &packet, Clock::time_point now) {
+	HEADER header;
+	uint32_t id;
+	if (!(packet >> header >> id)) return;
+
+	switch (header) {
+	case HEADER::HEART_BEAT: {
+		uint32_t token;
+		if (!(packet >> token)) break;
+		Packet reply;
+		reply << HEADER::HEART_BEAT << client.id << token;
+		this->SendTcp(client, reply);
+		break;
+	}
+	case HEADER::COUNTDOWN: {
+		uint8_t step;
+		if (!(packet >> step) || step != 0) break;
+		Packet reply;
+		reply << HEADER::COUNTDOWN << client.id << (uint8_t)1;
+		this->SendTcp(client, reply);
+		break;
+	}
+	case HEADER::PING:
+		if (client.pingSent) {
+			this->pingTotal += std::chrono::duration<double, std::milli>(now - *client.pingSent).count();
+			++this->pings;
+			client.pingSent = {};
+		}
+		break;
+	case HEADER::STOP_SERVER:
+		client.alive = false;
+		break;
+	case HEADER::UPDATE:
+	case HEADER::UPDATE_DELTA: {
+		// Over TCP for TCP-only clients; start again so HandleUdp can read it
+		Packet copy(packet.Data(), packet.Size());
+		this->HandleUdp(client, copy, now);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// Records how long a position took to get from its player to here, if
+// it's one we haven't seen before. With the delta format, that's in the
+// update; otherwise, we look for it in what that player sent.
+void LoadGenerator::Applied(Client &client, uint32_t ghostId, const DataGhost &data, const uint16_t *sentAt, Clock::time_point now) {
+	auto it = client.seen.find(ghostId);
+	if (it != client.seen.end()) {
+		if (sentAt ? it->second.sentAt == *sentAt : samePosition(it->second.position, data.position)) return;
+	}
+	client.seen[ghostId] = {data.position, sentAt ? *sentAt : (uint16_t)0};
+	++client.statesApplied;
+
+	double ms = -1;
+	if (sentAt) {
+		ms = (uint16_t)(nowMs(now) - *sentAt);
+	} else {
+		auto sender = this->byId.find(ghostId);
+		if (sender == this->byId.end()) return;
+		auto &history = sender->second->history;
+		for (auto h = history.rbegin(); h != history.rend(); ++h) {
+			if (samePosition(h->first, data.position)) {
+				ms = std::chrono::duration<double, std::milli>(now - h->second).count();
+				break;
+			}
+		}
+	}
+	if (ms < 0) return;
+
+	this->latencyMax = std::max(this->latencyMax, ms);
+	size_t bucket = std::min((size_t)(ms * LATENCY_BUCKETS_PER_MS), this->latencyHistogram.size() - 1);
+	++this->latencyHistogram[bucket];
+}
+
+// }}}
+
+// Main loop {{{
+
+LoadResult LoadGenerator::Run(const std::atomic<bool> &stop) {
+	auto start = Clock::now();
+	auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(this->opts.seconds));
+	auto interval = std::chrono::milliseconds(this->opts.updateMs);
+	auto chatInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(this->opts.chatSeconds));
+
+	// Spread the clients' updates and chat over their intervals, as real
+	// players aren't in step with each other
+	int n = (int)this->clients.size();
+	for (auto &client : this->clients) {
+		client->nextSend = start + interval * client->index / n;
+		client->nextChat = start + chatInterval * (client->index + 1) / n;
+	}
+
+	std::vector<pollfd> fds;
+	while (!stop) {
+		auto now = Clock::now();
+		if (now >= end) break;
+
+		auto next = end;
+		fds.clear();
+		for (auto &client : this->clients) {
+			if (!client->alive) continue;
+			next = std::min(next, client->nextSend);
+			fds.push_back({client->tcp->Fd(), (short)(POLLIN | (client->tcp->WantsWrite() ? POLLOUT : 0)), 0});
+			fds.push_back({client->udpFd, POLLIN, 0});
+		}
+		if (fds.empty()) break;
+
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+		poll(fds.data(), fds.size(), (int)std::clamp<long long>(wait, 0, 100));
+		now = Clock::now();
+
+		size_t f = 0;
+		for (auto &client : this->clients) {
+			if (!client->alive) continue;
+			auto &tcpFd = fds[f++];
+			auto &udpFd = fds[f++];
+
+			if (udpFd.revents & POLLIN) {
+				Packet packet;
+				sockaddr_in from;
+				while (ReceiveFrom(client->udpFd, &packet, &from)) {
+					client->udpBytesDown += packet.Size();
+					this->Capture(*client, GhostCapture::Kind::RECV_UDP, packet);
+					this->HandleUdp(*client, packet, now);
+				}
+			}
+
+			if (tcpFd.revents) {
+				std::vector<Packet> packets;
+				bool ok = !(tcpFd.revents & POLLOUT) || client->tcp->Flush();
+				ok = ok && client->tcp->Receive(packets);
+				for (auto &packet : packets) {
+					this->Capture(*client, GhostCapture::Kind::RECV_TCP, packet);
+					this->HandleTcp(*client, packet, now);
+				}
+				if (!ok || !client->alive) {
+					client->alive = false;
+					++this->dropped;
+					continue;
+				}
+			}
+
+			if (now >= client->nextSend) {
+				this->Move(*client, this->opts.updateMs / 1000.0);
+				this->SendUpdate(*client);
+				client->nextSend += interval;
+				if (client->nextSend < now) client->nextSend = now + interval;
+			}
+
+			if (this->opts.chatSeconds > 0 && now >= client->nextChat) {
+				Packet message;
+				message << HEADER::MESSAGE << client->id << Utils::ssprintf("hello from client %d", client->index);
+				this->SendTcp(*client, message);
+				Packet ping;
+				ping << HEADER::PING << client->id;
+				this->SendTcp(*client, ping);
+				client->pingSent = now;
+				client->nextChat += chatInterval;
+			}
+		}
+	}
+
+	LoadResult res;
+	res.clients = n;
+	res.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	for (auto &client : this->clients) {
+		res.bytesUp += client->tcp->bytesSent + client->udpBytesUp;
+		res.bytesDown += client->tcp->bytesReceived + client->udpBytesDown;
+		res.updatesSent += client->updatesSent;
+		res.statesApplied += client->statesApplied;
+		res.lost += client->stream.GetStats().lost;
+	}
+	res.dropped = this->dropped;
+
+	uint64_t samples = 0;
+	double total = 0;
+	for (size_t i = 0; i < this->latencyHistogram.size(); ++i) {
+		samples += this->latencyHistogram[i];
+		total += this->latencyHistogram[i] * (i + 0.5) / LATENCY_BUCKETS_PER_MS;
+	}
+	if (samples > 0) {
+		res.latencyMean = total / samples;
+		res.latencyMax = this->latencyMax;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < this->latencyHistogram.size(); ++i) {
+			uint64_t before = seen;
+			seen += this->latencyHistogram[i];
+			double ms = (i + 0.5) / LATENCY_BUCKETS_PER_MS;
+			if (before < samples / 2 && seen >= samples / 2) res.latencyP50 = ms;
+			if (before < samples * 99 / 100 && seen >= samples * 99 / 100) res.latencyP99 = ms;
+		}
+	}
+	res.pings = this->pings;
+	res.pingMean = this->pings ? this->pingTotal / this->pings : 0;
+
+	return res;
+}
+
+// }}}
@@ -0,0 +1,101 @@
+#pragma once
+#include "Features/Demo/GhostCapture.hpp"
+#include "Packet.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace GhostServer {
+	struct LoadResult {
+		int clients = 0;
+		double seconds = 0;
+		uint64_t bytesUp = 0;    // Everything the clients sent, TCP and UDP
+		uint64_t bytesDown = 0;
+		uint64_t updatesSent = 0;
+		uint64_t statesApplied = 0;  // Positions of other players newer than the last one seen
+		uint32_t lost = 0;           // Update packets the delta format saw go missing
+		uint32_t dropped = 0;        // Clients the server disconnected
+		// From a client sending its position to another one applying it, in ms
+		double latencyMean = 0;
+		double latencyP50 = 0;
+		double latencyP99 = 0;
+		double latencyMax = 0;
+		double pingMean = 0;
+		uint32_t pings = 0;
+	};
+
+	// Simulated players for load testing a ghost server: each connects like
+	// SAR does, sends its position at the usual rate and applies the
+	// updates it gets back, as well as answering heartbeats and countdowns
+	// and now and then chatting, pinging and changing maps. Positions come
+	// from demos or .sarghost runs, with every client at a different point
+	// in them, or are made up if there aren't any. Everything runs on the
+	// thread that calls Run.
+	class LoadGenerator {
+	public:
+		struct Options {
+			std::string host = "127.0.0.1";
+			uint16_t port = 53000;
+			int clients = 50;
+			double seconds = 30;
+			int updateMs = 50;
+			bool delta = true;
+			bool tcpOnly = false;
+			double chatSeconds = 30;  // How often each client chats, and pings
+			std::vector<std::string> runs;
+			std::string capture;  // Where to record the first client's traffic, if anywhere
+		};
+
+		explicit LoadGenerator(const Options &opts);
+		~LoadGenerator();
+
+		// Loads the runs and connects every client; returns false if any of
+		// that fails
+		bool Start();
+		LoadResult Run(const std::atomic<bool> &stop);
+
+	private:
+		// A stretch of movement on one map
+		struct Leg {
+			std::string map;
+			GhostTrack track;
+		};
+
+		struct Client;
+
+		using Clock = std::chrono::steady_clock;
+
+		bool LoadRun(const std::string &path);
+		bool ConnectClient(Client &client, int index);
+		void Move(Client &client, double dt);
+		void SendUpdate(Client &client);
+		void SendTcp(Client &client, const Packet &packet);
+		void Capture(const Client &client, GhostCapture::Kind kind, const Packet &packet);
+		void HandleUdp(Client &client, Packet &packet, Clock::time_point now);
+		void HandleTcp(Client &client, Packet &packet, Clock::time_point now);
+		void Applied(Client &client, uint32_t ghostId, const DataGhost &data, const uint16_t *sentAt, Clock::time_point now);
+
+		Options opts;
+		sockaddr_in server{};
+		std::vector<Leg> legs;
+		std::vector<std::unique_ptr<Client>> clients;
+		std::unordered_map<uint32_t, Client *> byId;
+		std::mt19937 rng{1234};
+		GhostCapture::Writer capture;
+
+		// Latencies in tenths of a millisecond, so there's no need to keep
+		// millions of them
+		std::vector<uint64_t> latencyHistogram;
+		double latencyMax = 0;
+		double pingTotal = 0;
+		uint32_t pings = 0;
+		uint32_t dropped = 0;
+	};
+}  // namespace GhostServer
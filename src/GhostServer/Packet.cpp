@@ -0,0 +1,356 @@
+#include "Packet.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace GhostServer;
+
+// SFML refuses anything bigger than this from a TCP peer too
+#define MAX_TCP_PACKET (64 * 1024 * 1024)
+
+// Packets {{{
+
+bool Packet::Check(size_t size) {
+	this->ok = this->ok && this->buf.size() - this->pos >= size;
+	return this->ok;
+}
+
+void Packet::Append(const void *data, size_t size) {
+	auto bytes = (const uint8_t *)data;
+	this->buf.insert(this->buf.end(), bytes, bytes + size);
+}
+
+Packet &Packet::operator<<(uint8_t val) {
+	this->buf.push_back(val);
+	return *this;
+}
+
+Packet &Packet::operator<<(uint16_t val) {
+	val = htons(val);
+	this->Append(&val, sizeof val);
+	return *this;
+}
+
+Packet &Packet::operator<<(uint32_t val) {
+	val = htonl(val);
+	this->Append(&val, sizeof val);
+	return *this;
+}
+
+Packet &Packet::operator<<(float val) {
+	this->Append(&val, sizeof val);
+	return *this;
+}
+
+Packet &Packet::operator<<(bool val) {
+	return *this << (uint8_t)val;
+}
+
+Packet &Packet::operator<<(HEADER header) {
+	return *this << (uint8_t)header;
+}
+
+Packet &Packet::operator<<(const std::string &str) {
+	*this << (uint32_t)str.size();
+	this->Append(str.data(), str.size());
+	return *this;
+}
+
+// The view offset is packed into 7 bits, as in NetworkGhostPlayer
+Packet &Packet::operator<<(const DataGhost &data) {
+	*this << data.position.x << data.position.y << data.position.z;
+	*this << data.view_angle.x << data.view_angle.y << data.view_angle.z;
+	return *this << (uint8_t)(((int)data.view_offset & 0x7F) | (data.grounded ? 0x80 : 0x00));
+}
+
+Packet &Packet::operator<<(const Rgb &col) {
+	return *this << col.r << col.g << col.b;
+}
+
+Packet &Packet::operator>>(uint8_t &val) {
+	if (this->Check(1)) val = this->buf[this->pos++];
+	return *this;
+}
+
+Packet &Packet::operator>>(uint16_t &val) {
+	if (this->Check(2)) {
+		memcpy(&val, &this->buf[this->pos], 2);
+		val = ntohs(val);
+		this->pos += 2;
+	}
+	return *this;
+}
+
+Packet &Packet::operator>>(uint32_t &val) {
+	if (this->Check(4)) {
+		memcpy(&val, &this->buf[this->pos], 4);
+		val = ntohl(val);
+		this->pos += 4;
+	}
+	return *this;
+}
+
+Packet &Packet::operator>>(float &val) {
+	if (this->Check(4)) {
+		memcpy(&val, &this->buf[this->pos], 4);
+		this->pos += 4;
+	}
+	return *this;
+}
+
+Packet &Packet::operator>>(bool &val) {
+	uint8_t byte = 0;
+	*this >> byte;
+	val = byte != 0;
+	return *this;
+}
+
+Packet &Packet::operator>>(HEADER &header) {
+	uint8_t byte = 0;
+	*this >> byte;
+	header = (HEADER)byte;
+	return *this;
+}
+
+Packet &Packet::operator>>(std::string &str) {
+	uint32_t len = 0;
+	if (*this >> len && this->Check(len)) {
+		str.assign((const char *)&this->buf[this->pos], len);
+		this->pos += len;
+	}
+	return *this;
+}
+
+Packet &Packet::operator>>(DataGhost &data) {
+	uint8_t view = 0;
+	*this >> data.position.x >> data.position.y >> data.position.z;
+	*this >> data.view_angle.x >> data.view_angle.y >> data.view_angle.z >> view;
+	data.view_offset = (float)(view & 0x7F);
+	data.grounded = (view & 0x80) != 0;
+	return *this;
+}
+
+Packet &Packet::operator>>(Rgb &col) {
+	return *this >> col.r >> col.g >> col.b;
+}
+
+// }}}
+
+// TCP connections {{{
+
+TcpConnection::TcpConnection(int fd)
+	: fd(fd) {
+}
+
+TcpConnection::~TcpConnection() {
+	if (this->fd >= 0) close(this->fd);
+}
+
+void TcpConnection::Send(const Packet &packet) {
+	uint32_t size = htonl((uint32_t)packet.Size());
+	auto bytes = (const uint8_t *)&size;
+	this->out.insert(this->out.end(), bytes, bytes + sizeof size);
+	this->out.insert(this->out.end(), packet.Data(), packet.Data() + packet.Size());
+	this->Flush();
+}
+
+bool TcpConnection::Flush() {
+	size_t done = 0;
+	while (!this->broken && done < this->out.size()) {
+		ssize_t n = send(this->fd, this->out.data() + done, this->out.size() - done, MSG_NOSIGNAL);
+		if (n > 0) {
+			done += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			this->broken = true;
+		}
+	}
+	this->bytesSent += done;
+	this->out.erase(this->out.begin(), this->out.begin() + done);
+	return !this->broken;
+}
+
+bool TcpConnection::Receive(std::vector<Packet> &packets) {
+	uint8_t chunk[16384];
+	while (!this->broken) {
+		ssize_t n = recv(this->fd, chunk, sizeof chunk, 0);
+		if (n > 0) {
+			this->in.insert(this->in.end(), chunk, chunk + n);
+			this->bytesReceived += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			this->broken = true;
+		}
+	}
+
+	size_t done = 0;
+	while (this->in.size() - done >= 4) {
+		uint32_t size;
+		memcpy(&size, &this->in[done], 4);
+		size = ntohl(size);
+		if (size > MAX_TCP_PACKET) {
+			this->broken = true;
+			break;
+		}
+		if (this->in.size() - done - 4 < size) break;
+		packets.emplace_back(&this->in[done + 4], size);
+		done += 4 + size;
+	}
+	this->in.erase(this->in.begin(), this->in.begin() + done);
+
+	return !this->broken;
+}
+
+// }}}
+
+// Sockets {{{
+
+static bool setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int GhostServer::Listen(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 128) < 0 || !setNonBlocking(fd)) {
+		fprintf(stderr, "cannot listen on TCP port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void setNoDelay(int fd) {
+	// Small packets are all we send, and they shouldn't wait for each other
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+int GhostServer::Accept(int listenFd) {
+	int fd;
+	do {
+		fd = accept(listenFd, nullptr, nullptr);
+	} while (fd < 0 && errno == EINTR);
+	if (fd < 0) return -1;
+
+	// accept() doesn't pass O_NONBLOCK on
+	if (!setNonBlocking(fd)) {
+		close(fd);
+		return -1;
+	}
+	setNoDelay(fd);
+	return fd;
+}
+
+// Blocks until connected, then becomes non-blocking
+int GhostServer::Connect(const sockaddr_in &addr) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (const sockaddr *)&addr, sizeof addr) < 0 || !setNonBlocking(fd)) {
+		fprintf(stderr, "cannot connect to %s:%d: %s\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	setNoDelay(fd);
+	return fd;
+}
+
+int GhostServer::BindUdp(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (sockaddr *)&addr, sizeof addr) < 0 || !setNonBlocking(fd)) {
+		fprintf(stderr, "cannot bind UDP port %d: %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// A whole tick of updates for lots of players can arrive at once
+	int bufSize = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof bufSize);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof bufSize);
+
+	return fd;
+}
+
+uint16_t GhostServer::LocalPort(int fd) {
+	sockaddr_in addr{};
+	socklen_t len = sizeof addr;
+	if (getsockname(fd, (sockaddr *)&addr, &len) < 0) return 0;
+	return ntohs(addr.sin_port);
+}
+
+bool GhostServer::ResolveIPv4(const std::string &host, uint16_t port, sockaddr_in *out) {
+	addrinfo hints{};
+	hints.ai_family = AF_INET;
+	addrinfo *res;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || !res) {
+		fprintf(stderr, "cannot resolve %s\n", host.c_str());
+		return false;
+	}
+	*out = *(sockaddr_in *)res->ai_addr;
+	out->sin_port = htons(port);
+	freeaddrinfo(res);
+	return true;
+}
+
+size_t GhostServer::SendTo(int fd, const sockaddr_in &addr, const Packet &packet) {
+	ssize_t n;
+	do {
+		n = sendto(fd, packet.Data(), packet.Size(), 0, (const sockaddr *)&addr, sizeof addr);
+	} while (n < 0 && errno == EINTR);
+	return n > 0 ? n : 0;
+}
+
+bool GhostServer::ReceiveFrom(int fd, Packet *packet, sockaddr_in *from) {
+	uint8_t buf[65536];
+	socklen_t len = sizeof *from;
+	ssize_t n;
+	do {
+		n = recvfrom(fd, buf, sizeof buf, 0, (sockaddr *)from, &len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return false;
+	*packet = Packet(buf, n);
+	return true;
+}
+
+// }}}
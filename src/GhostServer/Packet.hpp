@@ -0,0 +1,106 @@
+#pragma once
+#include "Features/Demo/GhostNet.hpp"
+#include "Features/Demo/GhostTrack.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+// Packets and sockets for sar-ghostserver, laid out exactly as SFML's
+// sf::Packet does, which is what SAR and the real ghost server use:
+// integers are big-endian, floats are as they are in memory, strings are
+// a 32-bit length and then the characters, and bools are a byte. Over
+// TCP, each packet has its 32-bit size in front.
+namespace GhostServer {
+	struct Rgb {
+		uint8_t r, g, b;
+	};
+
+	class Packet {
+	public:
+		Packet() = default;
+		Packet(const uint8_t *data, size_t size)
+			: buf(data, data + size) {
+		}
+
+		Packet &operator<<(uint8_t val);
+		Packet &operator<<(uint16_t val);
+		Packet &operator<<(uint32_t val);
+		Packet &operator<<(float val);
+		Packet &operator<<(bool val);
+		Packet &operator<<(HEADER header);
+		Packet &operator<<(const std::string &str);
+		Packet &operator<<(const DataGhost &data);
+		Packet &operator<<(const Rgb &col);
+		void Append(const void *data, size_t size);
+
+		// Once a read fails, every one after it does too, as in SFML
+		Packet &operator>>(uint8_t &val);
+		Packet &operator>>(uint16_t &val);
+		Packet &operator>>(uint32_t &val);
+		Packet &operator>>(float &val);
+		Packet &operator>>(bool &val);
+		Packet &operator>>(HEADER &header);
+		Packet &operator>>(std::string &str);
+		Packet &operator>>(DataGhost &data);
+		Packet &operator>>(Rgb &col);
+		explicit operator bool() const { return this->ok; }
+
+		const uint8_t *Data() const { return this->buf.data(); }
+		size_t Size() const { return this->buf.size(); }
+		// How far reading has got, for handing the rest to GhostNet
+		size_t Offset() const { return this->pos; }
+
+	private:
+		bool Check(size_t size);
+
+		std::vector<uint8_t> buf;
+		size_t pos = 0;
+		bool ok = true;
+	};
+
+	// One end of a TCP connection, buffered both ways so it never blocks
+	class TcpConnection {
+	public:
+		explicit TcpConnection(int fd);
+		~TcpConnection();
+		TcpConnection(const TcpConnection &) = delete;
+		TcpConnection &operator=(const TcpConnection &) = delete;
+
+		int Fd() const { return this->fd; }
+		bool WantsWrite() const { return !this->out.empty(); }
+
+		// Queues the packet and sends as much as the socket will take
+		void Send(const Packet &packet);
+		// Sends whatever's still queued; returns false if the connection's gone
+		bool Flush();
+		// Reads whatever's arrived, adding any whole packets to out; returns
+		// false if the connection's gone
+		bool Receive(std::vector<Packet> &out);
+
+		uint64_t bytesSent = 0;
+		uint64_t bytesReceived = 0;
+
+	private:
+		int fd;
+		bool broken = false;
+		std::vector<uint8_t> in;
+		std::vector<uint8_t> out;
+	};
+
+	// Non-blocking sockets; return -1 on failure, having printed why
+	int Listen(uint16_t port);
+	int Accept(int listenFd);
+	int Connect(const sockaddr_in &addr);
+	int BindUdp(uint16_t port);
+	uint16_t LocalPort(int fd);
+	bool ResolveIPv4(const std::string &host, uint16_t port, sockaddr_in *out);
+
+	// Returns the number of bytes sent, or 0 if the datagram was dropped
+	size_t SendTo(int fd, const sockaddr_in &addr, const Packet &packet);
+	// Returns false once there's nothing more to read
+	bool ReceiveFrom(int fd, Packet *packet, sockaddr_in *from);
+}  // namespace GhostServer
@@ -0,0 +1,203 @@
+#include "Replay.hpp"
+
+#include "Features/Demo/GhostCapture.hpp"
+#include "Features/Demo/GhostNet.hpp"
+#include "Features/Demo/GhostPool.hpp"
+#include "Features/Demo/GhostSnapshotBuffer.hpp"
+#include "Packet.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <vector>
+
+using namespace GhostServer;
+
+namespace {
+	struct ReplayGhost {
+		uint32_t ID;
+		GhostSnapshotBuffer snapshots;
+		Vector lastPos;
+		Vector lastVel;
+		int drawn = 0;
+	};
+
+	using Clock = std::chrono::steady_clock;
+}  // namespace
+
+static void hashBytes(uint32_t *hash, const void *data, size_t size) {
+	// FNV-1a
+	auto bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < size; ++i) *hash = (*hash ^ bytes[i]) * 16777619u;
+}
+
+static double percentile(std::vector<double> &vals, double p) {
+	if (vals.empty()) return 0;
+	auto nth = vals.begin() + (size_t)((vals.size() - 1) * p);
+	std::nth_element(vals.begin(), nth, vals.end());
+	return *nth;
+}
+
+Replayer::Replayer(const Options &opts)
+	: opts(opts) {
+}
+
+bool Replayer::Run(const std::string &path, ReplayResult *res) {
+	GhostCapture::Capture capture;
+	if (!GhostCapture::Read(path, &capture)) {
+		fprintf(stderr, "%s: not a ghost capture\n", path.c_str());
+		return false;
+	}
+
+	auto reply = std::find_if(capture.records.begin(), capture.records.end(), [](const GhostCapture::Record &record) {
+		return record.kind == GhostCapture::Kind::CONNECT_REPLY;
+	});
+	if (reply == capture.records.end()) {
+		fprintf(stderr, "%s: doesn't start with a connection\n", path.c_str());
+		return false;
+	}
+
+	// As NetworkManager::AcceptConnection
+	GhostPool<ReplayGhost> pool;
+	Packet packet(reply->data, reply->size);
+	uint32_t ourId, nPlayers;
+	packet >> ourId >> nPlayers;
+	for (uint32_t i = 0; packet && i < nPlayers; ++i) {
+		uint32_t id;
+		std::string name, model, map;
+		DataGhost data;
+		Rgb col;
+		packet >> id >> name >> data >> model >> map >> col;
+		auto ghost = std::make_shared<ReplayGhost>();
+		ghost->ID = id;
+		pool.Add(ghost);
+	}
+	if (!packet) {
+		fprintf(stderr, "%s: bad connection reply\n", path.c_str());
+		return false;
+	}
+
+	ReplayResult out;
+	out.hash = 2166136261u;
+	GhostNet::Stream stream;
+	uint64_t start = reply->time;
+	double frame = 1.0 / std::max(this->opts.fps, 1);
+	double nextFrame = 0;
+	double updateNs = 0;
+	std::vector<double> frameTimes, stutters;
+	std::vector<std::shared_ptr<ReplayGhost>> gone;
+
+	auto draw = [&](double now) {
+		auto before = Clock::now();
+		auto snap = pool.Load();
+		for (auto &ghost : *snap) {
+			DataGhost data;
+			Vector vel;
+			if (!ghost->snapshots.Sample(now, this->opts.delay, this->opts.extrapolate, &data, &vel)) {
+				++out.missing;
+				continue;
+			}
+			++out.samples;
+			hashBytes(&out.hash, &ghost->ID, sizeof ghost->ID);
+			hashBytes(&out.hash, &data.position, sizeof data.position);
+			hashBytes(&out.hash, &data.view_angle, sizeof data.view_angle);
+
+			Vector v = (data.position - ghost->lastPos) * (float)(1 / frame);
+			if (ghost->drawn >= 2) stutters.push_back((v - ghost->lastVel).Length());
+			ghost->lastPos = data.position;
+			ghost->lastVel = v;
+			++ghost->drawn;
+		}
+		frameTimes.push_back(std::chrono::duration<double, std::micro>(Clock::now() - before).count());
+	};
+
+	auto push = [&](uint32_t id, const DataGhost &data, std::optional<uint16_t> sentAt, double now) {
+		if (id == ourId) return;
+		auto ghost = pool.Get(id);
+		if (!ghost) return;
+		ghost->snapshots.Push(now, data, sentAt);
+		++out.updates;
+	};
+
+	for (auto &record : capture.records) {
+		if (record.time < start) continue;
+		if (record.kind != GhostCapture::Kind::RECV_UDP && record.kind != GhostCapture::Kind::RECV_TCP) continue;
+
+		double now = (record.time - start) / 1e9;
+		for (; nextFrame <= now; nextFrame += frame) draw(nextFrame);
+
+		// As NetworkManager::Treat, for everything that touches the pool
+		auto before = Clock::now();
+		Packet packet(record.data, record.size);
+		HEADER header;
+		uint32_t id;
+		if (!(packet >> header >> id)) continue;
+		++out.packets;
+
+		switch (header) {
+		case HEADER::CONNECT: {
+			auto ghost = std::make_shared<ReplayGhost>();
+			ghost->ID = id;
+			pool.Add(ghost);
+			++out.joined;
+			break;
+		}
+		case HEADER::DISCONNECT: {
+			auto ghost = pool.Remove(id);
+			if (ghost) {
+				// Keep their stats for the totals
+				gone.push_back(ghost);
+				++out.left;
+			}
+			break;
+		}
+		case HEADER::UPDATE: {
+			uint32_t count;
+			if (id != 0 || !(packet >> count)) break;
+			for (uint32_t i = 0; i < count; ++i) {
+				uint32_t ghostId;
+				DataGhost data;
+				if (!(packet >> ghostId >> data)) break;
+				push(ghostId, data, {}, now);
+			}
+			break;
+		}
+		case HEADER::UPDATE_DELTA: {
+			GhostNet::Snapshot snap;
+			if (id != 0 || !stream.Decode(packet.Data() + packet.Offset(), packet.Size() - packet.Offset(), &snap)) break;
+			for (auto &[ghostId, state] : snap.ghosts) push(ghostId, GhostNet::Dequantise(state), state.time, now);
+			break;
+		}
+		default:
+			break;
+		}
+		updateNs += std::chrono::duration<double, std::nano>(Clock::now() - before).count();
+	}
+
+	out.seconds = nextFrame;
+	out.frames = frameTimes.size();
+	out.updateNs = updateNs / std::max<uint64_t>(out.updates, 1);
+	for (double t : frameTimes) {
+		out.frameMean += t;
+		out.frameMax = std::max(out.frameMax, t);
+	}
+	out.frameMean /= std::max<size_t>(frameTimes.size(), 1);
+	out.frameP99 = percentile(frameTimes, 0.99);
+	for (double s : stutters) out.stutterMean += s;
+	out.stutterMean /= std::max<size_t>(stutters.size(), 1);
+	out.stutterP99 = percentile(stutters, 0.99);
+
+	auto snap = pool.Load();
+	gone.insert(gone.end(), snap->begin(), snap->end());
+	for (auto &ghost : gone) {
+		auto stats = ghost->snapshots.GetStats();
+		out.late += stats.late;
+		out.dropped += stats.dropped;
+	}
+
+	*res = out;
+	return true;
+}
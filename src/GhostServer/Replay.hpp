@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace GhostServer {
+	struct ReplayResult {
+		double seconds = 0;  // Of traffic in the capture
+		uint32_t packets = 0;
+		uint64_t updates = 0;  // Positions pushed to snapshot buffers
+		uint32_t joined = 0;
+		uint32_t left = 0;
+		uint64_t frames = 0;
+		uint64_t samples = 0;  // Ghosts drawn, over every frame
+		uint64_t missing = 0;  // Ghosts with nothing to draw yet
+		double updateNs = 0;   // Per update, decoding and buffering it
+		// Drawing every ghost for a frame, in us
+		double frameMean = 0;
+		double frameP99 = 0;
+		double frameMax = 0;
+		// How much each ghost's speed changes from one frame to the next,
+		// in units/s: what shows up as stutter
+		double stutterMean = 0;
+		double stutterP99 = 0;
+		uint32_t late = 0;
+		uint32_t dropped = 0;
+		// Of every position drawn, so runs can be checked to match exactly
+		uint32_t hash = 0;
+	};
+
+	// Plays what a capture received back through a ghost pool and snapshot
+	// buffers on a simulated clock, as NetworkManager's Treat and
+	// UpdateGhostsPosition would, drawing a frame every 1/fps s of the
+	// capture's time. Only the measured costs depend on the real clock;
+	// every run puts the ghosts in exactly the same places.
+	class Replayer {
+	public:
+		struct Options {
+			int fps = 144;
+			float delay = 0;           // As ghost_net_interp_delay, in s
+			float extrapolate = 0.1f;  // As ghost_net_extrapolate, in s
+		};
+
+		explicit Replayer(const Options &opts);
+
+		bool Run(const std::string &path, ReplayResult *res);
+
+	private:
+		Options opts;
+	};
+}  // namespace GhostServer
@@ -0,0 +1,512 @@
+#include "Server.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace GhostServer;
+
+#define HEARTBEAT_INTERVAL std::chrono::seconds(5)
+// Players who miss this many heartbeats in a row are dropped
+#define MAX_MISSED_HEARTBEATS 3
+// A countdown starts anyway if anyone's still not ready after this long
+#define COUNTDOWN_TIMEOUT std::chrono::seconds(10)
+
+static uint16_t nowMs() {
+	return (uint16_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Server::Server(const Options &opts)
+	: opts(opts) {
+}
+
+Server::~Server() {
+	this->players.clear();
+	if (this->listenFd >= 0) close(this->listenFd);
+	if (this->udpFd >= 0) close(this->udpFd);
+}
+
+bool Server::Start() {
+	this->listenFd = Listen(this->opts.port);
+	if (this->listenFd < 0) return false;
+
+	// Players send their UDP updates to the same port number
+	this->udpFd = BindUdp(this->opts.port);
+	if (this->udpFd < 0) return false;
+
+	if (this->opts.verbose) {
+		printf("listening on port %d, ticking every %d ms, %s\n", this->opts.port, this->opts.tickMs, this->opts.allowDelta ? "offering delta updates" : "original updates only");
+		fflush(stdout);
+	}
+	return true;
+}
+
+// Main loop {{{
+
+void Server::Run(const std::atomic<bool> &stop) {
+	auto tick = std::chrono::milliseconds(this->opts.tickMs);
+	auto now = Clock::now();
+	auto nextTick = now + tick;
+	auto nextHeartbeat = now + HEARTBEAT_INTERVAL;
+	{
+		std::lock_guard<std::mutex> lock(this->statsLock);
+		this->statsStart = now;
+	}
+
+	std::vector<pollfd> fds;
+	std::vector<uint32_t> fdPlayers;
+
+	while (!stop && !this->stopping) {
+		this->RunCommands();
+
+		fds.clear();
+		fdPlayers.clear();
+		fds.push_back({this->listenFd, POLLIN, 0});
+		fds.push_back({this->udpFd, POLLIN, 0});
+		for (auto &[id, player] : this->players) {
+			fds.push_back({player.tcp->Fd(), (short)(POLLIN | (player.tcp->WantsWrite() ? POLLOUT : 0)), 0});
+			fdPlayers.push_back(id);
+		}
+
+		// Wake up at least every so often to check for commands and stopping
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - Clock::now()).count();
+		poll(fds.data(), fds.size(), (int)std::clamp<long long>(wait, 0, 100));
+
+		if (fds[0].revents & POLLIN) this->Accept();
+
+		if (fds[1].revents & POLLIN) {
+			Packet packet;
+			sockaddr_in from;
+			while (ReceiveFrom(this->udpFd, &packet, &from)) {
+				{
+					std::lock_guard<std::mutex> lock(this->statsLock);
+					this->bytesReceived += packet.Size();
+				}
+				this->HandleUdp(packet, from);
+			}
+		}
+
+		std::vector<std::pair<uint32_t, const char *>> dropped;
+		for (size_t i = 0; i < fdPlayers.size(); ++i) {
+			auto &pfd = fds[i + 2];
+			if (!pfd.revents) continue;
+
+			auto it = this->players.find(fdPlayers[i]);
+			if (it == this->players.end()) continue;
+			auto &player = it->second;
+
+			if (pfd.revents & POLLOUT && !player.tcp->Flush()) {
+				dropped.push_back({player.id, "connection lost"});
+				continue;
+			}
+
+			std::vector<Packet> packets;
+			bool alive = player.tcp->Receive(packets);
+			for (auto &packet : packets) {
+				HEADER header;
+				packet >> header;
+				if (header == HEADER::DISCONNECT) {
+					alive = false;
+					break;
+				}
+				this->HandleTcp(player, header, packet);
+			}
+			if (!alive) dropped.push_back({player.id, "disconnected"});
+		}
+		for (auto &[id, why] : dropped) this->Drop(id, why);
+
+		now = Clock::now();
+		if (now >= nextTick) {
+			this->Tick();
+			nextTick += tick;
+			// Don't try to catch up on ticks missed while stopped in a debugger
+			if (nextTick < now) nextTick = now + tick;
+		}
+		if (now >= nextHeartbeat) {
+			this->Heartbeat();
+			nextHeartbeat = now + HEARTBEAT_INTERVAL;
+		}
+		if (this->countdownStarted && now - *this->countdownStarted > COUNTDOWN_TIMEOUT) this->StartCountdown();
+
+		for (auto &[id, player] : this->players) this->CountTcpBytes(player);
+	}
+
+	Packet packet;
+	packet << HEADER::STOP_SERVER << (uint32_t)0;
+	this->Broadcast(packet);
+	for (auto &[id, player] : this->players) player.tcp->Flush();
+}
+
+void Server::Accept() {
+	int fd;
+	while ((fd = GhostServer::Accept(this->listenFd)) >= 0) {
+		uint32_t id = this->nextId++;
+		auto &player = this->players[id];
+		player.id = id;
+		player.tcp = std::make_unique<TcpConnection>(fd);
+	}
+}
+
+void Server::Drop(uint32_t id, const char *why) {
+	auto it = this->players.find(id);
+	if (it == this->players.end()) return;
+
+	this->CountTcpBytes(it->second);
+	bool wasConnected = it->second.connected;
+	if (wasConnected && this->opts.verbose) {
+		printf("[%u] %s %s\n", id, it->second.name.c_str(), why);
+		fflush(stdout);
+	}
+	this->players.erase(it);
+
+	if (wasConnected) {
+		{
+			std::lock_guard<std::mutex> lock(this->statsLock);
+			--this->connectedCount;
+		}
+		Packet packet;
+		packet << HEADER::DISCONNECT << id;
+		this->Broadcast(packet);
+	}
+}
+
+void Server::CountTcpBytes(Player &player) {
+	std::lock_guard<std::mutex> lock(this->statsLock);
+	this->bytesSent += std::exchange(player.tcp->bytesSent, 0);
+	this->bytesReceived += std::exchange(player.tcp->bytesReceived, 0);
+}
+
+// }}}
+
+// Packets {{{
+
+void Server::HandleTcp(Player &player, HEADER header, Packet &packet) {
+	if (header == HEADER::CONNECT) {
+		if (!player.connected) this->HandleConnect(player, packet);
+		return;
+	}
+	if (!player.connected) return;
+
+	// Whatever ID a player gives, they can only speak for themselves
+	uint32_t id;
+	if (!(packet >> id)) return;
+
+	switch (header) {
+	case HEADER::PING: {
+		Packet reply;
+		reply << HEADER::PING << player.id;
+		player.tcp->Send(reply);
+		break;
+	}
+	case HEADER::MAP_CHANGE: {
+		uint32_t ticksIL, ticksTotal;
+		if (!(packet >> player.map >> ticksIL >> ticksTotal)) break;
+		Packet out;
+		out << HEADER::MAP_CHANGE << player.id << player.map << ticksIL << ticksTotal;
+		this->Broadcast(out, player.id);
+		if (this->opts.verbose) printf("[%u] %s is now on %s\n", player.id, player.name.c_str(), player.map.c_str());
+		break;
+	}
+	case HEADER::HEART_BEAT: {
+		uint32_t token;
+		if (packet >> token && token == player.heartbeatToken) player.missedHeartbeats = 0;
+		break;
+	}
+	case HEADER::MESSAGE: {
+		std::string message;
+		if (!(packet >> message)) break;
+		Packet out;
+		out << HEADER::MESSAGE << player.id << message;
+		this->Broadcast(out, player.id);
+		if (this->opts.verbose) printf("[%u] %s: %s\n", player.id, player.name.c_str(), message.c_str());
+		break;
+	}
+	case HEADER::COUNTDOWN: {
+		uint8_t step;
+		if (!(packet >> step) || step != 1 || !this->countdownStarted) break;
+		player.countdownReady = true;
+		bool allReady = std::all_of(this->players.begin(), this->players.end(), [](auto &p) { return !p.second.connected || p.second.countdownReady; });
+		if (allReady) this->StartCountdown();
+		break;
+	}
+	case HEADER::SPEEDRUN_FINISH: {
+		std::string time;
+		if (!(packet >> time)) break;
+		Packet out;
+		out << HEADER::SPEEDRUN_FINISH << player.id << time;
+		this->Broadcast(out, player.id);
+		if (this->opts.verbose) printf("[%u] %s finished on %s in %s\n", player.id, player.name.c_str(), player.map.c_str(), time.c_str());
+		break;
+	}
+	case HEADER::MODEL_CHANGE: {
+		if (!(packet >> player.model)) break;
+		Packet out;
+		out << HEADER::MODEL_CHANGE << player.id << player.model;
+		this->Broadcast(out, player.id);
+		break;
+	}
+	case HEADER::COLOR_CHANGE: {
+		if (!(packet >> player.color)) break;
+		Packet out;
+		out << HEADER::COLOR_CHANGE << player.id << player.color;
+		this->Broadcast(out, player.id);
+		break;
+	}
+	case HEADER::UPDATE:
+	case HEADER::UPDATE_DELTA:
+		this->HandleUpdate(player, header, packet);
+		break;
+	default:
+		break;
+	}
+
+	if (this->opts.verbose) fflush(stdout);
+}
+
+void Server::HandleConnect(Player &player, Packet &packet) {
+	uint16_t udpPort;
+	packet >> udpPort >> player.name >> player.data >> player.model >> player.map >> player.tcpOnly >> player.color;
+	if (!packet) return;
+
+	// Only newer clients say which protocols they speak
+	uint32_t offered;
+	if (!(packet >> offered)) offered = GhostNet::PROTOCOL_LEGACY;
+	player.protocol = std::min(offered, this->opts.allowDelta ? (uint32_t)GhostNet::PROTOCOL_CURRENT : (uint32_t)GhostNet::PROTOCOL_LEGACY);
+
+	sockaddr_in peer{};
+	socklen_t len = sizeof peer;
+	getpeername(player.tcp->Fd(), (sockaddr *)&peer, &len);
+	player.udpAddr = peer;
+	player.udpAddr.sin_port = htons(udpPort);
+
+	Packet reply;
+	reply << player.id << (uint32_t)std::count_if(this->players.begin(), this->players.end(), [](auto &p) { return p.second.connected; });
+	for (auto &[id, other] : this->players) {
+		if (!other.connected) continue;
+		reply << id << other.name << other.data << other.model << other.map << other.color;
+	}
+	reply << player.protocol;
+	player.tcp->Send(reply);
+
+	Packet announce;
+	announce << HEADER::CONNECT << player.id << player.name << player.data << player.model << player.map << player.color;
+	this->Broadcast(announce, player.id);
+
+	player.connected = true;
+	{
+		std::lock_guard<std::mutex> lock(this->statsLock);
+		++this->connectedCount;
+	}
+
+	if (this->opts.verbose) {
+		printf("[%u] %s connected from %s on %s (%s%s)\n", player.id, player.name.c_str(), inet_ntoa(peer.sin_addr), player.map.empty() ? "the menu" : player.map.c_str(), player.protocol >= GhostNet::PROTOCOL_DELTA ? "delta" : "original", player.tcpOnly ? ", TCP only" : "");
+		fflush(stdout);
+	}
+}
+
+void Server::HandleUdp(Packet &packet, const sockaddr_in &from) {
+	HEADER header;
+	uint32_t id;
+	if (!(packet >> header >> id)) return;
+
+	auto it = this->players.find(id);
+	if (it == this->players.end() || !it->second.connected) return;
+	auto &player = it->second;
+
+	// NAT can change the port, but anyone else claiming to be them is ignored
+	if (from.sin_addr.s_addr != player.udpAddr.sin_addr.s_addr) return;
+	player.udpAddr.sin_port = from.sin_port;
+
+	if (header == HEADER::UPDATE || header == HEADER::UPDATE_DELTA) this->HandleUpdate(player, header, packet);
+}
+
+void Server::HandleUpdate(Player &player, HEADER header, Packet &packet) {
+	if (header == HEADER::UPDATE) {
+		DataGhost data;
+		if (!(packet >> data)) return;
+		player.data = data;
+		player.state = GhostNet::Quantise(data, nowMs());
+		player.hasState = true;
+		return;
+	}
+
+	GhostNet::Snapshot snap;
+	if (!player.stream.Decode(packet.Data() + packet.Offset(), packet.Size() - packet.Offset(), &snap)) return;
+	auto state = snap.Find(player.id);
+	if (!state) return;
+	player.state = *state;
+	player.data = GhostNet::Dequantise(*state);
+	player.hasState = true;
+}
+
+// Everyone's latest position goes to everybody else. The original format
+// is the same for everyone, since players skip their own ID; deltas
+// depend on what each player has acknowledged.
+void Server::Tick() {
+	auto start = Clock::now();
+
+	GhostNet::Snapshot all;
+	for (auto &[id, player] : this->players) {
+		if (player.connected && player.hasState) all.ghosts.push_back({id, player.state});
+	}
+
+	Packet legacy;
+	legacy << HEADER::UPDATE << (uint32_t)0 << (uint32_t)all.ghosts.size();
+	for (auto &[id, state] : all.ghosts) legacy << id << this->players[id].data;
+
+	std::vector<uint8_t> body;
+	GhostNet::Snapshot others;
+	for (auto &[id, player] : this->players) {
+		if (!player.connected) continue;
+
+		if (player.protocol < GhostNet::PROTOCOL_DELTA || player.tcpOnly) {
+			this->SendUpdate(player, legacy);
+			continue;
+		}
+
+		others.ghosts.clear();
+		for (auto &ghost : all.ghosts) {
+			if (ghost.first != id) others.ghosts.push_back(ghost);
+		}
+		body.clear();
+		player.stream.Encode(others, body);
+
+		Packet packet;
+		packet << HEADER::UPDATE_DELTA << (uint32_t)0;
+		packet.Append(body.data(), body.size());
+		this->SendUpdate(player, packet);
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	std::lock_guard<std::mutex> lock(this->statsLock);
+	this->tickTimes.push_back(ms);
+}
+
+void Server::SendUpdate(Player &player, const Packet &packet) {
+	if (player.tcpOnly) {
+		player.tcp->Send(packet);
+		return;
+	}
+	size_t sent = SendTo(this->udpFd, player.udpAddr, packet);
+	std::lock_guard<std::mutex> lock(this->statsLock);
+	this->bytesSent += sent;
+}
+
+void Server::Broadcast(const Packet &packet, uint32_t except) {
+	for (auto &[id, player] : this->players) {
+		if (id != except && player.connected) player.tcp->Send(packet);
+	}
+}
+
+// Once everyone's ready, or we've waited long enough
+void Server::StartCountdown() {
+	Packet packet;
+	packet << HEADER::COUNTDOWN << (uint32_t)0 << (uint8_t)1;
+	this->Broadcast(packet);
+	this->countdownStarted = {};
+	if (this->opts.verbose) printf("countdown started\n");
+}
+
+void Server::Heartbeat() {
+	std::vector<uint32_t> dead;
+	for (auto &[id, player] : this->players) {
+		if (!player.connected) continue;
+		if (player.heartbeatToken && ++player.missedHeartbeats >= MAX_MISSED_HEARTBEATS) {
+			dead.push_back(id);
+			continue;
+		}
+		player.heartbeatToken = (uint32_t)rand() | 1;
+		Packet packet;
+		packet << HEADER::HEART_BEAT << (uint32_t)0 << player.heartbeatToken;
+		player.tcp->Send(packet);
+	}
+	for (uint32_t id : dead) this->Drop(id, "timed out");
+}
+
+// }}}
+
+// Commands {{{
+
+void Server::Command(const std::string &line) {
+	std::lock_guard<std::mutex> lock(this->commandLock);
+	this->commands.push_back(line);
+}
+
+void Server::RunCommands() {
+	std::vector<std::string> lines;
+	{
+		std::lock_guard<std::mutex> lock(this->commandLock);
+		lines.swap(this->commands);
+	}
+
+	for (auto &line : lines) {
+		std::istringstream in(line);
+		std::string cmd;
+		in >> cmd;
+
+		if (cmd == "stop") {
+			this->stopping = true;
+		} else if (cmd == "status") {
+			printf("%d players:\n", (int)this->players.size());
+			for (auto &[id, player] : this->players) {
+				if (!player.connected) continue;
+				printf("  [%u] %s on %s (%s%s)\n", id, player.name.c_str(), player.map.empty() ? "the menu" : player.map.c_str(), player.protocol >= GhostNet::PROTOCOL_DELTA ? "delta" : "original", player.tcpOnly ? ", TCP only" : "");
+			}
+		} else if (cmd == "stats") {
+			auto stats = this->TakeStats();
+			double secs = std::max(stats.seconds, 0.001);
+			printf("%u players; %u ticks in %.1f s, %.3f ms mean, %.3f ms p99, %.3f ms max; %.1f KiB/s out, %.1f KiB/s in\n", stats.players, stats.ticks, stats.seconds, stats.tickMean, stats.tickP99, stats.tickMax, stats.bytesSent / 1024.0 / secs, stats.bytesReceived / 1024.0 / secs);
+		} else if (cmd == "countdown") {
+			// countdown [seconds] [commands before] [commands after]
+			uint32_t duration = 3;
+			std::string pre, post;
+			in >> duration >> pre >> post;
+			for (auto &[id, player] : this->players) player.countdownReady = false;
+			Packet packet;
+			packet << HEADER::COUNTDOWN << (uint32_t)0 << (uint8_t)0 << duration << pre << post;
+			this->Broadcast(packet);
+			this->countdownStarted = Clock::now();
+			printf("countdown of %u set up\n", duration);
+		} else if (cmd == "kick") {
+			uint32_t id = 0;
+			in >> id;
+			this->Drop(id, "was kicked");
+		} else if (!cmd.empty()) {
+			printf("commands: status, stats, countdown [seconds] [pre] [post], kick <id>, stop\n");
+		}
+	}
+	if (!lines.empty()) fflush(stdout);
+}
+
+ServerStats Server::TakeStats() {
+	std::lock_guard<std::mutex> lock(this->statsLock);
+
+	ServerStats stats;
+	auto now = Clock::now();
+	stats.seconds = std::chrono::duration<double>(now - this->statsStart).count();
+	stats.ticks = this->tickTimes.size();
+	if (!this->tickTimes.empty()) {
+		std::sort(this->tickTimes.begin(), this->tickTimes.end());
+		for (double t : this->tickTimes) stats.tickMean += t;
+		stats.tickMean /= this->tickTimes.size();
+		stats.tickP99 = this->tickTimes[this->tickTimes.size() * 99 / 100];
+		stats.tickMax = this->tickTimes.back();
+	}
+	stats.bytesSent = this->bytesSent;
+	stats.bytesReceived = this->bytesReceived;
+	stats.players = this->connectedCount;
+
+	this->statsStart = now;
+	this->tickTimes.clear();
+	this->bytesSent = 0;
+	this->bytesReceived = 0;
+	return stats;
+}
+
+// }}}
@@ -0,0 +1,114 @@
+#pragma once
+#include "Packet.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace GhostServer {
+	// How long every tick took to send out updates, and everything the
+	// server sent and received, since they were last taken
+	struct ServerStats {
+		double seconds = 0;
+		uint32_t ticks = 0;
+		double tickMean = 0;  // ms
+		double tickP99 = 0;
+		double tickMax = 0;
+		uint64_t bytesSent = 0;
+		uint64_t bytesReceived = 0;
+		uint32_t players = 0;
+	};
+
+	// A ghost server which speaks the same protocol as the real one, for
+	// testing SAR against. It relays everyone's position to everybody else
+	// once a tick, in whichever of the update formats each player asked
+	// for, and passes on map changes, messages and the like as they come.
+	// Everything happens on the thread that calls Run.
+	class Server {
+	public:
+		struct Options {
+			uint16_t port = 53000;
+			int tickMs = 50;
+			bool allowDelta = true;
+			bool verbose = true;  // Print who connects and so on
+		};
+
+		explicit Server(const Options &opts);
+		~Server();
+
+		bool Start();
+		// Runs until stop is set or a stop command is given
+		void Run(const std::atomic<bool> &stop);
+
+		// Commands as typed into the console; safe to call from any thread
+		void Command(const std::string &line);
+
+		ServerStats TakeStats();
+
+	private:
+		struct Player {
+			uint32_t id;
+			std::unique_ptr<TcpConnection> tcp;
+			bool connected = false;  // Has sent CONNECT
+			sockaddr_in udpAddr{};
+			bool tcpOnly = false;
+			uint32_t protocol = GhostNet::PROTOCOL_LEGACY;
+			GhostNet::Stream stream;
+
+			std::string name;
+			std::string model;
+			std::string map;
+			Rgb color{};
+			bool hasState = false;
+			DataGhost data{};
+			GhostNet::State state{};
+
+			bool countdownReady = false;
+			uint32_t heartbeatToken = 0;
+			int missedHeartbeats = 0;
+		};
+
+		using Clock = std::chrono::steady_clock;
+
+		void Accept();
+		void Drop(uint32_t id, const char *why);
+		void HandleTcp(Player &player, HEADER header, Packet &packet);
+		void HandleUdp(Packet &packet, const sockaddr_in &from);
+		void HandleConnect(Player &player, Packet &packet);
+		void HandleUpdate(Player &player, HEADER header, Packet &packet);
+		void Tick();
+		void StartCountdown();
+		void Heartbeat();
+		void RunCommands();
+		void CountTcpBytes(Player &player);
+
+		// To everyone who has connected, except the given ID
+		void Broadcast(const Packet &packet, uint32_t except = 0);
+		void SendUpdate(Player &player, const Packet &packet);
+
+		Options opts;
+		int listenFd = -1;
+		int udpFd = -1;
+		uint32_t nextId = 1;
+		std::map<uint32_t, Player> players;
+		bool stopping = false;
+
+		std::optional<Clock::time_point> countdownStarted;
+
+		std::mutex commandLock;
+		std::vector<std::string> commands;
+
+		std::mutex statsLock;
+		Clock::time_point statsStart;
+		std::vector<double> tickTimes;
+		uint64_t bytesSent = 0;
+		uint64_t bytesReceived = 0;
+		uint32_t connectedCount = 0;
+	};
+}  // namespace GhostServer
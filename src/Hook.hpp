@@ -11,11 +11,14 @@ public:
 	Hook(T hook)
 		: func(nullptr)
 		, hook((void *)hook)
-		, enabled(false) {
+		, enabled(false)
+		, trampoline(nullptr) {
 		Hook::hooks.push_back(this);
 	}
 
-	~Hook() {}
+	~Hook() {
+		if (this->trampoline) Memory::FreeExecutable(this->trampoline, TRAMPOLINE_SIZE);
+	}
 
 	template <typename T = void *>
 	void SetFunc(T func, bool enable = true) {
@@ -42,13 +45,42 @@ public:
 		this->enabled = false;
 	}
 
+	// Builds a stub which runs the first prologueLen bytes of the
+	// original function and then jumps to the rest of it, so the original
+	// can be called without disabling the hook. prologueLen must be at
+	// least 5, end on an instruction boundary, and cover no relative
+	// jumps or calls; since it depends on the exact code being hooked,
+	// it's up to the caller to know it.
+	void *Trampoline(size_t prologueLen) {
+		if (this->trampoline) return this->trampoline;
+		if (!this->func || prologueLen < 5 || prologueLen > TRAMPOLINE_SIZE - 5) return nullptr;
+
+		uint8_t *stub = (uint8_t *)Memory::AllocExecutable(TRAMPOLINE_SIZE);
+		if (!stub) return nullptr;
+
+		// If we've already patched the function, its first bytes are our
+		// JMP rather than the original code
+		memcpy(stub, this->func, prologueLen);
+		if (this->enabled) memcpy(stub, this->origCode, sizeof this->origCode);
+
+		uint8_t *jmp = stub + prologueLen;
+		jmp[0] = 0xE9;  // JMP
+		*(uint32_t *)(jmp + 1) = ((uintptr_t)this->func + prologueLen) - ((uintptr_t)jmp + 5);
+
+		this->trampoline = stub;
+		return stub;
+	}
+
 	static void DisableAll();
 
 private:
+	static constexpr size_t TRAMPOLINE_SIZE = 32;
+
 	void *func;
 	void *hook;
 	bool enabled;
 	uint8_t origCode[5];
+	void *trampoline;
 
 	static std::vector<Hook *> hooks;
 };
@@ -1,6 +1,7 @@
 #pragma once
 #include "Module.hpp"
 #include "Utils.hpp"
+#include "Utils/SDK.hpp"
 #include "Scheduler.hpp"
 
 #include <functional>
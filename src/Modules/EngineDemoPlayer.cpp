@@ -7,8 +7,10 @@
 #include "Event.hpp"
 #include "Features/Camera.hpp"
 #include "Features/Demo/Demo.hpp"
+#include "Features/Demo/DemoBatch.hpp"
 #include "Features/Demo/DemoParser.hpp"
 #include "Features/Renderer.hpp"
+#include "Features/Speedrun/SpeedrunTimer.hpp"
 #include "Interface.hpp"
 #include "Offsets.hpp"
 #include "SAR.hpp"
@@ -370,35 +372,31 @@ CON_COMMAND_F_COMPLETION(sar_startdemosfolder, "sar_startdemosfolder <folder nam
 		return console->Print(sar_startdemosfolder.ThisPtr()->m_pszHelpString);
 	}
 
-	engine->demoplayer->demoQueue.clear();
-
-	auto dir = engine->GetGameDirectory() + std::string("/");
-	std::string filepath;
-	Demo demo;
-	DemoParser parser;
-
-	for (const auto &file : std::filesystem::directory_iterator(dir + args[1])) {
-		try {
-			if (file.path().extension() != ".dem")
-				continue;
-
-			filepath = args[1];
-			if (filepath[filepath.size() - 1] != '/') filepath += "/";
-			filepath += file.path().filename().string();
-			console->Print("%s\n", filepath.c_str());
-			if (parser.Parse(dir + filepath, &demo)) {
-				engine->demoplayer->demoQueue.push_back(filepath);
-			}
-		} catch (std::system_error &e) {
-		}
+	if (DemoBatch::IsRunning()) {
+		return console->Print("Demos are already being processed! Use sar_demo_batch_cancel to stop them.\n");
 	}
 
-	std::sort(engine->demoplayer->demoQueue.begin(), engine->demoplayer->demoQueue.end());
+	// Check the demos can be parsed in the background, then queue the ones
+	// that can once they're all done
+	DemoBatch::Start(
+		DemoBatch::FindDemos(args[1], false),
+		[](const DemoBatch::Result &res, size_t idx, size_t total) {
+			console->Print("%s\n", res.name.c_str());
+		},
+		[](const std::vector<DemoBatch::Result> &results, bool cancelled) {
+			if (cancelled) return;
+
+			engine->demoplayer->demoQueue.clear();
+			for (auto &res : results) {
+				if (res.parsed) engine->demoplayer->demoQueue.push_back(res.name);
+			}
 
-	engine->demoplayer->demoQueueSize = engine->demoplayer->demoQueue.size();
-	engine->demoplayer->currentDemoID = 0;
+			engine->demoplayer->demoQueueSize = engine->demoplayer->demoQueue.size();
+			engine->demoplayer->currentDemoID = 0;
 
-	EngineDemoPlayer::stopdemo_callback(args);
+			CCommand args = {};
+			EngineDemoPlayer::stopdemo_callback(args);
+		});
 }
 CON_COMMAND_COMPLETION(sar_skiptodemo, "sar_skiptodemo <demoname> - skip demos in demo queue to this demo\n", ({engine->demoplayer->demoQueue})) {
 	if (args.ArgC() < 2) {
@@ -12,6 +12,7 @@
 #include "Features/Speedrun/SpeedrunTimer.hpp"
 #include "Features/Timer/Timer.hpp"
 #include "Features/TimescaleDetect.hpp"
+#include "FileSums.hpp"
 #include "Offsets.hpp"
 #include "Server.hpp"
 #include "Utils.hpp"
@@ -24,10 +25,13 @@ REDECL(EngineDemoRecorder::SetSignonState);
 REDECL(EngineDemoRecorder::StartRecording);
 REDECL(EngineDemoRecorder::StopRecording);
 REDECL(EngineDemoRecorder::RecordCustomData);
+REDECL(EngineDemoRecorder::FileWrite);
+REDECL(EngineDemoRecorder::FileClose);
 REDECL(EngineDemoRecorder::stop_callback);
 REDECL(EngineDemoRecorder::record_callback);
 
 Variable sar_demo_overwrite_bak("sar_demo_overwrite_bak", "0", 0, "Rename demos to (name)_bak if they would be overwritten by recording\n");
+Variable sar_demo_checksum_verify("sar_demo_checksum_verify", "0", "Re-hash each demo when it finishes recording, and warn if the checksum calculated while recording was different.\n");
 
 int EngineDemoRecorder::GetTick() {
 	return this->GetRecordingTick(this->s_ClientDemoRecorder->ThisPtr());
@@ -140,7 +144,7 @@ DETOUR(EngineDemoRecorder::SetSignonState, int state) {
 
 		lastName += ".dem";
 
-		if (!AddDemoChecksum(lastName.c_str())) {
+		if (!engine->demorecorder->AddChecksum(lastName)) {
 			// TODO: report failure?
 		}
 
@@ -148,6 +152,11 @@ DETOUR(EngineDemoRecorder::SetSignonState, int state) {
 		needToRecordInitialVals = true;
 	}
 
+	if (state == SIGNONSTATE_FULL && *engine->demorecorder->m_bRecording) {
+		// The new demo file is open now
+		engine->demorecorder->checksum.SetFilename(engine->demorecorder->GetDemoFilename());
+	}
+
 	if (state == SIGNONSTATE_FULL && needToRecordInitialVals) {
 		needToRecordInitialVals = false;
 		RecordTimestamp();
@@ -226,7 +235,7 @@ DETOUR(EngineDemoRecorder::StopRecording) {
 
 	if (engine->demorecorder->isRecordingDemo) {
 		std::string demoName = engine->demorecorder->GetDemoFilename();
-		if (!AddDemoChecksum(demoName.c_str())) {
+		if (!engine->demorecorder->AddChecksum(demoName)) {
 			// TODO: report failure?
 		}
 	}
@@ -265,6 +274,24 @@ DETOUR(EngineDemoRecorder::RecordCustomData, int id, const void *data, unsigned
 	return EngineDemoRecorder::RecordCustomData(thisptr, id, data, length);
 }
 
+// IBaseFileSystem::Write
+DETOUR(EngineDemoRecorder::FileWrite, const void *input, int size, void *file) {
+	// Hash demos as the engine writes them out, so there's nothing to read
+	// back when they finish
+	auto &checksum = engine->demorecorder->checksum;
+	if (size > 0 && checksum.Wants(file, input, size)) {
+		unsigned int offset = engine->demorecorder->FileTell(thisptr, file);
+		checksum.OnWrite(file, offset, input, size);
+	}
+	return EngineDemoRecorder::FileWrite(thisptr, input, size, file);
+}
+
+// IBaseFileSystem::Close
+DETOUR(EngineDemoRecorder::FileClose, void *file) {
+	engine->demorecorder->checksum.OnClose(file);
+	return EngineDemoRecorder::FileClose(thisptr, file);
+}
+
 DETOUR_COMMAND(EngineDemoRecorder::stop) {
 	engine->demorecorder->requestedStop = true;
 	EngineDemoRecorder::stop_callback(args);
@@ -362,12 +389,23 @@ bool EngineDemoRecorder::Init() {
 			engine->net_time = Memory::Deref<double *>((uintptr_t)this->GetRecordingTick + Offsets::net_time);
 	}
 
+	// Demos are written through the filesystem's IBaseFileSystem, which
+	// comes after IAppSystem in IFileSystem
+	if (auto filesystem = Interface::Get<uint8_t *>(MODULE("filesystem_stdio"), "VFileSystem017")) {
+		if (this->s_BaseFileSystem = Interface::Create(filesystem + sizeof(void *))) {
+			this->FileTell = this->s_BaseFileSystem->Original<_FileTell>(Offsets::Tell);
+			this->s_BaseFileSystem->Hook(EngineDemoRecorder::FileWrite_Hook, EngineDemoRecorder::FileWrite, Offsets::Write);
+			this->s_BaseFileSystem->Hook(EngineDemoRecorder::FileClose_Hook, EngineDemoRecorder::FileClose, Offsets::Close);
+		}
+	}
+
 	Command::Hook("stop", EngineDemoRecorder::stop_callback_hook, EngineDemoRecorder::stop_callback);
 	Command::Hook("record", EngineDemoRecorder::record_callback_hook, EngineDemoRecorder::record_callback);
 
 	return this->hasLoaded = this->s_ClientDemoRecorder;
 }
 void EngineDemoRecorder::Shutdown() {
+	Interface::Delete(this->s_BaseFileSystem);
 	Interface::Delete(this->s_ClientDemoRecorder);
 	Command::Unhook("stop", EngineDemoRecorder::stop_callback);
 	Command::Unhook("record", EngineDemoRecorder::record_callback);
@@ -393,6 +431,23 @@ void EngineDemoRecorder::RecordData(const void *data, unsigned long length) {
 	free(buf);
 }
 
+bool EngineDemoRecorder::AddChecksum(const std::string &filename) {
+	// If the writes couldn't all be followed, fall back to reading the
+	// whole file
+	uint32_t checksum;
+	if (!this->checksum.Finish(filename, &checksum)) return AddDemoChecksum(filename.c_str());
+
+	if (sar_demo_checksum_verify.GetBool()) {
+		uint32_t full;
+		if (FileChecksum(filename.c_str(), &full) && full != checksum) {
+			console->Warning("Demo checksum calculated while recording was %08X, but the file hashes to %08X!\n", checksum, full);
+			checksum = full;
+		}
+	}
+
+	return AddDemoChecksum(filename.c_str(), checksum);
+}
+
 ON_EVENT(PRE_TICK) {
 	if (event.simulating && !engine->demorecorder->hasNotified && engine->demorecorder->m_bRecording) {
 		const char *cmd = "echo \"SAR " SAR_VERSION " (Built " SAR_BUILT ")\"";
@@ -1,4 +1,5 @@
 #pragma once
+#include "Checksum.hpp"
 #include "Command.hpp"
 #include "Interface.hpp"
 #include "Module.hpp"
@@ -12,10 +13,14 @@
 class EngineDemoRecorder : public Module {
 public:
 	Interface *s_ClientDemoRecorder = nullptr;
+	Interface *s_BaseFileSystem = nullptr;
 
 	using _GetRecordingTick = int(__rescall *)(void *thisptr);
 	_GetRecordingTick GetRecordingTick = nullptr;
 
+	using _FileTell = unsigned int(__rescall *)(void *thisptr, void *file);
+	_FileTell FileTell = nullptr;
+
 	char *m_szDemoBaseName = nullptr;
 	int *m_nDemoNumber = nullptr;
 	bool *m_bRecording = nullptr;
@@ -30,6 +35,8 @@ public:
 
 	char coopRadialMenuLastPos[8];
 
+	DemoChecksumTracker checksum;
+
 public:
 	int GetTick();
 	std::string GetDemoFilename();
@@ -46,6 +53,12 @@ public:
 	// CDemoRecorder::RecordCustomData
 	DECL_DETOUR(RecordCustomData, int id, const void *data, unsigned long length);
 
+	// IBaseFileSystem::Write
+	DECL_DETOUR(FileWrite, const void *input, int size, void *file);
+
+	// IBaseFileSystem::Close
+	DECL_DETOUR(FileClose, void *file);
+
 	DECL_DETOUR_COMMAND(stop);
 
 	DECL_DETOUR_COMMAND(record);
@@ -54,4 +67,5 @@ public:
 	void Shutdown() override;
 	const char *Name() override { return MODULE("engine"); }
 	void RecordData(const void *data, unsigned long length);
+	bool AddChecksum(const std::string &filename);
 };
@@ -2,6 +2,7 @@
 #include "Interface.hpp"
 #include "Module.hpp"
 #include "Utils.hpp"
+#include "Utils/SDK.hpp"
 
 #ifdef _WIN32
 #	define TIER1 "vstdlib"
@@ -110,6 +110,11 @@ namespace Offsets {
 	int m_bRecording;
 	int m_nDemoNumber;
 
+	// IBaseFileSystem
+	int Write;
+	int Close;
+	int Tell;
+
 	// CDemoPlayer
 	int GetPlaybackTick;
 	int StartPlayback;
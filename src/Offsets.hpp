@@ -118,6 +118,11 @@ namespace Offsets {
 	extern int m_bRecording;
 	extern int m_nDemoNumber;
 
+	// IBaseFileSystem
+	extern int Write;
+	extern int Close;
+	extern int Tell;
+
 	// CDemoPlayer
 	extern int GetPlaybackTick;
 	extern int StartPlayback;
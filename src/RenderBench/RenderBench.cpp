@@ -0,0 +1,398 @@
+// sar-renderbench: drives RenderEncoder with synthetic frames and audio,
+// without the game, to measure how codec, blending, resolution and
+// segment threads affect render speed. Built by `make sar-renderbench`
+// against a full FFmpeg; see the Makefile.
+
+#include "Features/RenderBlend.hpp"
+#include "Features/RenderConvert.hpp"
+#include "Features/RenderEncoder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+struct Options {
+	std::vector<std::string> codecs = {"h264"};
+	std::vector<int> blends = {1, 4};
+	std::vector<std::pair<int, int>> sizes = {{1920, 1080}};
+	std::vector<int> threads = {0, 4};
+	int frames = 300;  // Output frames per run
+	int fps = 60;
+	int quality = 35;
+	bool verbose = false;
+	bool checkConvert = false;
+};
+
+struct RunResult {
+	bool ok;
+	double fps;            // Output frames per second of encoder time
+	double latencyMean;    // ms from the first subframe of an output frame to it being encoded
+	double latencyP99;
+	double peakRssMiB;     // Over the run
+};
+
+static bool g_verbose;
+
+static void benchLog(const char *fmt, ...) {
+	if (!g_verbose) return;
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+static void usage() {
+	fputs(
+		"usage: sar-renderbench [options]\n"
+		"\n"
+		"Renders synthetic frames and audio through the same encoder as\n"
+		"sar_render, for every combination of the lists given, and reports\n"
+		"frames per second, per-frame latency and peak memory of each.\n"
+		"\n"
+		"options:\n"
+		"  --codecs <list>   video codecs (h264, hevc, vp8, vp9, dnxhd; default h264)\n"
+		"  --blends <list>   frames blended into each output frame (default 1,4)\n"
+		"  --sizes <list>    resolutions as WxH (default 1920x1080)\n"
+		"  --threads <list>  sar_render_encode_threads values (default 0,4)\n"
+		"  --frames <n>      output frames per run (default 300)\n"
+		"  --quality <n>     as sar_render_quality (default 35)\n"
+		"  -v                print the encoder's own output\n"
+		"  --check-convert   instead of benchmarking, check that converting in\n"
+		"                    slices gives the same image as converting in one go\n"
+		"\n"
+		"Lists are comma separated, e.g. --sizes 1280x720,1920x1080,3840x2160\n",
+		stderr);
+}
+
+static std::vector<std::string> splitList(const char *str) {
+	std::vector<std::string> out;
+	std::string cur;
+	for (; *str; ++str) {
+		if (*str == ',') {
+			if (!cur.empty()) out.push_back(cur);
+			cur.clear();
+		} else {
+			cur += *str;
+		}
+	}
+	if (!cur.empty()) out.push_back(cur);
+	return out;
+}
+
+// Peak resident memory since the last call, in KiB. Writing 5 to
+// clear_refs resets the peak, so each run is measured on its own.
+static long peakRss() {
+	long peak = 0;
+	FILE *fp = fopen("/proc/self/status", "r");
+	if (fp) {
+		char line[256];
+		while (fgets(line, sizeof line, fp)) {
+			if (!strncmp(line, "VmHWM:", 6)) peak = atol(line + 6);
+		}
+		fclose(fp);
+	}
+	fp = fopen("/proc/self/clear_refs", "w");
+	if (fp) {
+		fputs("5", fp);
+		fclose(fp);
+	}
+	return peak;
+}
+
+// Something with motion and detail for the encoder to work on: a
+// scrolling gradient with a moving block of noise, a bit like a camera
+// turning across a textured wall
+static void fillFrame(uint8_t *image, int width, int height, int n, uint32_t *rng) {
+	for (int y = 0; y < height; ++y) {
+		uint8_t *row = image + (size_t)y * width * 3;
+		for (int x = 0; x < width; ++x) {
+			row[3 * x + 0] = (uint8_t)(x + 2 * n);
+			row[3 * x + 1] = (uint8_t)(y + n);
+			row[3 * x + 2] = (uint8_t)((x ^ y) + 3 * n);
+		}
+	}
+
+	int bw = width / 4, bh = height / 4;
+	int bx = (int)((width - bw) * (0.5 + 0.5 * sin(n * 0.02)));
+	int by = (int)((height - bh) * (0.5 + 0.5 * cos(n * 0.03)));
+	for (int y = by; y < by + bh; ++y) {
+		uint8_t *row = image + ((size_t)y * width + bx) * 3;
+		for (int i = 0; i < bw * 3; ++i) {
+			*rng = *rng * 1664525 + 1013904223;
+			row[i] = *rng >> 24;
+		}
+	}
+}
+
+// Sliced conversion check {{{
+
+// Converts the same frames with 1 and with 2-8 slices, for the formats
+// and scalers sar_render can use, and compares every plane. Slices have
+// to overlap for the chroma filters to see across their edges, so this
+// catches seams.
+static bool checkConvert(const Options &opts) {
+	static const AVPixelFormat formats[] = {AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV422P};
+	static const char *scalers[] = {"point", "bilinear", "bicubic"};
+
+	auto sizes = opts.sizes;
+	sizes.push_back({642, 362});  // Slices of unequal, unaligned heights
+
+	int failed = 0, checked = 0;
+	for (auto [width, height] : sizes) {
+		std::vector<uint8_t> image((size_t)width * height * 3);
+		uint32_t rng = 1234;
+		fillFrame(image.data(), width, height, 100, &rng);
+
+		for (AVPixelFormat fmt : formats) {
+			for (const char *scaler : scalers) {
+				AVFrame *ref = av_frame_alloc();
+				AVFrame *out = av_frame_alloc();
+				ref->format = out->format = fmt;
+				ref->width = out->width = width;
+				ref->height = out->height = height;
+				av_frame_get_buffer(ref, 32);
+				av_frame_get_buffer(out, 32);
+
+				FrameConverter single;
+				single.Init(width, height, fmt, ScalerFlagsFromName(scaler), 1);
+				single.Convert(image.data(), 3 * width, ref);
+
+				for (int threads = 2; threads <= 8; ++threads) {
+					FrameConverter sliced;
+					if (!sliced.Init(width, height, fmt, ScalerFlagsFromName(scaler), threads)) {
+						printf("FAIL %dx%d %s %s, %d threads: could not initialise\n", width, height, av_get_pix_fmt_name(fmt), scaler, threads);
+						++failed;
+						continue;
+					}
+					sliced.Convert(image.data(), 3 * width, out);
+					++checked;
+
+					for (int p = 0; p < 3; ++p) {
+						int shift = p ? av_pix_fmt_desc_get(fmt)->log2_chroma_h : 0;
+						int rows = -((-height) >> shift);
+						int bytes = av_image_get_linesize(fmt, width, p);
+						int bad = -1;
+						for (int y = 0; y < rows && bad < 0; ++y) {
+							if (memcmp(ref->data[p] + y * ref->linesize[p], out->data[p] + y * out->linesize[p], bytes)) bad = y;
+						}
+						if (bad >= 0) {
+							printf("FAIL %dx%d %s %s, %d slices: plane %d differs from row %d\n", width, height, av_get_pix_fmt_name(fmt), scaler, sliced.SliceCount(), p, bad);
+							++failed;
+							break;
+						}
+					}
+				}
+
+				av_frame_free(&ref);
+				av_frame_free(&out);
+			}
+		}
+	}
+
+	if (failed) {
+		printf("%d of %d sliced conversions differ\n", failed, checked);
+		return false;
+	}
+	printf("All %d sliced conversions match\n", checked);
+	return true;
+}
+
+// }}}
+
+static const char *extensionFor(AVCodecID codec) {
+	switch (codec) {
+	case AV_CODEC_ID_VP8: return "mkv";
+	case AV_CODEC_ID_DNXHD: return "mov";
+	default: return "mp4";
+	}
+}
+
+static RunResult runOne(const Options &opts, const std::string &codec, int blend, int width, int height, int encodeThreads) {
+	RunResult res = {};
+
+	RenderSettings settings;
+	settings.videoCodec = RenderEncoder::VideoCodecFromName(codec.c_str());
+	settings.audioCodec = RenderEncoder::AudioCodecFromName("aac");
+	settings.filename = (std::filesystem::temp_directory_path() / ("sar-renderbench." + std::string(extensionFor(settings.videoCodec)))).string();
+	settings.videoBitrate = 40000 * 1000;
+	settings.audioBitrate = 160 * 1000;
+	settings.quality = opts.quality;
+	settings.width = width;
+	settings.height = height;
+	settings.fps = opts.fps;
+	settings.samplerate = 44100;
+	settings.scalerFlags = SWS_BILINEAR;
+	settings.convertThreads = std::max(1, std::min(4, (int)std::thread::hardware_concurrency() / 2));
+	settings.encodeThreads = encodeThreads;
+	settings.segmentGops = 4;
+	settings.fragmented = false;
+	settings.fragmentSeconds = 2;
+	settings.resume = false;
+	settings.toBlend = blend;
+
+	// As sar_render does with the default 180 degree shutter and box
+	// profile
+	settings.blendWeightSum = 0;
+	if (blend > 1) {
+		int toExclude = (int)round(blend * 0.5f / 2);
+		if (toExclude * 2 >= blend) toExclude = blend / 2 - 1;
+		settings.blendWeights = RenderBlend::ComputeWeights(RenderBlend::Profile::BOX, blend, toExclude, blend - toExclude, {});
+		for (uint16_t w : settings.blendWeights) settings.blendWeightSum += w;
+	}
+
+	peakRss();
+
+	RenderEncoder encoder(&benchLog);
+	if (!encoder.Open(settings)) {
+		fprintf(stderr, "%s %dx%d: could not open the encoder\n", codec.c_str(), width, height);
+		return res;
+	}
+
+	int channels = encoder.Channels();
+	int audioFrame = encoder.AudioFrameSize();
+	std::vector<int16_t> audio(channels * audioFrame);
+	std::vector<const int16_t *> planes(channels);
+	for (int c = 0; c < channels; ++c) planes[c] = audio.data() + c * audioFrame;
+	int64_t audioSamples = 0;
+	int64_t audioSubmitted = 0;
+
+	std::vector<uint8_t> image((size_t)width * height * 3);
+	uint32_t rng = 1234;
+
+	using Clock = std::chrono::steady_clock;
+	double busy = 0;
+	double groupStart = 0;
+	std::vector<double> latencies;
+	bool ok = true;
+
+	int subframes = opts.frames * blend;
+	for (int n = 0; n < subframes && ok; ++n) {
+		fillFrame(image.data(), width, height, n, &rng);
+
+		RenderStats::FrameRow row = {};
+		row.capture = n;
+		row.output = -1;
+
+		auto start = Clock::now();
+		ok = encoder.SubmitVideo(image.data(), &row);
+		double secs = std::chrono::duration<double>(Clock::now() - start).count();
+		busy += secs;
+
+		if (n % blend == 0) groupStart = 0;
+		groupStart += secs;
+		if (row.output >= 0) latencies.push_back(groupStart * 1e3);
+
+		// A 440 Hz tone, keeping up with the video as the game's mixer does
+		audioSamples = (int64_t)(n + 1) * settings.samplerate / (opts.fps * blend);
+		while (ok && audioSubmitted + audioFrame <= audioSamples) {
+			for (int i = 0; i < audioFrame; ++i) {
+				int16_t v = (int16_t)(8000 * sin((audioSubmitted + i) * 2 * M_PI * 440 / RenderEncoder::INPUT_SAMPLE_RATE));
+				for (int c = 0; c < channels; ++c) audio[c * audioFrame + i] = v;
+			}
+			auto start = Clock::now();
+			ok = encoder.SubmitAudio(planes.data());
+			busy += std::chrono::duration<double>(Clock::now() - start).count();
+			audioSubmitted += audioFrame;
+		}
+	}
+
+	auto start = Clock::now();
+	ok &= encoder.Close();
+	busy += std::chrono::duration<double>(Clock::now() - start).count();
+	std::remove(settings.filename.c_str());
+
+	res.ok = ok;
+	res.fps = opts.frames / busy;
+	for (double l : latencies) res.latencyMean += l;
+	res.latencyMean /= std::max<size_t>(latencies.size(), 1);
+	if (!latencies.empty()) {
+		auto nth = latencies.begin() + (latencies.size() - 1) * 99 / 100;
+		std::nth_element(latencies.begin(), nth, latencies.end());
+		res.latencyP99 = *nth;
+	}
+	res.peakRssMiB = peakRss() / 1024.0;
+	return res;
+}
+
+int main(int argc, char **argv) {
+	Options opts;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--codecs" && hasValue) {
+			opts.codecs = splitList(argv[++i]);
+		} else if (arg == "--blends" && hasValue) {
+			opts.blends.clear();
+			for (auto &b : splitList(argv[++i])) opts.blends.push_back(std::clamp(atoi(b.c_str()), 1, (int)RenderBlend::MAX_WEIGHT_SUM));
+		} else if (arg == "--sizes" && hasValue) {
+			opts.sizes.clear();
+			for (auto &s : splitList(argv[++i])) {
+				int w, h;
+				if (sscanf(s.c_str(), "%dx%d", &w, &h) == 2 && w > 0 && h > 0) opts.sizes.push_back({w & ~1, h & ~1});
+			}
+		} else if (arg == "--threads" && hasValue) {
+			opts.threads.clear();
+			for (auto &t : splitList(argv[++i])) opts.threads.push_back(std::clamp(atoi(t.c_str()), 0, 16));
+		} else if (arg == "--frames" && hasValue) {
+			opts.frames = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--quality" && hasValue) {
+			opts.quality = std::clamp(atoi(argv[++i]), 0, 50);
+		} else if (arg == "-v") {
+			opts.verbose = true;
+		} else if (arg == "--check-convert") {
+			opts.checkConvert = true;
+		} else {
+			usage();
+			return arg == "-h" || arg == "--help" ? 0 : 2;
+		}
+	}
+	g_verbose = opts.verbose;
+
+	if (opts.checkConvert) return checkConvert(opts) ? 0 : 1;
+
+	for (auto &codec : opts.codecs) {
+		if (RenderEncoder::VideoCodecFromName(codec.c_str()) == AV_CODEC_ID_NONE) {
+			fprintf(stderr, "unknown codec '%s'\n", codec.c_str());
+			return 2;
+		}
+	}
+
+	printf("%d output frames per run, blend kernel %s\n", opts.frames, RenderBlend::KernelName());
+	printf("%-6s %-10s %5s %7s %8s %12s %11s %10s\n", "codec", "size", "blend", "threads", "fps", "latency (ms)", "p99 (ms)", "RSS (MiB)");
+
+	bool ok = true;
+	for (auto &codec : opts.codecs) {
+		for (auto [width, height] : opts.sizes) {
+			for (int blend : opts.blends) {
+				for (int threads : opts.threads) {
+					auto res = runOne(opts, codec, blend, width, height, threads);
+					auto size = std::to_string(width) + "x" + std::to_string(height);
+					if (!res.ok) {
+						printf("%-6s %-10s %5d %7d %8s\n", codec.c_str(), size.c_str(), blend, threads, "failed");
+						ok = false;
+						continue;
+					}
+					printf("%-6s %-10s %5d %7d %8.1f %12.2f %11.2f %10.0f\n", codec.c_str(), size.c_str(), blend, threads, res.fps, res.latencyMean, res.latencyP99, res.peakRssMiB);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	return ok ? 0 : 1;
+}
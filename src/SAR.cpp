@@ -16,7 +16,9 @@
 #include "CrashHandler.hpp"
 #include "Event.hpp"
 #include "Features.hpp"
+#include "Features/Demo/Demo.hpp"
 #include "Features/Stats/Stats.hpp"
+#include "FileSums.hpp"
 #include "Game.hpp"
 #include "Hook.hpp"
 #include "Interface.hpp"
@@ -168,6 +170,7 @@ bool SAR::Load(CreateInterfaceFn interfaceFactory, CreateInterfaceFn gameServerF
 
 	if (this->game) {
 		this->game->LoadOffsets();
+		Demo::defaultTickrate = this->game->Tickrate();
 
 		CrashHandler::Init();
 
@@ -215,6 +218,7 @@ bool SAR::Load(CreateInterfaceFn interfaceFactory, CreateInterfaceFn gameServerF
 			this->modules->InitAll();
 
 			InitSARChecksum();
+			InitFileSums();
 
 			if (engine && engine->hasLoaded) {
 				engine->demoplayer->Init();
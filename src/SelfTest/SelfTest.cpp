@@ -0,0 +1,1244 @@
+// sar-selftest: checks and benchmarks for the parts of SAR which don't
+// need the game, comparing them against what they replaced where there
+// was something. Built by `make sar-selftest`; Linux only.
+
+#include "Checksum.hpp"
+#include "DemoTool/DemoFiles.hpp"
+#include "Features/Demo/Demo.hpp"
+#include "Features/Demo/DemoParser.hpp"
+#include "Features/Demo/GhostFile.hpp"
+#include "Features/Demo/GhostNet.hpp"
+#include "Features/Demo/GhostPool.hpp"
+#include "Features/Demo/GhostSnapshotBuffer.hpp"
+#include "Features/Demo/GhostTrack.hpp"
+#include "Features/RenderBlend.hpp"
+#include "Utils.hpp"
+#include "Utils/Cpu.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+static void usage() {
+	fputs(
+		"usage: sar-selftest <command> [args]\n"
+		"\n"
+		"commands:\n"
+		"  crctest     check the CRC32 implementations against each other and\n"
+		"              known values, and measure their speed\n"
+		"  blendtest   check the render blending kernels give exactly what the\n"
+		"              scalar ones do, and measure their speed\n"
+		"  nettest [players] [loss%]\n"
+		"              play network ghost updates through a simulated lossy\n"
+		"              server, checking they decode exactly and comparing the\n"
+		"              bandwidth with the original format\n"
+		"  jittertest [jitter ms] [loss%]\n"
+		"              compare how smoothly network ghosts move with and\n"
+		"              without the snapshot buffer\n"
+		"  poolbench [ghosts]\n"
+		"              measure frame and update costs of the network ghost pool\n"
+		"              against the locked vector it replaced\n"
+		"  parsebench [demo|folder]...\n"
+		"              compare timing the demos with the mapped parser and with\n"
+		"              the stream reads it replaced; with no demos, uses a\n"
+		"              synthesised one\n"
+		"  ghostbench <demo|folder>...\n"
+		"              compare loading and playing back the demos as ghosts from\n"
+		"              GhostTrack and from the std::map it replaced\n",
+		stderr);
+}
+
+// Demo parser benchmark {{{
+
+namespace {
+	struct ParseTiming {
+		int32_t lastMessageTick = -1;
+		int32_t firstPositivePacketTick = 0;
+		int32_t segmentTicks = -1;
+		size_t messages = 0;
+	};
+
+	// What sar_time_demo collects, as DemoTiming's visitor does
+	class ParseBenchVisitor : public DemoVisitor {
+	public:
+		ParseTiming timing;
+
+		bool OnMessage(uint8_t type, int32_t tick, size_t offset) override {
+			++this->timing.messages;
+			if (tick >= 0) this->timing.lastMessageTick = tick;
+			return true;
+		}
+
+		bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override {
+			if (tick > 0 && this->gotSync && !this->gotFirstPositivePacket) {
+				this->timing.firstPositivePacketTick = tick;
+				this->gotFirstPositivePacket = true;
+			}
+			return true;
+		}
+
+		bool OnSyncTick(int32_t tick) override {
+			this->gotSync = true;
+			return true;
+		}
+
+		bool OnConsoleCmd(int32_t tick, const char *data, int32_t length) override {
+			if (std::string(data, length).find("__END__") != std::string::npos) this->timing.segmentTicks = tick;
+			return true;
+		}
+
+	private:
+		bool gotSync = false;
+		bool gotFirstPositivePacket = false;
+	};
+}  // namespace
+
+// How DemoParser::Parse read demos before it mapped them: field by field
+// from an ifstream, collecting every message tick, with the console
+// commands copied out to look for __END__
+static bool streamParse(const std::string &path, ParseTiming *out) {
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.good()) return false;
+
+	Demo demo;
+	file.read(demo.demoFileStamp, sizeof demo.demoFileStamp);
+	file.read((char *)&demo.demoProtocol, sizeof demo.demoProtocol);
+	file.read((char *)&demo.networkProtocol, sizeof demo.networkProtocol);
+	file.read(demo.serverName, sizeof demo.serverName);
+	file.read(demo.clientName, sizeof demo.clientName);
+	file.read(demo.mapName, sizeof demo.mapName);
+	file.read(demo.gameDirectory, sizeof demo.gameDirectory);
+	file.read((char *)&demo.playbackTime, sizeof demo.playbackTime);
+	file.read((char *)&demo.playbackTicks, sizeof demo.playbackTicks);
+	file.read((char *)&demo.playbackFrames, sizeof demo.playbackFrames);
+	file.read((char *)&demo.signOnLength, sizeof demo.signOnLength);
+
+	bool alignment = demo.demoProtocol == 4;
+	int splitScreen = demo.demoProtocol == 4 ? 2 : 1;
+	std::vector<int32_t> messageTicks;
+	bool gotSync = false, gotFirstPositivePacket = false;
+
+	while (!file.eof() && !file.bad()) {
+		unsigned char cmd;
+		int32_t tick;
+		file.read((char *)&cmd, sizeof cmd);
+		if (!file || cmd == 0x07) break;
+		file.read((char *)&tick, sizeof tick);
+		if (!file) break;
+		if (tick >= 0) messageTicks.push_back(tick);
+		++out->messages;
+		if (alignment) file.ignore(1);
+
+		int32_t length;
+		switch (cmd) {
+		case 0x01:
+		case 0x02:
+			if (tick > 0 && gotSync && !gotFirstPositivePacket) {
+				out->firstPositivePacketTick = tick;
+				gotFirstPositivePacket = true;
+			}
+			file.ignore(splitScreen * 76 + 4 + 4);
+			file.read((char *)&length, sizeof length);
+			file.ignore(length);
+			break;
+		case 0x03:
+			gotSync = true;
+			break;
+		case 0x04: {
+			file.read((char *)&length, sizeof length);
+			std::string str(length, ' ');
+			file.read(&str[0], length);
+			if (str.find("__END__") != std::string::npos) out->segmentTicks = tick;
+			break;
+		}
+		case 0x05:
+			file.ignore(4);
+			file.read((char *)&length, sizeof length);
+			file.ignore(length);
+			break;
+		case 0x06:
+			file.read((char *)&length, sizeof length);
+			file.ignore(length);
+			break;
+		case 0x08:
+			if (demo.demoProtocol == 4) file.ignore(4);
+			file.read((char *)&length, sizeof length);
+			file.ignore(length);
+			break;
+		case 0x09:
+			file.read((char *)&length, sizeof length);
+			file.ignore(length);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (!messageTicks.empty()) out->lastMessageTick = *std::max_element(messageTicks.begin(), messageTicks.end());
+	return true;
+}
+
+// A Portal 2 demo of a few minutes with the usual mix of messages: a
+// packet and a usercmd every tick, the odd console command and SAR's
+// custom data, and __END__ near the end
+static bool writeSynthDemo(const std::string &path, int ticks) {
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp) return false;
+
+	std::mt19937 rng(1234);
+	auto put32 = [&](int32_t v) { fwrite(&v, 4, 1, fp); };
+	auto putMsg = [&](uint8_t cmd, int32_t tick) {
+		fputc(cmd, fp);
+		put32(tick);
+		fputc(0, fp);
+	};
+	auto putBlock = [&](size_t size) {
+		put32((int32_t)size);
+		for (size_t i = 0; i < size; ++i) fputc(rng() & 0xFF, fp);
+	};
+
+	char header[1072] = "HL2DEMO";
+	int32_t fields[] = {4, 2001};
+	memcpy(header + 8, fields, sizeof fields);
+	strcpy(header + 16 + 260, "synth");
+	strcpy(header + 16 + 520, "sp_a1_intro1");
+	strcpy(header + 16 + 780, "portal2");
+	float time = ticks / 60.0f;
+	int32_t counts[] = {ticks, ticks, 0};
+	memcpy(header + 16 + 1040, &time, 4);
+	memcpy(header + 16 + 1044, counts, sizeof counts);
+	fwrite(header, sizeof header, 1, fp);
+
+	putMsg(0x01, 0);
+	fwrite(std::vector<uint8_t>(2 * 76 + 8).data(), 2 * 76 + 8, 1, fp);
+	putBlock(64 * 1024);
+	putMsg(0x06, 0);
+	putBlock(256 * 1024);
+	putMsg(0x03, 0);
+
+	for (int tick = 1; tick <= ticks; ++tick) {
+		putMsg(0x02, tick);
+		fwrite(std::vector<uint8_t>(2 * 76 + 8).data(), 2 * 76 + 8, 1, fp);
+		putBlock(200 + rng() % 1200);
+		putMsg(0x05, tick);
+		put32(tick);
+		putBlock(20 + rng() % 40);
+		if (tick % 97 == 0) {
+			putMsg(0x08, tick);
+			put32(0);
+			putBlock(8 + 32);
+		}
+		if (tick % 301 == 0 || tick == ticks - 10) {
+			const char *cmd = tick == ticks - 10 ? "echo #SAR# __END__" : "+jump";
+			putMsg(0x04, tick);
+			put32((int32_t)strlen(cmd) + 1);
+			fwrite(cmd, strlen(cmd) + 1, 1, fp);
+		}
+	}
+	putMsg(0x07, ticks);
+
+	return fclose(fp) == 0;
+}
+
+static bool parseBench(std::vector<std::string> demos) {
+	using Clock = std::chrono::steady_clock;
+
+	std::string synth;
+	if (demos.empty()) {
+		synth = (std::filesystem::temp_directory_path() / "sar-demotool-bench.dem").string();
+		if (!writeSynthDemo(synth, 60 * 60 * 5)) {
+			fprintf(stderr, "could not write %s\n", synth.c_str());
+			return false;
+		}
+		demos.push_back(synth);
+	}
+
+	uint64_t bytes = 0;
+	for (auto &path : demos) {
+		std::error_code ec;
+		bytes += std::filesystem::file_size(path, ec);
+	}
+
+	// Both must time every demo the same
+	bool ok = true;
+	for (auto &path : demos) {
+		Demo demo;
+		DemoParser parser;
+		ParseBenchVisitor visitor;
+		ParseTiming stream;
+		bool mappedOk = parser.Parse(path, &demo, &visitor);
+		bool streamOk = streamParse(path, &stream);
+		auto &mapped = visitor.timing;
+		if (mappedOk != streamOk || (mappedOk && (mapped.lastMessageTick != stream.lastMessageTick || mapped.firstPositivePacketTick != stream.firstPositivePacketTick || mapped.segmentTicks != stream.segmentTicks || mapped.messages != stream.messages))) {
+			printf("%s: the parsers disagree\n", path.c_str());
+			ok = false;
+		}
+	}
+
+	// Enough passes for a second or so of the slower one, with the files
+	// in the page cache after the check above
+	auto run = [&](auto parse) {
+		int passes = 0;
+		auto start = Clock::now();
+		double secs;
+		do {
+			for (auto &path : demos) parse(path);
+			++passes;
+			secs = std::chrono::duration<double>(Clock::now() - start).count();
+		} while (secs < 1.0);
+		return secs / passes;
+	};
+
+	double mappedSecs = run([](const std::string &path) {
+		Demo demo;
+		DemoParser parser;
+		ParseBenchVisitor visitor;
+		parser.Parse(path, &demo, &visitor);
+	});
+	double streamSecs = run([](const std::string &path) {
+		ParseTiming timing;
+		streamParse(path, &timing);
+	});
+
+	printf("%d demos, %.1f MB%s\n", (int)demos.size(), bytes / 1e6, synth.empty() ? "" : " (synthesised)");
+	printf("%-10s %12s %10s\n", "", "per pass (ms)", "MB/s");
+	printf("%-10s %12.2f %10.0f\n", "mapped", mappedSecs * 1e3, bytes / mappedSecs / 1e6);
+	printf("%-10s %12.2f %10.0f\n", "ifstream", streamSecs * 1e3, bytes / streamSecs / 1e6);
+
+	if (!synth.empty()) std::remove(synth.c_str());
+	return ok;
+}
+
+// }}}
+
+// Ghost track benchmark {{{
+
+namespace {
+	// Collects the same positions as GhostVisitor, so that building each
+	// kind of storage can be timed without the parsing
+	class GhostFramesVisitor : public DemoVisitor {
+	public:
+		std::vector<std::pair<int, DataGhost>> frames;
+
+		bool OnPacket(uint8_t type, int32_t tick, const DemoCmdInfo *infos, int nInfos, int32_t inSeq, int32_t outSeq, const uint8_t *data, int32_t length) override {
+			if (nInfos < 1) return true;
+			if (tick == 0) this->waitForNext = true;
+
+			if (tick > 0 && this->waitForNext && this->lastTick != tick) {
+				const DemoCmdInfo &info = infos[0];
+				this->lastTick = tick;
+				this->frames.push_back({tick, DataGhost{{info.viewOrigin[0], info.viewOrigin[1], info.viewOrigin[2]}, {info.viewAngles[0], info.viewAngles[1], info.viewAngles[2]}, 64, true}});
+			}
+			return true;
+		}
+
+	private:
+		bool waitForNext = false;
+		int lastTick = 0;
+	};
+}  // namespace
+
+// The lookup DemoGhostEntity::UpdateDemoGhost does each tick, including
+// the fallback for alternateticks demos
+template <typename Lookup>
+static void updateGhost(Lookup get, int tick, DataGhost *data) {
+	DataGhost next;
+	if (!get(tick, data) && get(tick + 1, &next)) {
+		Vector old = data->position;
+		*data = next;
+		data->position = (old + next.position) * 0.5f;
+	}
+}
+
+static bool ghostBench(const std::vector<std::string> &demos) {
+	using Clock = std::chrono::steady_clock;
+	auto secsSince = [](Clock::time_point start) {
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	};
+
+	std::vector<std::vector<std::pair<int, DataGhost>>> parsed;
+	for (auto &path : demos) {
+		Demo demo;
+		DemoParser parser;
+		GhostFramesVisitor visitor;
+		if (!parser.Parse(path, &demo, &visitor)) {
+			fprintf(stderr, "%s: could not parse\n", path.c_str());
+			return false;
+		}
+		parsed.push_back(std::move(visitor.frames));
+	}
+
+	// At least as many ghosts as a decent race would have
+	size_t nGhosts = std::max((size_t)10, parsed.size());
+	size_t frameCount = 0;
+	int endTick = 0;
+	for (size_t i = 0; i < nGhosts; ++i) {
+		auto &frames = parsed[i % parsed.size()];
+		frameCount += frames.size();
+		if (!frames.empty()) endTick = std::max(endTick, frames.back().first + 1);
+	}
+
+	std::vector<std::map<int, DataGhost>> maps(nGhosts);
+	std::vector<GhostTrack> tracks(nGhosts);
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < nGhosts; ++i) {
+		for (auto &[tick, data] : parsed[i % parsed.size()]) maps[i][tick] = data;
+	}
+	double mapLoad = secsSince(start);
+
+	start = Clock::now();
+	for (size_t i = 0; i < nGhosts; ++i) {
+		for (auto &[tick, data] : parsed[i % parsed.size()]) tracks[i].Set(tick, data);
+		tracks[i].ShrinkToFit();
+	}
+	double trackLoad = secsSince(start);
+
+	// The same tracks saved and mapped back in, as ghost_set_track does
+	auto tmpPath = (std::filesystem::temp_directory_path() / "sar-demotool-bench.sarghost").string();
+	GhostFile::Run run;
+	for (auto &track : tracks) run.levels.push_back({"", 0, 0, track, {}});
+	if (!GhostFile::Write(tmpPath, run)) {
+		fprintf(stderr, "could not write %s\n", tmpPath.c_str());
+		return false;
+	}
+	run = {};
+	start = Clock::now();
+	bool readOk = GhostFile::Read(tmpPath, &run);
+	double fileLoad = secsSince(start);
+	if (!readOk || run.levels.size() != nGhosts) {
+		fprintf(stderr, "could not read back %s\n", tmpPath.c_str());
+		return false;
+	}
+
+	// A red-black tree node is a colour and three pointers followed by the
+	// value, and malloc rounds it up to 16 bytes with 8 bytes of its own
+	size_t nodeSize = ((4 * sizeof(void *) + sizeof(std::pair<const int, DataGhost>) + 8 + 15) & ~(size_t)15);
+	size_t mapMem = frameCount * nodeSize;
+	size_t trackMem = 0;
+	for (auto &track : tracks) trackMem += track.MemoryUsage();
+
+	// Both must give the same path, give or take the angle quantisation
+	bool ok = true;
+	for (size_t i = 0; i < nGhosts && ok; ++i) {
+		for (int tick = 0; tick < endTick; ++tick) {
+			auto it = maps[i].find(tick);
+			DataGhost data;
+			bool found = tracks[i].Get(tick, &data);
+			if (found != (it != maps[i].end()) || (found && (data.position.x != it->second.position.x || std::fabs(std::remainder(data.view_angle.y - it->second.view_angle.y, 360.0f)) > 0.01f))) {
+				printf("ghost %d differs at tick %d\n", (int)i, tick);
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	float sink = 0;
+	auto runUpdates = [&](auto get) {
+		std::vector<DataGhost> state(nGhosts, DataGhost{{0, 0, 0}, {0, 0, 0}, 0, false});
+		auto start = Clock::now();
+		for (int tick = 0; tick < endTick; ++tick) {
+			for (size_t i = 0; i < nGhosts; ++i) {
+				updateGhost([&](int t, DataGhost *out) { return get(i, t, out); }, tick, &state[i]);
+			}
+		}
+		double secs = secsSince(start);
+		for (auto &s : state) sink += s.position.x;
+		return secs * 1e9 / ((double)endTick * nGhosts);
+	};
+
+	double mapUpdate = runUpdates([&](size_t i, int tick, DataGhost *out) {
+		auto it = maps[i].find(tick);
+		if (it == maps[i].end()) return false;
+		*out = it->second;
+		return true;
+	});
+	double trackUpdate = runUpdates([&](size_t i, int tick, DataGhost *out) {
+		return tracks[i].Get(tick, out);
+	});
+	double fileUpdate = runUpdates([&](size_t i, int tick, DataGhost *out) {
+		return run.levels[i].track.Get(tick, out);
+	});
+
+	// The mapped tracks must match the ones they were saved from exactly
+	for (size_t i = 0; i < nGhosts && ok; ++i) {
+		auto &track = run.levels[i].track;
+		if (track.FirstTick() != tracks[i].FirstTick() || track.EndTick() != tracks[i].EndTick() || track.Count() != tracks[i].Count()
+			|| memcmp(track.FrameData(), tracks[i].FrameData(), (track.EndTick() - track.FirstTick()) * GhostTrack::FRAME_SIZE)) {
+			printf("ghost %d differs after saving and loading\n", (int)i);
+			ok = false;
+		}
+	}
+	run = {};
+	std::remove(tmpPath.c_str());
+
+	printf("%d ghosts from %d demos, %d ticks of data (checksum %g)\n", (int)nGhosts, (int)parsed.size(), (int)frameCount, sink);
+	printf("%-12s %10s %12s %16s\n", "", "load (ms)", "memory (KiB)", "update (ns/tick)");
+	printf("%-12s %10.2f %12.0f %16.1f\n", "std::map", mapLoad * 1e3, mapMem / 1024.0, mapUpdate);
+	printf("%-12s %10.2f %12.0f %16.1f\n", "GhostTrack", trackLoad * 1e3, trackMem / 1024.0, trackUpdate);
+	printf("%-12s %10.2f %12s %16.1f\n", ".sarghost", fileLoad * 1e3, "mapped", fileUpdate);
+
+	return ok;
+}
+
+// }}}
+
+// CRC32 self test {{{
+
+static bool crcTest() {
+	struct Impl {
+		const char *name;
+		uint32_t (*fn)(uint32_t state, const uint8_t *data, size_t size);
+	};
+	std::vector<Impl> impls = {
+		{"bytewise", Crc32::UpdateBytewise},
+		{"slicing-by-8", Crc32::UpdateSlicing8},
+	};
+	if (Cpu::HasPCLMUL()) impls.push_back({"pclmul", Crc32::UpdatePCLMUL});
+
+	struct Vector {
+		const char *data;
+		uint32_t crc;
+	};
+	static const Vector vectors[] = {
+		{"", 0x00000000},
+		{"a", 0xE8B7BE43},
+		{"abc", 0x352441C2},
+		{"123456789", 0xCBF43926},
+		{"The quick brown fox jumps over the lazy dog", 0x414FA339},
+		{"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", 0x5507E455},
+	};
+
+	bool ok = true;
+
+	for (auto &impl : impls) {
+		for (auto &v : vectors) {
+			uint32_t crc = ~impl.fn(0xFFFFFFFF, (const uint8_t *)v.data, strlen(v.data));
+			if (crc != v.crc) {
+				printf("%s: \"%s\" gave %08X, expected %08X\n", impl.name, v.data, crc, v.crc);
+				ok = false;
+			}
+		}
+	}
+
+	// Every length and alignment up to a few blocks, compared against the
+	// bytewise implementation
+	std::mt19937 rng(1234);
+	std::vector<uint8_t> buf(4096 + 16);
+	for (auto &b : buf) b = rng();
+
+	for (size_t len = 0; len <= 1024; ++len) {
+		for (size_t align = 0; align < 16; ++align) {
+			uint32_t expected = Crc32::UpdateBytewise(0xFFFFFFFF, buf.data() + align, len);
+			for (auto &impl : impls) {
+				uint32_t crc = impl.fn(0xFFFFFFFF, buf.data() + align, len);
+				if (crc != expected) {
+					printf("%s: length %d at offset %d gave %08X, expected %08X\n", impl.name, (int)len, (int)align, ~crc, ~expected);
+					ok = false;
+				}
+			}
+		}
+	}
+
+	// Streaming in random pieces must match hashing in one go
+	for (int i = 0; i < 1000; ++i) {
+		Crc32 crc;
+		size_t pos = 0;
+		while (pos < buf.size()) {
+			size_t n = std::min(buf.size() - pos, (size_t)(rng() % 300));
+			crc.Update(buf.data() + pos, n);
+			pos += n;
+		}
+		if (crc.Value() != ~Crc32::UpdateBytewise(0xFFFFFFFF, buf.data(), buf.size())) {
+			printf("streaming gave a different result\n");
+			ok = false;
+			break;
+		}
+	}
+
+	// Combining the CRCs of two halves must match hashing them together
+	for (size_t split = 0; split <= buf.size(); split += 37) {
+		uint32_t a = ~Crc32::UpdateBytewise(0xFFFFFFFF, buf.data(), split);
+		uint32_t b = ~Crc32::UpdateBytewise(0xFFFFFFFF, buf.data() + split, buf.size() - split);
+		if (Crc32::Combine(a, b, buf.size() - split) != ~Crc32::UpdateBytewise(0xFFFFFFFF, buf.data(), buf.size())) {
+			printf("combining at %d gave a different result\n", (int)split);
+			ok = false;
+			break;
+		}
+	}
+
+	printf("%s (Crc32 uses %s)\n", ok ? "all tests passed" : "TESTS FAILED", Crc32::ImplName());
+
+	std::vector<uint8_t> big(64 * 1024 * 1024);
+	for (auto &b : big) b = rng();
+
+	for (auto &impl : impls) {
+		auto start = std::chrono::steady_clock::now();
+		uint32_t crc = impl.fn(0xFFFFFFFF, big.data(), big.size());
+		auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("%-14s %8.0f MB/s  (%08X)\n", impl.name, big.size() / secs / 1e6, ~crc);
+	}
+
+	return ok;
+}
+
+// }}}
+
+// Render blending self test {{{
+
+// Blends random frames with the weights of every profile, over a range
+// of blend lengths and shutters, through each kernel and the scalar
+// reference, which must agree on every accumulator and output byte
+static bool blendTest() {
+	auto kernels = RenderBlend::AvailableKernels();
+	auto &ref = kernels.back();
+
+	std::mt19937 rng(1234);
+	bool ok = true;
+
+	auto check = [&](const char *kernel, const char *what, const void *got, const void *expected, size_t size) {
+		if (!ok || !memcmp(got, expected, size)) return;
+		printf("%s: %s differs from scalar\n", kernel, what);
+		ok = false;
+	};
+
+	// Widths in pixels, including ones that leave every kernel a tail
+	std::vector<std::pair<int, bool>> widthCases;
+	for (int width : {1, 3, 5, 11, 16, 21, 32, 33, 100, 641}) widthCases.push_back({width, false});
+	for (int width : {1, 33, 641}) widthCases.push_back({width, true});
+	auto custom = RenderBlend::ParseCustomWeights("0 1 4 1 0.5 2");
+
+	int blends = 0;
+	for (int profileIdx = 0; profileIdx <= (int)RenderBlend::Profile::CUSTOM; ++profileIdx) {
+		auto profile = (RenderBlend::Profile)profileIdx;
+		for (int frames : {2, 3, 4, 7, 16, 30, 64, 120, 257, 500}) {
+			// The whole shutter, and one starting and ending partway
+			for (auto [start, end] : {std::make_pair(0, frames), std::make_pair(frames / 4, frames - frames / 3)}) {
+				auto weights = RenderBlend::ComputeWeights(profile, frames, start, end, custom);
+				uint32_t sum = 0;
+				for (auto w : weights) sum += w;
+				// The renderer refuses box blends this long
+				if (profile == RenderBlend::Profile::BOX && sum > RenderBlend::MAX_WEIGHT_SUM) continue;
+				if (sum == 0 || sum > RenderBlend::MAX_WEIGHT_SUM) {
+					printf("%s, %d frames: weights sum to %u\n", RenderBlend::ProfileName(profile), frames, sum);
+					ok = false;
+					continue;
+				}
+
+				// White frames take the accumulator as high as it can go;
+				// with a box of 257 frames, right up to 65535
+				for (auto [width, white] : widthCases) {
+					size_t size = 3 * width;
+					std::vector<uint8_t> src(size);
+					std::vector<uint16_t> refAcc(size, 0);
+					std::vector<std::vector<uint16_t>> accs(kernels.size(), refAcc);
+
+					for (auto w : weights) {
+						for (auto &b : src) b = white ? 255 : rng();
+						ref.accumulate(refAcc.data(), src.data(), size, w);
+						for (size_t k = 0; k + 1 < kernels.size(); ++k) {
+							kernels[k].accumulate(accs[k].data(), src.data(), size, w);
+							check(kernels[k].name, "accumulate", accs[k].data(), refAcc.data(), size * sizeof refAcc[0]);
+						}
+					}
+
+					std::vector<uint8_t> refDst(size);
+					ref.resolve(refDst.data(), refAcc.data(), size, sum);
+					for (size_t k = 0; k + 1 < kernels.size(); ++k) {
+						std::vector<uint8_t> dst(size);
+						kernels[k].resolve(dst.data(), accs[k].data(), size, sum);
+						check(kernels[k].name, "resolve", dst.data(), refDst.data(), size);
+						check(kernels[k].name, "cleared accumulator", accs[k].data(), refAcc.data(), size * sizeof refAcc[0]);
+					}
+					++blends;
+				}
+			}
+		}
+	}
+
+	// Every accumulator value a blend can produce, for every divisor up
+	// to MAX_WEIGHT_SUM; this is where the float division could go wrong
+	std::vector<uint16_t> all;
+	for (uint32_t divisor = 1; divisor <= RenderBlend::MAX_WEIGHT_SUM && ok; ++divisor) {
+		uint32_t max = std::min<uint32_t>(255 * divisor, 65535);
+		all.resize(max + 1);
+		std::vector<uint8_t> refDst(all.size()), dst(all.size());
+		for (uint32_t v = 0; v <= max; ++v) all[v] = v;
+		auto acc = all;
+		ref.resolve(refDst.data(), acc.data(), acc.size(), divisor);
+		for (size_t k = 0; k + 1 < kernels.size(); ++k) {
+			acc = all;
+			kernels[k].resolve(dst.data(), acc.data(), acc.size(), divisor);
+			if (ok && memcmp(dst.data(), refDst.data(), dst.size())) {
+				printf("%s: resolve differs from scalar dividing by %u\n", kernels[k].name, divisor);
+				ok = false;
+			}
+		}
+	}
+
+	printf("%s: %d blends (RenderBlend uses %s)\n", ok ? "all tests passed" : "TESTS FAILED", blends, RenderBlend::KernelName());
+
+	// A 1080p frame
+	size_t size = 1920 * 1080 * 3;
+	std::vector<uint8_t> src(size), dst(size);
+	std::vector<uint16_t> acc(size, 0);
+	for (auto &b : src) b = rng();
+
+	printf("%-10s %14s %14s\n", "", "accumulate", "resolve");
+	for (auto &kernel : kernels) {
+		const int reps = 50;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < reps; ++i) kernel.accumulate(acc.data(), src.data(), size, 1);
+		auto mid = std::chrono::steady_clock::now();
+		for (int i = 0; i < reps; ++i) kernel.resolve(dst.data(), acc.data(), size, reps);
+		auto end = std::chrono::steady_clock::now();
+		double accSecs = std::chrono::duration<double>(mid - start).count();
+		double resSecs = std::chrono::duration<double>(end - mid).count();
+		printf("%-10s %9.0f fps  %9.0f fps\n", kernel.name, reps / accSecs, reps / resSecs);
+	}
+
+	return ok;
+}
+
+// }}}
+
+// Network ghost protocol test {{{
+
+namespace {
+	// A lossy link which delivers some packets late, after the next one
+	class SimLink {
+	public:
+		std::vector<std::vector<uint8_t>> Send(std::vector<uint8_t> &&pkt, std::mt19937 &rng, double loss) {
+			std::vector<std::vector<uint8_t>> out;
+			std::uniform_real_distribution<double> dist(0, 1);
+			if (dist(rng) >= loss) {
+				if (!this->held.empty() || dist(rng) >= loss / 2) {
+					out.push_back(std::move(pkt));
+				} else {
+					this->held = std::move(pkt);
+					return out;
+				}
+			}
+			if (!this->held.empty()) out.push_back(std::move(this->held));
+			this->held.clear();
+			return out;
+		}
+
+	private:
+		std::vector<uint8_t> held;
+	};
+}  // namespace
+
+// Every update has a 1 byte header and a 4 byte ID in front; the original
+// format then has the ghosts' IDs and 25 byte DataGhosts
+#define NET_HEADER_SIZE 5
+#define NET_LEGACY_GHOST_SIZE 25
+
+// Plays players running around through a simulated server and lossy
+// links, checking every state arrives exactly as it was quantised, and
+// compares the bandwidth used with the original format
+static bool netTest(int nPlayers, double loss, int nUpdates) {
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(-1, 1);
+
+	struct Player {
+		DataGhost data;
+		Vector vel;
+		bool idle;
+		GhostNet::Stream stream;        // The player's end
+		GhostNet::Stream serverStream;  // The server's end
+		SimLink up, down;
+		std::pair<uint16_t, GhostNet::Snapshot> sent[2];  // What the server sent, by sequence number
+	};
+	std::vector<Player> players(nPlayers);
+	for (auto &p : players) {
+		p.data = {{unit(rng) * 2000, unit(rng) * 2000, unit(rng) * 500}, {0, unit(rng) * 180, 0}, 64, true};
+		p.idle = unit(rng) < -0.4f;  // About 30% of people stand still
+	}
+
+	std::map<uint32_t, GhostNet::State> serverStates;
+	uint64_t legacyBytes = 0, deltaBytes = 0;
+	int mismatches = 0;
+
+	for (int update = 0; update < nUpdates; ++update) {
+		// Everyone moves at up to 300 units/s and looks around, 20 times a second
+		for (uint32_t id = 0; id < (uint32_t)nPlayers; ++id) {
+			auto &p = players[id];
+			if (!p.idle) {
+				p.vel = {p.vel.x * 0.9f + unit(rng) * 30, p.vel.y * 0.9f + unit(rng) * 30, 0};
+				float speed = std::sqrt(p.vel.x * p.vel.x + p.vel.y * p.vel.y);
+				if (speed > 300) p.vel = {p.vel.x * 300 / speed, p.vel.y * 300 / speed, 0};
+				p.data.position = {p.data.position.x + p.vel.x * 0.05f, p.data.position.y + p.vel.y * 0.05f, p.data.position.z};
+				p.data.view_angle = {std::clamp(p.data.view_angle.x + unit(rng) * 3, -89.0f, 89.0f), std::remainder(p.data.view_angle.y + unit(rng) * 10, 360.0f), 0};
+				p.data.grounded = unit(rng) > -0.9f;
+			}
+
+			GhostNet::Snapshot snap;
+			snap.ghosts.push_back({id, GhostNet::Quantise(p.data, (uint16_t)(update * 50))});
+			std::vector<uint8_t> pkt;
+			p.stream.Encode(snap, pkt);
+			legacyBytes += NET_HEADER_SIZE + NET_LEGACY_GHOST_SIZE;
+			deltaBytes += NET_HEADER_SIZE + pkt.size();
+
+			for (auto &got : p.up.Send(std::move(pkt), rng, loss)) {
+				GhostNet::Snapshot recv;
+				if (!p.serverStream.Decode(got.data(), got.size(), &recv)) continue;
+				for (auto &[gid, state] : recv.ghosts) serverStates[gid] = state;
+			}
+		}
+
+		// The server sends everyone everybody else's latest state
+		for (uint32_t id = 0; id < (uint32_t)nPlayers; ++id) {
+			auto &p = players[id];
+
+			GhostNet::Snapshot snap;
+			for (auto &[gid, state] : serverStates) {
+				if (gid != id) snap.ghosts.push_back({gid, state});
+			}
+			std::vector<uint8_t> pkt;
+			p.serverStream.Encode(snap, pkt);
+			legacyBytes += NET_HEADER_SIZE + 4 + snap.ghosts.size() * (4 + NET_LEGACY_GHOST_SIZE);
+			deltaBytes += NET_HEADER_SIZE + pkt.size();
+
+			// A packet can arrive a step late, so keep the last couple around
+			// to check against
+			uint16_t seq = (uint16_t)(p.serverStream.GetStats().sent - 1);
+			p.sent[seq % 2] = {seq, snap};
+
+			for (auto &got : p.down.Send(std::move(pkt), rng, loss)) {
+				GhostNet::Snapshot recv;
+				if (!p.stream.Decode(got.data(), got.size(), &recv)) continue;
+				uint16_t gotSeq = (got[0] << 8) | got[1];
+				auto &[sentSeq, sent] = p.sent[gotSeq % 2];
+				if (sentSeq != gotSeq) ++mismatches;
+				for (auto &[gid, state] : sent.ghosts) {
+					auto decoded = recv.Find(gid);
+					if (!decoded || *decoded != state) ++mismatches;
+				}
+			}
+		}
+	}
+
+	GhostNet::Stats total;
+	for (auto &p : players) {
+		for (auto *stream : {&p.stream, &p.serverStream}) {
+			auto &st = stream->GetStats();
+			total.sent += st.sent;
+			total.sentDeltas += st.sentDeltas;
+			total.received += st.received;
+			total.lost += st.lost;
+			total.stale += st.stale;
+			total.undecodable += st.undecodable;
+		}
+	}
+
+	printf("%d players, %d updates each, %.0f%% loss\n", nPlayers, nUpdates, loss * 100);
+	printf("packets: %u sent (%u as deltas), %u received, %u lost, %u stale, %u undecodable\n", total.sent, total.sentDeltas, total.received, total.lost, total.stale, total.undecodable);
+	printf("%-10s %14s %18s\n", "", "total (KiB)", "per second (KiB)");
+	double secs = nUpdates * 0.05;
+	printf("%-10s %14.0f %18.1f\n", "original", legacyBytes / 1024.0, legacyBytes / 1024.0 / secs);
+	printf("%-10s %14.0f %18.1f  (%.0f%%)\n", "delta", deltaBytes / 1024.0, deltaBytes / 1024.0 / secs, 100.0 * deltaBytes / legacyBytes);
+	printf("%d states decoded differently to how they were sent\n", mismatches);
+
+	// Round trip through the quantisation
+	DataGhost in = {{1234.56f, -987.65f, 12.34f}, {-45.5f, 179.9f, 0}, 28, false};
+	DataGhost out = GhostNet::Dequantise(GhostNet::Quantise(in, 0));
+	bool quantOk = std::abs(out.position.x - in.position.x) <= 1 / 64.0f
+		&& std::abs(out.position.y - in.position.y) <= 1 / 64.0f
+		&& std::abs(out.position.z - in.position.z) <= 1 / 64.0f
+		&& std::abs(std::remainder(out.view_angle.x - in.view_angle.x, 360.0f)) <= 0.01f
+		&& std::abs(std::remainder(out.view_angle.y - in.view_angle.y, 360.0f)) <= 0.01f
+		&& out.view_offset == in.view_offset
+		&& out.grounded == in.grounded;
+	printf("quantisation round trip: %s\n", quantOk ? "ok" : "FAILED");
+
+	return mismatches == 0 && total.undecodable == 0 && quantOk;
+}
+
+// }}}
+
+// Network ghost smoothing test {{{
+
+// What GhostEntity did before GhostSnapshotBuffer: move from the second
+// newest state to the newest over the smoothed time between updates
+namespace {
+	struct TwoStateLerp {
+		DataGhost oldPos{}, newPos{};
+		double lastUpdate = 0;
+		double loopTime = 0;
+
+		void Push(double now, const DataGhost &data) {
+			this->oldPos = this->newPos;
+			this->newPos = data;
+			double newLoopTime = now - this->lastUpdate;
+			this->loopTime = this->loopTime == 0 ? newLoopTime : (2 * this->loopTime + newLoopTime) / 3;
+			this->lastUpdate = now;
+		}
+
+		Vector Sample(double now) const {
+			float t = std::clamp((float)((now - this->lastUpdate) / this->loopTime), 0.0f, 1.0f);
+			return this->oldPos.position * (1 - t) + this->newPos.position * t;
+		}
+	};
+}  // namespace
+
+// Sends a ghost running in a circle at a constant speed over a link with
+// jitter and loss, and measures how much its speed varies from frame to
+// frame when drawn at 144 fps, which is what shows up as stutter
+static bool jitterTest(double jitterMs, double loss) {
+	std::mt19937 rng(5678);
+	std::exponential_distribution<double> jitterDist(1.0 / std::max(jitterMs, 1e-3));
+	std::uniform_real_distribution<double> unit(0, 1);
+
+	static const double speed = 300, radius = 500, sendInterval = 0.05, frame = 1.0 / 144, duration = 120;
+	auto pathAt = [&](double t) {
+		double ang = t * speed / radius;
+		return DataGhost{{(float)(radius * std::cos(ang)), (float)(radius * std::sin(ang)), 0}, {0, (float)(ang * 180 / M_PI), 0}, 64, true};
+	};
+
+	// Arrival times for every update that gets through. Ones overtaken by a
+	// later update are dropped, as GhostNet::Stream does.
+	std::vector<std::tuple<double, double, DataGhost>> sent;
+	for (double t = 0; t < duration; t += sendInterval) {
+		if (unit(rng) < loss) continue;
+		sent.push_back({t + 0.03 + (jitterMs > 0 ? jitterDist(rng) / 1000 : 0), t, pathAt(t)});
+	}
+	std::stable_sort(sent.begin(), sent.end(), [](auto &a, auto &b) { return std::get<0>(a) < std::get<0>(b); });
+
+	struct Arrival {
+		double time;
+		DataGhost data;
+		uint16_t sentAt;
+	};
+	std::vector<Arrival> arrivals;
+	double newest = -1;
+	for (auto &[arrival, sendTime, data] : sent) {
+		if (sendTime < newest) continue;
+		newest = sendTime;
+		arrivals.push_back({arrival, data, (uint16_t)std::lround(sendTime * 1000)});
+	}
+
+	struct Result {
+		double sum = 0, sumSq = 0, worst = 0;
+		int n = 0;
+		Vector last;
+		bool haveLast = false;
+
+		void Add(const Vector &pos, double warmup) {
+			if (this->haveLast && !warmup) {
+				double v = (pos - this->last).Length() / frame;
+				this->sum += v;
+				this->sumSq += v * v;
+				this->worst = std::max(this->worst, std::abs(v - speed));
+				++this->n;
+			}
+			this->last = pos;
+			this->haveLast = true;
+		}
+		void Print(const char *name) const {
+			double mean = this->sum / this->n;
+			double sd = std::sqrt(std::max(0.0, this->sumSq / this->n - mean * mean));
+			printf("%-20s %12.1f %12.1f %16.1f\n", name, mean, sd, this->worst);
+		}
+	};
+
+	// The buffer is tried both with the send times the delta protocol
+	// carries and with just the arrival times, as for the original one
+	TwoStateLerp lerp;
+	GhostSnapshotBuffer untimed, timed;
+	Result lerpRes, untimedRes, timedRes;
+
+	size_t next = 0;
+	for (double now = 0; now < duration; now += frame) {
+		while (next < arrivals.size() && arrivals[next].time <= now) {
+			auto &a = arrivals[next];
+			lerp.Push(a.time, a.data);
+			untimed.Push(a.time, a.data);
+			timed.Push(a.time, a.data, a.sentAt);
+			++next;
+		}
+		if (next < 2) continue;
+
+		bool warmup = now < 1;
+		lerpRes.Add(lerp.Sample(now), warmup);
+
+		DataGhost data;
+		Vector vel;
+		if (untimed.Sample(now, 0, 0.1f, &data, &vel)) untimedRes.Add(data.position, warmup);
+		if (timed.Sample(now, 0, 0.1f, &data, &vel)) timedRes.Add(data.position, warmup);
+	}
+
+	printf("moving at %.0f units/s, updates every %.0f ms, %.0f ms mean jitter, %.0f%% loss\n", speed, sendInterval * 1000, jitterMs, loss * 100);
+	printf("%-20s %12s %12s %16s\n", "", "mean speed", "speed sd", "worst deviation");
+	lerpRes.Print("two-state lerp");
+	untimedRes.Print("buffer, untimed");
+	timedRes.Print("buffer, timed");
+	for (auto *buf : {&untimed, &timed}) {
+		auto stats = buf->GetStats();
+		printf("%s: delay %.0f ms, jitter %.0f ms, %u received, %u late, %u dropped\n", buf == &timed ? "timed" : "untimed", stats.delay * 1000, stats.jitter * 1000, stats.received, stats.late, stats.dropped);
+	}
+
+	return untimedRes.n > 0 && timedRes.n > 0;
+}
+
+// }}}
+
+// Ghost pool benchmark {{{
+
+namespace {
+	struct BenchGhost {
+		uint32_t ID;
+		std::atomic<float> x{0};
+		bool sameMap = true;
+	};
+
+	// A mutex which counts how often it had to be waited for
+	class CountingMutex {
+	public:
+		void lock() {
+			if (this->mutex.try_lock()) return;
+			++this->contended;
+			this->mutex.lock();
+		}
+		void unlock() { this->mutex.unlock(); }
+
+		std::atomic<uint64_t> contended{0};
+
+	private:
+		std::mutex mutex;
+	};
+
+	// The pool as it was before GhostPool: a locked vector, scanned for
+	// every lookup
+	class LockedPool {
+	public:
+		void Add(std::shared_ptr<BenchGhost> ghost) {
+			std::lock_guard<CountingMutex> lock(this->mutex);
+			this->ghosts.push_back(ghost);
+		}
+		void Remove(uint32_t id) {
+			std::lock_guard<CountingMutex> lock(this->mutex);
+			for (size_t i = 0; i < this->ghosts.size(); ++i) {
+				if (this->ghosts[i]->ID == id) {
+					this->ghosts.erase(this->ghosts.begin() + i);
+					break;
+				}
+			}
+		}
+		std::shared_ptr<BenchGhost> Get(uint32_t id) {
+			std::lock_guard<CountingMutex> lock(this->mutex);
+			for (auto &ghost : this->ghosts) {
+				if (ghost->ID == id) return ghost;
+			}
+			return nullptr;
+		}
+		template <typename Fn>
+		void Update(uint32_t first, uint32_t last, Fn fn) {
+			for (uint32_t id = first; id < last; ++id) {
+				auto ghost = this->Get(id);
+				if (ghost) fn(*ghost);
+			}
+		}
+		template <typename Fn>
+		void Draw(const uint32_t *ids, size_t nIds, Fn fn) {
+			{
+				std::lock_guard<CountingMutex> lock(this->mutex);
+				for (auto &ghost : this->ghosts) fn(*ghost);
+			}
+			for (size_t i = 0; i < nIds; ++i) {
+				auto ghost = this->Get(ids[i]);
+				if (ghost) fn(*ghost);
+			}
+		}
+
+		CountingMutex mutex;
+
+	private:
+		std::vector<std::shared_ptr<BenchGhost>> ghosts;
+	};
+
+	class SnapshotPool {
+	public:
+		void Add(std::shared_ptr<BenchGhost> ghost) { this->pool.Add(ghost); }
+		void Remove(uint32_t id) { this->pool.Remove(id); }
+		// As NetworkManager::ApplyUpdates and UpdateGhostsPosition: one
+		// snapshot for the whole batch or frame
+		template <typename Fn>
+		void Update(uint32_t first, uint32_t last, Fn fn) {
+			auto snap = this->pool.Load();
+			for (uint32_t id = first; id < last; ++id) {
+				auto ghost = snap->Get(id);
+				if (ghost) fn(*ghost);
+			}
+		}
+		template <typename Fn>
+		void Draw(const uint32_t *ids, size_t nIds, Fn fn) {
+			auto snap = this->pool.Load();
+			for (auto &ghost : *snap) fn(*ghost);
+			for (size_t i = 0; i < nIds; ++i) {
+				auto ghost = snap->Get(ids[i]);
+				if (ghost) fn(*ghost);
+			}
+		}
+
+	private:
+		GhostPool<BenchGhost> pool;
+	};
+
+	struct PoolBenchResult {
+		double frameMean, frameWorst;  // us
+		double updateMean;             // ns per ghost update
+		uint64_t frames;
+	};
+}  // namespace
+
+// A network thread applies a server update for every ghost 20 times a
+// second, with a ghost leaving and another joining every so often, while
+// the main thread draws a frame at 144 fps: it moves every ghost on the
+// same map and looks a few up by ID, like the sync and player list HUDs
+template <typename Pool>
+static PoolBenchResult poolBenchRun(Pool &pool, int nGhosts, double seconds) {
+	for (int i = 0; i < nGhosts; ++i) {
+		auto ghost = std::make_shared<BenchGhost>();
+		ghost->ID = i + 1;
+		pool.Add(ghost);
+	}
+
+	std::atomic<bool> stop{false};
+	std::atomic<uint64_t> updateNs{0}, updates{0};
+
+	std::thread network([&]() {
+		uint32_t nextID = nGhosts + 1, oldestID = 1;
+		int tick = 0;
+		while (!stop) {
+			auto start = std::chrono::steady_clock::now();
+			pool.Update(oldestID, nextID, [&](BenchGhost &ghost) {
+				ghost.x.store((float)tick, std::memory_order_relaxed);
+			});
+			updateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			updates += nextID - oldestID;
+
+			if (++tick % 10 == 0) {
+				pool.Remove(oldestID++);
+				auto ghost = std::make_shared<BenchGhost>();
+				ghost->ID = nextID++;
+				pool.Add(ghost);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	});
+
+	uint32_t lookups[8];
+	for (uint32_t i = 0; i < 8; ++i) lookups[i] = (i + 1) * nGhosts / 8;
+
+	std::vector<double> frameTimes;
+	float sink = 0;
+	auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+	while (std::chrono::steady_clock::now() < end) {
+		auto start = std::chrono::steady_clock::now();
+		pool.Draw(lookups, 8, [&](BenchGhost &ghost) {
+			if (ghost.sameMap) sink += ghost.x.load(std::memory_order_relaxed);
+		});
+		frameTimes.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		std::this_thread::sleep_until(start + std::chrono::microseconds(1000000 / 144));
+	}
+
+	stop = true;
+	network.join();
+
+	PoolBenchResult res;
+	res.frames = frameTimes.size();
+	res.frameMean = 0;
+	res.frameWorst = 0;
+	for (double t : frameTimes) {
+		res.frameMean += t;
+		res.frameWorst = std::max(res.frameWorst, t);
+	}
+	res.frameMean /= std::max<size_t>(res.frames, 1);
+	res.updateMean = (double)updateNs / std::max<uint64_t>(updates, 1);
+	if (sink == -1) puts("");  // Keep the reads from being optimised out
+	return res;
+}
+
+static bool poolBench(int nGhosts) {
+	printf("%d ghosts, 20 updates/s each, drawn at 144 fps\n", nGhosts);
+	printf("%-16s %14s %14s %16s %12s\n", "", "frame (us)", "worst (us)", "update (ns)", "lock waits");
+
+	LockedPool locked;
+	auto res = poolBenchRun(locked, nGhosts, 3.0);
+	printf("%-16s %14.2f %14.1f %16.1f %12llu\n", "locked vector", res.frameMean, res.frameWorst, res.updateMean, (unsigned long long)locked.mutex.contended);
+
+	SnapshotPool snap;
+	res = poolBenchRun(snap, nGhosts, 3.0);
+	printf("%-16s %14.2f %14.1f %16.1f %12s\n", "GhostPool", res.frameMean, res.frameWorst, res.updateMean, "none");
+
+	return res.frames > 0;
+}
+
+// }}}
+int main(int argc, char **argv) {
+	std::vector<std::string> args(argv + 1, argv + argc);
+	if (args.empty() || args[0] == "-h" || args[0] == "--help") {
+		usage();
+		return args.empty() ? 2 : 0;
+	}
+
+	std::string command = args[0];
+	args.erase(args.begin());
+
+	if (command == "crctest" && args.empty()) {
+		return crcTest() ? 0 : 1;
+	}
+
+	if (command == "blendtest" && args.empty()) {
+		return blendTest() ? 0 : 1;
+	}
+
+	if (command == "nettest" && args.size() <= 2) {
+		int nPlayers = args.size() > 0 ? atoi(args[0].c_str()) : 50;
+		double loss = args.size() > 1 ? atof(args[1].c_str()) / 100 : 0.05;
+		return netTest(std::max(nPlayers, 2), std::clamp(loss, 0.0, 0.9), 1200) ? 0 : 1;
+	}
+
+	if (command == "jittertest" && args.size() <= 2) {
+		double jitter = args.size() > 0 ? atof(args[0].c_str()) : 20;
+		double loss = args.size() > 1 ? atof(args[1].c_str()) / 100 : 0.02;
+		return jitterTest(std::max(jitter, 0.0), std::clamp(loss, 0.0, 0.9)) ? 0 : 1;
+	}
+
+	if (command == "poolbench" && args.size() <= 1) {
+		int nGhosts = args.size() > 0 ? atoi(args[0].c_str()) : 500;
+		return poolBench(std::max(nGhosts, 8)) ? 0 : 1;
+	}
+
+	if (command == "parsebench") {
+		return parseBench(DemoTool::CollectDemos(args)) ? 0 : 1;
+	}
+
+	if (command == "ghostbench") {
+		auto demos = DemoTool::CollectDemos(args);
+		if (demos.empty()) {
+			fprintf(stderr, "no demos found\n");
+			return 1;
+		}
+		return ghostBench(demos) ? 0 : 1;
+	}
+
+	usage();
+	return 2;
+}
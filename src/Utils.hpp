@@ -2,7 +2,7 @@
 #include "Utils/Math.hpp"
 #include "Utils/Memory.hpp"
 #include "Utils/Platform.hpp"
-#include "Utils/SDK.hpp"
+#include "Utils/BaseTypes.hpp"
 #include <optional>
 
 #ifndef _WIN32
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+
+// The plain value types from the SDK, kept apart from the rest of it so
+// that code shared with the native tools can use them
+
+struct Vector {
+	float x, y, z;
+	inline Vector()
+		: x(0)
+		, y(0)
+		, z(0) {
+	}
+	inline Vector(float x, float y, float z = 0)
+		: x(x)
+		, y(y)
+		, z(z) {
+	}
+	inline float SquaredLength() const {
+		return x*x + y*y + z*z;
+	}
+	inline float Length() const {
+		return std::sqrt(x * x + y * y + z * z);
+	}
+	inline float Length2D() const {
+		return std::sqrt(x * x + y * y);
+	}
+	inline float Dot(const Vector &vOther) const {
+		return Vector::DotProduct(*this, vOther);
+	}
+	inline Vector operator*(float fl) const {
+		Vector res;
+		res.x = x * fl;
+		res.y = y * fl;
+		res.z = z * fl;
+		return res;
+	}
+	inline Vector &operator*=(float fl) {
+		x = x * fl;
+		y = y * fl;
+		z = z * fl;
+		return *this;
+	}
+	inline Vector operator/(float fl) const {
+		return *this * (1 / fl);
+	}
+	inline Vector &operator+=(Vector &vec) {
+		x = x + vec.x;
+		y = y + vec.y;
+		z = z + vec.z;
+		return *this;
+	}
+	inline Vector operator+(const Vector vec) const {
+		Vector res;
+		res.x = x + vec.x;
+		res.y = y + vec.y;
+		res.z = z + vec.z;
+		return res;
+	}
+	inline Vector &operator-=(Vector &vec) {
+		x -= vec.x;
+		y -= vec.y;
+		z -= vec.z;
+		return *this;
+	}
+	inline Vector operator-(const Vector vec) const {
+		Vector res;
+		res.x = x - vec.x;
+		res.y = y - vec.y;
+		res.z = z - vec.z;
+		return res;
+	}
+	inline Vector operator-() const {
+		return Vector{0, 0, 0} - *this;
+	}
+	inline float &operator[](int i) {
+		return ((float *)this)[i];
+	}
+	inline float operator[](int i) const {
+		return ((float *)this)[i];
+	}
+	inline bool operator==(const Vector vec) const {
+		return x == vec.x && y == vec.y && z == vec.z;
+	}
+	inline bool operator!=(const Vector vec) const {
+		return !(*this == vec);
+	}
+	static inline float DotProduct(const Vector &a, const Vector &b) {
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+	inline Vector Cross(const Vector &v) {
+		Vector out;
+		out.x = this->y * v.z - this->z * v.y;
+		out.y = this->z * v.x - this->x * v.z;
+		out.z = this->x * v.y - this->y * v.x;
+		return out;
+	}
+	inline Vector Normalize() {
+		return *this / this->Length();
+	}
+};
+
+struct QAngle {
+	float x, y, z;
+};
+
+inline QAngle VectorToQAngle(const Vector &v) {
+	return {v.x, v.y, v.z};
+}
+
+inline Vector QAngleToVector(const QAngle &a) {
+	return {a.x, a.y, a.z};
+}
+
+struct Color {
+	Color() {
+		*((int *)this) = 255;
+	}
+	Color(int _r, int _g, int _b) {
+		SetColor(_r, _g, _b, 255);
+	}
+	Color(int _r, int _g, int _b, int _a) {
+		SetColor(_r, _g, _b, _a);
+	}
+	void SetColor(int _r, int _g, int _b, int _a = 255) {
+		_color[0] = (unsigned char)_r;
+		_color[1] = (unsigned char)_g;
+		_color[2] = (unsigned char)_b;
+		_color[3] = (unsigned char)_a;
+	}
+	inline int r() const { return _color[0]; }
+	inline int g() const { return _color[1]; }
+	inline int b() const { return _color[2]; }
+	inline int a() const { return _color[3]; }
+	unsigned char _color[4] = {0, 0, 0, 0};
+	inline bool operator==(const Color col) const {
+		return !memcmp(this->_color, col._color, sizeof _color);
+	}
+	inline bool operator!=(const Color col) const {
+		return memcmp(this->_color, col._color, sizeof _color);
+	}
+};
@@ -0,0 +1,85 @@
+#include "Cpu.hpp"
+
+#include <cstdint>
+
+#ifdef _MSC_VER
+#	include <immintrin.h>
+#	include <intrin.h>
+#else
+#	include <cpuid.h>
+#endif
+
+namespace {
+	struct CpuFeatures {
+		bool sse2 = false;
+		bool sse41 = false;
+		bool avx2 = false;
+		bool pclmul = false;
+
+		CpuFeatures() {
+			uint32_t regs[4];  // eax, ebx, ecx, edx
+
+			if (!cpuid(0, regs)) return;
+			uint32_t maxLeaf = regs[0];
+
+			if (!cpuid(1, regs)) return;
+			this->sse2 = regs[3] & (1 << 26);
+			this->sse41 = regs[2] & (1 << 19);
+			this->pclmul = regs[2] & (1 << 1);
+
+			// AVX2 also needs the OS to save the upper halves of the YMM
+			// registers, which we check through XGETBV
+			bool osxsave = regs[2] & (1 << 27);
+			bool avx = regs[2] & (1 << 28);
+			if (maxLeaf >= 7 && osxsave && avx && (xgetbv0() & 6) == 6) {
+				cpuid(7, regs);
+				this->avx2 = regs[1] & (1 << 5);
+			}
+		}
+
+	private:
+		static bool cpuid(uint32_t leaf, uint32_t *regs) {
+#ifdef _MSC_VER
+			int info[4];
+			__cpuidex(info, leaf, 0);
+			for (int i = 0; i < 4; ++i) regs[i] = info[i];
+			return true;
+#else
+			return __get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+		}
+
+		static uint64_t xgetbv0() {
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t lo, hi;
+			__asm__ volatile("xgetbv"
+			                 : "=a"(lo), "=d"(hi)
+			                 : "c"(0));
+			return ((uint64_t)hi << 32) | lo;
+#endif
+		}
+	};
+
+	const CpuFeatures &features() {
+		static CpuFeatures f;
+		return f;
+	}
+}  // namespace
+
+bool Cpu::HasSSE2() {
+	return features().sse2;
+}
+
+bool Cpu::HasSSE41() {
+	return features().sse41;
+}
+
+bool Cpu::HasAVX2() {
+	return features().avx2;
+}
+
+bool Cpu::HasPCLMUL() {
+	return features().pclmul;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// Runtime CPU feature detection, used to pick between SIMD and scalar
+// implementations of hot loops. The results are computed once and
+// cached.
+namespace Cpu {
+	bool HasSSE2();
+	bool HasSSE41();
+	bool HasAVX2();
+	bool HasPCLMUL();
+}  // namespace Cpu
+
+#ifdef _MSC_VER
+#	define CPU_TARGET_SSE2
+#	define CPU_TARGET_SSE41
+#	define CPU_TARGET_AVX2
+#	define CPU_TARGET_PCLMUL
+#else
+#	define CPU_TARGET_SSE2 __attribute__((target("sse2")))
+#	define CPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+#	define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#	define CPU_TARGET_PCLMUL __attribute__((target("sse4.1,pclmul")))
+#endif
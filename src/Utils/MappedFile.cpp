@@ -0,0 +1,106 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+// clang-format off
+#	include <windows.h>
+// clang-format on
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+	this->Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string &path) {
+	this->Close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		return false;
+	}
+
+	this->file = file;
+	this->size = (size_t)size.QuadPart;
+	this->isOpen = true;
+
+	// Zero-length mappings aren't allowed
+	if (this->size == 0) return true;
+
+	this->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!this->mapping) {
+		this->Close();
+		return false;
+	}
+
+	this->data = (const uint8_t *)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!this->data) {
+		this->Close();
+		return false;
+	}
+
+	return true;
+}
+
+void MappedFile::Close() {
+	if (this->data) UnmapViewOfFile(this->data);
+	if (this->mapping) CloseHandle(this->mapping);
+	if (this->file) CloseHandle(this->file);
+	this->data = nullptr;
+	this->mapping = nullptr;
+	this->file = nullptr;
+	this->size = 0;
+	this->isOpen = false;
+}
+
+#else
+
+bool MappedFile::Open(const std::string &path) {
+	this->Close();
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+
+	this->size = (size_t)st.st_size;
+
+	if (this->size > 0) {
+		void *data = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			this->size = 0;
+			return false;
+		}
+		madvise(data, this->size, MADV_SEQUENTIAL);
+		this->data = (const uint8_t *)data;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+
+	this->isOpen = true;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (this->data) munmap((void *)this->data, this->size);
+	this->data = nullptr;
+	this->size = 0;
+	this->isOpen = false;
+}
+
+#endif
@@ -1,5 +1,5 @@
 #pragma once
-#include "SDK.hpp"
+#include "BaseTypes.hpp"
 
 #include <random>
 
@@ -132,6 +132,23 @@ namespace Memory {
 		VirtualProtect((void *)startPage, pageLen, PAGE_EXECUTE_READWRITE, &wtf_microsoft_why_cant_this_be_null);
 #else
 		mprotect((void *)startPage, pageLen, PROT_READ | PROT_WRITE | PROT_EXEC);
+#endif
+	}
+
+	inline void *AllocExecutable(size_t len) {
+#ifdef _WIN32
+		return VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+		void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return ptr == MAP_FAILED ? NULL : ptr;
+#endif
+	}
+
+	inline void FreeExecutable(void *addr, size_t len) {
+#ifdef _WIN32
+		VirtualFree(addr, 0, MEM_RELEASE);
+#else
+		munmap(addr, len);
 #endif
 	}
 }  // namespace Memory